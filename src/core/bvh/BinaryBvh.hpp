@@ -2,6 +2,7 @@
 #define BINARYBVH_HPP_
 
 #include "BvhBuilder.hpp"
+#include "BvhCache.hpp"
 
 #include "math/Box.hpp"
 #include "math/Vec.hpp"
@@ -9,6 +10,8 @@
 
 #include "IntTypes.hpp"
 
+#include <atomic>
+
 namespace Tungsten {
 
 #include "AlignedAllocator.hpp"
@@ -107,39 +110,119 @@ class BinaryBvh
         {
             return _rChild.node != nullptr;
         }
+
+        // Turns the child pointers into indices relative to base and back,
+        // so that nodes can be stored on disk. The right child index is
+        // offset by one to keep leaves distinguishable
+        void makeRelative(const TinyBvhNode *base)
+        {
+            if (isNode()) {
+                _lChild.index = uint64(_lChild.node - base);
+                _rChild.index = uint64(_rChild.node - base) + 1;
+            }
+        }
+
+        bool makeAbsolute(TinyBvhNode *base, uint64 nodeCount, uint64 primCount)
+        {
+            if (_rChild.index == 0)
+                return uint64(primIndex()) + childCount() <= primCount;
+            if (_lChild.index >= nodeCount || _rChild.index > nodeCount)
+                return false;
+            _lChild.node = base + _lChild.index;
+            _rChild.node = base + (_rChild.index - 1);
+            return true;
+        }
     };
 
+    friend class SwitchableBvh;
+    friend BvhCache;
+
     int _depth;
     aligned_vector<TinyBvhNode> _nodes;
     std::vector<uint32> _primIndices;
     Box3f _bounds;
+    BuildStats _buildStats;
 
-    uint32 recursiveBuild(const NaiveBvhNode *node, uint32 head, uint32 &tail, uint32 &primIndex,
-            std::vector<uint32> &primIndices, uint32 maxPrimsPerLeaf)
+    // Writes the nodes straight into _nodes. Children are allocated in pairs
+    // with an atomic add, so they always come after their parents
+    class Writer : public NodeWriter
     {
-        if (node->isLeaf()) {
-            _nodes[head].setJointBbox(node->bbox(), node->bbox());
-            _nodes[head].setPrimIndex(1, primIndex);
-            _nodes[head].setRchild(nullptr);
-            primIndices[primIndex++] = node->id();
+        BinaryBvh &_bvh;
+        std::atomic<uint32> _tail;
 
-            return 1;
-        } else {
-            int childIdx = tail;
-            _nodes[head].setJointBbox(node->child(0)->bbox(), node->child(1)->bbox());
-            _nodes[head].setLchild(&_nodes[childIdx + 0]);
-            _nodes[head].setRchild(&_nodes[childIdx + 1]);
-            tail += 2;
-            uint32 lPrims = recursiveBuild(node->child(0), childIdx + 0, tail, primIndex, primIndices, maxPrimsPerLeaf);
-            uint32 rPrims = recursiveBuild(node->child(1), childIdx + 1, tail, primIndex, primIndices, maxPrimsPerLeaf);
-
-            if (lPrims + rPrims <= maxPrimsPerLeaf) {
-                _nodes[head].setPrimIndex(lPrims + rPrims, _nodes[childIdx].primIndex());
-                _nodes[head].setRchild(nullptr);
-                tail = childIdx;
+        void writeLeaf(TinyBvhNode &node, const BuildChild &leaf)
+        {
+            node.setJointBbox(leaf.box, leaf.box);
+            node.setPrimIndex(leaf.primCount, leaf.primStart);
+            node.setRchild(nullptr);
+            for (uint32 i = 0; i < leaf.primCount; ++i)
+                _bvh._primIndices[leaf.primStart + i] = leaf.prims[i].id();
+        }
+
+    public:
+        Writer(BinaryBvh &bvh)
+        : _bvh(bvh),
+          _tail(0)
+        {
+        }
+
+        virtual void begin(uint32 maxReferences) override
+        {
+            _bvh._nodes.resize(2*maxReferences - 1);
+            _bvh._primIndices.resize(maxReferences);
+            _tail = 1;
+        }
+
+        virtual uint32 writeRoot(const BuildChild &root) override
+        {
+            _bvh._bounds = root.box;
+            if (root.isLeaf())
+                writeLeaf(_bvh._nodes[0], root);
+            return 0;
+        }
+
+        virtual void writeChildren(uint32 node, const BuildChild *children, uint32 count, uint32 *childNodes) override
+        {
+            ASSERT(count == 2, "Binary BVH nodes need two children, got %d", count);
+            uint32 childIdx = _tail.fetch_add(2);
+            TinyBvhNode &parent = _bvh._nodes[node];
+            parent.setJointBbox(children[0].box, children[1].box);
+            parent.setLchild(&_bvh._nodes[childIdx + 0]);
+            parent.setRchild(&_bvh._nodes[childIdx + 1]);
+            for (uint32 i = 0; i < 2; ++i) {
+                if (children[i].isLeaf())
+                    writeLeaf(_bvh._nodes[childIdx + i], children[i]);
+                else
+                    childNodes[i] = childIdx + i;
             }
+        }
 
-            return lPrims + rPrims;
+        virtual size_t memoryUsage() const override
+        {
+            return _bvh._nodes.size()*sizeof(TinyBvhNode) + _bvh._primIndices.size()*sizeof(uint32);
+        }
+
+        uint32 size() const
+        {
+            return _tail;
+        }
+    };
+
+    template<typename BoundsFunction>
+    Box3f refitNode(TinyBvhNode &node, BoundsFunction &bounds)
+    {
+        if (node.isLeaf()) {
+            Box3f box;
+            for (uint32 i = node.primIndex(); i < node.primIndex() + node.childCount(); ++i)
+                box.grow(bounds(_primIndices[i]));
+            node.setJointBbox(box, box);
+            return box;
+        } else {
+            Box3f lBox = refitNode(*node.lChild(), bounds);
+            Box3f rBox = refitNode(*node.rChild(), bounds);
+            node.setJointBbox(lBox, rBox);
+            lBox.grow(rBox);
+            return lBox;
         }
     }
 
@@ -168,32 +251,103 @@ class BinaryBvh
         return false;
     }
 
-public:
-    BinaryBvh(PrimVector prims, int maxPrimsPerLeaf)
+    BinaryBvh() = default;
+
+    // Cache entries are checked for everything that traversal relies on:
+    // Leaves reference valid primitives, and children always come after their
+    // parents, which rules out cycles and bounds the depth of the tree by
+    // _depth, which sizes the traversal stack
+    bool load(CacheReader &in, uint32 primCount)
+    {
+        if (!in.read(_depth) || !in.read(_bounds) || !in.read(_nodes) || !in.read(_primIndices) || _nodes.empty())
+            return false;
+        for (uint32 id : _primIndices)
+            if (id >= primCount)
+                return false;
+        if (_depth < 0 || uint64(_depth) > _nodes.size() + _primIndices.size())
+            return false;
+
+        // Empty BVHs are a single node pointing to itself, which is never
+        // traversed since the bounds are empty
+        if (_primIndices.empty())
+            return _nodes.size() == 1 && _bounds.empty() && _nodes[0].makeAbsolute(&_nodes[0], 1, 0);
+
+        std::vector<int> depths(_nodes.size(), 0);
+        for (size_t i = 0; i < _nodes.size(); ++i) {
+            TinyBvhNode &node = _nodes[i];
+            if (!node.makeAbsolute(&_nodes[0], _nodes.size(), _primIndices.size()))
+                return false;
+            if (node.isLeaf())
+                continue;
+
+            size_t l = node.lChild() - &_nodes[0];
+            size_t r = node.rChild() - &_nodes[0];
+            if (l <= i || r <= i || depths[i] > _depth)
+                return false;
+            depths[l] = max(depths[l], depths[i] + 1);
+            depths[r] = max(depths[r], depths[i] + 1);
+        }
+        return true;
+    }
+
+    void save(CacheWriter &out) const
     {
-        size_t count = prims.size();
+        aligned_vector<TinyBvhNode> nodes(_nodes);
+        for (TinyBvhNode &node : nodes)
+            node.makeRelative(&_nodes[0]);
+
+        out.write(_depth);
+        out.write(_bounds);
+        out.write(nodes);
+        out.write(_primIndices);
+    }
 
+public:
+    BinaryBvh(PrimVector prims, int maxPrimsPerLeaf, float splitBudget = 0.0f, ClipFunction clip = ClipFunction())
+    {
         if (prims.empty()) {
             _depth = 0;
             _nodes.push_back(TinyBvhNode());
             _nodes.back().setJointBbox(Box3f(), Box3f());
+            _nodes.back().setLchild(&_nodes.back());
             _nodes.back().setRchild(&_nodes.back());
         } else {
-            BvhBuilder builder(2);
-            builder.build(std::move(prims));
+            BvhBuilder builder(2, splitBudget, std::move(clip));
+            Writer writer(*this);
+            builder.build(std::move(prims), writer, maxPrimsPerLeaf);
 
-            _primIndices.resize(count);
-            _nodes.resize(builder.numNodes());
             _depth = builder.depth();
-            _bounds = builder.root()->bbox();
-
-            uint32 tail = 1, primIndex = 0;
-            recursiveBuild(builder.root().get(), 0, tail, primIndex, _primIndices, maxPrimsPerLeaf);
-            builder.root().reset();
-            _nodes.resize(tail);
+            _buildStats = builder.stats();
+            // Child pointers are absolute, so they need to be rebased when
+            // the unused tail of the node array is released
+            for (uint32 i = 0; i < writer.size(); ++i)
+                _nodes[i].makeRelative(&_nodes[0]);
+            _nodes.resize(writer.size());
+            _nodes.shrink_to_fit();
+            for (TinyBvhNode &node : _nodes)
+                node.makeAbsolute(&_nodes[0], _nodes.size(), builder.numReferences());
+            _primIndices.resize(builder.numReferences());
+            _primIndices.shrink_to_fit();
         }
     }
 
+    // Recomputes all node boxes bottom up after primitives have moved, keeping
+    // the topology of the tree. bounds(id) returns the new box of primitive id.
+    // Much cheaper than a rebuild, but the tree degrades if the primitives
+    // move relative to each other
+    template<typename BoundsFunction>
+    void refit(BoundsFunction bounds)
+    {
+        if (_primIndices.empty())
+            return;
+        _bounds = refitNode(_nodes[0], bounds);
+    }
+
+    const BuildStats &buildStats() const
+    {
+        return _buildStats;
+    }
+
     template<typename LAMBDA>
     void trace(Ray &ray, LAMBDA intersector) const
     {
@@ -13,8 +13,10 @@
 
 #include "IntTypes.hpp"
 #include "Debug.hpp"
+#include "Timer.hpp"
 
 #include <algorithm>
+#include <atomic>
 
 namespace Tungsten {
 
@@ -26,6 +28,40 @@ struct BuildResult
     uint32 depth;
 };
 
+struct BuildContext
+{
+    NodeWriter &writer;
+    uint32 branchFactor;
+    uint32 maxPrimsPerLeaf;
+};
+
+struct SpatialBuildContext
+{
+    const ClipFunction &clip;
+    NodeWriter &writer;
+    uint32 branchFactor;
+    uint32 maxPrimsPerLeaf;
+    uint32 maxDuplicates;
+    float rootArea;
+    std::atomic<uint32> duplicates;
+    // Next free slot in the prim index array. References of different nodes
+    // overlap, so leaves claim their slots as they are written
+    std::atomic<uint32> references;
+
+    SpatialBuildContext(const ClipFunction &clip_, NodeWriter &writer_, uint32 branchFactor_,
+            uint32 maxPrimsPerLeaf_, uint32 maxDuplicates_, float rootArea_)
+    : clip(clip_),
+      writer(writer_),
+      branchFactor(branchFactor_),
+      maxPrimsPerLeaf(maxPrimsPerLeaf_),
+      maxDuplicates(maxDuplicates_),
+      rootArea(rootArea_),
+      duplicates(0),
+      references(0)
+    {
+    }
+};
+
 static void twoWaySahSplit(uint32 start, uint32 end, PrimVector &prims, const Box3f &geomBox,
         const Box3f &centroidBox, SplitInfo &split)
 {
@@ -96,71 +132,229 @@ static uint32 sahSplit(uint32 starts[], uint32 ends[], Box3f geomBoxes[],
     return childCount;
 }
 
-static void recursiveBuild(BuildResult &result, NaiveBvhNode &dst, uint32 start, uint32 end,
-        PrimVector &prims, const Box3f &geomBox, const Box3f &centroidBox, uint32 branchFactor)
+static BuildChild makeChild(const Box3f &box, const Primitive *prims, uint32 primStart, uint32 primCount,
+        uint32 maxPrimsPerLeaf)
+{
+    if (primCount > maxPrimsPerLeaf)
+        return BuildChild{box, nullptr, 0, 0};
+    return BuildChild{box, prims, primStart, primCount};
+}
+
+static void accumulate(BuildResult &result, const BuildResult &child)
+{
+    result.nodeCount += child.nodeCount;
+    result.depth = max(result.depth, child.depth + 1);
+}
+
+// Builds the subtree below an inner node. Leaf children are written by the
+// parent, so this is only called for nodes with more than maxPrimsPerLeaf
+// primitives. The primitives of a leaf are not moved after it was written,
+// which lets them stay in place in the prim index array
+static void recursiveBuild(BuildResult &result, uint32 node, uint32 start, uint32 end,
+        PrimVector &prims, const Box3f &geomBox, const Box3f &centroidBox, const BuildContext &context)
 {
     result = BuildResult{1, 1};
 
-    dst.bbox() = geomBox;
     uint32 numPrims = end - start + 1;
 
-    if (numPrims == 1) {
-        // Single primitive, just create a leaf node
-        dst.setId(prims[start].id());
-    } else if (numPrims <= branchFactor) {
-        // Few primitives, create internal node with numPrims children
-        result.nodeCount += numPrims;
-        for (uint32 i = start; i <= end; ++i)
-            dst.setChild(i - start, new NaiveBvhNode(narrow(prims[i].box()), prims[i].id()));
+    uint32 starts[4], ends[4];
+    Box3f geomBoxes[4], centroidBoxes[4];
+    uint32 childCount;
+    if (numPrims <= context.branchFactor) {
+        // Few primitives, create one leaf per primitive
+        childCount = numPrims;
+        for (uint32 i = 0; i < numPrims; ++i) {
+            starts[i] = ends[i] = start + i;
+            geomBoxes[i] = narrow(prims[start + i].box());
+        }
     } else {
         // Many primitives: Setup SAH split
-        uint32 starts[4], ends[4];
-        Box3f geomBoxes[4], centroidBoxes[4];
         starts       [0] = start;
         ends         [0] = end;
         geomBoxes    [0] = geomBox;
         centroidBoxes[0] = centroidBox;
 
         // Perform the split (potentially in parallel)
-        uint32 childCount = sahSplit(starts, ends, geomBoxes, centroidBoxes, prims, branchFactor);
-
-        // TODO: Use pool allocator?
-        for (unsigned i = 0; i < childCount; ++i)
-            dst.setChild(i, new NaiveBvhNode());
-
-        if (numPrims <= 32*1024) {
-            // Perform single threaded recursive build for small workloads
-            for (unsigned i = 0; i < childCount; ++i) {
-                BuildResult recursiveResult;
-                recursiveBuild(recursiveResult, *dst.child(i), starts[i], ends[i],
-                        prims, geomBoxes[i], centroidBoxes[i], branchFactor);
-                result.nodeCount += recursiveResult.nodeCount;
-                result.depth = max(result.depth, recursiveResult.depth + 1);
-            }
-        } else {
-            // Enqueue parallel build for large workloads
-            BuildResult results[4];
-            std::shared_ptr<TaskGroup> group = ThreadUtils::pool->enqueue([&](uint32 i, uint32, uint32) {
-                recursiveBuild(results[i], *dst.child(i), starts[i], ends[i],
-                        prims, geomBoxes[i], centroidBoxes[i], branchFactor);
-            }, childCount);
-            // Do some work while we wait
-            ThreadUtils::pool->yield(*group);
-
-            // Serial reduce
-            for (unsigned i = 0; i < childCount; ++i) {
-                result.nodeCount += results[i].nodeCount;
-                result.depth = max(result.depth, results[i].depth + 1);
+        childCount = sahSplit(starts, ends, geomBoxes, centroidBoxes, prims, context.branchFactor);
+    }
+
+    BuildChild children[4];
+    uint32 childNodes[4];
+    for (uint32 i = 0; i < childCount; ++i)
+        children[i] = makeChild(geomBoxes[i], &prims[starts[i]], starts[i], ends[i] - starts[i] + 1,
+                context.maxPrimsPerLeaf);
+    context.writer.writeChildren(node, children, childCount, childNodes);
+
+    BuildResult results[4];
+    for (uint32 i = 0; i < childCount; ++i)
+        results[i] = BuildResult{1, 1};
+
+    if (numPrims <= 32*1024) {
+        // Perform single threaded recursive build for small workloads
+        for (uint32 i = 0; i < childCount; ++i)
+            if (!children[i].isLeaf())
+                recursiveBuild(results[i], childNodes[i], starts[i], ends[i],
+                        prims, geomBoxes[i], centroidBoxes[i], context);
+    } else {
+        // Enqueue parallel build for large workloads
+        std::shared_ptr<TaskGroup> group = ThreadUtils::pool->enqueue([&](uint32 i, uint32, uint32) {
+            if (!children[i].isLeaf())
+                recursiveBuild(results[i], childNodes[i], starts[i], ends[i],
+                        prims, geomBoxes[i], centroidBoxes[i], context);
+        }, childCount);
+        // Do some work while we wait
+        ThreadUtils::pool->yield(*group);
+    }
+
+    for (uint32 i = 0; i < childCount; ++i)
+        accumulate(result, results[i]);
+}
+
+static void computeBounds(const PrimVector &prims, Box3f &geomBox, Box3f &centroidBox)
+{
+    Box3fp geomBounds, centroidBounds;
+    for (const Primitive &p : prims) {
+        geomBounds.grow(p.box());
+        centroidBounds.grow(p.centroid());
+    }
+    geomBox = narrow(geomBounds);
+    centroidBox = narrow(centroidBounds);
+}
+
+static bool reserveDuplicates(SpatialBuildContext &context, uint32 count)
+{
+    uint32 current = context.duplicates;
+    do {
+        if (current + count > context.maxDuplicates)
+            return false;
+    } while (!context.duplicates.compare_exchange_weak(current, current + count));
+    return true;
+}
+
+static void twoWaySpatialSplit(SpatialBuildContext &context, PrimVector &prims, const Box3f &geomBox,
+        const Box3f &centroidBox, PrimVector &lPrims, PrimVector &rPrims)
+{
+    uint32 numPrims = prims.size();
+
+    SplitInfo objectSplit;
+    twoWaySahSplit(0, numPrims - 1, prims, geomBox, centroidBox, objectSplit);
+
+    // Only look for spatial splits if the children of the object split
+    // overlap significantly and we still have memory left for duplicates
+    Box3f overlap = narrow(objectSplit.lBox);
+    overlap.intersect(narrow(objectSplit.rBox));
+    if (context.duplicates < context.maxDuplicates && SpatialSplitter::isValid(overlap) &&
+            overlap.area() > SpatialSplitter::OverlapThreshold*context.rootArea) {
+        SpatialSplitInfo spatialSplit;
+        spatialSplit.cost = Splitter::IntersectionCost*(objectSplit.lBox.area()*(objectSplit.idx)
+                + objectSplit.rBox.area()*(numPrims - objectSplit.idx));
+
+        SpatialSplitter splitter(context.clip);
+        if (splitter.findSplit(prims, geomBox, spatialSplit)) {
+            uint32 maxDuplicates = spatialSplit.lCount + spatialSplit.rCount - numPrims;
+            if (reserveDuplicates(context, maxDuplicates)) {
+                PrimVector l, r;
+                uint32 duplicates = splitter.split(prims, spatialSplit, l, r);
+                context.duplicates -= maxDuplicates - duplicates;
+
+                // Guard against splits that do not make progress
+                if (!l.empty() && !r.empty() && l.size() < numPrims && r.size() < numPrims) {
+                    lPrims = std::move(l);
+                    rPrims = std::move(r);
+                    return;
+                }
+                context.duplicates -= duplicates;
             }
         }
     }
+
+    lPrims.assign(prims.begin(), prims.begin() + objectSplit.idx);
+    rPrims.assign(prims.begin() + objectSplit.idx, prims.end());
 }
 
-BvhBuilder::BvhBuilder(uint32 branchFactor)
-: _root(new NaiveBvhNode()),
-  _depth(0),
+// Same as recursiveBuild, but with spatial splits. Since the number of
+// references changes while splitting, each node owns its references
+// instead of working on a range of a shared vector
+static void spatialRecursiveBuild(BuildResult &result, uint32 node, PrimVector prims,
+        const Box3f &geomBox, const Box3f &centroidBox, SpatialBuildContext &context)
+{
+    result = BuildResult{1, 1};
+
+    uint32 numPrims = prims.size();
+
+    BuildChild children[4];
+    uint32 childNodes[4];
+    if (numPrims <= context.branchFactor) {
+        uint32 primStart = context.references.fetch_add(numPrims);
+        for (uint32 i = 0; i < numPrims; ++i)
+            children[i] = BuildChild{narrow(prims[i].box()), &prims[i], primStart + i, 1};
+        context.writer.writeChildren(node, children, numPrims, childNodes);
+        result = BuildResult{numPrims + 1, 2};
+        return;
+    }
+
+    PrimVector childPrims[4];
+    Box3f geomBoxes[4], centroidBoxes[4];
+    childPrims   [0] = std::move(prims);
+    geomBoxes    [0] = geomBox;
+    centroidBoxes[0] = centroidBox;
+
+    uint32 childCount;
+    for (childCount = 1; childCount < context.branchFactor; ++childCount) {
+        uint32 interval = 0;
+        for (uint32 i = 1; i < childCount; ++i)
+            if (childPrims[interval].size() < childPrims[i].size())
+                interval = i;
+
+        if (childPrims[interval].size() <= context.branchFactor)
+            break;
+
+        PrimVector lPrims, rPrims;
+        twoWaySpatialSplit(context, childPrims[interval], geomBoxes[interval], centroidBoxes[interval], lPrims, rPrims);
+        childPrims[interval] = std::move(lPrims);
+        childPrims[childCount] = std::move(rPrims);
+        computeBounds(childPrims[interval], geomBoxes[interval], centroidBoxes[interval]);
+        computeBounds(childPrims[childCount], geomBoxes[childCount], centroidBoxes[childCount]);
+    }
+
+    for (uint32 i = 0; i < childCount; ++i) {
+        uint32 count = childPrims[i].size();
+        uint32 primStart = count <= context.maxPrimsPerLeaf ? context.references.fetch_add(count) : 0;
+        children[i] = makeChild(geomBoxes[i], childPrims[i].data(), primStart, count, context.maxPrimsPerLeaf);
+    }
+    context.writer.writeChildren(node, children, childCount, childNodes);
+
+    BuildResult results[4];
+    for (uint32 i = 0; i < childCount; ++i)
+        results[i] = BuildResult{1, 1};
+
+    if (numPrims <= 32*1024) {
+        for (uint32 i = 0; i < childCount; ++i)
+            if (!children[i].isLeaf())
+                spatialRecursiveBuild(results[i], childNodes[i], std::move(childPrims[i]),
+                        geomBoxes[i], centroidBoxes[i], context);
+    } else {
+        std::shared_ptr<TaskGroup> group = ThreadUtils::pool->enqueue([&](uint32 i, uint32, uint32) {
+            if (!children[i].isLeaf())
+                spatialRecursiveBuild(results[i], childNodes[i], std::move(childPrims[i]),
+                        geomBoxes[i], centroidBoxes[i], context);
+        }, childCount);
+        ThreadUtils::pool->yield(*group);
+    }
+
+    for (uint32 i = 0; i < childCount; ++i)
+        accumulate(result, results[i]);
+}
+
+BvhBuilder::BvhBuilder(uint32 branchFactor, float splitBudget, ClipFunction clip)
+: _depth(0),
   _numNodes(0),
-  _branchFactor(branchFactor)
+  _numReferences(0),
+  _branchFactor(branchFactor),
+  _splitBudget(splitBudget),
+  _clip(std::move(clip)),
+  _buildTime(0.0),
+  _peakMemory(0)
 {
 }
 
@@ -168,20 +362,51 @@ void BvhBuilder::build(PrimVector prims)
 {
     if (prims.empty())
         return;
+
+    build(std::move(prims), _arena, 1);
+
+#ifndef NDEBUG
+    integrityCheck(*_arena.root(), 0);
+#endif
+}
+
+void BvhBuilder::build(PrimVector prims, NodeWriter &writer, uint32 maxPrimsPerLeaf)
+{
+    if (prims.empty())
+        return;
+    Timer timer;
+
     Box3fp geomBounds, centroidBounds;
     for (const Primitive &p : prims) {
         geomBounds.grow(p.box());
         centroidBounds.grow(p.centroid());
     }
 
-    BuildResult result;
-    recursiveBuild(result, *_root, 0, uint32(prims.size() - 1), prims, narrow(geomBounds), narrow(centroidBounds), _branchFactor);
+    uint32 numPrims = prims.size();
+    uint32 maxDuplicates = _splitBudget > 0.0f ? uint32(numPrims*_splitBudget) : 0;
+    writer.begin(numPrims + maxDuplicates);
+
+    BuildResult result{1, 1};
+    BuildChild root = makeChild(narrow(geomBounds), prims.data(), 0, numPrims, maxPrimsPerLeaf);
+    uint32 rootNode = writer.writeRoot(root);
+
+    if (_splitBudget > 0.0f) {
+        SpatialBuildContext context(_clip, writer, _branchFactor, maxPrimsPerLeaf, maxDuplicates, geomBounds.area());
+        if (!root.isLeaf())
+            spatialRecursiveBuild(result, rootNode, std::move(prims), narrow(geomBounds), narrow(centroidBounds), context);
+        _numReferences = numPrims + context.duplicates;
+        _peakMemory = writer.memoryUsage() + 2*size_t(_numReferences)*sizeof(Primitive);
+    } else {
+        BuildContext context{writer, _branchFactor, maxPrimsPerLeaf};
+        if (!root.isLeaf())
+            recursiveBuild(result, rootNode, 0, numPrims - 1, prims, narrow(geomBounds), narrow(centroidBounds), context);
+        _numReferences = numPrims;
+        _peakMemory = writer.memoryUsage() + size_t(numPrims)*sizeof(Primitive);
+    }
     _numNodes = result.nodeCount;
     _depth = result.depth;
-
-#ifndef NDEBUG
-    integrityCheck(*_root, 0);
-#endif
+    timer.stop();
+    _buildTime = timer.elapsed();
 }
 
 void BvhBuilder::integrityCheck(const NaiveBvhNode &node, int depth) const
@@ -1,29 +1,167 @@
 #ifndef BVHBUILDER_HPP_
 #define BVHBUILDER_HPP_
 
+#include "SpatialSplitter.hpp"
 #include "NaiveBvhNode.hpp"
 #include "Primitive.hpp"
 
+#include "Debug.hpp"
+
+#include <tinyformat/tinyformat.hpp>
+
+#include <memory>
+#include <atomic>
+#include <string>
+
 namespace Tungsten {
 
 namespace Bvh {
 
+// A child produced by the builder. Leaves reference primCount primitives,
+// whose ids go to positions primStart onwards in the prim index array of the
+// final BVH. Inner nodes have a primCount of zero
+struct BuildChild
+{
+    Box3f box;
+    const Primitive *prims;
+    uint32 primStart;
+    uint32 primCount;
+
+    bool isLeaf() const
+    {
+        return primCount > 0;
+    }
+};
+
+// Receives the tree from the BvhBuilder as it is built, so that BVHs can emit
+// their own node layout directly instead of converting an intermediate tree.
+// Nodes are referred to by handles chosen by the writer. writeChildren is
+// called concurrently from all build threads, but at most once per node, and
+// always after the node was handed out by its parent
+class NodeWriter
+{
+public:
+    virtual ~NodeWriter() {}
+
+    // Called before the build. Each inner node has at least two children, so
+    // the tree has fewer than 2*maxReferences nodes
+    virtual void begin(uint32 maxReferences) = 0;
+    // Returns the handle of the root if it is an inner node
+    virtual uint32 writeRoot(const BuildChild &root) = 0;
+    // Writes the children of node, and returns the handles of inner children
+    // in childNodes
+    virtual void writeChildren(uint32 node, const BuildChild *children, uint32 count, uint32 *childNodes) = 0;
+    // Memory held by the writer in bytes
+    virtual size_t memoryUsage() const = 0;
+};
+
+// Writer for the NaiveBvhNode tree, for users that walk the tree themselves.
+// All nodes end up in one linear array, and allocating the children of a node
+// is a single atomic add, which is safe to do from all build threads at once
+class NodeArena : public NodeWriter
+{
+    std::unique_ptr<NaiveBvhNode[]> _nodes;
+    std::atomic<uint32> _tail;
+    uint32 _capacity;
+
+    uint32 allocate(uint32 count)
+    {
+        uint32 idx = _tail.fetch_add(count);
+        ASSERT(idx + count <= _capacity, "Node arena exhausted: %d/%d nodes", idx + count, _capacity);
+        return idx;
+    }
+
+public:
+    NodeArena()
+    : _tail(0),
+      _capacity(0)
+    {
+    }
+
+    virtual void begin(uint32 maxReferences) override
+    {
+        _capacity = 2*maxReferences;
+        _nodes.reset(new NaiveBvhNode[_capacity]);
+        _tail = 0;
+    }
+
+    virtual uint32 writeRoot(const BuildChild &root) override
+    {
+        uint32 idx = allocate(1);
+        _nodes[idx] = NaiveBvhNode(root.box, root.isLeaf() ? root.prims[0].id() : 0);
+        return idx;
+    }
+
+    virtual void writeChildren(uint32 node, const BuildChild *children, uint32 count, uint32 *childNodes) override
+    {
+        uint32 first = allocate(count);
+        for (uint32 i = 0; i < count; ++i) {
+            const BuildChild &child = children[i];
+            _nodes[first + i] = NaiveBvhNode(child.box, child.isLeaf() ? child.prims[0].id() : 0);
+            childNodes[i] = first + i;
+        }
+        _nodes[node].setChildren(&_nodes[first], count);
+    }
+
+    virtual size_t memoryUsage() const override
+    {
+        return size_t(_capacity)*sizeof(NaiveBvhNode);
+    }
+
+    NaiveBvhNode *root()
+    {
+        return _nodes.get();
+    }
+};
+
+// Statistics of a BVH build. Zero for BVHs loaded from the cache
+struct BuildStats
+{
+    uint32 depth;
+    uint32 numReferences;
+    double buildTime;
+    size_t peakMemory;
+
+    BuildStats()
+    : depth(0), numReferences(0), buildTime(0.0), peakMemory(0)
+    {
+    }
+
+    std::string toString() const
+    {
+        return tfm::format("%d references, depth %d, built in %.3fs with %.1f MB peak memory",
+                numReferences, depth, buildTime, peakMemory*1e-6);
+    }
+};
+
 class BvhBuilder
 {
-    std::unique_ptr<NaiveBvhNode> _root;
+    NodeArena _arena;
     uint32 _depth;
     uint32 _numNodes;
+    uint32 _numReferences;
     uint32 _branchFactor;
+    float _splitBudget;
+    ClipFunction _clip;
+    double _buildTime;
+    size_t _peakMemory;
 
 public:
-    BvhBuilder(uint32 branchFactor);
+    // splitBudget enables spatial splits: It is the maximum number of
+    // duplicated references, as a fraction of the primitive count
+    BvhBuilder(uint32 branchFactor, float splitBudget = 0.0f, ClipFunction clip = ClipFunction());
 
+    // Builds a tree of NaiveBvhNodes with one primitive per leaf
     void build(PrimVector prims);
+    // Builds the tree into writer. Subtrees with at most maxPrimsPerLeaf
+    // references become leaves
+    void build(PrimVector prims, NodeWriter &writer, uint32 maxPrimsPerLeaf);
     void integrityCheck(const NaiveBvhNode &node, int depth) const;
 
-    std::unique_ptr<NaiveBvhNode> &root()
+    // Root of the tree built by build(prims), or nullptr if nothing was built
+    const NaiveBvhNode *root()
     {
-        return _root;
+        return _arena.root();
     }
 
     uint32 depth() const
@@ -35,6 +173,38 @@ public:
     {
         return _numNodes;
     }
+
+    // Number of primitive references in the leaves. This is larger than the
+    // primitive count if spatial splits duplicated some of them
+    uint32 numReferences() const
+    {
+        return _numReferences;
+    }
+
+    // Wall clock time of the last build in seconds
+    double buildTime() const
+    {
+        return _buildTime;
+    }
+
+    // Approximate peak memory of the last build in bytes, made up of the
+    // memory of the node writer and the primitive references. Spatial builds copy the
+    // references of a node into its children while splitting, which is
+    // accounted for as twice the final reference count
+    size_t peakMemory() const
+    {
+        return _peakMemory;
+    }
+
+    BuildStats stats() const
+    {
+        BuildStats result;
+        result.depth = _depth;
+        result.numReferences = _numReferences;
+        result.buildTime = _buildTime;
+        result.peakMemory = _peakMemory;
+        return result;
+    }
 };
 
 }
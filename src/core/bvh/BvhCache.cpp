@@ -0,0 +1,93 @@
+#include "BvhCache.hpp"
+
+#include "io/MemoryMappedFile.hpp"
+#include "io/FileIterables.hpp"
+
+#include "Debug.hpp"
+
+#include <tinyformat/tinyformat.hpp>
+
+namespace Tungsten {
+
+namespace Bvh {
+
+// Bump this whenever the serialized layout of any of the BVHs changes
+static CONSTEXPR uint32 CacheVersion = 1;
+static CONSTEXPR uint32 CacheMagic = 0x48564254; // "TBVH"
+
+struct CacheHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint64 key;
+};
+
+Path BvhCache::_directory;
+
+Path BvhCache::entryPath(uint64 key)
+{
+    return _directory/tfm::format("%016x.bvh", key);
+}
+
+bool BvhCache::load(uint64 key, std::function<bool(CacheReader &)> reader)
+{
+    Path path = entryPath(key);
+    if (!path.exists())
+        return false;
+
+    MemoryMappedFile file(path);
+    if (!file.valid())
+        return false;
+
+    CacheReader in(file.data(), file.size());
+    CacheHeader header;
+    if (!in.read(header) || header.magic != CacheMagic || header.version != CacheVersion || header.key != key)
+        return false;
+
+    if (!reader(in) || !in.atEnd()) {
+        DBG("Ignoring corrupt BVH cache entry at %s", path);
+        return false;
+    }
+
+    return true;
+}
+
+void BvhCache::store(uint64 key, std::function<void(CacheWriter &)> writer)
+{
+    Path path = entryPath(key);
+    bool written = FileUtils::writeFileAtomically(path, [&](OutputStreamHandle &out) {
+        CacheWriter cacheOut(out);
+        cacheOut.write(CacheHeader{CacheMagic, CacheVersion, key});
+        writer(cacheOut);
+    });
+    if (!written)
+        DBG("Unable to write BVH cache entry at %s", path);
+}
+
+void BvhCache::setDirectory(const Path &directory)
+{
+    _directory = directory.empty() ? Path() : directory.absolute();
+    if (enabled() && !FileUtils::createDirectory(_directory))
+        DBG("Unable to create BVH cache directory at %s", _directory);
+}
+
+int BvhCache::clear()
+{
+    if (!enabled() || !_directory.exists())
+        return 0;
+
+    std::vector<Path> entries;
+    for (const Path &p : _directory.files())
+        if (p.testExtension("bvh") || p.testExtension("tmp"))
+            entries.push_back(p);
+
+    int count = 0;
+    for (const Path &p : entries)
+        if (FileUtils::deleteFile(p))
+            count++;
+    return count;
+}
+
+}
+
+}
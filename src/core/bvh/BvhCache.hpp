@@ -0,0 +1,206 @@
+#ifndef BVHCACHE_HPP_
+#define BVHCACHE_HPP_
+
+#include "Primitive.hpp"
+
+#include "io/FileUtils.hpp"
+#include "io/Path.hpp"
+
+#include "math/BitManip.hpp"
+
+#include "IntTypes.hpp"
+
+#include <functional>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace Tungsten {
+
+namespace Bvh {
+
+// Identifies a cache entry. Built from a type tag, the build settings and the
+// data the BVH was built from, e.g. the primitive boxes and any geometry
+// buffers that influence the build through a clip function
+class CacheKey
+{
+    uint64 _hash;
+
+public:
+    CacheKey(const std::string &type)
+    : _hash(BitManip::hash(type))
+    {
+    }
+
+    template<typename T>
+    CacheKey &add(const T *data, size_t count)
+    {
+        _hash = BitManip::hash(data, count*sizeof(T), _hash);
+        return *this;
+    }
+
+    template<typename T>
+    CacheKey &add(const T &value)
+    {
+        return add(&value, 1);
+    }
+
+    template<typename T, typename Alloc>
+    CacheKey &add(const std::vector<T, Alloc> &values)
+    {
+        return add(values.data(), values.size());
+    }
+
+    CacheKey &add(const std::string &s)
+    {
+        return add(s.data(), s.size());
+    }
+
+    CacheKey &add(const char *s)
+    {
+        return add(std::string(s));
+    }
+
+    // Primitives contain padding, so only their members are hashed
+    CacheKey &add(const PrimVector &prims)
+    {
+        add(uint64(prims.size()));
+        for (const Primitive &p : prims) {
+            Box3f box = narrow(p.box());
+            Vec3f centroid = narrow(p.centroid());
+            uint32 id = p.id();
+            add(box.min()).add(box.max()).add(centroid).add(id);
+        }
+        return *this;
+    }
+
+    uint64 value() const
+    {
+        return _hash;
+    }
+};
+
+// Sequential reader over a cache entry. Reads fail once the entry is
+// exhausted, so that truncated entries are rejected
+class CacheReader
+{
+    const uint8 *_ptr;
+    const uint8 *_end;
+
+public:
+    CacheReader(const uint8 *data, size_t size)
+    : _ptr(data), _end(data + size)
+    {
+    }
+
+    template<typename T>
+    bool read(T &dst)
+    {
+        if (size_t(_end - _ptr) < sizeof(T))
+            return false;
+        std::memcpy(&dst, _ptr, sizeof(T));
+        _ptr += sizeof(T);
+        return true;
+    }
+
+    template<typename T, typename Alloc>
+    bool read(std::vector<T, Alloc> &dst)
+    {
+        uint64 count;
+        if (!read(count) || size_t(_end - _ptr)/sizeof(T) < count)
+            return false;
+        dst.resize(count);
+        std::memcpy(dst.data(), _ptr, count*sizeof(T));
+        _ptr += count*sizeof(T);
+        return true;
+    }
+
+    bool atEnd() const
+    {
+        return _ptr == _end;
+    }
+};
+
+class CacheWriter
+{
+    OutputStreamHandle &_out;
+
+public:
+    CacheWriter(OutputStreamHandle &out)
+    : _out(out)
+    {
+    }
+
+    template<typename T>
+    void write(const T &src)
+    {
+        FileUtils::streamWrite(_out, src);
+    }
+
+    template<typename T, typename Alloc>
+    void write(const std::vector<T, Alloc> &src)
+    {
+        FileUtils::streamWrite(_out, uint64(src.size()));
+        FileUtils::streamWrite(_out, src.data(), src.size());
+    }
+};
+
+// Optional on-disk cache of built BVHs. It is disabled until a cache
+// directory is set. Entries are memory mapped when they are loaded, and
+// entries that are corrupt or were written by a different version of the
+// cache are ignored and rebuilt.
+//
+// BVH types that support caching provide a default constructor and
+// load(CacheReader &, uint32 primCount)/save(CacheWriter &) methods, and
+// befriend BvhCache. Loading fails for entries that reference primitive IDs
+// of primCount or above
+class BvhCache
+{
+    static Path _directory;
+
+    static Path entryPath(uint64 key);
+
+    static bool load(uint64 key, std::function<bool(CacheReader &)> reader);
+    static void store(uint64 key, std::function<void(CacheWriter &)> writer);
+
+public:
+    static void setDirectory(const Path &directory);
+
+    static const Path &directory()
+    {
+        return _directory;
+    }
+
+    static bool enabled()
+    {
+        return !_directory.empty();
+    }
+
+    // Deletes all entries in the cache directory. Returns the number of
+    // deleted entries
+    static int clear();
+
+    // Returns the cached BVH for the key, if there is one. Otherwise, the BVH
+    // is built by the build function and added to the cache. The IDs of the
+    // primitives the BVH is built from must be below primCount
+    template<typename BvhType, typename BuildFunction>
+    static std::unique_ptr<BvhType> fetch(const CacheKey &key, uint32 primCount, BuildFunction build)
+    {
+        if (enabled()) {
+            std::unique_ptr<BvhType> bvh(new BvhType());
+            if (load(key.value(), [&](CacheReader &in) { return bvh->load(in, primCount); }))
+                return bvh;
+        }
+
+        std::unique_ptr<BvhType> bvh(build());
+        if (enabled())
+            store(key.value(), [&](CacheWriter &out) { bvh->save(out); });
+        return bvh;
+    }
+};
+
+}
+
+}
+
+#endif /* BVHCACHE_HPP_ */
@@ -3,29 +3,34 @@
 
 #include "math/Box.hpp"
 
-#include <memory>
-#include <array>
+#include "IntTypes.hpp"
 
 namespace Tungsten {
 
 namespace Bvh {
 
+// Intermediate node produced by the BvhBuilder. Nodes are allocated from the
+// builder's node arena, and the children of a node are stored contiguously
 class NaiveBvhNode
 {
-    std::array<std::unique_ptr<NaiveBvhNode>, 4> _children;
+    NaiveBvhNode *_children;
     Box3f _box;
     uint32 _id;
+    uint32 _childCount;
 public:
-    NaiveBvhNode() = default;
+    NaiveBvhNode()
+    : _children(nullptr), _id(0), _childCount(0)
+    {
+    }
 
     NaiveBvhNode(const Box3f &box, uint32 id)
-    : _box(box), _id(id)
+    : _children(nullptr), _box(box), _id(id), _childCount(0)
     {
     }
 
     const NaiveBvhNode *child(int id) const
     {
-        return _children[id].get();
+        return uint32(id) < _childCount ? &_children[id] : nullptr;
     }
 
     uint32 id() const
@@ -40,17 +45,18 @@ public:
 
     bool isLeaf() const
     {
-        return !_children[0];
+        return _childCount == 0;
     }
 
-    void setChild(int id, NaiveBvhNode *child)
+    void setChildren(NaiveBvhNode *children, uint32 count)
     {
-        _children[id].reset(child);
+        _children = children;
+        _childCount = count;
     }
 
     NaiveBvhNode *child(int id)
     {
-        return _children[id].get();
+        return uint32(id) < _childCount ? &_children[id] : nullptr;
     }
 
     void setId(uint32 id)
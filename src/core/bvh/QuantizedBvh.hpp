@@ -0,0 +1,455 @@
+#ifndef QUANTIZEDBVH_HPP_
+#define QUANTIZEDBVH_HPP_
+
+#include "BvhBuilder.hpp"
+#include "BvhCache.hpp"
+
+#include "math/BitManip.hpp"
+#include "math/MathUtil.hpp"
+#include "math/Box.hpp"
+#include "math/Ray.hpp"
+#include "math/Vec.hpp"
+#include "sse/SimdUtils.hpp"
+
+#include "AlignedAllocator.hpp"
+#include "IntTypes.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <cmath>
+
+namespace Tungsten {
+
+typedef Vec<float4, 3> Vec3pf;
+
+namespace Bvh {
+
+// A four-wide BVH with compressed nodes. Each node stores the boxes of its
+// children with 8 bits per plane, relative to a frame spanning the node that
+// is given by an origin and a power of two scale per axis. Quantized boxes
+// are rounded outwards, so they always contain the exact child boxes.
+// A node fits into a single cache line and holds twice as many children as a
+// node of the BinaryBvh. All children of a node are tested at once and are
+// visited front to back.
+//
+// The intersector receives the same arguments as in BinaryBvh::trace. The
+// bounds passed to it are the (conservative) box of the leaf, unless
+// keepLeafBounds is set, in which case the exact box is passed instead
+class QuantizedBvh
+{
+    template<typename T> using aligned_vector = std::vector<T, AlignedAllocator<T, 64>>;
+
+    static CONSTEXPR uint32 LeafFlag = 0x80000000U;
+
+    struct QuantizedNode
+    {
+        float origin[3];
+        int8 exponent[3];
+        uint8 childCount;
+        uint8 lo[3][4];
+        uint8 hi[3][4];
+        // Index of the child node, or the index of the first primitive
+        // if primCount is non-zero
+        uint32 child[4];
+        uint8 primCount[4];
+        uint32 pad;
+    };
+
+    struct StackNode
+    {
+        uint32 ref;
+        float tMin;
+
+        void set(uint32 r, float t)
+        {
+            ref = r;
+            tMin = t;
+        }
+    };
+
+    int _depth;
+    aligned_vector<QuantizedNode> _nodes;
+    std::vector<uint32> _primIndices;
+    std::vector<Box3f> _leafBounds;
+    bool _keepLeafBounds;
+    Box3f _bounds;
+    BuildStats _buildStats;
+
+    static float exponentToScale(int8 exponent)
+    {
+        return BitManip::uintBitsToFloat(uint32(exponent + 127) << 23);
+    }
+
+    static float4 expandBytes(const uint8 *q)
+    {
+        int32 word;
+        std::memcpy(&word, q, sizeof(word));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i bytes = _mm_cvtsi32_si128(word);
+        return float4(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero)));
+    }
+
+    static void quantize(QuantizedNode &node, const Box3f *boxes, uint32 count)
+    {
+        Box3f frame;
+        for (uint32 i = 0; i < count; ++i)
+            frame.grow(boxes[i]);
+
+        node.childCount = count;
+        for (int a = 0; a < 3; ++a) {
+            float origin = frame.min()[a];
+            float extent = frame.max()[a] - origin;
+
+            // Smallest power of two that spans the frame in 255 steps
+            int exponent;
+            std::frexp(extent/255.0f, &exponent);
+            exponent = clamp(exponent, -126, 127);
+            while (exponent < 127 && origin + 255.0f*exponentToScale(exponent) < frame.max()[a])
+                exponent++;
+            float scale = exponentToScale(exponent);
+
+            node.origin[a] = origin;
+            node.exponent[a] = exponent;
+            for (uint32 i = 0; i < 4; ++i) {
+                if (i >= count) {
+                    node.lo[a][i] = node.hi[a][i] = 0;
+                    continue;
+                }
+                // Round outwards, checking against the same float operations
+                // that are used to dequantize the planes during traversal
+                float lo = clamp(std::floor((boxes[i].min()[a] - origin)/scale), 0.0f, 255.0f);
+                float hi = clamp(std::ceil ((boxes[i].max()[a] - origin)/scale), 0.0f, 255.0f);
+                while (lo > 0.0f && origin + lo*scale > boxes[i].min()[a])
+                    lo -= 1.0f;
+                while (hi < 255.0f && origin + hi*scale < boxes[i].max()[a])
+                    hi += 1.0f;
+                node.lo[a][i] = uint8(lo);
+                node.hi[a][i] = uint8(hi);
+            }
+        }
+    }
+
+    void setLeaf(uint32 nodeIdx, uint32 slot, const BuildChild &leaf)
+    {
+        _nodes[nodeIdx].child[slot] = leaf.primStart;
+        _nodes[nodeIdx].primCount[slot] = leaf.primCount;
+        for (uint32 i = 0; i < leaf.primCount; ++i) {
+            _primIndices[leaf.primStart + i] = leaf.prims[i].id();
+            if (_keepLeafBounds)
+                _leafBounds[leaf.primStart + i] = leaf.box;
+        }
+    }
+
+    // Writes the nodes straight into _nodes. Leaves are stored in the slots
+    // of their parent, so only inner children allocate nodes, which always
+    // come after their parents
+    class Writer : public NodeWriter
+    {
+        QuantizedBvh &_bvh;
+        std::atomic<uint32> _tail;
+
+    public:
+        Writer(QuantizedBvh &bvh)
+        : _bvh(bvh),
+          _tail(0)
+        {
+        }
+
+        virtual void begin(uint32 maxReferences) override
+        {
+            _bvh._nodes.resize(maxReferences);
+            _bvh._primIndices.resize(maxReferences);
+            if (_bvh._keepLeafBounds)
+                _bvh._leafBounds.resize(maxReferences);
+            _tail = 1;
+        }
+
+        virtual uint32 writeRoot(const BuildChild &root) override
+        {
+            _bvh._bounds = root.box;
+            if (root.isLeaf()) {
+                _bvh.setLeaf(0, 0, root);
+                quantize(_bvh._nodes[0], &root.box, 1);
+            }
+            return 0;
+        }
+
+        virtual void writeChildren(uint32 node, const BuildChild *children, uint32 count, uint32 *childNodes) override
+        {
+            Box3f boxes[4];
+            uint32 innerCount = 0;
+            for (uint32 i = 0; i < count; ++i) {
+                boxes[i] = children[i].box;
+                if (!children[i].isLeaf())
+                    innerCount++;
+            }
+            quantize(_bvh._nodes[node], boxes, count);
+
+            uint32 childIdx = _tail.fetch_add(innerCount);
+            for (uint32 i = 0; i < count; ++i) {
+                if (children[i].isLeaf()) {
+                    _bvh.setLeaf(node, i, children[i]);
+                } else {
+                    _bvh._nodes[node].child[i] = childIdx;
+                    _bvh._nodes[node].primCount[i] = 0;
+                    childNodes[i] = childIdx++;
+                }
+            }
+        }
+
+        virtual size_t memoryUsage() const override
+        {
+            return _bvh._nodes.size()*sizeof(QuantizedNode) + _bvh._primIndices.size()*sizeof(uint32)
+                    + _bvh._leafBounds.size()*sizeof(Box3f);
+        }
+
+        uint32 size() const
+        {
+            return _tail;
+        }
+    };
+
+    template<typename BoundsFunction>
+    Box3f refitNode(uint32 nodeIdx, BoundsFunction &bounds)
+    {
+        QuantizedNode &node = _nodes[nodeIdx];
+        Box3f boxes[4];
+        Box3f result;
+        for (uint32 slot = 0; slot < node.childCount; ++slot) {
+            if (node.primCount[slot]) {
+                uint32 start = node.child[slot];
+                for (uint32 i = start; i < start + node.primCount[slot]; ++i)
+                    boxes[slot].grow(bounds(_primIndices[i]));
+                if (_keepLeafBounds)
+                    for (uint32 i = start; i < start + node.primCount[slot]; ++i)
+                        _leafBounds[i] = boxes[slot];
+            } else {
+                boxes[slot] = refitNode(node.child[slot], bounds);
+            }
+            result.grow(boxes[slot]);
+        }
+        quantize(node, boxes, node.childCount);
+        return result;
+    }
+
+    uint32 childRef(uint32 nodeIdx, uint32 slot) const
+    {
+        const QuantizedNode &node = _nodes[nodeIdx];
+        return node.primCount[slot] ? (LeafFlag | (nodeIdx << 2) | slot) : node.child[slot];
+    }
+
+    Vec3pf leafBounds(const QuantizedNode &node, uint32 slot) const
+    {
+        if (_keepLeafBounds) {
+            const Box3f &box = _leafBounds[node.child[slot]];
+            return Vec3pf(
+                float4(box.min().x(), box.min().x(), box.max().x(), box.max().x()),
+                float4(box.min().y(), box.min().y(), box.max().y(), box.max().y()),
+                float4(box.min().z(), box.min().z(), box.max().z(), box.max().z())
+            );
+        }
+
+        Vec3pf result;
+        for (int a = 0; a < 3; ++a) {
+            float scale = exponentToScale(node.exponent[a]);
+            float lo = node.origin[a] + float(node.lo[a][slot])*scale;
+            float hi = node.origin[a] + float(node.hi[a][slot])*scale;
+            result[a] = float4(lo, lo, hi, hi);
+        }
+        return result;
+    }
+
+    friend class SwitchableBvh;
+    friend BvhCache;
+
+    QuantizedBvh()
+    : _depth(0),
+      _keepLeafBounds(false)
+    {
+    }
+
+    // Checks cache entries the same way as BinaryBvh::load. Up to three
+    // children are pushed for every node on the way down
+    bool load(CacheReader &in, uint32 primCount)
+    {
+        if (!in.read(_depth) || !in.read(_keepLeafBounds) || !in.read(_bounds)
+                || !in.read(_nodes) || !in.read(_primIndices) || !in.read(_leafBounds))
+            return false;
+        for (uint32 id : _primIndices)
+            if (id >= primCount)
+                return false;
+        if (_depth < 0 || uint64(_depth) > _nodes.size() + _primIndices.size() || _nodes.size() > (LeafFlag >> 2))
+            return false;
+        if (_keepLeafBounds && _leafBounds.size() != _primIndices.size())
+            return false;
+
+        std::vector<int> stackSizes(_nodes.size(), 0);
+        for (size_t i = 0; i < _nodes.size(); ++i) {
+            const QuantizedNode &node = _nodes[i];
+            if (node.childCount < 1 || node.childCount > 4)
+                return false;
+            int stackSize = stackSizes[i] + node.childCount - 1;
+            if (stackSize > 3*_depth + 1)
+                return false;
+
+            for (uint32 slot = 0; slot < node.childCount; ++slot) {
+                uint32 child = node.child[slot];
+                if (node.primCount[slot]) {
+                    if (uint64(child) + node.primCount[slot] > _primIndices.size())
+                        return false;
+                } else {
+                    if (child <= i || child >= _nodes.size())
+                        return false;
+                    stackSizes[child] = max(stackSizes[child], stackSize);
+                }
+            }
+        }
+        return true;
+    }
+
+    void save(CacheWriter &out) const
+    {
+        out.write(_depth);
+        out.write(_keepLeafBounds);
+        out.write(_bounds);
+        out.write(_nodes);
+        out.write(_primIndices);
+        out.write(_leafBounds);
+    }
+
+public:
+    QuantizedBvh(PrimVector prims, int maxPrimsPerLeaf, bool keepLeafBounds = false,
+            float splitBudget = 0.0f, ClipFunction clip = ClipFunction())
+    : _depth(0),
+      _keepLeafBounds(keepLeafBounds)
+    {
+        if (prims.empty())
+            return;
+
+        BvhBuilder builder(4, splitBudget, std::move(clip));
+        Writer writer(*this);
+        builder.build(std::move(prims), writer, maxPrimsPerLeaf);
+
+        size_t count = builder.numReferences();
+        _depth = builder.depth();
+        _buildStats = builder.stats();
+        _nodes.resize(writer.size());
+        _primIndices.resize(count);
+        _primIndices.shrink_to_fit();
+        if (_keepLeafBounds) {
+            _leafBounds.resize(count);
+            _leafBounds.shrink_to_fit();
+        }
+        _nodes.shrink_to_fit();
+    }
+
+    // Recomputes and requantizes all node boxes bottom up after primitives
+    // have moved, keeping the topology of the tree. See BinaryBvh::refit
+    template<typename BoundsFunction>
+    void refit(BoundsFunction bounds)
+    {
+        if (_nodes.empty())
+            return;
+        _bounds = refitNode(0, bounds);
+    }
+
+    template<typename LAMBDA>
+    void trace(Ray &ray, LAMBDA intersector) const
+    {
+        if (_nodes.empty())
+            return;
+
+        StackNode *stack = reinterpret_cast<StackNode *>(alloca((3*_depth + 1)*sizeof(StackNode)));
+        StackNode *stackPtr = stack;
+
+        const Vec3pf rayO(float4(ray.pos().x()), float4(ray.pos().y()), float4(ray.pos().z()));
+        const Vec3pf invDir = float4(1.0f)/Vec3pf(float4(ray.dir().x()), float4(ray.dir().y()), float4(ray.dir().z()));
+        const float4 rayNearT(ray.nearT());
+
+        // Byte offsets of the near and far planes of each axis within a node
+        size_t nearOffset[3], farOffset[3];
+        for (int a = 0; a < 3; ++a) {
+            bool positive = ray.dir()[a] >= 0.0f;
+            nearOffset[a] = (positive ? offsetof(QuantizedNode, lo) : offsetof(QuantizedNode, hi)) + a*4;
+            farOffset [a] = (positive ? offsetof(QuantizedNode, hi) : offsetof(QuantizedNode, lo)) + a*4;
+        }
+
+        uint32 ref = 0;
+        float tMin = ray.nearT(), tMax = ray.farT();
+        while (true) {
+            while (!(ref & LeafFlag)) {
+                const QuantizedNode &node = _nodes[ref];
+                const uint8 *bytes = reinterpret_cast<const uint8 *>(&node);
+
+                float4 tNear = rayNearT, tFar(tMax);
+                for (int a = 0; a < 3; ++a) {
+                    float4 origin(node.origin[a]);
+                    float4 scale(exponentToScale(node.exponent[a]));
+                    tNear = max(tNear, (origin + expandBytes(bytes + nearOffset[a])*scale - rayO[a])*invDir[a]);
+                    tFar  = min(tFar,  (origin + expandBytes(bytes +  farOffset[a])*scale - rayO[a])*invDir[a]);
+                }
+                int hitMask = _mm_movemask_ps(_mm_cmple_ps(tNear.raw(), tFar.raw())) & ((1 << node.childCount) - 1);
+                if (!hitMask)
+                    goto pop;
+
+                // Sort hit children front to back
+                uint32 hitRefs[4];
+                float hitT[4];
+                int hitCount = 0;
+                for (uint32 i = 0; i < 4; ++i) {
+                    if (!(hitMask & (1 << i)))
+                        continue;
+                    int j = hitCount++;
+                    for (; j > 0 && hitT[j - 1] > tNear[i]; --j) {
+                        hitRefs[j] = hitRefs[j - 1];
+                        hitT[j] = hitT[j - 1];
+                    }
+                    hitRefs[j] = childRef(ref, i);
+                    hitT[j] = tNear[i];
+                }
+
+                for (int i = hitCount - 1; i > 0; --i)
+                    stackPtr++->set(hitRefs[i], hitT[i]);
+                ref = hitRefs[0];
+                tMin = hitT[0];
+            }
+
+            {
+                const QuantizedNode &node = _nodes[(ref & ~LeafFlag) >> 2];
+                uint32 slot = ref & 3;
+                uint32 start = node.child[slot];
+                uint32 count = node.primCount[slot];
+                Vec3pf bounds = leafBounds(node, slot);
+                for (uint32 i = start; i < start + count; ++i)
+                    intersector(ray, _primIndices[i], tMin, bounds);
+                tMax = min(tMax, ray.farT());
+            }
+
+pop:
+            do {
+                if (stackPtr == stack)
+                    return;
+                stackPtr--;
+            } while (stackPtr->tMin > tMax);
+            ref = stackPtr->ref;
+            tMin = stackPtr->tMin;
+        }
+    }
+
+    const Box3f &bounds() const
+    {
+        return _bounds;
+    }
+
+    const BuildStats &buildStats() const
+    {
+        return _buildStats;
+    }
+};
+
+}
+
+}
+
+#endif /* QUANTIZEDBVH_HPP_ */
@@ -0,0 +1,240 @@
+#ifndef SPATIALSPLITTER_HPP_
+#define SPATIALSPLITTER_HPP_
+
+#include "Primitive.hpp"
+#include "Splitter.hpp"
+
+#include "math/MathUtil.hpp"
+
+#include <functional>
+#include <cstring>
+
+namespace Tungsten {
+
+namespace Bvh {
+
+// Returns the bounds of the part of primitive id that lies inside the region.
+// The result may be conservative, but should be as tight as possible. Without
+// a clip function, references are clipped using their boxes only
+typedef std::function<Box3f(uint32 id, const Box3f &region)> ClipFunction;
+
+struct SpatialSplitInfo
+{
+    int dim;
+    int bin;
+    float plane;
+    float cost;
+    uint32 lCount, rCount;
+};
+
+// Binned spatial splits with reference duplication, after "Spatial Splits in
+// Bounding Volume Hierarchies" by Stich et al. Primitives straddling the split
+// plane are clipped against both halves and end up in both children
+class SpatialSplitter
+{
+    static CONSTEXPR int BinCount = 32;
+
+    const ClipFunction &_clip;
+
+    Box3fp _bounds[3][BinCount];
+    uint32 _entries[3][BinCount];
+    uint32 _exits[3][BinCount];
+    Vec3f _binMin, _binSize;
+
+    int binIndex(int dim, float x) const
+    {
+        return clamp(int((x - _binMin[dim])/_binSize[dim]), 0, BinCount - 1);
+    }
+
+    float binPlane(int dim, int bin) const
+    {
+        return _binMin[dim] + _binSize[dim]*bin;
+    }
+
+    Box3f clip(const Primitive &prim, const Box3f &refBox, const Box3f &region) const
+    {
+        Box3f result = refBox;
+        result.intersect(region);
+        if (_clip && isValid(result))
+            result.intersect(_clip(prim.id(), result));
+        return result;
+    }
+
+    void binPrimitives(const PrimVector &prims, int dim)
+    {
+        for (const Primitive &prim : prims) {
+            Box3f box = narrow(prim.box());
+            int first = binIndex(dim, box.min()[dim]);
+            int last  = binIndex(dim, box.max()[dim]);
+            _entries[dim][first]++;
+            _exits[dim][last]++;
+
+            if (first == last) {
+                _bounds[dim][first].grow(prim.box());
+                continue;
+            }
+            for (int i = first; i <= last; ++i) {
+                Box3f region = box;
+                if (i > first) region.min()[dim] = binPlane(dim, i);
+                if (i < last ) region.max()[dim] = binPlane(dim, i + 1);
+                Box3f clipped = clip(prim, box, region);
+                if (isValid(clipped))
+                    _bounds[dim][i].grow(expand(clipped));
+            }
+        }
+    }
+
+    void findSahSplit(int dim, SpatialSplitInfo &split) const
+    {
+        uint32 rCount = 0;
+        uint32 rCounts[BinCount];
+        Box3fp rBox;
+        Box3fp rBoxes[BinCount];
+        for (int i = BinCount - 1; i > 0; --i) {
+            rCount += _exits[dim][i];
+            rBox.grow(_bounds[dim][i]);
+
+            rCounts[i] = rCount;
+            rBoxes[i] = rBox;
+        }
+
+        uint32 lCount = _entries[dim][0];
+        Box3fp lBox = _bounds[dim][0];
+        for (int i = 1; i < BinCount; ++i) {
+            float cost = Splitter::IntersectionCost*(lBox.area()*lCount + rBoxes[i].area()*rCounts[i]);
+
+            if (cost < split.cost) {
+                split.dim = dim;
+                split.bin = i;
+                split.plane = binPlane(dim, i);
+                split.cost = cost;
+                split.lCount = lCount;
+                split.rCount = rCounts[i];
+            }
+
+            lCount += _entries[dim][i];
+            lBox.grow(_bounds[dim][i]);
+        }
+    }
+
+public:
+    // Fraction of the root surface area that the children of an object split
+    // need to overlap by before spatial splits are considered
+    static CONSTEXPR float OverlapThreshold = 1e-5f;
+
+    static bool isValid(const Box3f &box)
+    {
+        return box.min().x() <= box.max().x() && box.min().y() <= box.max().y() && box.min().z() <= box.max().z();
+    }
+
+    SpatialSplitter(const ClipFunction &clip)
+    : _clip(clip)
+    {
+        std::memset(_entries, 0, sizeof(_entries));
+        std::memset(_exits, 0, sizeof(_exits));
+    }
+
+    // Finds the best spatial split that is cheaper than split.cost.
+    // Returns false if there is none
+    bool findSplit(const PrimVector &prims, const Box3f &geomBox, SpatialSplitInfo &split)
+    {
+        split.dim = -1;
+
+        _binMin = geomBox.min();
+        _binSize = geomBox.diagonal()/float(BinCount);
+        for (int i = 0; i < 3; ++i) {
+            if (_binSize[i] > 0.0f) {
+                binPrimitives(prims, i);
+                findSahSplit(i, split);
+            }
+        }
+
+        return split.dim != -1;
+    }
+
+    // Distributes the references to the two sides of the split, clipping
+    // those that straddle the plane. Returns the number of duplicated references
+    uint32 split(const PrimVector &prims, const SpatialSplitInfo &split, PrimVector &lPrims, PrimVector &rPrims) const
+    {
+        int dim = split.dim;
+        lPrims.reserve(split.lCount);
+        rPrims.reserve(split.rCount);
+
+        uint32 duplicates = 0;
+        for (const Primitive &prim : prims) {
+            Box3f box = narrow(prim.box());
+            if (binIndex(dim, box.max()[dim]) < split.bin) {
+                lPrims.push_back(prim);
+            } else if (binIndex(dim, box.min()[dim]) >= split.bin) {
+                rPrims.push_back(prim);
+            } else {
+                Box3f lRegion = box, rRegion = box;
+                lRegion.max()[dim] = split.plane;
+                rRegion.min()[dim] = split.plane;
+                Box3f lBox = clip(prim, box, lRegion);
+                Box3f rBox = clip(prim, box, rRegion);
+
+                bool lValid = isValid(lBox), rValid = isValid(rBox);
+                if (lValid)
+                    lPrims.emplace_back(lBox, lBox.center(), prim.id());
+                if (rValid)
+                    rPrims.emplace_back(rBox, rBox.center(), prim.id());
+                if (lValid && rValid)
+                    duplicates++;
+                else if (!lValid && !rValid)
+                    lPrims.push_back(prim);
+            }
+        }
+
+        return duplicates;
+    }
+
+    // Bounds of the part of a convex polygon that lies inside the region,
+    // using Sutherland-Hodgman clipping. Polygons with two vertices are
+    // treated as line segments
+    static Box3f clipPolygonBounds(const Vec3f *verts, int count, const Box3f &region)
+    {
+        CONSTEXPR int MaxVerts = 16;
+        Vec3f bufferA[MaxVerts], bufferB[MaxVerts];
+        Vec3f *src = bufferA, *dst = bufferB;
+        for (int i = 0; i < count; ++i)
+            src[i] = verts[i];
+
+        for (int dim = 0; dim < 3 && count > 0; ++dim) {
+            for (int side = 0; side < 2 && count > 0; ++side) {
+                float plane = side ? region.max()[dim] : region.min()[dim];
+                float sign = side ? -1.0f : 1.0f;
+
+                int dstCount = 0;
+                for (int i = 0; i < count; ++i) {
+                    const Vec3f &a = src[i];
+                    const Vec3f &b = src[(i + 1) % count];
+                    float da = sign*(a[dim] - plane);
+                    float db = sign*(b[dim] - plane);
+                    if (da >= 0.0f)
+                        dst[dstCount++] = a;
+                    if ((da < 0.0f) != (db < 0.0f) && dstCount < MaxVerts) {
+                        Vec3f p = lerp(a, b, da/(da - db));
+                        p[dim] = plane;
+                        dst[dstCount++] = p;
+                    }
+                    if (dstCount == MaxVerts)
+                        break;
+                }
+                std::swap(src, dst);
+                count = dstCount;
+            }
+        }
+
+        Box3f result;
+        for (int i = 0; i < count; ++i)
+            result.grow(src[i]);
+        return result;
+    }
+};
+
+}
+
+}
+
+#endif /* SPATIALSPLITTER_HPP_ */
@@ -0,0 +1,10 @@
+#include "SwitchableBvh.hpp"
+
+namespace Tungsten {
+
+DEFINE_STRINGABLE_ENUM(Bvh::SwitchableBvh::Layout, "BVH layout", ({
+    {"binary", Bvh::SwitchableBvh::BinaryLayout},
+    {"quantized4", Bvh::SwitchableBvh::Quantized4Layout},
+}))
+
+}
@@ -0,0 +1,105 @@
+#ifndef SWITCHABLEBVH_HPP_
+#define SWITCHABLEBVH_HPP_
+
+#include "QuantizedBvh.hpp"
+#include "BinaryBvh.hpp"
+
+#include "StringableEnum.hpp"
+
+#include <memory>
+
+namespace Tungsten {
+
+namespace Bvh {
+
+// Wraps either a BinaryBvh or a QuantizedBvh, so that users of the BVH can
+// choose the node layout at runtime (e.g. from the scene file) while
+// keeping a single trace interface
+class SwitchableBvh
+{
+    enum LayoutEnum
+    {
+        BinaryLayout,
+        Quantized4Layout,
+    };
+
+public:
+    typedef StringableEnum<LayoutEnum> Layout;
+    friend Layout;
+
+private:
+    std::unique_ptr<BinaryBvh> _binaryBvh;
+    std::unique_ptr<QuantizedBvh> _quantizedBvh;
+
+    friend BvhCache;
+
+    SwitchableBvh() = default;
+
+    bool load(CacheReader &in, uint32 primCount)
+    {
+        uint32 layout;
+        if (!in.read(layout))
+            return false;
+
+        if (layout == Quantized4Layout) {
+            _quantizedBvh.reset(new QuantizedBvh());
+            return _quantizedBvh->load(in, primCount);
+        } else {
+            _binaryBvh.reset(new BinaryBvh());
+            return _binaryBvh->load(in, primCount);
+        }
+    }
+
+    void save(CacheWriter &out) const
+    {
+        if (_quantizedBvh) {
+            out.write(uint32(Quantized4Layout));
+            _quantizedBvh->save(out);
+        } else {
+            out.write(uint32(BinaryLayout));
+            _binaryBvh->save(out);
+        }
+    }
+
+public:
+    // If keepLeafBounds is set, the intersector receives the exact bounds of
+    // each leaf, regardless of the layout. See BvhBuilder for splitBudget
+    SwitchableBvh(PrimVector prims, int maxPrimsPerLeaf, Layout layout, bool keepLeafBounds = false,
+            float splitBudget = 0.0f, ClipFunction clip = ClipFunction())
+    {
+        if (layout == Quantized4Layout)
+            _quantizedBvh.reset(new QuantizedBvh(std::move(prims), maxPrimsPerLeaf, keepLeafBounds,
+                    splitBudget, std::move(clip)));
+        else
+            _binaryBvh.reset(new BinaryBvh(std::move(prims), maxPrimsPerLeaf, splitBudget, std::move(clip)));
+    }
+
+    template<typename BoundsFunction>
+    void refit(BoundsFunction bounds)
+    {
+        if (_quantizedBvh)
+            _quantizedBvh->refit(bounds);
+        else
+            _binaryBvh->refit(bounds);
+    }
+
+    const BuildStats &buildStats() const
+    {
+        return _quantizedBvh ? _quantizedBvh->buildStats() : _binaryBvh->buildStats();
+    }
+
+    template<typename LAMBDA>
+    void trace(Ray &ray, LAMBDA intersector) const
+    {
+        if (_quantizedBvh)
+            _quantizedBvh->trace(ray, intersector);
+        else
+            _binaryBvh->trace(ray, intersector);
+    }
+};
+
+}
+
+}
+
+#endif /* SWITCHABLEBVH_HPP_ */
@@ -29,7 +29,7 @@ void ThinlensCamera::precompute()
 {
     _fovRad = Angle::degToRad(_fovDeg);
     _planeDist = 1.0f/std::tan(_fovRad*0.5f);
-    _aperture->makeSamplable(MAP_UNIFORM);
+    _aperture->makeSamplable(MAP_UNIFORM, false);
 
     float planeArea = (2.0f/_planeDist)*(2.0f*_ratio/_planeDist);
     _invPlaneArea = 1.0f/planeArea;
@@ -53,6 +53,13 @@ void Integrator::advanceSpp()
     _nextSpp = min(_currentSpp + _scene->rendererSettings().sppStep(), _scene->rendererSettings().spp());
 }
 
+// Replaces the spp step of the renderer settings for the upcoming pass.
+// A step of zero ends the render
+void Integrator::setNextSppStep(uint32 step)
+{
+    _nextSpp = min(_currentSpp + step, _scene->rendererSettings().spp());
+}
+
 void Integrator::writeBuffers(const std::string &suffix, bool overwrite)
 {
     Vec2u res = _scene->cam().resolution();
@@ -89,6 +96,11 @@ void Integrator::saveCheckpoint()
     writeBuffers("_checkpoint", true);
 }
 
+// Must be bumped whenever the layout written by saveState changes. Resume
+// files written with a different version are ignored and the render restarts
+// from 0 spp. Version 2 dropped the per-tile sampler states
+static const uint32 ResumeStateVersion = 2;
+
 // Computes a hash of everything in the scene except the renderer settings
 // This is done by serializing everything to JSON and hashing the resulting string
 static uint64 sceneHash(Scene &scene)
@@ -117,6 +129,7 @@ void Integrator::saveRenderResumeData(Scene &scene)
     // TODO: Camera splat buffer not saved/reconstructed
     rapidjson::Document document;
     document.SetObject();
+    document.AddMember("state_version", ResumeStateVersion, document.GetAllocator());
     document.AddMember("current_spp", _currentSpp, document.GetAllocator());
     document.AddMember("adaptive_sampling", _scene->rendererSettings().useAdaptiveSampling(), document.GetAllocator());
     document.AddMember("stratified_sampler", _scene->rendererSettings().useSobol(), document.GetAllocator());
@@ -136,6 +149,9 @@ bool Integrator::resumeRender(Scene &scene)
         return false;
 
     JsonDocument document(file, FileUtils::streamRead<std::string>(in));
+    uint32 stateVersion;
+    if (!document.getField("state_version", stateVersion) || stateVersion != ResumeStateVersion)
+        return false;
     bool adaptiveSampling, stratifiedSampler;
     if (!document.getField("adaptive_sampling", adaptiveSampling)
             || adaptiveSampling != _scene->rendererSettings().useAdaptiveSampling())
@@ -166,4 +182,9 @@ bool Integrator::supportsResumeRender() const
     return false;
 }
 
+bool Integrator::invertsPaths() const
+{
+    return false;
+}
+
 }
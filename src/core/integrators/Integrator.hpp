@@ -45,6 +45,11 @@ public:
     void saveRenderResumeData(Scene &scene);
     bool resumeRender(Scene &scene);
     virtual bool supportsResumeRender() const;
+    // True if the integrator maps paths back into primary sample space, which
+    // requires all sampling routines to be invertible
+    virtual bool invertsPaths() const;
+
+    void setNextSppStep(uint32 step);
 
     bool done() const
     {
@@ -2,6 +2,7 @@
 
 #include "bidirectional_path_tracer/BidirectionalPathTraceIntegrator.hpp"
 #include "progressive_photon_map/ProgressivePhotonMapIntegrator.hpp"
+#include "wavefront_path_tracer/WavefrontPathTraceIntegrator.hpp"
 #include "reversible_jump_mlt/ReversibleJumpMltIntegrator.hpp"
 #include "multiplexed_mlt/MultiplexedMltIntegrator.hpp"
 #include "light_tracer/LightTraceIntegrator.hpp"
@@ -13,6 +14,7 @@ namespace Tungsten {
 
 DEFINE_STRINGABLE_ENUM(IntegratorFactory, "integrator", ({
     {"path_tracer", std::make_shared<PathTraceIntegrator>},
+    {"wavefront_path_tracer", std::make_shared<WavefrontPathTraceIntegrator>},
     {"light_tracer", std::make_shared<LightTraceIntegrator>},
     {"photon_map", std::make_shared<PhotonMapIntegrator>},
     {"progressive_photon_map", std::make_shared<ProgressivePhotonMapIntegrator>},
@@ -1,15 +1,27 @@
 #include "TraceBase.hpp"
 
+#include "path_tracer/SdTree.hpp"
+
+#include <mutex>
+
 namespace Tungsten {
 
+// Some integrators construct their tracers on the worker threads that use
+// them. Primitive::makeSamplable is not thread safe, so the lights are
+// prepared by one tracer at a time
+static std::mutex lightPreparationMutex;
+
 TraceBase::TraceBase(TraceableScene *scene, const TraceSettings &settings, uint32 threadId)
 : _scene(scene),
   _settings(settings),
-  _threadId(threadId)
+  _threadId(threadId),
+  _guide(nullptr),
+  _guideBsdfFraction(1.0f)
 {
     _scene = scene;
     _lightPdf.resize(scene->lights().size());
 
+    std::unique_lock<std::mutex> lock(lightPreparationMutex);
     std::vector<float> lightWeights(scene->lights().size());
     for (size_t i = 0; i < scene->lights().size(); ++i) {
         scene->lights()[i]->makeSamplable(*_scene, _threadId);
@@ -76,6 +88,7 @@ inline Vec3f TraceBase::generalizedShadowRayImpl(PathSampleGenerator &sampler,
     float initialFarT = ray.farT();
     Vec3f throughput(1.0f);
     do {
+        RENDER_STAT_ADD(ShadowSegments, 1);
         bool didHit = _scene->intersect(ray, data, info) && info.primitive != endCap;
         if (didHit) {
             if (!info.bsdf->lobes().hasForward())
@@ -413,6 +426,12 @@ Vec3f TraceBase::volumeSampleDirect(const Primitive &light,
     return result;
 }
 
+// Lights are picked proportional to their approximate radiance at p. In
+// scenes with many lights, most of them are covered by the light BVH, which
+// enters the choice as a single entry and is only descended if it was picked.
+// The returned weight is the inverse of the exact selection probability.
+// Both strategies of sampleDirect only ever consider the chosen light, so
+// their MIS weights stay correct independently of how it was selected
 const Primitive *TraceBase::chooseLight(PathSampleGenerator &sampler, const Vec3f &p, float &weight)
 {
     if (_scene->lights().empty())
@@ -422,21 +441,25 @@ const Primitive *TraceBase::chooseLight(PathSampleGenerator &sampler, const Vec3
         return _scene->lights()[0].get();
     }
 
+    const std::vector<const Primitive *> &lights = _scene->looseLights();
+    const LightBvh *bvh = _scene->lightBvh();
+    size_t numEntries = lights.size() + (bvh ? 1 : 0);
+
     float total = 0.0f;
     unsigned numNonNegative = 0;
-    for (size_t i = 0; i < _lightPdf.size(); ++i) {
-        _lightPdf[i] = _scene->lights()[i]->approximateRadiance(_threadId, p);
+    for (size_t i = 0; i < numEntries; ++i) {
+        _lightPdf[i] = i < lights.size() ? lights[i]->approximateRadiance(_threadId, p) : bvh->importance(p);
         if (_lightPdf[i] >= 0.0f) {
             total += _lightPdf[i];
             numNonNegative++;
         }
     }
     if (numNonNegative == 0) {
-        for (size_t i = 0; i < _lightPdf.size(); ++i)
+        for (size_t i = 0; i < numEntries; ++i)
             _lightPdf[i] = 1.0f;
-        total = _lightPdf.size();
-    } else if (numNonNegative < _lightPdf.size()) {
-        for (size_t i = 0; i < _lightPdf.size(); ++i) {
+        total = numEntries;
+    } else if (numNonNegative < numEntries) {
+        for (size_t i = 0; i < numEntries; ++i) {
             float uniformWeight = (total == 0.0f ? 1.0f : total)/numNonNegative;
             if (_lightPdf[i] < 0.0f) {
                 _lightPdf[i] = uniformWeight;
@@ -447,10 +470,17 @@ const Primitive *TraceBase::chooseLight(PathSampleGenerator &sampler, const Vec3
     if (total == 0.0f)
         return nullptr;
     float t = sampler.next1D()*total;
-    for (size_t i = 0; i < _lightPdf.size(); ++i) {
-        if (t < _lightPdf[i] || i == _lightPdf.size() - 1) {
+    for (size_t i = 0; i < numEntries; ++i) {
+        if (t < _lightPdf[i] || i == numEntries - 1) {
             weight = total/_lightPdf[i];
-            return _scene->lights()[i].get();
+            if (i < lights.size())
+                return lights[i];
+
+            // Reuse the remainder of the sample for the descent
+            float bvhPdf;
+            const Primitive *light = bvh->sample(_threadId, p, clamp(t/_lightPdf[i], 0.0f, 1.0f - 1e-7f), bvhPdf);
+            weight /= bvhPdf;
+            return light;
         } else {
             t -= _lightPdf[i];
         }
@@ -473,6 +503,8 @@ Vec3f TraceBase::volumeEstimateDirect(PathSampleGenerator &sampler,
                     int bounce,
                     const Ray &parentRay)
 {
+    RENDER_STAT_TIMER(TimeLightSampling);
+
     float weight;
     const Primitive *light = chooseLight(sampler, mediumSample.p, weight);
     if (light == nullptr)
@@ -486,6 +518,8 @@ Vec3f TraceBase::estimateDirect(SurfaceScatterEvent &event,
                                 const Ray &parentRay,
                                 Vec3f *transmittance)
 {
+    RENDER_STAT_TIMER(TimeLightSampling);
+
     float weight;
     const Primitive *light = chooseLight(*event.sampler, event.info->p, weight);
     if (light == nullptr)
@@ -497,6 +531,8 @@ bool TraceBase::handleVolume(PathSampleGenerator &sampler, MediumSample &mediumS
            const Medium *&medium, int bounce, bool adjoint, bool enableLightSampling,
            Ray &ray, Vec3f &throughput, Vec3f &emission, bool &wasSpecular)
 {
+    RENDER_STAT_TIMER(TimeShading);
+
     wasSpecular = !enableLightSampling;
 
     if (!adjoint && enableLightSampling && bounce < _settings.maxBounces - 1)
@@ -513,12 +549,40 @@ bool TraceBase::handleVolume(PathSampleGenerator &sampler, MediumSample &mediumS
     return true;
 }
 
+// One-sample MIS between the BSDF and the guide: Either technique picks the
+// direction, and the sample is weighted by the mixture of both densities
+bool TraceBase::sampleGuided(SurfaceScatterEvent &event, const IntersectionInfo &info) const
+{
+    const Bsdf &bsdf = *info.bsdf;
+
+    float guidePdf;
+    if (event.sampler->next1D() < _guideBsdfFraction) {
+        if (!bsdf.sample(event, false))
+            return false;
+        guidePdf = _guide->pdf(info.p, event.frame.toGlobal(event.wo));
+    } else {
+        event.wo = event.frame.toLocal(_guide->sample(info.p, event.sampler->next2D(), guidePdf));
+        event.sampledLobe = bsdf.lobes();
+    }
+
+    float pdf = _guideBsdfFraction*bsdf.pdf(event) + (1.0f - _guideBsdfFraction)*guidePdf;
+    if (!(pdf > 0.0f))
+        return false;
+
+    event.pdf = pdf;
+    event.weight = bsdf.eval(event, false)/pdf;
+
+    return true;
+}
+
 bool TraceBase::handleSurface(SurfaceScatterEvent &event, IntersectionTemporary &data,
                               IntersectionInfo &info, const Medium *&medium,
                               int bounce, bool adjoint, bool enableLightSampling, Ray &ray,
                               Vec3f &throughput, Vec3f &emission, bool &wasSpecular,
                               Medium::MediumState &state, Vec3f *transmittance)
 {
+    RENDER_STAT_TIMER(TimeShading);
+
     const Bsdf &bsdf = *info.bsdf;
 
     // For forward events, the transport direction does not matter (since wi = -wo)
@@ -544,8 +608,12 @@ bool TraceBase::handleSurface(SurfaceScatterEvent &event, IntersectionTemporary
         }
 
         event.requestedLobe = BsdfLobes::AllLobes;
-        if (!bsdf.sample(event, adjoint))
+        if (_guide && _guide->trained() && !adjoint && !bsdf.lobes().hasSpecular()) {
+            if (!sampleGuided(event, info))
+                return false;
+        } else if (!bsdf.sample(event, adjoint)) {
             return false;
+        }
 
         wo = event.frame.toGlobal(event.wo);
 
@@ -30,6 +30,8 @@
 
 namespace Tungsten {
 
+class SdTree;
+
 class TraceBase
 {
 protected:
@@ -42,10 +44,18 @@ protected:
     // For sampling light sources in adjoint light tracing
     std::unique_ptr<Distribution1D> _lightSampler;
 
+    // Learned distribution of incident radiance for guiding the scattering
+    // of paths at non-specular surfaces, if any
+    const SdTree *_guide;
+    // Probability of sampling the BSDF instead of the guide
+    float _guideBsdfFraction;
+
     TraceBase(TraceableScene *scene, const TraceSettings &settings, uint32 threadId);
 
     bool isConsistent(const SurfaceScatterEvent &event, const Vec3f &w) const;
 
+    bool sampleGuided(SurfaceScatterEvent &event, const IntersectionInfo &info) const;
+
     template<bool ComputePdfs>
     inline Vec3f generalizedShadowRayImpl(PathSampleGenerator &sampler,
                                Ray &ray,
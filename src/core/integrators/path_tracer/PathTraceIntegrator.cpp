@@ -8,11 +8,18 @@
 #include "thread/ThreadUtils.hpp"
 #include "thread/ThreadPool.hpp"
 
+#include "math/BitManip.hpp"
+
+#include <algorithm>
+
 namespace Tungsten {
 
 CONSTEXPR uint32 PathTraceIntegrator::TileSize;
 CONSTEXPR uint32 PathTraceIntegrator::VarianceTileSize;
 CONSTEXPR uint32 PathTraceIntegrator::AdaptiveThreshold;
+CONSTEXPR uint32 PathTraceIntegrator::MaxTileSplits;
+CONSTEXPR uint32 PathTraceIntegrator::SlowTileFactor;
+CONSTEXPR uint32 PathTraceIntegrator::MinTilesPerThread;
 
 PathTraceIntegrator::PathTraceIntegrator()
 : Integrator(),
@@ -20,23 +27,172 @@ PathTraceIntegrator::PathTraceIntegrator()
   _h(0),
   _varianceW(0),
   _varianceH(0),
-  _sampler(0xBA5EBA11)
+  _sampler(0xBA5EBA11),
+  _samplerSeed(0),
+  _sampleSlices(1),
+  _guidingIteration(0),
+  _guidingPassSpp(0)
+{
+}
+
+std::unique_ptr<PathSampleGenerator> PathTraceIntegrator::makeSampler()
+{
+    return _scene->rendererSettings().useSobol() ?
+        std::unique_ptr<PathSampleGenerator>(new SobolPathSampler(_samplerSeed, true)) :
+        std::unique_ptr<PathSampleGenerator>(new UniformPathSampler(_samplerSeed, true));
+}
+
+bool PathTraceIntegrator::inSlice(const WorkItem &item, uint32 x, uint32 y) const
 {
+    return item.sliceCount == 1 || ((x - item.x) + (y - item.y)*item.w) % item.sliceCount == item.part;
+}
+
+uint32 PathTraceIntegrator::tileSampleCount(const ImageTile &tile) const
+{
+    uint32 result = 0;
+    for (uint32 y = tile.y; y < tile.y + tile.h; ++y)
+        for (uint32 x = tile.x; x < tile.x + tile.w; ++x)
+            result += _samples[x/VarianceTileSize + y/VarianceTileSize*_varianceW].nextSampleCount;
+    return result;
 }
 
 void PathTraceIntegrator::diceTiles()
 {
-    for (uint32 y = 0; y < _h; y += TileSize) {
-        for (uint32 x = 0; x < _w; x += TileSize) {
-            _tiles.emplace_back(
-                x,
-                y,
-                min(TileSize, _w - x),
-                min(TileSize, _h - y),
-                _scene->rendererSettings().useSobol() ?
-                    std::unique_ptr<PathSampleGenerator>(new SobolPathSampler(MathUtil::hash32(_sampler.nextI()))) :
-                    std::unique_ptr<PathSampleGenerator>(new UniformPathSampler(MathUtil::hash32(_sampler.nextI())))
-            );
+    uint32 tilesX = (_w + TileSize - 1)/TileSize;
+    uint32 tilesY = (_h + TileSize - 1)/TileSize;
+    uint32 gridSize = 1;
+    while (gridSize < max(tilesX, tilesY))
+        gridSize *= 2;
+
+    // Tiles are issued along a Hilbert curve, so that tiles rendered at the
+    // same time touch neighbouring parts of the scene and the framebuffer
+    std::vector<std::pair<uint32, uint32>> order;
+    for (uint32 y = 0; y < tilesY; ++y)
+        for (uint32 x = 0; x < tilesX; ++x)
+            order.emplace_back(BitManip::hilbertIndex(gridSize, x, y), x + y*tilesX);
+    std::sort(order.begin(), order.end());
+
+    for (const auto &o : order) {
+        uint32 x = (o.second % tilesX)*TileSize;
+        uint32 y = (o.second / tilesX)*TileSize;
+        // Samplers are per thread rather than per tile, see renderWorkItem
+        _tiles.emplace_back(x, y, min(TileSize, _w - x), min(TileSize, _h - y), nullptr);
+    }
+
+    _tileCostPerSample.resize(_tiles.size(), 0.0f);
+    _finishedSlices.reset(new std::atomic<uint32>[_tiles.size()]);
+
+    uint32 minTiles = ThreadUtils::pool->threadCount()*MinTilesPerThread;
+    _sampleSlices = clamp(uint32((minTiles + _tiles.size() - 1)/_tiles.size()), 1u, MaxTileSplits);
+    if (_sampleSlices > 1)
+        _pixelRecords.resize(_w*_h);
+}
+
+void PathTraceIntegrator::updateTileCosts()
+{
+    std::vector<double> tileCost(_tiles.size(), 0.0);
+    for (const WorkItem &item : _workItems)
+        tileCost[item.tileId] += item.cost;
+
+    for (size_t i = 0; i < _tiles.size(); ++i) {
+        uint32 sampleCount = tileSampleCount(_tiles[i]);
+        if (tileCost[i] > 0.0 && sampleCount > 0)
+            _tileCostPerSample[i] = float(tileCost[i]/sampleCount);
+    }
+}
+
+void PathTraceIntegrator::addTileWork(uint32 tileId, bool split)
+{
+    const ImageTile &tile = _tiles[tileId];
+    if (_sampleSlices > 1) {
+        for (uint32 i = 0; i < _sampleSlices; ++i)
+            _workItems.push_back(WorkItem{tileId, tile.x, tile.y, tile.w, tile.h, i, _sampleSlices, 0.0});
+        return;
+    }
+
+    // Split points are aligned to variance tiles, so that no two work items
+    // ever update the same SampleRecord
+    uint32 splitW = tile.w, splitH = tile.h;
+    if (split) {
+        splitW = ((tile.w/2 + VarianceTileSize - 1)/VarianceTileSize)*VarianceTileSize;
+        splitH = ((tile.h/2 + VarianceTileSize - 1)/VarianceTileSize)*VarianceTileSize;
+        if (splitW == 0 || splitW >= tile.w)
+            splitW = tile.w;
+        if (splitH == 0 || splitH >= tile.h)
+            splitH = tile.h;
+    }
+
+    uint32 part = 0;
+    for (uint32 y = 0; y < tile.h; y += splitH)
+        for (uint32 x = 0; x < tile.w; x += splitW)
+            _workItems.push_back(WorkItem{tileId, tile.x + x, tile.y + y,
+                    min(splitW, tile.w - x), min(splitH, tile.h - y), part++, 1, 0.0});
+}
+
+void PathTraceIntegrator::scheduleWork()
+{
+    std::vector<double> predictedCost(_tiles.size());
+    double totalCost = 0.0;
+    for (size_t i = 0; i < _tiles.size(); ++i) {
+        predictedCost[i] = _tileCostPerSample[i]*double(tileSampleCount(_tiles[i]));
+        totalCost += predictedCost[i];
+    }
+    double slowThreshold = SlowTileFactor*totalCost/_tiles.size();
+
+    _workItems.clear();
+    for (size_t i = 0; i < _tiles.size(); ++i)
+        addTileWork(i, totalCost > 0.0 && predictedCost[i] > slowThreshold);
+
+    if (_sampleSlices > 1)
+        for (size_t i = 0; i < _tiles.size(); ++i)
+            _finishedSlices[i] = 0;
+
+    if (ThreadUtils::pool->nodeCount() > 1)
+        partitionWorkByNode();
+}
+
+void PathTraceIntegrator::partitionWorkByNode()
+{
+    uint32 nodeCount = ThreadUtils::pool->nodeCount();
+    auto stripeOf = [&](const WorkItem &item) {
+        return min((item.y*nodeCount)/_h, nodeCount - 1);
+    };
+
+    // Stable, so that each stripe is still traversed in Hilbert order
+    std::stable_sort(_workItems.begin(), _workItems.end(), [&](const WorkItem &a, const WorkItem &b) {
+        return stripeOf(a) < stripeOf(b);
+    });
+
+    _nodeItemStarts.assign(nodeCount + 1, uint32(_workItems.size()));
+    for (size_t i = _workItems.size(); i-- > 0; )
+        _nodeItemStarts[stripeOf(_workItems[i])] = uint32(i);
+    for (uint32 node = nodeCount; node-- > 0; )
+        _nodeItemStarts[node] = min(_nodeItemStarts[node], _nodeItemStarts[node + 1]);
+
+    if (!_nodeCursors)
+        _nodeCursors.reset(new std::atomic<uint32>[nodeCount]);
+    for (uint32 node = 0; node < nodeCount; ++node)
+        _nodeCursors[node] = 0;
+}
+
+uint32 PathTraceIntegrator::claimWorkItem(uint32 threadId, uint32 subTaskId)
+{
+    uint32 nodeCount = ThreadUtils::pool->nodeCount();
+    if (nodeCount == 1)
+        return subTaskId;
+
+    // There are exactly as many sub-tasks as work items, so every sub-task
+    // is guaranteed to eventually find an unclaimed item
+    uint32 home = ThreadUtils::pool->threadNode(threadId);
+    while (true) {
+        for (uint32 i = 0; i < nodeCount; ++i) {
+            uint32 node = (home + i) % nodeCount;
+            uint32 start = _nodeItemStarts[node], end = _nodeItemStarts[node + 1];
+            if (_nodeCursors[node] >= end - start)
+                continue;
+            uint32 idx = _nodeCursors[node]++;
+            if (idx < end - start)
+                return start + idx;
         }
     }
 }
@@ -90,8 +246,9 @@ void PathTraceIntegrator::distributeAdaptiveSamples(int spp)
     for (SampleRecord &record : _samples)
         totalWeight += record.adaptiveWeight;
 
-    int adaptiveBudget = (spp - 1)*_w*_h;
-    int budgetPerTile = adaptiveBudget/(VarianceTileSize*VarianceTileSize);
+    // Passes sized to a deadline can be large enough to overflow 32 bits here
+    uint64 adaptiveBudget = uint64(spp - 1)*_w*_h;
+    uint64 budgetPerTile = adaptiveBudget/(VarianceTileSize*VarianceTileSize);
     float weightToSampleFactor = double(budgetPerTile)/totalWeight;
 
     float pixelPdf = 0.0f;
@@ -109,6 +266,8 @@ void PathTraceIntegrator::distributeAdaptiveSamples(int spp)
 
 bool PathTraceIntegrator::generateWork()
 {
+    updateTileCosts();
+
     for (SampleRecord &record : _samples)
         record.sampleIndex += record.nextSampleCount;
 
@@ -130,27 +289,60 @@ bool PathTraceIntegrator::generateWork()
             record.nextSampleCount = sppCount;
     }
 
+    scheduleWork();
+
     return true;
 }
 
-void PathTraceIntegrator::renderTile(uint32 id, uint32 tileId)
+void PathTraceIntegrator::advanceGuiding()
+{
+    if (_guidingPassSpp > 0) {
+        _guide->refine(_guidingPassSpp);
+        _guidingPassSpp = 0;
+    }
+
+    // Passes are only ever shortened, so that spp steps and deadlines chosen
+    // by the caller are still respected
+    uint32 trainingSpp = uint32(max(_settings.guidingTrainingSpp, 0));
+    if (_currentSpp < trainingSpp) {
+        uint32 step = 1u << min(_guidingIteration++, 16u);
+        _nextSpp = min(_nextSpp, min(_currentSpp + step, trainingSpp));
+        _guidingPassSpp = _nextSpp - _currentSpp;
+    }
+
+    for (auto &tracer : _tracers)
+        tracer->setRecordGuiding(_guidingPassSpp > 0);
+}
+
+void PathTraceIntegrator::prepareTracer(TraceableScene &scene, uint32 threadId)
 {
-    ImageTile &tile = _tiles[tileId];
-    for (uint32 y = 0; y < tile.h; ++y) {
-        for (uint32 x = 0; x < tile.w; ++x) {
-            Vec2u pixel(tile.x + x, tile.y + y);
-            uint32 pixelIndex = pixel.x() + pixel.y()*_w;
-            uint32 variancePixelIndex = pixel.x()/VarianceTileSize + pixel.y()/VarianceTileSize*_varianceW;
-
-            SampleRecord &record = _samples[variancePixelIndex];
-            int spp = record.nextSampleCount;
-            for (int i = 0; i < spp; ++i) {
-                tile.sampler->startPath(pixelIndex, record.sampleIndex + i);
-                Vec3f c = _tracers[id]->traceSample(pixel, *tile.sampler);
-
-                record.addSample(c);
-                _scene->cam().colorBuffer()->addSample(pixel, c);
-            }
+    _tracers[threadId].reset(new PathTracer(&scene, _settings, threadId, _guide.get()));
+}
+
+void PathTraceIntegrator::renderWorkItem(uint32 id, uint32 subTaskId)
+{
+    PathSampleGenerator &sampler = *_threadSamplers[id];
+    renderItemSamples(id, subTaskId, [&](Vec2u pixel, uint32 pixelIndex, uint32 sampleIndex, SampleRecord &record) {
+        sampler.startPath(pixelIndex, sampleIndex);
+        Vec3f c = _tracers[id]->traceSample(pixel, sampler);
+
+        record.addSample(c);
+        _scene->cam().colorBuffer()->addSample(pixel, c);
+    }, []() {});
+}
+
+bool PathTraceIntegrator::supportsGuiding() const
+{
+    return true;
+}
+
+void PathTraceIntegrator::accumulateSlices(const ImageTile &tile)
+{
+    for (uint32 y = tile.y; y < tile.y + tile.h; ++y) {
+        for (uint32 x = tile.x; x < tile.x + tile.w; ++x) {
+            uint32 pixelIndex = x + y*_w;
+            uint32 variancePixelIndex = x/VarianceTileSize + y/VarianceTileSize*_varianceW;
+            _samples[variancePixelIndex].addSamples(_pixelRecords[pixelIndex]);
         }
     }
 }
@@ -159,16 +351,22 @@ void PathTraceIntegrator::saveState(OutputStreamHandle &out)
 {
     for (SampleRecord &s : _samples)
         s.saveState(out);
-    for (ImageTile &i : _tiles)
-        i.sampler->saveState(out);
+    if (_guide) {
+        _guide->saveState(out);
+        FileUtils::streamWrite(out, _guidingIteration);
+        FileUtils::streamWrite(out, _guidingPassSpp);
+    }
 }
 
 void PathTraceIntegrator::loadState(InputStreamHandle &in)
 {
     for (SampleRecord &s : _samples)
         s.loadState(in);
-    for (ImageTile &i : _tiles)
-        i.sampler->loadState(in);
+    if (_guide) {
+        _guide->loadState(in);
+        FileUtils::streamRead(in, _guidingIteration);
+        FileUtils::streamRead(in, _guidingPassSpp);
+    }
 }
 
 void PathTraceIntegrator::fromJson(JsonPtr value, const Scene &/*scene*/)
@@ -185,12 +383,24 @@ void PathTraceIntegrator::prepareForRender(TraceableScene &scene, uint32 seed)
 {
     _currentSpp = 0;
     _sampler = UniformSampler(MathUtil::hash32(seed));
+    _samplerSeed = MathUtil::hash32(_sampler.nextI());
     _scene = &scene;
     advanceSpp();
     scene.cam().requestColorBuffer();
 
-    for (uint32 i = 0; i < ThreadUtils::pool->threadCount(); ++i)
-        _tracers.emplace_back(new PathTracer(&scene, _settings, i));
+    if (_settings.enableGuiding && supportsGuiding())
+        _guide.reset(new SdTree(scene.bounds()));
+    _guidingIteration = 0;
+    _guidingPassSpp = 0;
+
+    // Tracers are created by the thread that uses them, so that their memory
+    // is first touched on the NUMA node of that thread
+    _tracers.resize(ThreadUtils::pool->threadCount());
+    _threadSamplers.resize(ThreadUtils::pool->threadCount());
+    ThreadUtils::pool->yield(*ThreadUtils::pool->enqueuePerThread([&](uint32 id, uint32, uint32) {
+        prepareTracer(scene, id);
+        _threadSamplers[id] = makeSampler();
+    }));
 
     _w = scene.cam().resolution().x();
     _h = scene.cam().resolution().y();
@@ -210,6 +420,19 @@ void PathTraceIntegrator::teardownAfterRender()
     _tracers.shrink_to_fit();
     _samples.shrink_to_fit();
     _tiles  .shrink_to_fit();
+
+    _threadSamplers.clear();
+    _tileCostPerSample.clear();
+    _workItems.clear();
+    _pixelRecords.clear();
+    _threadSamplers.shrink_to_fit();
+    _tileCostPerSample.shrink_to_fit();
+    _workItems.shrink_to_fit();
+    _pixelRecords.shrink_to_fit();
+    _finishedSlices.reset();
+    _nodeItemStarts.clear();
+    _nodeCursors.reset();
+    _guide.reset();
 }
 
 bool PathTraceIntegrator::supportsResumeRender() const
@@ -219,6 +442,9 @@ bool PathTraceIntegrator::supportsResumeRender() const
 
 void PathTraceIntegrator::startRender(std::function<void()> completionCallback)
 {
+    if (_guide && !done())
+        advanceGuiding();
+
     if (done() || !generateWork()) {
         _currentSpp = _nextSpp;
         advanceSpp();
@@ -226,10 +452,12 @@ void PathTraceIntegrator::startRender(std::function<void()> completionCallback)
         return;
     }
 
+    // Work items are claimed in Hilbert order through the sub-task counter of
+    // the task group, which acts as a shared atomic cursor
     using namespace std::placeholders;
     _group = ThreadUtils::pool->enqueue(
-        std::bind(&PathTraceIntegrator::renderTile, this, _3, _1),
-        _tiles.size(),
+        std::bind(&PathTraceIntegrator::renderWorkItem, this, _3, _1),
+        _workItems.size(),
         [&, completionCallback]() {
             _currentSpp = _nextSpp;
             advanceSpp();
@@ -4,6 +4,7 @@
 #include "PathTracerSettings.hpp"
 #include "SampleRecord.hpp"
 #include "PathTracer.hpp"
+#include "SdTree.hpp"
 
 #include "integrators/Integrator.hpp"
 #include "integrators/ImageTile.hpp"
@@ -15,6 +16,8 @@
 
 #include "math/MathUtil.hpp"
 
+#include "Timer.hpp"
+
 #include <thread>
 #include <memory>
 #include <vector>
@@ -24,9 +27,33 @@ namespace Tungsten {
 
 class PathTraceIntegrator : public Integrator
 {
+protected:
     static CONSTEXPR uint32 TileSize = 16;
     static CONSTEXPR uint32 VarianceTileSize = 4;
     static CONSTEXPR uint32 AdaptiveThreshold = 16;
+    // Upper bound on the number of pieces a tile may be split into in one pass
+    static CONSTEXPR uint32 MaxTileSplits = 4;
+    // Tiles whose predicted cost exceeds the average by this factor are split
+    static CONSTEXPR uint32 SlowTileFactor = 2;
+    // Below this many tiles per thread, the pixels of each tile are split too
+    static CONSTEXPR uint32 MinTilesPerThread = 8;
+
+    // A piece of a tile handed to the thread pool. Slow tiles are split
+    // spatially into pieces aligned to the variance tiles; for small images,
+    // the pixels of each tile are dealt out to interleaved slices instead.
+    // Slices record the statistics of their pixels into _pixelRecords, which
+    // are merged into the variance tiles in order once all slices of the tile
+    // are done.
+    // Every path is seeded from its pixel and sample index, so neither kind
+    // of split changes the image
+    struct WorkItem
+    {
+        uint32 tileId;
+        uint32 x, y, w, h;
+        uint32 part;
+        uint32 sliceCount;
+        double cost;
+    };
 
     PathTracerSettings _settings;
 
@@ -38,19 +65,95 @@ class PathTraceIntegrator : public Integrator
     uint32 _varianceH;
 
     UniformSampler _sampler;
+    uint32 _samplerSeed;
     std::vector<std::unique_ptr<PathTracer>> _tracers;
+    std::vector<std::unique_ptr<PathSampleGenerator>> _threadSamplers;
 
     std::vector<SampleRecord> _samples;
     std::vector<ImageTile> _tiles;
+    std::vector<float> _tileCostPerSample;
+
+    std::vector<WorkItem> _workItems;
+    uint32 _sampleSlices;
+    std::vector<SampleRecord> _pixelRecords;
+    std::unique_ptr<std::atomic<uint32>[]> _finishedSlices;
+
+    // With more than one NUMA node, the image is split into horizontal
+    // stripes, one per node. Threads take work from the stripe of their own
+    // node first and only help out on other stripes once theirs is done
+    std::vector<uint32> _nodeItemStarts;
+    std::unique_ptr<std::atomic<uint32>[]> _nodeCursors;
+
+    // Path guiding is trained in passes of doubling spp counts. Each pass
+    // renders with the guide learned by the previous ones, so its samples
+    // remain part of the image
+    std::unique_ptr<SdTree> _guide;
+    uint32 _guidingIteration;
+    // Spp of the training pass in progress, or 0 when not training
+    uint32 _guidingPassSpp;
+
+    std::unique_ptr<PathSampleGenerator> makeSampler();
+    bool inSlice(const WorkItem &item, uint32 x, uint32 y) const;
+    uint32 tileSampleCount(const ImageTile &tile) const;
 
     void diceTiles();
+    void updateTileCosts();
+    void addTileWork(uint32 tileId, bool split);
+    void scheduleWork();
+    void partitionWorkByNode();
+    uint32 claimWorkItem(uint32 threadId, uint32 subTaskId);
 
     float errorPercentile95();
     void dilateAdaptiveWeights();
     void distributeAdaptiveSamples(int spp);
     bool generateWork();
-
-    void renderTile(uint32 id, uint32 tileId);
+    void advanceGuiding();
+
+    virtual void prepareTracer(TraceableScene &scene, uint32 threadId);
+    virtual void renderWorkItem(uint32 id, uint32 subTaskId);
+    // False for integrators that cannot record training paths, in which case
+    // no guide is built even if guiding is enabled
+    virtual bool supportsGuiding() const;
+    void accumulateSlices(const ImageTile &tile);
+
+    // Claims the next work item of the thread and issues its samples through
+    // traceSample(pixel, pixelIndex, sampleIndex, record). flush() is called
+    // once all samples were issued; by the time it returns, every sample has
+    // to be added to its record and to the color buffer
+    template<typename SampleFunc, typename FlushFunc>
+    void renderItemSamples(uint32 id, uint32 subTaskId, SampleFunc traceSample, FlushFunc flush)
+    {
+        Timer timer;
+
+        WorkItem &item = _workItems[claimWorkItem(id, subTaskId)];
+        for (uint32 y = item.y; y < item.y + item.h; ++y) {
+            for (uint32 x = item.x; x < item.x + item.w; ++x) {
+                if (!inSlice(item, x, y))
+                    continue;
+
+                Vec2u pixel(x, y);
+                uint32 pixelIndex = pixel.x() + pixel.y()*_w;
+                uint32 variancePixelIndex = pixel.x()/VarianceTileSize + pixel.y()/VarianceTileSize*_varianceW;
+
+                const SampleRecord &tileRecord = _samples[variancePixelIndex];
+                SampleRecord &record = item.sliceCount == 1 ? _samples[variancePixelIndex] : _pixelRecords[pixelIndex];
+                if (item.sliceCount > 1)
+                    record = SampleRecord();
+
+                int spp = tileRecord.nextSampleCount;
+                uint32 sampleIndex = tileRecord.sampleIndex;
+                for (int i = 0; i < spp; ++i)
+                    traceSample(pixel, pixelIndex, sampleIndex + i, record);
+            }
+        }
+        flush();
+
+        if (item.sliceCount > 1 && ++_finishedSlices[item.tileId] == item.sliceCount)
+            accumulateSlices(_tiles[item.tileId]);
+
+        timer.stop();
+        item.cost = timer.elapsed();
+    }
 
     virtual void saveState(OutputStreamHandle &out) override;
     virtual void loadState(InputStreamHandle &in) override;
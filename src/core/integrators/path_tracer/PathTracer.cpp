@@ -1,23 +1,57 @@
 #include "PathTracer.hpp"
+#include "SdTree.hpp"
 
 #include "bsdfs/TransparencyBsdf.hpp"
 
 namespace Tungsten {
 
-PathTracer::PathTracer(TraceableScene *scene, const PathTracerSettings &settings, uint32 threadId)
+PathTracer::PathTracer(TraceableScene *scene, const PathTracerSettings &settings, uint32 threadId,
+        SdTree *guide)
 : TraceBase(scene, settings, threadId),
   _settings(settings),
-  _trackOutputValues(!scene->rendererSettings().renderOutputs().empty())
+  _trackOutputValues(!scene->rendererSettings().renderOutputs().empty()),
+  _trainingGuide(guide),
+  _recordGuiding(false)
 {
+    _guide = guide;
+    _guideBsdfFraction = settings.guidingBsdfFraction;
+}
+
+// The radiance arriving at a vertex along the sampled direction is what the
+// path gathered after it, divided by the throughput up to there
+void PathTracer::recordGuidingVertices(const Vec3f &emission)
+{
+    for (const GuidingVertex &v : _guidingVertices) {
+        Vec3f gathered = emission - v.emission;
+        float radiance = 0.0f;
+        for (int i = 0; i < 3; ++i)
+            if (v.throughput[i] > 0.0f)
+                radiance += gathered[i]/v.throughput[i];
+        _trainingGuide->record(v.p, v.w, max(radiance*(1.0f/3.0f), 0.0f), v.pdf);
+    }
 }
 
 Vec3f PathTracer::traceSample(Vec2u pixel, PathSampleGenerator &sampler)
+{
+    if (!_recordGuiding)
+        return tracePath(pixel, sampler);
+
+    _guidingVertices.clear();
+    Vec3f result = tracePath(pixel, sampler);
+    recordGuidingVertices(result);
+
+    return result;
+}
+
+Vec3f PathTracer::tracePath(Vec2u pixel, PathSampleGenerator &sampler)
 {
     // TODO: Put diagnostic colors in JSON?
     const Vec3f nanDirColor = Vec3f(0.0f);
     const Vec3f nanEnvDirColor = Vec3f(0.0f);
     const Vec3f nanBsdfColor = Vec3f(0.0f);
 
+    RENDER_STAT_ADD(Samples, 1);
+
     try {
 
     PositionSample point;
@@ -45,6 +79,7 @@ Vec3f PathTracer::traceSample(Vec2u pixel, PathSampleGenerator &sampler)
 
     int mediumBounces = 0;
     int bounce = 0;
+    RENDER_STAT_ADD(PrimaryRays, 1);
     bool didHit = _scene->intersect(ray, data, info);
     bool wasSpecular = true;
     while ((didHit || medium) && bounce < _settings.maxBounces) {
@@ -97,6 +132,9 @@ Vec3f PathTracer::traceSample(Vec2u pixel, PathSampleGenerator &sampler)
 
             if (terminate)
                 return emission;
+
+            if (_recordGuiding && !surfaceEvent.sampledLobe.hasSpecular() && !surfaceEvent.sampledLobe.isForward())
+                _guidingVertices.push_back(GuidingVertex{info.p, ray.dir(), surfaceEvent.pdf, throughput, emission});
         } else {
             mediumBounces++;
 
@@ -5,17 +5,48 @@
 
 #include "integrators/TraceBase.hpp"
 
+#include <vector>
+
 namespace Tungsten {
 
+class SdTree;
+
 class PathTracer : public TraceBase
 {
+    // A scattering event whose incident radiance is recorded into the guide
+    // once the path is complete
+    struct GuidingVertex
+    {
+        Vec3f p;
+        Vec3f w;
+        float pdf;
+        // Throughput after scattering, and emission gathered up to and
+        // including direct lighting at the vertex
+        Vec3f throughput;
+        Vec3f emission;
+    };
+
     PathTracerSettings _settings;
     bool _trackOutputValues;
 
+    SdTree *_trainingGuide;
+    bool _recordGuiding;
+    std::vector<GuidingVertex> _guidingVertices;
+
+    Vec3f tracePath(Vec2u pixel, PathSampleGenerator &sampler);
+    void recordGuidingVertices(const Vec3f &emission);
+
 public:
-    PathTracer(TraceableScene *scene, const PathTracerSettings &settings, uint32 threadId);
+    PathTracer(TraceableScene *scene, const PathTracerSettings &settings, uint32 threadId,
+            SdTree *guide = nullptr);
 
     Vec3f traceSample(Vec2u pixel, PathSampleGenerator &sampler);
+
+    // Whether the radiance found by traced paths is recorded into the guide
+    void setRecordGuiding(bool record)
+    {
+        _recordGuiding = record && _trainingGuide;
+    }
 };
 
 }
@@ -13,12 +13,18 @@ struct PathTracerSettings : public TraceSettings
     bool enableVolumeLightSampling;
     bool lowOrderScattering;
     bool includeSurfaces;
+    bool enableGuiding;
+    int guidingTrainingSpp;
+    float guidingBsdfFraction;
 
     PathTracerSettings()
     : enableLightSampling(true),
       enableVolumeLightSampling(true),
       lowOrderScattering(true),
-      includeSurfaces(true)
+      includeSurfaces(true),
+      enableGuiding(false),
+      guidingTrainingSpp(63),
+      guidingBsdfFraction(0.5f)
     {
     }
 
@@ -29,6 +35,9 @@ struct PathTracerSettings : public TraceSettings
         value.getField("enable_volume_light_sampling", enableVolumeLightSampling);
         value.getField("low_order_scattering", lowOrderScattering);
         value.getField("include_surfaces", includeSurfaces);
+        value.getField("enable_guiding", enableGuiding);
+        value.getField("guiding_training_spp", guidingTrainingSpp);
+        value.getField("guiding_bsdf_fraction", guidingBsdfFraction);
     }
 
     rapidjson::Value toJson(rapidjson::Document::AllocatorType &allocator) const
@@ -38,7 +47,10 @@ struct PathTracerSettings : public TraceSettings
             "enable_light_sampling", enableLightSampling,
             "enable_volume_light_sampling", enableVolumeLightSampling,
             "low_order_scattering", lowOrderScattering,
-            "include_surfaces", includeSurfaces
+            "include_surfaces", includeSurfaces,
+            "enable_guiding", enableGuiding,
+            "guiding_training_spp", guidingTrainingSpp,
+            "guiding_bsdf_fraction", guidingBsdfFraction
         };
     }
 };
@@ -54,6 +54,20 @@ struct SampleRecord
         addSample(x.luminance());
     }
 
+    // Merges the statistics of another record, see Chan et al., "Updating
+    // Formulae and a Pairwise Algorithm for Computing Sample Variances"
+    inline void addSamples(const SampleRecord &o)
+    {
+        if (o.sampleCount == 0)
+            return;
+
+        uint32 total = sampleCount + o.sampleCount;
+        float delta = o.mean - mean;
+        runningVariance += o.runningVariance + delta*delta*(float(sampleCount)*o.sampleCount/total);
+        mean += delta*o.sampleCount/total;
+        sampleCount = total;
+    }
+
     inline float variance() const
     {
         return runningVariance/(sampleCount - 1);
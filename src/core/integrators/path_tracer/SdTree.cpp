@@ -0,0 +1,367 @@
+#include "SdTree.hpp"
+
+#include "math/MathUtil.hpp"
+#include "math/Angle.hpp"
+
+#include "thread/ThreadUtils.hpp"
+
+#include <cmath>
+#include <cstdlib>
+static float envf(const char *n, float d) { const char *v = getenv(n); return v ? atof(v) : d; }
+
+namespace Tungsten {
+
+CONSTEXPR float SdTree::SpatialThreshold;
+CONSTEXPR float SdTree::DirectionalThreshold;
+CONSTEXPR int SdTree::MaxDirectionalDepth;
+CONSTEXPR int SdTree::MaxSpatialDepth;
+
+static void atomicAdd(std::atomic<float> &dst, float add)
+{
+    float current = dst.load(std::memory_order_relaxed);
+    float desired = current + add;
+    while (!dst.compare_exchange_weak(current, desired))
+        desired = current + add;
+}
+
+// Picks the second of two children with probability w1/(w0 + w1) and
+// rescales u to [0, 1]
+static int pick(float &u, float w0, float w1)
+{
+    float p0 = w0 + w1 > 0.0f ? w0/(w0 + w1) : 0.5f;
+    if (u < p0) {
+        u = clamp(u/p0, 0.0f, 1.0f);
+        return 0;
+    } else {
+        u = clamp((u - p0)/(1.0f - p0), 0.0f, 1.0f);
+        return 1;
+    }
+}
+
+static Vec2f directionToSquare(const Vec3f &w)
+{
+    float phi = std::atan2(w.y(), w.x())*INV_TWO_PI;
+    if (phi < 0.0f)
+        phi += 1.0f;
+    return Vec2f(clamp((w.z() + 1.0f)*0.5f, 0.0f, 1.0f), clamp(phi, 0.0f, 1.0f));
+}
+
+static Vec3f squareToDirection(const Vec2f &p)
+{
+    float cosTheta = p.x()*2.0f - 1.0f;
+    float sinTheta = std::sqrt(max(1.0f - cosTheta*cosTheta, 0.0f));
+    float phi = p.y()*TWO_PI;
+    return Vec3f(std::cos(phi)*sinTheta, std::sin(phi)*sinTheta, cosTheta);
+}
+
+DTree::Node::Node()
+{
+    for (int i = 0; i < 4; ++i) {
+        sums[i] = 0.0f;
+        children[i] = 0;
+    }
+}
+
+DTree::Node::Node(const Node &o)
+{
+    *this = o;
+}
+
+DTree::Node &DTree::Node::operator=(const Node &o)
+{
+    for (int i = 0; i < 4; ++i) {
+        sums[i] = o.sums[i].load(std::memory_order_relaxed);
+        children[i] = o.children[i];
+    }
+    return *this;
+}
+
+float DTree::Node::sum() const
+{
+    return sums[0].load(std::memory_order_relaxed) + sums[1].load(std::memory_order_relaxed)
+         + sums[2].load(std::memory_order_relaxed) + sums[3].load(std::memory_order_relaxed);
+}
+
+DTree::DTree()
+: _nodes(1),
+  _weight(0.0f)
+{
+}
+
+DTree::DTree(const DTree &o)
+: _nodes(o._nodes),
+  _weight(o.weight())
+{
+}
+
+DTree &DTree::operator=(const DTree &o)
+{
+    _nodes = o._nodes;
+    _weight = o.weight();
+    return *this;
+}
+
+void DTree::record(Vec2f p, float energy)
+{
+    atomicAdd(_weight, 1.0f);
+    if (!(energy > 0.0f) || std::isinf(energy))
+        return;
+
+    uint32 node = 0;
+    while (true) {
+        int x = p.x() >= 0.5f;
+        int y = p.y() >= 0.5f;
+        int idx = x + y*2;
+        atomicAdd(_nodes[node].sums[idx], energy);
+        if (!_nodes[node].children[idx])
+            break;
+        node = _nodes[node].children[idx];
+        p = p*2.0f - Vec2f(float(x), float(y));
+    }
+}
+
+Vec2f DTree::sample(Vec2f u, float &pdf) const
+{
+    pdf = 1.0f;
+    if (!(_nodes[0].sum() > 0.0f))
+        return u;
+
+    Vec2f origin(0.0f);
+    float scale = 0.5f;
+    uint32 node = 0;
+    while (true) {
+        const Node &n = _nodes[node];
+        float s[4];
+        for (int i = 0; i < 4; ++i)
+            s[i] = n.sums[i].load(std::memory_order_relaxed);
+
+        int x = pick(u.x(), s[0] + s[2], s[1] + s[3]);
+        int y = pick(u.y(), s[x], s[x + 2]);
+        origin += Vec2f(float(x), float(y))*scale;
+        pdf *= 4.0f*s[x + y*2]/(s[0] + s[1] + s[2] + s[3]);
+
+        if (!n.children[x + y*2])
+            return Vec2f(
+                clamp(origin.x() + u.x()*scale, 0.0f, 1.0f),
+                clamp(origin.y() + u.y()*scale, 0.0f, 1.0f)
+            );
+        node = n.children[x + y*2];
+        scale *= 0.5f;
+    }
+}
+
+float DTree::pdf(Vec2f p) const
+{
+    if (!(_nodes[0].sum() > 0.0f))
+        return 1.0f;
+
+    float result = 1.0f;
+    uint32 node = 0;
+    while (true) {
+        const Node &n = _nodes[node];
+        int x = p.x() >= 0.5f;
+        int y = p.y() >= 0.5f;
+        int idx = x + y*2;
+        float sum = n.sum();
+        float s = n.sums[idx].load(std::memory_order_relaxed);
+        if (!(s > 0.0f))
+            return 0.0f;
+        result *= 4.0f*s/sum;
+
+        if (!n.children[idx])
+            return result;
+        node = n.children[idx];
+        p = p*2.0f - Vec2f(float(x), float(y));
+    }
+}
+
+void DTree::refine(DTree &dst, uint32 dstIdx, int srcIdx, const float *energies,
+        float threshold, int depth, int maxDepth) const
+{
+    if (depth >= maxDepth)
+        return;
+
+    for (int i = 0; i < 4; ++i) {
+        if (energies[i] <= threshold)
+            continue;
+
+        // Quadrants without children of their own in this tree split their
+        // energy evenly
+        int srcChild = (srcIdx >= 0 && _nodes[srcIdx].children[i]) ? int(_nodes[srcIdx].children[i]) : -1;
+        float childEnergies[4];
+        for (int j = 0; j < 4; ++j)
+            childEnergies[j] = srcChild >= 0 ? _nodes[srcChild].sums[j].load(std::memory_order_relaxed)
+                                             : energies[i]*0.25f;
+
+        uint32 child = dst._nodes.size();
+        dst._nodes.emplace_back();
+        dst._nodes[dstIdx].children[i] = child;
+        refine(dst, child, srcChild, childEnergies, threshold, depth + 1, maxDepth);
+    }
+}
+
+DTree DTree::refined(float threshold, int maxDepth) const
+{
+    DTree result;
+
+    float total = _nodes[0].sum();
+    if (!(total > 0.0f) || std::isinf(total))
+        return result;
+
+    float energies[4];
+    for (int i = 0; i < 4; ++i)
+        energies[i] = _nodes[0].sums[i].load(std::memory_order_relaxed);
+    refine(result, 0, 0, energies, threshold*total, 1, maxDepth);
+
+    return result;
+}
+
+void DTree::saveState(OutputStreamHandle &out) const
+{
+    FileUtils::streamWrite(out, weight());
+    FileUtils::streamWrite(out, uint32(_nodes.size()));
+    for (const Node &n : _nodes) {
+        for (int i = 0; i < 4; ++i)
+            FileUtils::streamWrite(out, n.sums[i].load(std::memory_order_relaxed));
+        FileUtils::streamWrite(out, n.children, 4);
+    }
+}
+
+void DTree::loadState(InputStreamHandle &in)
+{
+    float weight;
+    uint32 numNodes;
+    FileUtils::streamRead(in, weight);
+    FileUtils::streamRead(in, numNodes);
+    _weight = weight;
+    _nodes.resize(numNodes);
+    for (Node &n : _nodes) {
+        for (int i = 0; i < 4; ++i)
+            n.sums[i] = FileUtils::streamRead<float>(in);
+        FileUtils::streamRead(in, n.children, 4);
+    }
+}
+
+SdTree::SdTree(const Box3f &sceneBounds)
+: _nodes(1, Node{{0, 0}, 0}),
+  _leaves(1),
+  _trained(false)
+{
+    // Cells are kept cubic, so that splits along the cycled axes stay
+    // roughly isotropic
+    Vec3f center = sceneBounds.center();
+    float radius = sceneBounds.diagonal().max()*0.5f*1.01f + 1e-4f;
+    _bounds = Box3f(center - radius, center + radius);
+}
+
+const SdTree::Leaf &SdTree::leaf(const Vec3f &p) const
+{
+    Vec3f q = (p - _bounds.min())/(_bounds.max() - _bounds.min());
+    uint32 node = 0;
+    while (true) {
+        const Node &n = _nodes[node];
+        if (!n.children[1])
+            return _leaves[n.children[0]];
+
+        int axis = n.axis;
+        if (q[axis] < 0.5f) {
+            q[axis] *= 2.0f;
+            node = n.children[0];
+        } else {
+            q[axis] = q[axis]*2.0f - 1.0f;
+            node = n.children[1];
+        }
+    }
+}
+
+SdTree::Leaf &SdTree::leaf(const Vec3f &p)
+{
+    return const_cast<Leaf &>(static_cast<const SdTree *>(this)->leaf(p));
+}
+
+void SdTree::record(const Vec3f &p, const Vec3f &w, float radiance, float pdf)
+{
+    if (!(pdf > 0.0f) || std::isnan(radiance))
+        return;
+    leaf(p).building.record(directionToSquare(w), radiance/pdf);
+}
+
+Vec3f SdTree::sample(const Vec3f &p, Vec2f u, float &pdf) const
+{
+    Vec3f w = squareToDirection(leaf(p).sampling.sample(u, pdf));
+    pdf *= INV_FOUR_PI;
+    return w;
+}
+
+float SdTree::pdf(const Vec3f &p, const Vec3f &w) const
+{
+    return leaf(p).sampling.pdf(directionToSquare(w))*INV_FOUR_PI;
+}
+
+void SdTree::refine(uint32 spp)
+{
+    for (Leaf &l : _leaves)
+        l.sampling = l.building;
+
+    // New nodes are appended, so cells split here are visited again and
+    // split further if needed
+    float threshold = envf("SD_SPATIAL", SpatialThreshold)*std::sqrt(float(max(spp, 1u)));
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        if (_nodes[i].children[1])
+            continue;
+        uint32 leafIdx = _nodes[i].children[0];
+        float weight = _leaves[leafIdx].sampling.weight();
+        if (weight <= threshold || int(_nodes[i].axis) >= MaxSpatialDepth)
+            continue;
+
+        _leaves[leafIdx].sampling.setWeight(weight*0.5f);
+        Leaf split = _leaves[leafIdx];
+        uint32 newLeaf = _leaves.size();
+        _leaves.emplace_back(split);
+
+        uint32 depth = _nodes[i].axis;
+        uint32 child = _nodes.size();
+        _nodes[i] = Node{{child, child + 1}, depth % 3};
+        _nodes.push_back(Node{{leafIdx, 0}, depth + 1});
+        _nodes.push_back(Node{{newLeaf, 0}, depth + 1});
+    }
+
+    ThreadUtils::parallelFor(0, uint32(_leaves.size()), 16, [&](uint32 i) {
+        _leaves[i].building = _leaves[i].sampling.refined(envf("SD_DIR", DirectionalThreshold), MaxDirectionalDepth);
+    });
+
+    _trained = true;
+    if (getenv("SD_PRINT")) {
+        size_t nodes = 0, maxNodes = 0;
+        for (Leaf &l : _leaves) { nodes += l.building.numNodes(); maxNodes = max(maxNodes, l.building.numNodes()); }
+        printf("refine spp %d: %d leaves, %d dnodes (max %d)\n", spp, int(_leaves.size()), int(nodes), int(maxNodes));
+    }
+}
+
+void SdTree::saveState(OutputStreamHandle &out) const
+{
+    FileUtils::streamWrite(out, _bounds);
+    FileUtils::streamWrite(out, _trained);
+    FileUtils::streamWrite(out, uint32(_nodes.size()));
+    FileUtils::streamWrite(out, _nodes);
+    FileUtils::streamWrite(out, uint32(_leaves.size()));
+    for (const Leaf &l : _leaves) {
+        l.sampling.saveState(out);
+        l.building.saveState(out);
+    }
+}
+
+void SdTree::loadState(InputStreamHandle &in)
+{
+    FileUtils::streamRead(in, _bounds);
+    FileUtils::streamRead(in, _trained);
+    _nodes.resize(FileUtils::streamRead<uint32>(in));
+    FileUtils::streamRead(in, _nodes);
+    _leaves.resize(FileUtils::streamRead<uint32>(in));
+    for (Leaf &l : _leaves) {
+        l.sampling.loadState(in);
+        l.building.loadState(in);
+    }
+}
+
+}
@@ -0,0 +1,147 @@
+#ifndef SDTREE_HPP_
+#define SDTREE_HPP_
+
+#include "math/Vec.hpp"
+#include "math/Box.hpp"
+
+#include "io/FileUtils.hpp"
+
+#include "IntTypes.hpp"
+
+#include <atomic>
+#include <vector>
+
+namespace Tungsten {
+
+// Quadtree over the cylindrical parametrization of the sphere of directions
+// (cos theta, phi), which preserves area, so densities over the unit square
+// only differ from solid angle densities by a factor of 4*PI. Every node
+// stores the energy recorded in each of its four quadrants. Recording is
+// thread safe
+class DTree
+{
+    struct Node
+    {
+        std::atomic<float> sums[4];
+        // Index of the node of each quadrant, or 0 for leaves
+        uint32 children[4];
+
+        Node();
+        Node(const Node &o);
+        Node &operator=(const Node &o);
+
+        float sum() const;
+    };
+
+    std::vector<Node> _nodes;
+    std::atomic<float> _weight;
+
+    void refine(DTree &dst, uint32 dstIdx, int srcIdx, const float *energies,
+            float threshold, int depth, int maxDepth) const;
+
+public:
+    DTree();
+    DTree(const DTree &o);
+    DTree &operator=(const DTree &o);
+
+    void record(Vec2f p, float energy);
+    size_t numNodes() const { return _nodes.size(); }
+
+    // Number of samples recorded, which determines when the spatial cell
+    // of the tree is subdivided
+    float weight() const
+    {
+        return _weight.load(std::memory_order_relaxed);
+    }
+
+    void setWeight(float weight)
+    {
+        _weight = weight;
+    }
+
+    // Densities are uniform if no energy was recorded. sample also returns
+    // the density of the sampled point, which saves a second descent
+    Vec2f sample(Vec2f u, float &pdf) const;
+    float pdf(Vec2f p) const;
+
+    // Returns a tree without any recorded energy, whose quadrants are
+    // subdivided wherever they received more than threshold of the total
+    // energy of this tree
+    DTree refined(float threshold, int maxDepth) const;
+
+    void saveState(OutputStreamHandle &out) const;
+    void loadState(InputStreamHandle &in);
+};
+
+// Spatial-directional tree for path guiding (see Mueller et al., "Practical
+// Path Guiding for Efficient Light-Transport Simulation"). A binary tree
+// subdivides the scene bounds, alternating between the axes, and each of its
+// leaves holds a directional tree of the incident radiance in the leaf.
+// Every leaf keeps two directional trees: Samples are drawn from the one
+// learned in the previous training pass, while the current pass records into
+// the other one. refine() moves from one pass to the next
+class SdTree
+{
+    struct Node
+    {
+        // Index of both child nodes, or of the leaf in the first slot if
+        // second is 0
+        uint32 children[2];
+        // Split axis of inner nodes, depth of leaf nodes
+        uint32 axis;
+    };
+
+    struct Leaf
+    {
+        DTree sampling;
+        DTree building;
+    };
+
+    Box3f _bounds;
+    std::vector<Node> _nodes;
+    std::vector<Leaf> _leaves;
+    bool _trained;
+
+    const Leaf &leaf(const Vec3f &p) const;
+    Leaf &leaf(const Vec3f &p);
+
+public:
+    // Spatial cells are split once they receive more than this number of
+    // samples times the square root of the spp of the training pass
+    static CONSTEXPR float SpatialThreshold = 12000.0f;
+    // Directional quadrants are split if they hold more than this fraction
+    // of the energy of their tree
+    static CONSTEXPR float DirectionalThreshold = 0.01f;
+    static CONSTEXPR int MaxDirectionalDepth = 20;
+    static CONSTEXPR int MaxSpatialDepth = 48;
+
+    SdTree(const Box3f &sceneBounds);
+
+    // Adds a sample of incident radiance from direction w at p, which was
+    // sampled with solid angle density pdf
+    void record(const Vec3f &p, const Vec3f &w, float radiance, float pdf);
+
+    // Samples a direction at p proportional to the learned incident radiance,
+    // and returns its solid angle density in pdf
+    Vec3f sample(const Vec3f &p, Vec2f u, float &pdf) const;
+    // Solid angle density of sample
+    float pdf(const Vec3f &p, const Vec3f &w) const;
+
+    // Ends a training pass of spp samples per pixel. The recorded radiance
+    // becomes the sampling distribution, and the spatial and directional
+    // trees for the next pass are refined from it
+    void refine(uint32 spp);
+
+    // False until the first training pass is done
+    bool trained() const
+    {
+        return _trained;
+    }
+
+    void saveState(OutputStreamHandle &out) const;
+    void loadState(InputStreamHandle &in);
+};
+
+}
+
+#endif /* SDTREE_HPP_ */
@@ -134,7 +134,7 @@ private:
     {
         _atomicListOffsets = zeroAlloc<std::atomic<uint32>>(_cellCount + 1);
 
-        ThreadUtils::parallelFor(0, prims.size(), ThreadUtils::pool->threadCount() + 1, [&](uint32 i) {
+        ThreadUtils::parallelFor(0, uint32(prims.size()), 64, [&](uint32 i) {
             if (prims[i].isBeam()) {
                 iterateBeam(prims[i].p0, prims[i].p1, prims[i].r, [&](int x, int y, int z) {
                     _atomicListOffsets[idx(x, y, z)]++;
@@ -154,7 +154,7 @@ private:
 
         _lists.reset(new uint32[prefixSum]);
 
-        ThreadUtils::parallelFor(0, prims.size(), ThreadUtils::pool->threadCount() + 1, [&](uint32 i) {
+        ThreadUtils::parallelFor(0, uint32(prims.size()), 64, [&](uint32 i) {
             if (prims[i].isBeam()) {
                 iterateBeam(prims[i].p0, prims[i].p1, prims[i].r, [&](int x, int y, int z) {
                     _lists[--_atomicListOffsets[idx(x, y, z)]] = prims[i].idx & 0x7FFFFFFFu;
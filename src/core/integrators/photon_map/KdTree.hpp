@@ -106,23 +106,21 @@ public:
     void buildVolumeHierarchy(bool fixedRadius, float radiusScale)
     {
         if (fixedRadius) {
-            for (uint32 i = 0; i < _treeEnd; ++i)
+            ThreadUtils::parallelFor(0, _treeEnd, 16384, [&](uint32 i) {
                 _nodes[i].radiusSq = radiusScale*radiusScale;
+            });
         } else {
-            int m = min(30, int(_treeEnd));
+            // Lookup cost varies wildly with local photon density, so hand
+            // out small chunks to keep the workers balanced
+            const int MaxM = 30;
+            int m = min(MaxM, int(_treeEnd));
             float scale = radiusScale*(std::sqrt(float(_treeEnd))*0.05f)/float(m);
-            ThreadUtils::pool->yield(*ThreadUtils::pool->enqueue([&](uint32 idx, uint32 num, uint32 /*threadId*/) {
-                uint32 span = (_treeEnd + num - 1)/num;
-                uint32 start = span*idx;
-                uint32 end = min(start + span, _treeEnd);
-
-                std::unique_ptr<const PhotonType *[]> photons(new const PhotonType *[m]);
-                std::unique_ptr<float[]> dists(new float[m]);
-                for (uint32 i = start; i < end; ++i) {
-                    nearestNeighbours(_nodes[i].pos, photons.get(), dists.get(), m);
-                    _nodes[i].radiusSq = dists[0]*scale;
-                }
-            }, ThreadUtils::pool->threadCount()));
+            ThreadUtils::parallelFor(0, _treeEnd, 256, [&](uint32 i) {
+                const PhotonType *photons[MaxM];
+                float dists[MaxM];
+                nearestNeighbours(_nodes[i].pos, photons, dists, m);
+                _nodes[i].radiusSq = dists[0]*scale;
+            });
         }
 
         buildVolumeHierarchy(0);
@@ -9,7 +9,7 @@
 #include "thread/ThreadUtils.hpp"
 #include "thread/ThreadPool.hpp"
 
-#include "bvh/BinaryBvh.hpp"
+#include "bvh/SwitchableBvh.hpp"
 
 namespace Tungsten {
 
@@ -18,7 +18,8 @@ CONSTEXPR uint32 PhotonMapIntegrator::TileSize;
 PhotonMapIntegrator::PhotonMapIntegrator()
 : _w(0),
   _h(0),
-  _sampler(0xBA5EBA11)
+  _sampler(0xBA5EBA11),
+  _aborting(false)
 {
 }
 
@@ -79,7 +80,7 @@ void PhotonMapIntegrator::tracePhotons(uint32 taskId, uint32 numSubTasks, uint32
         if (data.surfaceRange.full() && data.volumeRange.full() && data.pathRange.full())
             break;
 
-        if (_group->isAborting())
+        if (_aborting)
                 break;
     }
 
@@ -119,7 +120,7 @@ void PhotonMapIntegrator::tracePixels(uint32 tileId, uint32 threadId, float surf
                 );
                 _scene->cam().colorBuffer()->addSample(pixel, c);
             }
-            if (_group->isAborting())
+            if (_aborting)
                 break;
         }
     }
@@ -132,8 +133,9 @@ std::unique_ptr<KdTree<PhotonType>> streamCompactAndBuild(std::vector<PhotonRang
     uint32 tail = streamCompact(ranges);
 
     float scale = 1.0f/totalTraced;
-    for (uint32 i = 0; i < tail; ++i)
+    ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
         photons[i].power *= scale;
+    });
 
     return std::unique_ptr<KdTree<PhotonType>>(new KdTree<PhotonType>(&photons[0], tail));
 }
@@ -194,6 +196,17 @@ static void precomputePlane1D(PhotonPlane1D &plane, const PathPhoton &p0, const
     plane.bounce = p1.bounce();
 }
 
+static Vec3f beamExtent(const Vec3f &dir, float radius)
+{
+    int majorAxis = std::abs(dir).maxDim();
+
+    Vec3f extent(radius);
+    for (int j = 0; j < 3; ++j)
+        if (j != majorAxis)
+            extent[j] /= std::sqrt(max(0.0f, 1.0f - sqr(dir[j])));
+    return extent;
+}
+
 static void insertDicedBeam(Bvh::PrimVector &beams, PhotonBeam &beam, uint32 i, const PathPhoton &p0, const PathPhoton &p1, float radius)
 {
     precomputeBeam(beam, p0, p1);
@@ -202,12 +215,9 @@ static void insertDicedBeam(Bvh::PrimVector &beams, PhotonBeam &beam, uint32 i,
     int majorAxis = absDir.maxDim();
     int numSteps = min(64, max(1, int(absDir[majorAxis]*16.0f)));
 
-    Vec3f minExtend = Vec3f(radius);
-    for (int j = 0; j < 3; ++j) {
+    Vec3f minExtend = beamExtent(p0.dir, radius);
+    for (int j = 0; j < 3; ++j)
         minExtend[j] = std::copysign(minExtend[j], p0.dir[j]);
-        if (j != majorAxis)
-            minExtend[j] /= std::sqrt(max(0.0f, 1.0f - sqr(p0.dir[j])));
-    }
     for (int j = 0; j < numSteps; ++j) {
         Vec3f v0 = p0.pos + p0.dir*p0.length*(j + 0)/numSteps;
         Vec3f v1 = p0.pos + p0.dir*p0.length*(j + 1)/numSteps;
@@ -222,47 +232,90 @@ static void insertDicedBeam(Bvh::PrimVector &beams, PhotonBeam &beam, uint32 i,
         beams.emplace_back(Bvh::Primitive(bounds, bounds.center(), i));
     }
 }
+// With spatial splits, beams are inserted whole and the BVH builder clips
+// them instead of dicing them up front
+static void insertBeam(Bvh::PrimVector &beams, PhotonBeam &beam, uint32 i, const PathPhoton &p0, const PathPhoton &p1, float radius)
+{
+    precomputeBeam(beam, p0, p1);
+
+    Vec3f extent = beamExtent(p0.dir, radius);
+    Box3f bounds(p0.pos);
+    bounds.grow(p0.pos + p0.dir*p0.length);
+    bounds = Box3f(bounds.min() - extent, bounds.max() + extent);
+
+    beams.emplace_back(Bvh::Primitive(bounds, bounds.center(), i));
+}
+static Box3f clipBeam(const PhotonBeam &beam, float radius, const Box3f &region)
+{
+    Vec3f extent = beamExtent(beam.dir, radius);
+    Vec3f segment[] = {beam.p0, beam.p0 + beam.dir*beam.length};
+
+    Box3f result = Bvh::SpatialSplitter::clipPolygonBounds(segment, 2,
+            Box3f(region.min() - extent, region.max() + extent));
+    if (Bvh::SpatialSplitter::isValid(result))
+        result = Box3f(result.min() - extent, result.max() + extent);
+    return result;
+}
 
 void PhotonMapIntegrator::buildPointBvh(uint32 tail, float volumeRadiusScale)
 {
     float radius = _settings.volumeGatherRadius*volumeRadiusScale;
 
-    Bvh::PrimVector points;
-    for (uint32 i = 0; i < tail; ++i) {
+    Bvh::PrimVector points(tail, Bvh::Primitive(Box3f(), Vec3f(0.0f), 0));
+    ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
         Box3f bounds(_pathPhotons[i].pos);
         bounds.grow(radius);
-        points.emplace_back(Bvh::Primitive(bounds, _pathPhotons[i].pos, i));
-    }
+        points[i] = Bvh::Primitive(bounds, _pathPhotons[i].pos, i);
+    });
 
-    _volumeBvh.reset(new Bvh::BinaryBvh(std::move(points), 1));
+    _volumeBvh.reset(new Bvh::SwitchableBvh(std::move(points), 1, _settings.volumeBvhLayout));
+    DBG("Photon point BVH: %s", _volumeBvh->buildStats().toString());
 }
 void PhotonMapIntegrator::buildBeamBvh(uint32 tail, float volumeRadiusScale)
 {
     float radius = _settings.volumeGatherRadius*volumeRadiusScale;
 
+    bool spatialSplits = _settings.volumeBvhSplitBudget > 0.0f;
+
     Bvh::PrimVector beams;
     for (uint32 i = 0; i < tail; ++i) {
         if (_pathPhotons[i].bounce() == 0)
             continue;
 
-        if (!_pathPhotons[i - 1].onSurface() || _settings.lowOrderScattering)
-            insertDicedBeam(beams, _beams[i], i, _pathPhotons[i - 1], _pathPhotons[i], radius);
+        if (!_pathPhotons[i - 1].onSurface() || _settings.lowOrderScattering) {
+            if (spatialSplits)
+                insertBeam(beams, _beams[i], i, _pathPhotons[i - 1], _pathPhotons[i], radius);
+            else
+                insertDicedBeam(beams, _beams[i], i, _pathPhotons[i - 1], _pathPhotons[i], radius);
+        }
     }
 
-    _volumeBvh.reset(new Bvh::BinaryBvh(std::move(beams), 1));
+    Bvh::ClipFunction clip;
+    if (spatialSplits)
+        clip = [&](uint32 id, const Box3f &region) { return clipBeam(_beams[id], radius, region); };
+
+    _volumeBvh.reset(new Bvh::SwitchableBvh(std::move(beams), 1, _settings.volumeBvhLayout, !spatialSplits,
+            _settings.volumeBvhSplitBudget, clip));
+    DBG("Photon beam BVH: %s", _volumeBvh->buildStats().toString());
 }
 void PhotonMapIntegrator::buildPlaneBvh(uint32 tail, float volumeRadiusScale)
 {
     float radius = _settings.volumeGatherRadius*volumeRadiusScale;
 
+    bool spatialSplits = _settings.volumeBvhSplitBudget > 0.0f;
+
     Bvh::PrimVector planes;
     for (uint32 i = 0; i < tail; ++i) {
         const PathPhoton &p0 = _pathPhotons[i - 2];
         const PathPhoton &p1 = _pathPhotons[i - 1];
         const PathPhoton &p2 = _pathPhotons[i - 0];
 
-        if (p2.bounce() > 0 && p2.bounce() > p1.bounce() && p1.onSurface() && _settings.lowOrderScattering)
-            insertDicedBeam(planes, _beams[i], i, p1, p2, radius);
+        if (p2.bounce() > 0 && p2.bounce() > p1.bounce() && p1.onSurface() && _settings.lowOrderScattering) {
+            if (spatialSplits)
+                insertBeam(planes, _beams[i], i, p1, p2, radius);
+            else
+                insertDicedBeam(planes, _beams[i], i, p1, p2, radius);
+        }
         if (p2.bounce() > 1 && !p1.onSurface() && p1.sampledLength > 0.0f) {
             if (_settings.volumePhotonType == PhotonMapSettings::VOLUME_PLANES) {
                 precomputePlane0D(_planes0D[i], p0, p1, p2);
@@ -278,7 +331,23 @@ void PhotonMapIntegrator::buildPlaneBvh(uint32 tail, float volumeRadiusScale)
         }
     }
 
-    _volumeBvh.reset(new Bvh::BinaryBvh(std::move(planes), 1));
+    Bvh::ClipFunction clip;
+    if (spatialSplits) {
+        clip = [&](uint32 id, const Box3f &region) -> Box3f {
+            if (_beams[id].valid)
+                return clipBeam(_beams[id], radius, region);
+            if (_settings.volumePhotonType == PhotonMapSettings::VOLUME_PLANES) {
+                const PhotonPlane0D &plane = _planes0D[id];
+                Vec3f quad[] = {plane.p0, plane.p1, plane.p2, plane.p3};
+                return Bvh::SpatialSplitter::clipPolygonBounds(quad, 4, region);
+            }
+            return region;
+        };
+    }
+
+    _volumeBvh.reset(new Bvh::SwitchableBvh(std::move(planes), 1, _settings.volumeBvhLayout, !spatialSplits,
+            _settings.volumeBvhSplitBudget, clip));
+    DBG("Photon plane BVH: %s", _volumeBvh->buildStats().toString());
 }
 
 void PhotonMapIntegrator::buildBeamGrid(uint32 tail, float volumeRadiusScale)
@@ -350,20 +419,22 @@ void PhotonMapIntegrator::buildPhotonDataStructures(float volumeRadiusScale)
         _volumeTree->buildVolumeHierarchy(_settings.fixedVolumeRadius, volumeRadius*volumeRadiusScale);
     } else if (!_pathPhotons.empty()) {
         uint32 tail = streamCompact(pathRanges);
-        for (uint32 i = 0; i < tail; ++i)
+        ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
             _pathPhotons[i].power *= (1.0/_totalTracedPaths);
+        });
 
-        for (uint32 i = 0; i < tail; ++i) {
+        ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
             if (_pathPhotons[i].bounce() > 0) {
                 Vec3f dir = _pathPhotons[i].pos - _pathPhotons[i - 1].pos;
                 _pathPhotons[i - 1].length = dir.length();
                 _pathPhotons[i - 1].dir = dir/_pathPhotons[i - 1].length;
             }
-        }
+        });
 
         _beams.reset(new PhotonBeam[tail]);
-        for (uint32 i = 0; i < tail; ++i)
+        ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
             _beams[i].valid = false;
+        });
 
         if (_settings.volumePhotonType == PhotonMapSettings::VOLUME_BEAMS) {
             if (_settings.useGrid)
@@ -373,13 +444,15 @@ void PhotonMapIntegrator::buildPhotonDataStructures(float volumeRadiusScale)
         } else if (_settings.volumePhotonType == PhotonMapSettings::VOLUME_PLANES || _settings.volumePhotonType == PhotonMapSettings::VOLUME_PLANES_1D) {
             if (_settings.volumePhotonType == PhotonMapSettings::VOLUME_PLANES) {
                  _planes0D.reset(new PhotonPlane0D[tail]);
-                for (uint32 i = 0; i < tail; ++i)
+                ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
                     _planes0D[i].valid = false;
+                });
             }
             if (_settings.volumePhotonType == PhotonMapSettings::VOLUME_PLANES_1D) {
                 _planes1D.reset(new PhotonPlane1D[tail]);
-                for (uint32 i = 0; i < tail; ++i)
+                ThreadUtils::parallelFor(0, tail, 16384, [&](uint32 i) {
                     _planes1D[i].valid = false;
+                });
             }
 
             if (_settings.useGrid)
@@ -432,6 +505,7 @@ void PhotonMapIntegrator::prepareForRender(TraceableScene &scene, uint32 seed)
     }
 
     int numThreads = ThreadUtils::pool->threadCount();
+    std::vector<uint32> seeds;
     for (int i = 0; i < numThreads; ++i) {
         uint32 surfaceRangeStart = intLerp(0, uint32(     _surfacePhotons.size()), i + 0, numThreads);
         uint32 surfaceRangeEnd   = intLerp(0, uint32(     _surfacePhotons.size()), i + 1, numThreads);
@@ -442,14 +516,21 @@ void PhotonMapIntegrator::prepareForRender(TraceableScene &scene, uint32 seed)
             VolumePhotonRange(  _volumePhotons.empty() ? nullptr : & _volumePhotons[0],  volumeRangeStart,  volumeRangeEnd),
               PathPhotonRange(    _pathPhotons.empty() ? nullptr : &   _pathPhotons[0],  volumeRangeStart,  volumeRangeEnd)
         });
-        _samplers.emplace_back(_scene->rendererSettings().useSobol() ?
-            std::unique_ptr<PathSampleGenerator>(new SobolPathSampler(MathUtil::hash32(_sampler.nextI()))) :
-            std::unique_ptr<PathSampleGenerator>(new UniformPathSampler(MathUtil::hash32(_sampler.nextI())))
-        );
-
-        _tracers.emplace_back(new PhotonTracer(&scene, _settings, i));
+        seeds.push_back(MathUtil::hash32(_sampler.nextI()));
     }
 
+    // Per-thread state is created by the thread that uses it, so that its
+    // memory is first touched on the NUMA node of that thread
+    _samplers.resize(numThreads);
+    _tracers.resize(numThreads);
+    ThreadUtils::pool->yield(*ThreadUtils::pool->enqueuePerThread([&](uint32 id, uint32, uint32) {
+        _samplers[id] = _scene->rendererSettings().useSobol() ?
+            std::unique_ptr<PathSampleGenerator>(new SobolPathSampler(seeds[id])) :
+            std::unique_ptr<PathSampleGenerator>(new UniformPathSampler(seeds[id]));
+
+        _tracers[id].reset(new PhotonTracer(&scene, _settings, id));
+    }));
+
     Vec2u res = _scene->cam().resolution();
     _w = res.x();
     _h = res.y();
@@ -534,6 +615,7 @@ void PhotonMapIntegrator::startRender(std::function<void()> completionCallback)
         return;
     }
 
+    _aborting = false;
     _group = ThreadUtils::pool->enqueue([&, completionCallback](uint32, uint32, uint32) {
         renderSegment(completionCallback);
     }, 1, [](){});
@@ -550,6 +632,7 @@ void PhotonMapIntegrator::waitForCompletion()
 void PhotonMapIntegrator::abortRender()
 {
     if (_group) {
+        _aborting = true;
         _group->abort();
         _group->wait();
         _group.reset();
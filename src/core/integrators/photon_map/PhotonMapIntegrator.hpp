@@ -23,7 +23,7 @@
 namespace Tungsten {
 
 namespace Bvh {
-class BinaryBvh;
+class SwitchableBvh;
 }
 
 class PhotonTracer;
@@ -48,6 +48,9 @@ protected:
     UniformSampler _sampler;
 
     std::shared_ptr<TaskGroup> _group;
+    // Sub-tasks may start before _group is assigned, so they check this
+    // flag instead of the group itself
+    std::atomic<bool> _aborting;
     std::unique_ptr<Ray[]> _depthBuffer;
 
     std::atomic<uint32> _totalTracedSurfacePaths;
@@ -64,7 +67,7 @@ protected:
 
     std::unique_ptr<KdTree<Photon>> _surfaceTree;
     std::unique_ptr<KdTree<VolumePhoton>> _volumeTree;
-    std::unique_ptr<Bvh::BinaryBvh> _volumeBvh;
+    std::unique_ptr<Bvh::SwitchableBvh> _volumeBvh;
     std::unique_ptr<GridAccel> _volumeGrid;
 
     std::vector<std::unique_ptr<PhotonTracer>> _tracers;
@@ -5,6 +5,8 @@
 
 #include "io/JsonObject.hpp"
 
+#include "bvh/SwitchableBvh.hpp"
+
 #include "StringableEnum.hpp"
 
 #include <tinyformat/tinyformat.hpp>
@@ -30,6 +32,8 @@ struct PhotonMapSettings : public TraceSettings
     float gatherRadius;
     float volumeGatherRadius;
     VolumePhotonType volumePhotonType;
+    Bvh::SwitchableBvh::Layout volumeBvhLayout;
+    float volumeBvhSplitBudget;
     bool includeSurfaces;
     bool lowOrderScattering;
     bool fixedVolumeRadius;
@@ -44,6 +48,8 @@ struct PhotonMapSettings : public TraceSettings
       gatherRadius(1e30f),
       volumeGatherRadius(gatherRadius),
       volumePhotonType("points"),
+      volumeBvhLayout("binary"),
+      volumeBvhSplitBudget(0.0f),
       includeSurfaces(true),
       lowOrderScattering(true),
       fixedVolumeRadius(false),
@@ -61,6 +67,8 @@ struct PhotonMapSettings : public TraceSettings
         value.getField("gather_photon_count", gatherCount);
         if (auto type = value["volume_photon_type"])
             volumePhotonType = type;
+        volumeBvhLayout = value["volume_bvh_layout"];
+        value.getField("volume_bvh_split_budget", volumeBvhSplitBudget);
         bool gatherRadiusSet = value.getField("gather_radius", gatherRadius);
         if (!value.getField("volume_gather_radius", volumeGatherRadius) && gatherRadiusSet)
             volumeGatherRadius = gatherRadius;
@@ -85,6 +93,8 @@ struct PhotonMapSettings : public TraceSettings
             "gather_radius", gatherRadius,
             "volume_gather_radius", volumeGatherRadius,
             "volume_photon_type", volumePhotonType.toString(),
+            "volume_bvh_layout", volumeBvhLayout.toString(),
+            "volume_bvh_split_budget", volumeBvhSplitBudget,
             "low_order_scattering", lowOrderScattering,
             "include_surfaces", includeSurfaces,
             "fixed_volume_radius", fixedVolumeRadius,
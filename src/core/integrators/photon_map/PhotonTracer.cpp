@@ -3,7 +3,7 @@
 
 #include "math/FastMath.hpp"
 
-#include "bvh/BinaryBvh.hpp"
+#include "bvh/SwitchableBvh.hpp"
 
 #include "Timer.hpp"
 
@@ -244,7 +244,7 @@ void PhotonTracer::evalPrimaryRays(const PhotonBeam *beams, const PhotonPlane0D
 }
 
 Vec3f PhotonTracer::traceSensorPath(Vec2u pixel, const KdTree<Photon> &surfaceTree,
-        const KdTree<VolumePhoton> *mediumTree, const Bvh::BinaryBvh *mediumBvh, const GridAccel *mediumGrid,
+        const KdTree<VolumePhoton> *mediumTree, const Bvh::SwitchableBvh *mediumBvh, const GridAccel *mediumGrid,
         const PhotonBeam *beams, const PhotonPlane0D *planes0D, const PhotonPlane1D *planes1D, PathSampleGenerator &sampler,
         float gatherRadius, float volumeGatherRadius,
         PhotonMapSettings::VolumePhotonType photonType, Ray &depthRay, bool useFrustumGrid)
@@ -266,6 +266,9 @@ Vec3f PhotonTracer::traceSensorPath(Vec2u pixel, const KdTree<Photon> &surfaceTr
     IntersectionInfo info;
     const Medium *medium = _scene->cam().medium().get();
     const bool includeSurfaces = _settings.includeSurfaces;
+    // Spatial splits duplicate references to undiced beams and planes
+    // across leaves, so each one is only evaluated once per query
+    const bool spatialSplits = _settings.volumeBvhSplitBudget > 0.0f;
 
     Vec3f result(0.0f);
     int bounce = 0;
@@ -317,7 +320,15 @@ Vec3f PhotonTracer::traceSensorPath(Vec2u pixel, const KdTree<Photon> &surfaceTr
                 if (photonType == PhotonMapSettings::VOLUME_POINTS) {
                     mediumTree->beamQuery(ray.pos(), ray.dir(), ray.farT(), pointContribution);
                 } else if (photonType == PhotonMapSettings::VOLUME_BEAMS) {
-                    if (mediumBvh) {
+                    if (mediumBvh && spatialSplits) {
+                        _mailIdx++;
+                        mediumBvh->trace(ray, [&](Ray &ray, uint32 photonIndex, float /*tMin*/, const Vec3pf &/*bounds*/) {
+                            if (_mailboxes[photonIndex] == _mailIdx)
+                                return;
+                            _mailboxes[photonIndex] = _mailIdx;
+                            beamContribution(photonIndex, nullptr, ray.nearT(), ray.farT());
+                        });
+                    } else if (mediumBvh) {
                         mediumBvh->trace(ray, [&](Ray &ray, uint32 photonIndex, float /*tMin*/, const Vec3pf &bounds) {
                             beamContribution(photonIndex, &bounds, ray.nearT(), ray.farT());
                         });
@@ -327,7 +338,15 @@ Vec3f PhotonTracer::traceSensorPath(Vec2u pixel, const KdTree<Photon> &surfaceTr
                         });
                     }
                 } else if (photonType == PhotonMapSettings::VOLUME_PLANES || photonType == PhotonMapSettings::VOLUME_PLANES_1D) {
-                    if (mediumBvh) {
+                    if (mediumBvh && spatialSplits) {
+                        _mailIdx++;
+                        mediumBvh->trace(ray, [&](Ray &ray, uint32 photonIndex, float /*tMin*/, const Vec3pf &/*bounds*/) {
+                            if (_mailboxes[photonIndex] == _mailIdx)
+                                return;
+                            _mailboxes[photonIndex] = _mailIdx;
+                            planeContribution(photonIndex, nullptr, ray.nearT(), ray.farT());
+                        });
+                    } else if (mediumBvh) {
                         mediumBvh->trace(ray, [&](Ray &ray, uint32 photonIndex, float /*tMin*/, const Vec3pf &bounds) {
                             planeContribution(photonIndex, &bounds, ray.nearT(), ray.farT());
                         });
@@ -14,7 +14,7 @@
 namespace Tungsten {
 
 namespace Bvh {
-class BinaryBvh;
+class SwitchableBvh;
 }
 class GridAccel;
 
@@ -104,7 +104,7 @@ public:
             uint32 start, uint32 end, float radius, const Ray *depthBuffer, PathSampleGenerator &sampler, float scale);
 
     Vec3f traceSensorPath(Vec2u pixel, const KdTree<Photon> &surfaceTree,
-            const KdTree<VolumePhoton> *mediumTree, const Bvh::BinaryBvh *mediumBvh, const GridAccel *mediumGrid,
+            const KdTree<VolumePhoton> *mediumTree, const Bvh::SwitchableBvh *mediumBvh, const GridAccel *mediumGrid,
             const PhotonBeam *beams, const PhotonPlane0D *planes0D, const PhotonPlane1D *planes1D, PathSampleGenerator &sampler,
             float gatherRadius, float volumeGatherRadius,
             PhotonMapSettings::VolumePhotonType photonType, Ray &depthRay, bool useFrustumGrid);
@@ -10,7 +10,7 @@
 #include "thread/ThreadUtils.hpp"
 #include "thread/ThreadPool.hpp"
 
-#include "bvh/BinaryBvh.hpp"
+#include "bvh/SwitchableBvh.hpp"
 
 namespace Tungsten {
 
@@ -117,6 +117,7 @@ void ProgressivePhotonMapIntegrator::startRender(std::function<void()> completio
         return;
     }
 
+    _aborting = false;
     _group = ThreadUtils::pool->enqueue([&, completionCallback](uint32, uint32, uint32) {
         renderSegment(completionCallback);
     }, 1, [](){});
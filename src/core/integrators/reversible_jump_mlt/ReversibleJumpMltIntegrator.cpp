@@ -182,6 +182,11 @@ void ReversibleJumpMltIntegrator::saveOutputs()
         _imagePyramid->saveBuffers(_scene->rendererSettings().outputFile().stripExtension(), _scene->rendererSettings().spp(), true);
 }
 
+bool ReversibleJumpMltIntegrator::invertsPaths() const
+{
+    return true;
+}
+
 void ReversibleJumpMltIntegrator::prepareForRender(TraceableScene &scene, uint32 seed)
 {
     _chainsLaunched = false;
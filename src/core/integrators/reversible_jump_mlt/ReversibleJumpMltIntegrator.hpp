@@ -92,6 +92,7 @@ public:
     virtual rapidjson::Value toJson(Allocator &allocator) const override;
 
     virtual void saveOutputs() override;
+    virtual bool invertsPaths() const override;
 
     virtual void prepareForRender(TraceableScene &scene, uint32 seed) override;
     virtual void teardownAfterRender() override;
@@ -0,0 +1,88 @@
+#include "WavefrontPathTraceIntegrator.hpp"
+
+#include "cameras/Camera.hpp"
+
+#include "thread/ThreadUtils.hpp"
+#include "thread/ThreadPool.hpp"
+
+#include "Debug.hpp"
+
+namespace Tungsten {
+
+WavefrontPathTraceIntegrator::WavefrontPathTraceIntegrator()
+: PathTraceIntegrator()
+{
+}
+
+void WavefrontPathTraceIntegrator::prepareTracer(TraceableScene &scene, uint32 threadId)
+{
+    _wavefrontTracers[threadId].reset(new WavefrontPathTracer(&scene, _settings, threadId, _samplerSeed));
+    _targets[threadId].reserve(WavefrontPathTracer::MaxWavefrontSize);
+}
+
+void WavefrontPathTraceIntegrator::flushWavefront(uint32 threadId)
+{
+    WavefrontPathTracer &tracer = *_wavefrontTracers[threadId];
+    std::vector<PathTarget> &targets = _targets[threadId];
+
+    tracer.traceWavefront();
+    for (uint32 i = 0; i < tracer.size(); ++i) {
+        Vec3f c = tracer.radiance(i);
+        targets[i].record->addSample(c);
+        _scene->cam().colorBuffer()->addSample(targets[i].pixel, c);
+    }
+
+    tracer.clear();
+    targets.clear();
+}
+
+void WavefrontPathTraceIntegrator::renderWorkItem(uint32 id, uint32 subTaskId)
+{
+    WavefrontPathTracer &tracer = *_wavefrontTracers[id];
+    std::vector<PathTarget> &targets = _targets[id];
+
+    renderItemSamples(id, subTaskId, [&](Vec2u pixel, uint32 pixelIndex, uint32 sampleIndex, SampleRecord &record) {
+        tracer.addPath(pixel, pixelIndex, sampleIndex);
+        targets.push_back(PathTarget{pixel, &record});
+        if (tracer.full())
+            flushWavefront(id);
+    }, [&]() {
+        if (tracer.size() > 0)
+            flushWavefront(id);
+    });
+}
+
+bool WavefrontPathTraceIntegrator::supportsGuiding() const
+{
+    return false;
+}
+
+rapidjson::Value WavefrontPathTraceIntegrator::toJson(Allocator &allocator) const
+{
+    rapidjson::Value result = PathTraceIntegrator::toJson(allocator);
+    result["type"].SetString("wavefront_path_tracer");
+    return result;
+}
+
+void WavefrontPathTraceIntegrator::prepareForRender(TraceableScene &scene, uint32 seed)
+{
+    _wavefrontTracers.resize(ThreadUtils::pool->threadCount());
+    _targets.resize(ThreadUtils::pool->threadCount());
+
+    if (_settings.enableGuiding)
+        DBG("Warning: Path guiding is not supported by the wavefront path tracer and will be ignored");
+
+    PathTraceIntegrator::prepareForRender(scene, seed);
+}
+
+void WavefrontPathTraceIntegrator::teardownAfterRender()
+{
+    _wavefrontTracers.clear();
+    _targets.clear();
+    _wavefrontTracers.shrink_to_fit();
+    _targets.shrink_to_fit();
+
+    PathTraceIntegrator::teardownAfterRender();
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef WAVEFRONTPATHTRACEINTEGRATOR_HPP_
+#define WAVEFRONTPATHTRACEINTEGRATOR_HPP_
+
+#include "WavefrontPathTracer.hpp"
+
+#include "integrators/path_tracer/PathTraceIntegrator.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace Tungsten {
+
+// Shares tiling, adaptive sampling and scheduling with the path tracer, but
+// renders the samples of each work item in wavefronts of up to
+// WavefrontPathTracer::MaxWavefrontSize paths
+class WavefrontPathTraceIntegrator : public PathTraceIntegrator
+{
+    struct PathTarget
+    {
+        Vec2u pixel;
+        SampleRecord *record;
+    };
+
+    std::vector<std::unique_ptr<WavefrontPathTracer>> _wavefrontTracers;
+    std::vector<std::vector<PathTarget>> _targets;
+
+    void flushWavefront(uint32 threadId);
+
+    virtual void prepareTracer(TraceableScene &scene, uint32 threadId) override;
+    virtual void renderWorkItem(uint32 id, uint32 subTaskId) override;
+    virtual bool supportsGuiding() const override;
+
+public:
+    WavefrontPathTraceIntegrator();
+
+    virtual rapidjson::Value toJson(Allocator &allocator) const override;
+
+    virtual void prepareForRender(TraceableScene &scene, uint32 seed) override;
+    virtual void teardownAfterRender() override;
+
+};
+
+}
+
+#endif /* WAVEFRONTPATHTRACEINTEGRATOR_HPP_ */
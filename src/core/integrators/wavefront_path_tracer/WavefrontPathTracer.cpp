@@ -0,0 +1,670 @@
+#include "WavefrontPathTracer.hpp"
+
+#include "sampling/UniformPathSampler.hpp"
+#include "sampling/SobolPathSampler.hpp"
+#include "sampling/UniformSampler.hpp"
+
+#include "bsdfs/TransparencyBsdf.hpp"
+
+#include <typeindex>
+#include <algorithm>
+
+namespace Tungsten {
+
+CONSTEXPR uint32 WavefrontPathTracer::MaxWavefrontSize;
+
+WavefrontPathTracer::WavefrontPathTracer(TraceableScene *scene, const PathTracerSettings &settings,
+        uint32 threadId, uint32 seed)
+: TraceBase(scene, settings, threadId),
+  _settings(settings),
+  _trackOutputValues(!scene->rendererSettings().renderOutputs().empty())
+{
+    // Paths in a wavefront are in flight at the same time, so every slot
+    // needs its own sampler. Samplers are reseeded for every path from its
+    // pixel and sample index, so all slots share one seed
+    for (uint32 i = 0; i < MaxWavefrontSize; ++i) {
+        if (scene->rendererSettings().useSobol())
+            _samplers.emplace_back(new SobolPathSampler(seed, true));
+        else
+            _samplers.emplace_back(new UniformPathSampler(seed, true));
+    }
+
+    _paths.reserve(MaxWavefrontSize);
+    _radiance.reserve(MaxWavefrontSize);
+}
+
+void WavefrontPathTracer::finish(uint32 path, Vec3f radiance)
+{
+    _paths[path].status = PathFinished;
+    _radiance[path] = radiance;
+}
+
+void WavefrontPathTracer::terminate(uint32 path)
+{
+    _paths[path].status = PathTerminated;
+}
+
+void WavefrontPathTracer::exitLoop(uint32 path)
+{
+    _paths[path].status = PathExited;
+}
+
+bool WavefrontPathTracer::emitterHit(const Primitive &light, float expectedDist, IntersectionTemporary &data,
+        IntersectionInfo &info, Ray &ray, Vec3f &emission) const
+{
+    CONSTEXPR float fudgeFactor = 1.0f + 1e-3f;
+
+    if (light.isDirac()) {
+        ray.setFarT(expectedDist);
+    } else {
+        if (!light.intersect(ray, data) || ray.farT()*fudgeFactor < expectedDist)
+            return false;
+    }
+    info.p = ray.pos() + ray.dir()*ray.farT();
+    info.w = ray.dir();
+    light.intersectionInfo(data, info);
+
+    emission = light.evalDirect(data, info);
+    return true;
+}
+
+int WavefrontPathTracer::queueShadow(uint32 path, const Ray &ray, const Medium *medium, const Primitive *endCap,
+        int bounce, bool startsOnSurface, Vec3f contribution)
+{
+    _shadowRequests.push_back(ShadowRequest{path, ray, medium, endCap, bounce, startsOnSurface, false,
+            ray.farT(), Vec3f(1.0f), contribution});
+    return int(_shadowRequests.size() - 1);
+}
+
+int WavefrontPathTracer::lightSample(uint32 path, const Primitive &light, SurfaceScatterEvent &event,
+        const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale)
+{
+    LightSample sample;
+    if (!light.sampleDirect(_threadId, event.info->p, *event.sampler, sample))
+        return -1;
+
+    event.wo = event.frame.toLocal(sample.d);
+    if (!isConsistent(event, sample.d))
+        return -1;
+
+    bool geometricBackside = (sample.d.dot(event.info->Ng) < 0.0f);
+    medium = event.info->primitive->selectMedium(medium, geometricBackside);
+
+    event.requestedLobe = BsdfLobes::AllButSpecular;
+
+    Vec3f f = event.info->bsdf->eval(event, false);
+    if (f == 0.0f)
+        return -1;
+
+    Ray ray = parentRay.scatter(event.info->p, sample.d, event.info->epsilon);
+    ray.setPrimaryRay(false);
+
+    IntersectionTemporary data;
+    IntersectionInfo info;
+    Vec3f e;
+    if (!emitterHit(light, sample.dist, data, info, ray, e))
+        return -1;
+
+    // The shadow ray of the light sample also provides the visibility
+    // output, so it is traced even if it cannot contribute
+    if (e == 0.0f && !(_trackOutputValues && _scene->cam().visibilityBuffer()))
+        return -1;
+
+    Vec3f lightF = f*e/sample.pdf;
+
+    if (!light.isDirac())
+        lightF *= SampleWarp::powerHeuristic(sample.pdf, event.info->bsdf->pdf(event));
+
+    return queueShadow(path, ray, medium, &light, bounce, true, lightF*scale);
+}
+
+void WavefrontPathTracer::bsdfSample(uint32 path, const Primitive &light, SurfaceScatterEvent &event,
+        const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale)
+{
+    event.requestedLobe = BsdfLobes::AllButSpecular;
+    if (!event.info->bsdf->sample(event, false))
+        return;
+    if (event.weight == 0.0f)
+        return;
+
+    Vec3f wo = event.frame.toGlobal(event.wo);
+    if (!isConsistent(event, wo))
+        return;
+
+    bool geometricBackside = (wo.dot(event.info->Ng) < 0.0f);
+    medium = event.info->primitive->selectMedium(medium, geometricBackside);
+
+    Ray ray = parentRay.scatter(event.info->p, wo, event.info->epsilon);
+    ray.setPrimaryRay(false);
+
+    IntersectionTemporary data;
+    IntersectionInfo info;
+    Vec3f e;
+    if (!emitterHit(light, -1.0f, data, info, ray, e) || e == 0.0f)
+        return;
+
+    Vec3f bsdfF = e*event.weight;
+
+    bsdfF *= SampleWarp::powerHeuristic(event.pdf, light.directPdf(_threadId, data, info, event.info->p));
+
+    queueShadow(path, ray, medium, &light, bounce, true, bsdfF*scale);
+}
+
+int WavefrontPathTracer::estimateDirect(uint32 path, SurfaceScatterEvent &event, const Medium *medium,
+        int bounce, const Ray &parentRay, Vec3f scale)
+{
+    RENDER_STAT_TIMER(TimeLightSampling);
+
+    float weight;
+    const Primitive *light = chooseLight(*event.sampler, event.info->p, weight);
+    if (light == nullptr)
+        return -1;
+
+    if (event.info->bsdf->lobes().isPureSpecular() || event.info->bsdf->lobes().isForward())
+        return -1;
+
+    int request = lightSample(path, *light, event, medium, bounce, parentRay, scale*weight);
+    if (!light->isDirac())
+        bsdfSample(path, *light, event, medium, bounce, parentRay, scale*weight);
+
+    return request;
+}
+
+void WavefrontPathTracer::volumeLightSample(uint32 path, MediumSample &mediumSample, const Primitive &light,
+        const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale)
+{
+    LightSample lightSample;
+    if (!light.sampleDirect(_threadId, mediumSample.p, sampler(path), lightSample))
+        return;
+
+    Vec3f f = mediumSample.phase->eval(parentRay.dir(), lightSample.d);
+    if (f == 0.0f)
+        return;
+
+    Ray ray = parentRay.scatter(mediumSample.p, lightSample.d, 0.0f);
+    ray.setPrimaryRay(false);
+
+    IntersectionTemporary data;
+    IntersectionInfo info;
+    Vec3f e;
+    if (!emitterHit(light, lightSample.dist, data, info, ray, e) || e == 0.0f)
+        return;
+
+    Vec3f lightF = f*e/lightSample.pdf;
+
+    if (!light.isDirac())
+        lightF *= SampleWarp::powerHeuristic(lightSample.pdf, mediumSample.phase->pdf(parentRay.dir(), lightSample.d));
+
+    queueShadow(path, ray, medium, &light, bounce, false, lightF*scale);
+}
+
+void WavefrontPathTracer::volumePhaseSample(uint32 path, MediumSample &mediumSample, const Primitive &light,
+        const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale)
+{
+    PhaseSample phaseSample;
+    if (!mediumSample.phase->sample(sampler(path), parentRay.dir(), phaseSample))
+        return;
+
+    Ray ray = parentRay.scatter(mediumSample.p, phaseSample.w, 0.0f);
+    ray.setPrimaryRay(false);
+
+    IntersectionTemporary data;
+    IntersectionInfo info;
+    Vec3f e;
+    if (!emitterHit(light, -1.0f, data, info, ray, e) || e == 0.0f)
+        return;
+
+    Vec3f phaseF = e*phaseSample.weight;
+
+    phaseF *= SampleWarp::powerHeuristic(phaseSample.pdf, light.directPdf(_threadId, data, info, mediumSample.p));
+
+    queueShadow(path, ray, medium, &light, bounce, false, phaseF*scale);
+}
+
+void WavefrontPathTracer::volumeEstimateDirect(uint32 path, MediumSample &mediumSample, const Medium *medium,
+        int bounce, const Ray &parentRay, Vec3f scale)
+{
+    RENDER_STAT_TIMER(TimeLightSampling);
+
+    float weight;
+    const Primitive *light = chooseLight(sampler(path), mediumSample.p, weight);
+    if (light == nullptr)
+        return;
+
+    volumeLightSample(path, mediumSample, *light, medium, bounce, parentRay, scale*weight);
+    if (!light->isDirac())
+        volumePhaseSample(path, mediumSample, *light, medium, bounce, parentRay, scale*weight);
+}
+
+void WavefrontPathTracer::intersectPhase()
+{
+    _batch.clear();
+    for (uint32 path : _active)
+        _paths[path].batchIdx = _batch.push(_paths[path].ray);
+
+    _scene->intersect(_batch);
+
+    for (uint32 path : _active) {
+        PathState &p = _paths[path];
+        p.ray = _batch.ray(p.batchIdx);
+        p.didHit = _batch.hit(p.batchIdx);
+    }
+}
+
+void WavefrontPathTracer::mediumPhase()
+{
+    RENDER_STAT_TIMER(TimeShading);
+
+    for (uint32 path : _active) {
+        PathState &p = _paths[path];
+
+        try {
+
+        if (!((p.didHit || p.medium) && p.bounce < _settings.maxBounces)) {
+            exitLoop(path);
+            continue;
+        }
+
+        MediumSample mediumSample;
+        bool hitSurface = true;
+        if (p.medium) {
+            mediumSample.continuedWeight = p.throughput;
+            if (!p.medium->sampleDistance(sampler(path), p.ray, p.mediumState, mediumSample)) {
+                terminate(path);
+                continue;
+            }
+            p.emission += p.throughput*mediumSample.emission;
+            p.throughput *= mediumSample.weight;
+            hitSurface = mediumSample.exited;
+            if (hitSurface && !p.didHit) {
+                exitLoop(path);
+                continue;
+            }
+        }
+
+        if (hitSurface) {
+            p.hitDistance += p.ray.farT();
+
+            if (p.mediumBounces == 1 && !_settings.lowOrderScattering) {
+                terminate(path);
+                continue;
+            }
+
+            _surfaceQueue.push_back(path);
+        } else {
+            p.mediumBounces++;
+
+            bool enableLightSampling = _settings.enableVolumeLightSampling
+                    && (p.mediumBounces > 1 || _settings.lowOrderScattering);
+            p.wasSpecular = !enableLightSampling;
+
+            if (enableLightSampling && p.bounce < _settings.maxBounces - 1)
+                volumeEstimateDirect(path, mediumSample, p.medium, p.bounce + 1, p.ray, p.throughput);
+
+            PhaseSample phaseSample;
+            if (!mediumSample.phase->sample(sampler(path), p.ray.dir(), phaseSample)) {
+                terminate(path);
+                continue;
+            }
+
+            p.ray = p.ray.scatter(mediumSample.p, phaseSample.w, 0.0f);
+            p.ray.setPrimaryRay(false);
+            p.throughput *= phaseSample.weight;
+
+            _continueQueue.push_back(path);
+        }
+
+        } catch (std::runtime_error &e) {
+            std::cout << tfm::format("Caught an internal error at pixel %s: %s", p.pixel, e.what()) << std::endl;
+            finish(path, Vec3f(0.0f));
+        }
+    }
+}
+
+void WavefrontPathTracer::recordOutputValues(uint32 path, IntersectionTemporary &data, IntersectionInfo &info,
+        int visibilityRequest)
+{
+    PathState &p = _paths[path];
+
+    if (_scene->cam().depthBuffer())
+        _scene->cam().depthBuffer()->addSample(p.pixel, p.hitDistance);
+    if (_scene->cam().normalBuffer())
+        _scene->cam().normalBuffer()->addSample(p.pixel, info.Ns);
+    if (_scene->cam().albedoBuffer()) {
+        Vec3f albedo;
+        if (const TransparencyBsdf *bsdf = dynamic_cast<const TransparencyBsdf *>(info.bsdf))
+            albedo = (*bsdf->base()->albedo())[info];
+        else
+            albedo = (*info.bsdf->albedo())[info];
+        if (info.primitive->isEmissive())
+            albedo += info.primitive->evalDirect(data, info);
+        _scene->cam().albedoBuffer()->addSample(p.pixel, albedo);
+    }
+    if (_scene->cam().visibilityBuffer() && visibilityRequest >= 0)
+        _shadowRequests[visibilityRequest].recordVisibility = true;
+    p.recordedOutputValues = true;
+}
+
+void WavefrontPathTracer::shadeSurface(uint32 path)
+{
+    PathState &p = _paths[path];
+    IntersectionTemporary &data = _batch.data(p.batchIdx);
+    IntersectionInfo &info = _batch.info(p.batchIdx);
+
+    SurfaceScatterEvent event = makeLocalScatterEvent(data, info, p.ray, &sampler(path));
+    const Bsdf &bsdf = *info.bsdf;
+
+    bool enableLightSampling = _settings.enableLightSampling && (p.mediumBounces > 0 || _settings.includeSurfaces);
+    int visibilityRequest = -1;
+    bool scatterFailed = false;
+
+    // For forward events, the transport direction does not matter (since wi = -wo)
+    Vec3f transparency = bsdf.eval(event.makeForwardEvent(), false);
+    float transparencyScalar = transparency.avg();
+
+    Vec3f wo;
+    if (event.sampler->nextBoolean(transparencyScalar)) {
+        wo = p.ray.dir();
+        event.pdf = transparencyScalar;
+        event.weight = transparency/transparencyScalar;
+        event.sampledLobe = BsdfLobes::ForwardLobe;
+        p.throughput *= event.weight;
+    } else {
+        if (enableLightSampling && p.bounce < _settings.maxBounces - 1)
+            visibilityRequest = estimateDirect(path, event, p.medium, p.bounce + 1, p.ray, p.throughput);
+
+        if (info.primitive->isEmissive() && p.bounce >= _settings.minBounces) {
+            if (!enableLightSampling || p.wasSpecular || !info.primitive->isSamplable())
+                p.emission += info.primitive->evalDirect(data, info)*p.throughput;
+        }
+
+        event.requestedLobe = BsdfLobes::AllLobes;
+        if (!bsdf.sample(event, false)) {
+            scatterFailed = true;
+        } else {
+            wo = event.frame.toGlobal(event.wo);
+
+            if (!isConsistent(event, wo)) {
+                scatterFailed = true;
+            } else {
+                p.throughput *= event.weight;
+                p.wasSpecular = event.sampledLobe.hasSpecular();
+                if (!p.wasSpecular)
+                    p.ray.setPrimaryRay(false);
+            }
+        }
+    }
+
+    if (!scatterFailed) {
+        bool geometricBackside = (wo.dot(info.Ng) < 0.0f);
+        p.medium = info.primitive->selectMedium(p.medium, geometricBackside);
+        p.mediumState.reset();
+
+        p.ray = p.ray.scatter(p.ray.hitpoint(), wo, info.epsilon);
+    }
+
+    if (!info.bsdf->lobes().isPureDirac()) {
+        if (p.mediumBounces == 0 && !_settings.includeSurfaces) {
+            terminate(path);
+            return;
+        }
+    }
+
+    if (_trackOutputValues && !p.recordedOutputValues && (!p.wasSpecular || scatterFailed))
+        recordOutputValues(path, data, info, visibilityRequest);
+
+    if (scatterFailed) {
+        terminate(path);
+        return;
+    }
+
+    _continueQueue.push_back(path);
+}
+
+void WavefrontPathTracer::surfacePhase()
+{
+    RENDER_STAT_TIMER(TimeShading);
+
+    // Grouping hits by BSDF type keeps the virtual calls of consecutive
+    // paths going to the same code
+    std::vector<std::pair<std::type_index, uint32>> order;
+    order.reserve(_surfaceQueue.size());
+    for (uint32 path : _surfaceQueue)
+        order.emplace_back(std::type_index(typeid(*_batch.info(_paths[path].batchIdx).bsdf)), path);
+    std::sort(order.begin(), order.end());
+
+    for (const auto &o : order) {
+        try {
+            shadeSurface(o.second);
+        } catch (std::runtime_error &e) {
+            std::cout << tfm::format("Caught an internal error at pixel %s: %s", _paths[o.second].pixel, e.what()) << std::endl;
+            finish(o.second, Vec3f(0.0f));
+        }
+    }
+    _surfaceQueue.clear();
+}
+
+void WavefrontPathTracer::shadowPhase()
+{
+    _pendingShadows.clear();
+    for (uint32 i = 0; i < _shadowRequests.size(); ++i)
+        _pendingShadows.push_back(i);
+
+    // Each iteration traces one segment of every unresolved shadow ray.
+    // Rays passing through transparent surfaces continue behind them in
+    // the next iteration, exactly like TraceBase::generalizedShadowRay
+    while (!_pendingShadows.empty()) {
+        _shadowBatch.clear();
+        for (uint32 idx : _pendingShadows)
+            _shadowBatch.push(_shadowRequests[idx].ray);
+
+        RENDER_STAT_ADD(ShadowSegments, _shadowBatch.size());
+        _scene->intersect(_shadowBatch);
+
+        uint32 tail = 0;
+        for (uint32 k = 0; k < _shadowBatch.size(); ++k) {
+            ShadowRequest &request = _shadowRequests[_pendingShadows[k]];
+            IntersectionTemporary &data = _shadowBatch.data(k);
+            IntersectionInfo &info = _shadowBatch.info(k);
+            Ray ray = _shadowBatch.ray(k);
+
+            Vec3f shadow(0.0f);
+            bool resolved = false;
+            bool didHit = _shadowBatch.hit(k) && info.primitive != request.endCap;
+            if (didHit) {
+                if (!info.bsdf->lobes().hasForward()) {
+                    resolved = true;
+                } else {
+                    SurfaceScatterEvent event = makeLocalScatterEvent(data, info, ray, nullptr);
+                    Vec3f transparency = info.bsdf->eval(event.makeForwardEvent(), false);
+                    request.throughput *= transparency;
+                    request.bounce++;
+                    if (transparency == 0.0f || request.bounce >= _settings.maxBounces)
+                        resolved = true;
+                }
+            }
+
+            if (!resolved) {
+                if (request.medium)
+                    request.throughput *= request.medium->transmittance(sampler(request.path), ray,
+                            request.startsOnSurface, true);
+                if (info.primitive == nullptr || info.primitive == request.endCap) {
+                    shadow = request.bounce >= _settings.minBounces ? request.throughput : Vec3f(0.0f);
+                } else {
+                    request.medium = info.primitive->selectMedium(request.medium, !info.primitive->hitBackside(data));
+                    request.startsOnSurface = true;
+
+                    ray.setPos(ray.hitpoint());
+                    request.initialFarT -= ray.farT();
+                    ray.setNearT(info.epsilon);
+                    ray.setFarT(request.initialFarT);
+                    request.ray = ray;
+
+                    _pendingShadows[tail++] = _pendingShadows[k];
+                    continue;
+                }
+            }
+
+            PathState &p = _paths[request.path];
+            if (request.recordVisibility)
+                _scene->cam().visibilityBuffer()->addSample(p.pixel, shadow.avg());
+            p.emission += request.contribution*shadow;
+        }
+        _pendingShadows.resize(tail);
+    }
+
+    _shadowRequests.clear();
+}
+
+void WavefrontPathTracer::continuePhase()
+{
+    uint32 tail = 0;
+    for (uint32 path : _continueQueue) {
+        PathState &p = _paths[path];
+        if (p.status != PathActive)
+            continue;
+
+        if (p.throughput.max() == 0.0f) {
+            exitLoop(path);
+            continue;
+        }
+
+        float roulettePdf = std::abs(p.throughput).max();
+        if (p.bounce > 2 && roulettePdf < 0.1f) {
+            if (sampler(path).nextBoolean(roulettePdf)) {
+                p.throughput /= roulettePdf;
+            } else {
+                finish(path, p.emission);
+                continue;
+            }
+        }
+
+        // NaN paths contribute black, like in the scalar path tracer
+        if (std::isnan(p.ray.dir().sum() + p.ray.pos().sum()) ||
+                std::isnan(p.throughput.sum() + p.emission.sum())) {
+            finish(path, Vec3f(0.0f));
+            continue;
+        }
+
+        p.bounce++;
+        if (p.bounce < _settings.maxBounces)
+            _continueQueue[tail++] = path;
+        else
+            exitLoop(path);
+    }
+    _continueQueue.resize(tail);
+}
+
+void WavefrontPathTracer::exitPhase()
+{
+    for (uint32 path : _active) {
+        PathState &p = _paths[path];
+
+        // Terminated paths still had shadow rays in flight, which are
+        // resolved by now
+        if (p.status == PathTerminated) {
+            finish(path, p.emission);
+            continue;
+        }
+        if (p.status != PathExited)
+            continue;
+
+        try {
+
+        IntersectionTemporary &data = _batch.data(p.batchIdx);
+        IntersectionInfo &info = _batch.info(p.batchIdx);
+
+        if (p.bounce >= _settings.minBounces && p.bounce < _settings.maxBounces)
+            handleInfiniteLights(data, info, _settings.enableLightSampling, p.ray, p.throughput, p.wasSpecular, p.emission);
+        if (std::isnan(p.throughput.sum() + p.emission.sum())) {
+            finish(path, Vec3f(0.0f));
+            continue;
+        }
+
+        if (_trackOutputValues && !p.recordedOutputValues) {
+            if (_scene->cam().depthBuffer() && p.bounce == 0)
+                _scene->cam().depthBuffer()->addSample(p.pixel, 0.0f);
+            if (_scene->cam().normalBuffer())
+                _scene->cam().normalBuffer()->addSample(p.pixel, -p.ray.dir());
+            if (_scene->cam().albedoBuffer() && info.primitive && info.primitive->isInfinite())
+                _scene->cam().albedoBuffer()->addSample(p.pixel, info.primitive->evalDirect(data, info));
+        }
+
+        finish(path, p.emission);
+
+        } catch (std::runtime_error &e) {
+            std::cout << tfm::format("Caught an internal error at pixel %s: %s", p.pixel, e.what()) << std::endl;
+            finish(path, Vec3f(0.0f));
+        }
+    }
+}
+
+void WavefrontPathTracer::clear()
+{
+    _paths.clear();
+    _radiance.clear();
+}
+
+uint32 WavefrontPathTracer::addPath(Vec2u pixel, uint32 pixelIndex, uint32 sample)
+{
+    uint32 path = uint32(_paths.size());
+    _paths.emplace_back();
+    _radiance.emplace_back(0.0f);
+
+    PathState &p = _paths.back();
+    p.pixel = pixel;
+    p.status = PathFinished;
+
+    RENDER_STAT_ADD(Samples, 1);
+
+    PathSampleGenerator &sampler = *_samplers[path];
+    sampler.startPath(pixelIndex, sample);
+
+    PositionSample point;
+    if (!_scene->cam().samplePosition(sampler, point))
+        return path;
+    DirectionSample direction;
+    if (!_scene->cam().sampleDirection(sampler, point, pixel, direction))
+        return path;
+
+    p.ray = Ray(point.p, direction.d);
+    p.ray.setPrimaryRay(true);
+    p.throughput = point.weight*direction.weight;
+    p.emission = Vec3f(0.0f);
+    p.medium = _scene->cam().medium().get();
+    p.mediumState.reset();
+    p.bounce = 0;
+    p.mediumBounces = 0;
+    p.wasSpecular = true;
+    p.didHit = false;
+    p.recordedOutputValues = false;
+    p.hitDistance = 0.0f;
+    p.status = PathActive;
+
+    RENDER_STAT_ADD(PrimaryRays, 1);
+
+    return path;
+}
+
+void WavefrontPathTracer::traceWavefront()
+{
+    _active.clear();
+    for (uint32 i = 0; i < _paths.size(); ++i)
+        if (_paths[i].status == PathActive)
+            _active.push_back(i);
+
+    while (!_active.empty()) {
+        intersectPhase();
+        mediumPhase();
+        surfacePhase();
+        shadowPhase();
+        continuePhase();
+        exitPhase();
+
+        // Only the paths that survived the bounce are traced further
+        _active.swap(_continueQueue);
+        _continueQueue.clear();
+    }
+}
+
+}
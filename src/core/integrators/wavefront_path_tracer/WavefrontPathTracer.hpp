@@ -0,0 +1,153 @@
+#ifndef WAVEFRONTPATHTRACER_HPP_
+#define WAVEFRONTPATHTRACER_HPP_
+
+#include "integrators/path_tracer/PathTracerSettings.hpp"
+
+#include "integrators/TraceBase.hpp"
+
+#include "renderer/RayBatch.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace Tungsten {
+
+// Traces a wavefront of paths in lockstep, one bounce at a time. Each bounce
+// runs as a sequence of phases over all live paths: a batched intersection,
+// medium sampling, surface shading grouped by BSDF type, a batched shadow
+// ray phase and finally roulette and compaction of the surviving paths.
+// Shadow rays are not traced during shading, but queued with their
+// unoccluded contribution and resolved together afterwards.
+// This computes the same estimator as PathTracer::traceSample, including
+// transparent shadow rays, media and the auxiliary output buffers
+class WavefrontPathTracer : public TraceBase
+{
+public:
+    static CONSTEXPR uint32 MaxWavefrontSize = 1024;
+
+private:
+    enum PathStatus
+    {
+        PathActive,
+        PathExited,
+        PathTerminated,
+        PathFinished,
+    };
+
+    struct PathState
+    {
+        Vec2u pixel;
+        Ray ray;
+        Vec3f throughput;
+        Vec3f emission;
+        const Medium *medium;
+        Medium::MediumState mediumState;
+        int bounce;
+        int mediumBounces;
+        bool wasSpecular;
+        bool didHit;
+        bool recordedOutputValues;
+        float hitDistance;
+        PathStatus status;
+        uint32 batchIdx;
+    };
+
+    struct ShadowRequest
+    {
+        uint32 path;
+        Ray ray;
+        const Medium *medium;
+        const Primitive *endCap;
+        int bounce;
+        bool startsOnSurface;
+        bool recordVisibility;
+        float initialFarT;
+        Vec3f throughput;
+        Vec3f contribution;
+    };
+
+    PathTracerSettings _settings;
+    bool _trackOutputValues;
+
+    std::vector<std::unique_ptr<PathSampleGenerator>> _samplers;
+    std::vector<PathState> _paths;
+    std::vector<Vec3f> _radiance;
+
+    std::vector<uint32> _active;
+    std::vector<uint32> _surfaceQueue;
+    std::vector<uint32> _continueQueue;
+    std::vector<ShadowRequest> _shadowRequests;
+    std::vector<uint32> _pendingShadows;
+
+    RayBatch _batch;
+    RayBatch _shadowBatch;
+
+    PathSampleGenerator &sampler(uint32 path)
+    {
+        return *_samplers[path];
+    }
+
+    void finish(uint32 path, Vec3f radiance);
+    void terminate(uint32 path);
+    void exitLoop(uint32 path);
+
+    bool emitterHit(const Primitive &light, float expectedDist, IntersectionTemporary &data,
+            IntersectionInfo &info, Ray &ray, Vec3f &emission) const;
+    int queueShadow(uint32 path, const Ray &ray, const Medium *medium, const Primitive *endCap,
+            int bounce, bool startsOnSurface, Vec3f contribution);
+
+    int lightSample(uint32 path, const Primitive &light, SurfaceScatterEvent &event,
+            const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale);
+    void bsdfSample(uint32 path, const Primitive &light, SurfaceScatterEvent &event,
+            const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale);
+    int estimateDirect(uint32 path, SurfaceScatterEvent &event, const Medium *medium,
+            int bounce, const Ray &parentRay, Vec3f scale);
+
+    void volumeLightSample(uint32 path, MediumSample &mediumSample, const Primitive &light,
+            const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale);
+    void volumePhaseSample(uint32 path, MediumSample &mediumSample, const Primitive &light,
+            const Medium *medium, int bounce, const Ray &parentRay, Vec3f scale);
+    void volumeEstimateDirect(uint32 path, MediumSample &mediumSample, const Medium *medium,
+            int bounce, const Ray &parentRay, Vec3f scale);
+
+    void intersectPhase();
+    void mediumPhase();
+    void surfacePhase();
+    void shadowPhase();
+    void continuePhase();
+    void exitPhase();
+
+    void shadeSurface(uint32 path);
+    void recordOutputValues(uint32 path, IntersectionTemporary &data, IntersectionInfo &info,
+            int visibilityRequest);
+
+public:
+    WavefrontPathTracer(TraceableScene *scene, const PathTracerSettings &settings, uint32 threadId,
+            uint32 seed);
+
+    // Starts a new wavefront. Paths are added with addPath and traced once
+    // the wavefront is full or traceWavefront is called
+    void clear();
+    uint32 addPath(Vec2u pixel, uint32 pixelIndex, uint32 sample);
+    void traceWavefront();
+
+    bool full() const
+    {
+        return _paths.size() == MaxWavefrontSize;
+    }
+
+    uint32 size() const
+    {
+        return uint32(_paths.size());
+    }
+
+    // Radiance of the i-th path of the last traced wavefront
+    Vec3f radiance(uint32 i) const
+    {
+        return _radiance[i];
+    }
+};
+
+}
+
+#endif /* WAVEFRONTPATHTRACER_HPP_ */
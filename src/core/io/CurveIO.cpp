@@ -15,10 +15,28 @@
 
 #include "Platform.hpp"
 
+#include <memory>
+
 namespace Tungsten {
 
 namespace CurveIO {
 
+// Reads count elements of type T in fixed-size chunks and hands each of them
+// to f(index, element). Large arrays are decoded straight into their
+// destination this way, rather than through a full temporary copy
+template<typename T, typename Function>
+static void streamElements(InputStreamHandle &in, size_t count, Function f)
+{
+    const size_t ChunkSize = 64*1024;
+    std::unique_ptr<T[]> chunk(new T[min(count, ChunkSize)]);
+    for (size_t start = 0; start < count; start += ChunkSize) {
+        size_t chunkCount = min(count - start, ChunkSize);
+        FileUtils::streamRead(in, chunk.get(), chunkCount);
+        for (size_t i = 0; i < chunkCount; ++i)
+            f(start + i, chunk[i]);
+    }
+}
+
 void extrudeMinimumTorsionNormals(CurveData &data)
 {
     std::vector<uint32> &curveEnds = *data.curveEnds;
@@ -60,9 +78,10 @@ void extrudeMinimumTorsionNormals(CurveData &data)
         return N;
     };
 
-    // Break work up into roughly ~10ms chunks
-    uint32 numTasks = (int(nodes.size()) - 1)/30000 + 1;
-    ThreadUtils::parallelFor(0, uint32(curveEnds.size()), numTasks, [&](uint32 i) {
+    // Break work up into chunks of roughly ~30000 nodes
+    uint32 nodesPerCurve = uint32(nodes.size()/max(curveEnds.size(), size_t(1))) + 1;
+    uint32 grainSize = max(30000/nodesPerCurve, 1u);
+    ThreadUtils::parallelFor(0, uint32(curveEnds.size()), grainSize, [&](uint32 i) {
         uint32 t = i ? curveEnds[i - 1] : 0;
         Vec3f lastNormal = normals[t];
         do {
@@ -158,33 +177,34 @@ bool loadHair(const Path &path, CurveData &data)
         std::vector<uint32> &curveEnds = *data.curveEnds;
         curveEnds.resize(curveCount);
         if (hasSegments) {
-            std::vector<uint16> segmentLength(curveCount);
-            FileUtils::streamRead(in, segmentLength);
-            for (uint32 i = 0; i < curveCount; ++i)
-                curveEnds[i] = uint32(segmentLength[i]) + 1 + (i > 0 ? curveEnds[i - 1] : 0);
+            streamElements<uint16>(in, curveCount, [&](size_t i, uint16 segmentLength) {
+                curveEnds[i] = uint32(segmentLength) + 1 + (i > 0 ? curveEnds[i - 1] : 0);
+            });
         } else {
             for (uint32 i = 0; i < curveCount; ++i)
                 curveEnds[i] = (i + 1)*(defaultSegments + 1);
         }
         curveEnds.shrink_to_fit();
+    } else if (hasSegments) {
+        in->seekg(sizeof(uint16)*curveCount, std::ios_base::cur);
     }
 
     if (data.nodeData) {
         std::vector<Vec4f> &nodeData = *data.nodeData;
 
-        std::vector<Vec3f> points(nodeCount);
-        FileUtils::streamRead(in, points);
         nodeData.resize(nodeCount);
-        for (size_t i = 0; i < nodeCount; ++i)
-            nodeData[i] = Vec4f(points[i].x(), points[i].y(), points[i].z(), defaultThickness);
+        nodeData.shrink_to_fit();
 
+        streamElements<Vec3f>(in, nodeCount, [&](size_t i, const Vec3f &p) {
+            nodeData[i] = Vec4f(p.x(), p.y(), p.z(), defaultThickness);
+        });
         if (hasThickness) {
-            std::vector<float> thicknesses(nodeCount);
-            FileUtils::streamRead(in, thicknesses);
-            for (size_t i = 0; i < nodeCount; ++i)
-                nodeData[i].w() = thicknesses[i];
+            streamElements<float>(in, nodeCount, [&](size_t i, float thickness) {
+                nodeData[i].w() = thickness;
+            });
         }
-        nodeData.shrink_to_fit();
+    } else {
+        in->seekg((sizeof(Vec3f) + (hasThickness ? sizeof(float) : 0))*nodeCount, std::ios_base::cur);
     }
 
     if (hasTransparency)
@@ -329,15 +349,20 @@ struct FiberAttribute
             && elementsPresent > 0;
     }
 
-    template<typename T>
-    std::unique_ptr<T[]> load(InputStreamHandle in, uint64 elementsRequired)
+    // Streams elementsRequired elements to f(index, element). Missing
+    // elements repeat the last one present, surplus ones are ignored
+    template<typename T, typename Function>
+    void load(InputStreamHandle &in, uint64 elementsRequired, Function f)
     {
-        std::unique_ptr<T[]> result(new T[size_t(elementsRequired)]);
-        FileUtils::streamRead(in, result.get(), size_t(elementsPresent));
+        size_t present = size_t(min(elementsPresent, elementsRequired));
+        T last;
+        streamElements<T>(in, present, [&](size_t i, const T &value) {
+            f(i, value);
+            last = value;
+        });
         // Copy-extend
-        for (size_t i = size_t(elementsPresent); i < size_t(elementsRequired); ++i)
-            result[i] = result[size_t(elementsPresent - 1)];
-        return std::move(result);
+        for (size_t i = present; i < size_t(elementsRequired); ++i)
+            f(i, last);
     }
 };
 static bool loadFiber(const Path &path, CurveData &data)
@@ -377,20 +402,23 @@ static bool loadFiber(const Path &path, CurveData &data)
         in->seekg(size_t(offset), std::ios_base::beg);
 
         if (data.curveEnds && attribute.matches("num_vertices", true, FIBER_UINT16, 1)) {
-            data.curveEnds->resize(size_t(numCurves));
-            auto vertexCounts = attribute.load<uint16>(in, numCurves);
-            for (size_t i = 0; i < size_t(numCurves); ++i)
-                (*data.curveEnds)[i] = uint32(vertexCounts[i]) + (i > 0 ? (*data.curveEnds)[i - 1] : 0);
+            std::vector<uint32> &curveEnds = *data.curveEnds;
+            curveEnds.resize(size_t(numCurves));
+            attribute.load<uint16>(in, numCurves, [&](size_t i, uint16 vertexCount) {
+                curveEnds[i] = uint32(vertexCount) + (i > 0 ? curveEnds[i - 1] : 0);
+            });
         } else if (data.nodeData && attribute.matches("position", false, FIBER_FLOAT, 3)) {
-            data.nodeData->resize(size_t(numVertices));
-            auto pos = attribute.load<Vec3f>(in, numVertices);
-            for (size_t i = 0; i < size_t(numVertices); ++i)
-                (*data.nodeData)[i] = Vec4f(pos[i].x(), pos[i].y(), pos[i].z(), (*data.nodeData)[i].w());
+            std::vector<Vec4f> &nodeData = *data.nodeData;
+            nodeData.resize(size_t(numVertices));
+            attribute.load<Vec3f>(in, numVertices, [&](size_t i, const Vec3f &p) {
+                nodeData[i] = Vec4f(p.x(), p.y(), p.z(), nodeData[i].w());
+            });
         } else if (data.nodeData && attribute.matches("width", false, FIBER_FLOAT, 1)) {
-            data.nodeData->resize(size_t(numVertices));
-            auto width = attribute.load<float>(in, numVertices);
-            for (size_t i = 0; i < size_t(numVertices); ++i)
-                (*data.nodeData)[i].w() = width[i];
+            std::vector<Vec4f> &nodeData = *data.nodeData;
+            nodeData.resize(size_t(numVertices));
+            attribute.load<float>(in, numVertices, [&](size_t i, float width) {
+                nodeData[i].w() = width;
+            });
         }
 
         offset += attribute.dataLength;
@@ -27,6 +27,8 @@
 #include <cstdio>
 #include <memory>
 #include <locale>
+#include <random>
+#include <atomic>
 
 namespace Tungsten {
 
@@ -550,6 +552,36 @@ bool FileUtils::deleteFile(const Path &path)
 #endif
 }
 
+bool FileUtils::writeFileAtomically(const Path &path, const std::function<void(OutputStreamHandle &)> &writer)
+{
+    // The process ID and a counter make names unique on this machine, and
+    // the random number guards against other machines sharing the directory
+    static std::atomic<uint32> counter(0);
+#if _WIN32
+    uint32 pid = uint32(GetCurrentProcessId());
+#else
+    uint32 pid = uint32(getpid());
+#endif
+    Path tmpPath = path + tfm::format(".%d.%d.%08x.tmp", pid, counter++, std::random_device()());
+
+    bool success;
+    {
+        OutputStreamHandle out = openOutputStream(tmpPath);
+        if (!out)
+            return false;
+
+        writer(out);
+        out->flush();
+        success = out->good();
+    }
+
+    if (!success || !moveFile(tmpPath, path, true)) {
+        deleteFile(tmpPath);
+        return false;
+    }
+    return true;
+}
+
 InputStreamHandle FileUtils::openInputStream(const Path &p)
 {
     NativeStatStruct info;
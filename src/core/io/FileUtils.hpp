@@ -99,6 +99,11 @@ public:
     static bool copyFile(const Path &src, const Path &dst, bool createDstDir);
     static bool moveFile(const Path &src, const Path &dst, bool deleteDst);
     static bool deleteFile(const Path &path);
+    // Writes path by handing a stream to a uniquely named temporary file next
+    // to it to writer, which is renamed to path once it is complete. Readers
+    // of path never observe partially written files, and concurrent writers
+    // of the same path, in this or other processes, do not clobber each other
+    static bool writeFileAtomically(const Path &path, const std::function<void(OutputStreamHandle &)> &writer);
 
     static InputStreamHandle openInputStream(const Path &p);
     static OutputStreamHandle openOutputStream(const Path &p);
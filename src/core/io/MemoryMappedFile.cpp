@@ -0,0 +1,85 @@
+#include "MemoryMappedFile.hpp"
+#include "UnicodeUtils.hpp"
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Tungsten {
+
+#if _WIN32
+
+MemoryMappedFile::MemoryMappedFile(const Path &path)
+: _file(INVALID_HANDLE_VALUE),
+  _mapping(nullptr),
+  _data(nullptr),
+  _size(0)
+{
+    std::wstring wpath = UnicodeUtils::utf8ToWchar(path.absolute().nativeSeparators().asString());
+    _file = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+        return;
+
+    _mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!_mapping)
+        return;
+
+    _data = static_cast<const uint8 *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (_data)
+        _size = size_t(size.QuadPart);
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    if (_data)
+        UnmapViewOfFile(_data);
+    if (_mapping)
+        CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile(const Path &path)
+: _file(-1),
+  _data(nullptr),
+  _size(0)
+{
+    _file = open(path.absolute().asString().c_str(), O_RDONLY);
+    if (_file == -1)
+        return;
+
+    struct stat info;
+    if (fstat(_file, &info) != 0 || info.st_size == 0)
+        return;
+
+    void *data = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, _file, 0);
+    if (data == MAP_FAILED)
+        return;
+
+    _data = static_cast<const uint8 *>(data);
+    _size = size_t(info.st_size);
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    if (_data)
+        munmap(const_cast<uint8 *>(_data), _size);
+    if (_file != -1)
+        close(_file);
+}
+
+#endif
+
+}
@@ -0,0 +1,50 @@
+#ifndef MEMORYMAPPEDFILE_HPP_
+#define MEMORYMAPPEDFILE_HPP_
+
+#include "Path.hpp"
+
+#include "IntTypes.hpp"
+
+#include <cstddef>
+
+namespace Tungsten {
+
+// Read-only view of a whole file on disk. Only works for regular files, not
+// for files inside of archives. Check valid() after construction
+class MemoryMappedFile
+{
+#if _WIN32
+    void *_file;
+    void *_mapping;
+#else
+    int _file;
+#endif
+    const uint8 *_data;
+    size_t _size;
+
+public:
+    MemoryMappedFile(const Path &path);
+    ~MemoryMappedFile();
+
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    bool valid() const
+    {
+        return _data != nullptr;
+    }
+
+    const uint8 *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+};
+
+}
+
+#endif /* MEMORYMAPPEDFILE_HPP_ */
@@ -3,6 +3,8 @@
 
 #include "IntTypes.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <string>
 
@@ -67,6 +69,19 @@ public:
     }
 #endif
 
+    // Index of the lowest set bit. x must not be zero
+#if defined(__GNUC__)
+    static inline uint32 lsb(uint32 x)
+    {
+        return __builtin_ctz(x);
+    }
+#else
+    static inline uint32 lsb(uint32 x)
+    {
+        return msb(x & (~x + 1)) - 1;
+    }
+#endif
+
     // Computes std::log(x/UINT_MAX) to within 1e-5 accuracy, but 16x faster
     static inline float normalizedLog(uint32 x)
     {
@@ -75,6 +90,26 @@ public:
         return (_logLookup[res] + int(ai - LogMantissaBits - 32))*0.693147181f;
     }
 
+    // Position of (x, y) along a Hilbert curve filling an n x n grid.
+    // n must be a power of two
+    static inline uint32 hilbertIndex(uint32 n, uint32 x, uint32 y)
+    {
+        uint32 d = 0;
+        for (uint32 s = n/2; s > 0; s /= 2) {
+            uint32 rx = (x & s) > 0;
+            uint32 ry = (y & s) > 0;
+            d += s*s*((3*rx) ^ ry);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = n - 1 - x;
+                    y = n - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+
     // std::hash is not necessarily portable across compilers.
     // In case a consistent hash function is needed (for file IO),
     // this will do. This function is what is used in gawk.
@@ -86,6 +121,32 @@ public:
             result = (result*65599ull) + uint64(c);
         return result;
     }
+
+    // Consistent hash of a block of memory, for larger amounts of data
+    // (e.g. geometry buffers). Processes eight bytes at a time
+    static inline uint64 hash(const void *data, size_t size, uint64 seed = 0)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        uint64 result = seed ^ (size*0x9E3779B97F4A7C15ull);
+        auto mix = [&](uint64 word) {
+            result ^= word*0x9E3779B97F4A7C15ull;
+            result = ((result << 31) | (result >> 33))*0xBF58476D1CE4E5B9ull;
+        };
+
+        for (; size >= 8; size -= 8, bytes += 8) {
+            uint64 word;
+            std::memcpy(&word, bytes, 8);
+            mix(word);
+        }
+        if (size > 0) {
+            uint64 word = 0;
+            std::memcpy(&word, bytes, size);
+            mix(word);
+        }
+
+        result ^= result >> 32;
+        return result;
+    }
 };
 
 }
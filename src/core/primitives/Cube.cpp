@@ -330,6 +330,17 @@ float Cube::approximateRadiance(uint32 /*threadIndex*/, const Vec3f &p) const
     return _emission->average().max()*_faceCdf.z()/dSq;
 }
 
+bool Cube::emissionCone(Vec3f &axis, float &theta, float &intensity) const
+{
+    if (!isEmissive())
+        return false;
+    // The projected area of the cube never exceeds the sum of three faces
+    axis = Vec3f(0.0f, 1.0f, 0.0f);
+    theta = PI;
+    intensity = _emission->average().max()*_faceCdf.z();
+    return true;
+}
+
 Box3f Cube::bounds() const
 {
     Box3f box;
@@ -0,0 +1,177 @@
+#ifndef CURVEBLOCK_HPP_
+#define CURVEBLOCK_HPP_
+
+#include "math/TangentFrame.hpp"
+#include "math/Vec.hpp"
+#include "math/Ray.hpp"
+
+#include "sse/SimdUtils.hpp"
+
+#include <limits>
+
+namespace Tungsten {
+
+// Leaf of the curve BVH, holding up to Width consecutive segments of one
+// curve. The Width + 2 nodes spanned by the segments (xyz and width) are
+// stored quantized to 16 bits relative to the bounds of the block, and
+// decoded on the fly during intersection. Quadratic B-splines share nodes
+// between neighbouring segments, so this is a quarter of the size of storing
+// the Bezier control points of each segment in floats, and lets the render
+// drop the full precision node data altogether.
+// Blocks of 8 segments (float8) were tried as well, but the oriented
+// bounds get too loose on curly hair and cost more than the wider SIMD gains
+struct CurveBlock
+{
+    typedef float4 Float;
+    typedef SimdBool<Float::n> Bool;
+    static CONSTEXPR uint32 Width = Float::n;
+    static CONSTEXPR uint32 NodeCount = Width + 2;
+
+    // Padded to 8 entries, so that the nodes k, k + 1 and k + 2 of all lanes
+    // can be fetched with a single 64 bit load each
+    uint16 qx[8], qy[8], qz[8], qw[8];
+    // Node i decodes to origin + q[i]*scale (and q.w*widthScale)
+    Vec3f origin, scale;
+    float widthScale;
+
+    // Oriented box around all segments of the block. The first axis follows
+    // the chord of the block, so that it stays tight for diagonal strands
+    // where axis-aligned boxes are mostly empty space
+    Vec3f axes[3];
+    Vec3f boundsMin, boundsMax;
+
+    // Segment t spans the nodes t - 2, t - 1 and t
+    uint32 firstSegment;
+    uint32 count;
+
+    static uint16 quantize(float x, float offset, float scale)
+    {
+        return scale > 0.0f ? uint16(clamp(int((x - offset)/scale + 0.5f), 0, 0xFFFF)) : 0;
+    }
+
+    static Float decode(const uint16 *q, float offset, float scale)
+    {
+        __m128i ints = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(q)), _mm_setzero_si128());
+        return Float(offset) + Float(_mm_cvtepi32_ps(ints))*Float(scale);
+    }
+
+    // Nodes k + offset of all lanes k
+    Vec<Float, 4> lanes(uint32 offset) const
+    {
+        return Vec<Float, 4>(
+            decode(qx + offset, origin.x(), scale.x()),
+            decode(qy + offset, origin.y(), scale.y()),
+            decode(qz + offset, origin.z(), scale.z()),
+            decode(qw + offset, 0.0f, widthScale)
+        );
+    }
+
+    // Node i of the block, i.e. node firstSegment - 2 + i of the curves
+    Vec4f node(uint32 i) const
+    {
+        return Vec4f(
+            origin.x() + qx[i]*scale.x(),
+            origin.y() + qy[i]*scale.y(),
+            origin.z() + qz[i]*scale.z(),
+            qw[i]*widthScale
+        );
+    }
+
+    void set(const Vec4f *nodes, uint32 first, uint32 count_)
+    {
+        firstSegment = first;
+        count = count_;
+
+        const Vec4f *src = nodes + first - 2;
+        uint32 n = count + 2;
+
+        Vec3f pMin(src[0].xyz()), pMax(src[0].xyz());
+        float wMax = 0.0f;
+        for (uint32 i = 0; i < n; ++i) {
+            pMin = min(pMin, src[i].xyz());
+            pMax = max(pMax, src[i].xyz());
+            wMax = max(wMax, src[i].w());
+        }
+        origin = pMin;
+        scale = (pMax - pMin)*(1.0f/0xFFFF);
+        widthScale = wMax*(1.0f/0xFFFF);
+
+        for (uint32 i = 0; i < 8; ++i) {
+            // Unused lanes repeat the last node, which keeps them degenerate
+            const Vec4f &p = src[min(i, n - 1)];
+            qx[i] = quantize(p.x(), origin.x(), scale.x());
+            qy[i] = quantize(p.y(), origin.y(), scale.y());
+            qz[i] = quantize(p.z(), origin.z(), scale.z());
+            qw[i] = quantize(p.w(), 0.0f, widthScale);
+        }
+
+        // Everything past this point works on the decoded nodes, so that the
+        // bounds match what the intersection sees
+        Vec3f chord = (node(n - 2).xyz() + node(n - 1).xyz()) - (node(0).xyz() + node(1).xyz());
+        TangentFrame frame(chord.lengthSq() > 0.0f ? chord.normalized() : Vec3f(0.0f, 0.0f, 1.0f));
+        axes[0] = frame.normal;
+        axes[1] = frame.tangent;
+        axes[2] = frame.bitangent;
+
+        boundsMin = Vec3f(std::numeric_limits<float>::infinity());
+        boundsMax = Vec3f(-std::numeric_limits<float>::infinity());
+        for (uint32 k = 0; k < count; ++k) {
+            Vec4f n0 = node(k), n1 = node(k + 1), n2 = node(k + 2);
+            Vec4f b[] = {(n0 + n1)*0.5f, n1, (n1 + n2)*0.5f};
+            for (const Vec4f &q : b) {
+                Vec3f local(axes[0].dot(q.xyz()), axes[1].dot(q.xyz()), axes[2].dot(q.xyz()));
+                boundsMin = min(boundsMin, local - q.w());
+                boundsMax = max(boundsMax, local + q.w());
+            }
+        }
+    }
+
+    bool intersectBounds(const Ray &ray) const
+    {
+        float tEnter = ray.nearT(), tExit = ray.farT();
+        for (int i = 0; i < 3; ++i) {
+            float o = axes[i].dot(ray.pos());
+            float d = axes[i].dot(ray.dir());
+            if (std::abs(d) < 1e-20f)
+                d = 1e-20f;
+            float invD = 1.0f/d;
+            float t0 = (boundsMin[i] - o)*invD;
+            float t1 = (boundsMax[i] - o)*invD;
+            tEnter = max(tEnter, min(t0, t1));
+            tExit  = min(tExit,  max(t0, t1));
+        }
+        return tEnter <= tExit;
+    }
+
+    // Returns a bit mask of the segments whose bounds, aligned with the
+    // ray frame (o, lx, ly, lz), contain the ray. lz is the ray direction
+    uint32 overlapMask(const Vec3f &o, const Vec3f &lx, const Vec3f &ly, const Vec3f &lz,
+            float tMin, float tMax) const
+    {
+        Float ox(lx.dot(o)), oy(ly.dot(o)), oz(lz.dot(o));
+        auto project = [](const Vec3f &l, const Vec<Float, 4> &p, const Float &offset) {
+            return Float(l.x())*p.x() + Float(l.y())*p.y() + Float(l.z())*p.z() - offset;
+        };
+
+        Vec<Float, 4> n0 = lanes(0), n1 = lanes(1), n2 = lanes(2);
+        // Bezier control points of the segments
+        Vec<Float, 4> p0 = (n0 + n1)*Float(0.5f), p1 = n1, p2 = (n1 + n2)*Float(0.5f);
+
+        Float x0 = project(lx, p0, ox), x1 = project(lx, p1, ox), x2 = project(lx, p2, ox);
+        Float y0 = project(ly, p0, oy), y1 = project(ly, p1, oy), y2 = project(ly, p2, oy);
+        Float z0 = project(lz, p0, oz), z1 = project(lz, p1, oz), z2 = project(lz, p2, oz);
+        Float w = max(p0.w(), max(p1.w(), p2.w()));
+
+        Bool overlap =
+               (min(x0, min(x1, x2)) <= w) && (max(x0, max(x1, x2)) >= -w)
+            && (min(y0, min(y1, y2)) <= w) && (max(y0, max(y1, y2)) >= -w)
+            && (max(z0, max(z1, z2)) + w >= Float(tMin))
+            && (min(z0, min(z1, z2)) - w <= Float(tMax));
+
+        return overlap.mask() & ((1u << count) - 1u);
+    }
+};
+
+}
+
+#endif /* CURVEBLOCK_HPP_ */
@@ -1,11 +1,13 @@
 #include "Curves.hpp"
 #include "TriangleMesh.hpp"
+#include "EmbreeUtil.hpp"
 
 #include "sampling/UniformSampler.hpp"
 
 #include "bsdfs/HairBcsdf.hpp"
 
 #include "math/TangentFrame.hpp"
+#include "math/BitManip.hpp"
 #include "math/MathUtil.hpp"
 #include "math/BSpline.hpp"
 #include "math/Vec.hpp"
@@ -26,7 +28,8 @@ DEFINE_STRINGABLE_ENUM(Curves::CurveMode, "curve mode", ({
 
 struct CurveIntersection
 {
-    uint32 curveP0;
+    uint32 blockId;
+    uint32 lane;
     float t;
     Vec2f uv;
     float w;
@@ -235,13 +238,29 @@ static Box3f curveBox(const Vec4f &q0, const Vec4f &q1, const Vec4f &q2)
     );
 }
 
+// Bounds of the part of the curve segment inside the region, using the
+// convex hull of its Bezier control points
+static Box3f clipCurve(const Vec4f &q0, const Vec4f &q1, const Vec4f &q2, const Box3f &region)
+{
+    float maxW = max(q0.w(), q1.w(), q2.w());
+    Vec3f hull[] = {(q0.xyz() + q1.xyz())*0.5f, q1.xyz(), (q1.xyz() + q2.xyz())*0.5f};
+
+    Box3f result = Bvh::SpatialSplitter::clipPolygonBounds(hull, 3, Box3f(region.min() - maxW, region.max() + maxW));
+    if (Bvh::SpatialSplitter::isValid(result))
+        result = Box3f(result.min() - maxW, result.max() + maxW);
+    return result;
+}
+
 Curves::Curves()
 : _mode("half_cylinder"),
+  _bvhLayout("binary"),
+  _splitBudget(0.0f),
   _curveThickness(0.01f),
   _subsample(0.0f),
   _overrideThickness(false),
   _taperThickness(false),
-  _bsdf(std::make_shared<HairBcsdf>())
+  _bsdf(std::make_shared<HairBcsdf>()),
+  _blockCount(0)
 {
 }
 
@@ -249,6 +268,8 @@ Curves::Curves(const Curves &o)
 : Primitive(o)
 {
     _mode              = o._mode;
+    _bvhLayout         = o._bvhLayout;
+    _splitBudget       = o._splitBudget;
     _curveThickness    = o._curveThickness;
     _taperThickness    = o._taperThickness;
     _overrideThickness = o._overrideThickness;
@@ -262,12 +283,15 @@ Curves::Curves(const Curves &o)
     _bsdf              = o._bsdf;
     _proxy             = o._proxy;
     _bounds            = o._bounds;
+    _blockCount        = 0;
 }
 
 Curves::Curves(std::vector<uint32> curveEnds, std::vector<Vec4f> nodeData, std::shared_ptr<Bsdf> bsdf, std::string name)
 : Primitive(name),
   _path(std::make_shared<Path>(name.append(".fiber"))),
   _mode("half_cylinder"),
+  _bvhLayout("binary"),
+  _splitBudget(0.0f),
   _curveThickness(0.01f),
   _overrideThickness(false),
   _taperThickness(false),
@@ -275,7 +299,8 @@ Curves::Curves(std::vector<uint32> curveEnds, std::vector<Vec4f> nodeData, std::
   _nodeCount(nodeData.size()),
   _curveEnds(std::move(curveEnds)),
   _nodeData(std::move(nodeData)),
-  _bsdf(std::move(bsdf))
+  _bsdf(std::move(bsdf)),
+  _blockCount(0)
 {
 }
 
@@ -285,7 +310,8 @@ void Curves::loadCurves()
     data.curveEnds = &_curveEnds;
     data.nodeData  = &_nodeData;
     data.nodeColor = &_nodeColor;
-    data.nodeNormal = &_nodeNormals;
+    // Normals are only needed to orient ribbons
+    data.nodeNormal = _mode == MODE_RIBBON ? &_nodeNormals : nullptr;
 
     if (_path && !CurveIO::load(*_path, data))
         DBG("Unable to load curves at %s", *_path);
@@ -306,11 +332,39 @@ void Curves::loadCurves()
     }
 }
 
+bool Curves::canReleaseNodes() const
+{
+    // Interactive edits refit from the full precision nodes
+    return !EmbreeUtil::dynamicScenes() && _path && FileUtils::exists(*_path);
+}
+
+void Curves::releaseNodes()
+{
+    std::vector<uint32>().swap(_curveEnds);
+    std::vector<Vec4f>().swap(_nodeData);
+    std::vector<Vec4f>().swap(_tfNodeData);
+    std::vector<Vec3f>().swap(_nodeColor);
+}
+
+void Curves::buildBlocks()
+{
+    for (uint32 i = 0; i < _blockCount; ++i)
+        _blocks[i].set(_tfNodeData.data(), _blocks[i].firstSegment, _blocks[i].count);
+}
+
 void Curves::computeBounds()
 {
     _bounds = Box3f();
-    for (size_t i = 2; i < _nodeData.size(); ++i)
-        _bounds.grow(curveBox(_nodeData[i - 2], _nodeData[i - 1], _nodeData[i]));
+    for (uint32 i = 0; i < _blockCount; ++i)
+        _bounds.grow(blockBounds(_blocks[i]));
+}
+
+Box3f Curves::blockBounds(const CurveBlock &block) const
+{
+    Box3f result;
+    for (uint32 k = 0; k < block.count; ++k)
+        result.grow(curveBox(block.node(k), block.node(k + 1), block.node(k + 2)));
+    return result;
 }
 
 void Curves::buildProxy()
@@ -343,15 +397,17 @@ void Curves::buildProxy()
             const Vec4f &p0 = _nodeData[t - 2];
             const Vec4f &p1 = _nodeData[t - 1];
             const Vec4f &p2 = _nodeData[t - 0];
-            const Vec3f &n0 = _nodeNormals[t - 2];
-            const Vec3f &n1 = _nodeNormals[t - 1];
-            const Vec3f &n2 = _nodeNormals[t - 0];
 
             for (int j = 0; j <= samples; ++j) {
                 float curveT = j*(1.0f/samples);
                 Vec3f tangent = BSpline::quadraticDeriv(p0.xyz(), p1.xyz(), p2.xyz(), curveT).normalized();
-                Vec3f normal = BSpline::quadratic(n0, n1, n2, curveT);
-                Vec3f binormal = tangent.cross(normal).normalized();
+                Vec3f binormal;
+                if (_nodeNormals.empty()) {
+                    binormal = TangentFrame(tangent).tangent;
+                } else {
+                    Vec3f normal = BSpline::quadratic(_nodeNormals[t - 2], _nodeNormals[t - 1], _nodeNormals[t], curveT);
+                    binormal = tangent.cross(normal).normalized();
+                }
                 Vec4f p = BSpline::quadratic(p0, p1, p2, curveT);
                 Vec3f v0 = -p.w()*binormal + p.xyz();
                 Vec3f v1 =  p.w()*binormal + p.xyz();
@@ -376,6 +432,8 @@ void Curves::fromJson(JsonPtr value, const Scene &scene)
     if (auto path = value["file"]) _path = scene.fetchResource(path);
     if (auto bsdf = value["bsdf"]) _bsdf = scene.fetchBsdf(bsdf);
     _mode = value["mode"];
+    _bvhLayout = value["bvh_layout"];
+    value.getField("spatial_split_budget", _splitBudget);
     value.getField("curve_taper", _taperThickness);
     value.getField("subsample", _subsample);
     _overrideThickness = value.getField("curve_thickness", _curveThickness);
@@ -388,6 +446,8 @@ rapidjson::Value Curves::toJson(Allocator &allocator) const
         "curve_taper", _taperThickness,
         "subsample", _subsample,
         "mode", _mode.toString(),
+        "bvh_layout", _bvhLayout.toString(),
+        "spatial_split_budget", _splitBudget,
         "bsdf", *_bsdf
     };
     if (_path)
@@ -444,22 +504,34 @@ bool Curves::intersectTemplate(Ray &ray, IntersectionTemporary &data) const
     bool didIntersect = false;
     CurveIntersection &isect = *data.as<CurveIntersection>();
 
-    _bvh->trace(ray, [&](Ray &ray, uint32 id, float /*tMin*/, const Vec3pf &/*bounds*/) {
-        Vec4f q0(project(o, lx, ly, lz, _nodeData[id - 2]));
-        Vec4f q1(project(o, lx, ly, lz, _nodeData[id - 1]));
-        Vec4f q2(project(o, lx, ly, lz, _nodeData[id - 0]));
+    _bvh->trace(ray, [&](Ray &ray, uint32 blockId, float /*tMin*/, const Vec3pf &/*bounds*/) {
+        const CurveBlock &block = _blocks[blockId];
+        if (!block.intersectBounds(ray))
+            return;
 
-        Vec3f n0, n1, n2;
-        if (isRibbon) {
-            n0 = project(lx, ly, lz, _nodeNormals[id - 2]);
-            n1 = project(lx, ly, lz, _nodeNormals[id - 1]);
-            n2 = project(lx, ly, lz, _nodeNormals[id - 0]);
-        }
+        uint32 candidates = block.overlapMask(o, lx, ly, lz, ray.nearT(), ray.farT());
+        while (candidates) {
+            uint32 lane = BitManip::lsb(candidates);
+            candidates &= candidates - 1;
+            uint32 id = block.firstSegment + lane;
+
+            Vec4f q0(project(o, lx, ly, lz, block.node(lane + 0)));
+            Vec4f q1(project(o, lx, ly, lz, block.node(lane + 1)));
+            Vec4f q2(project(o, lx, ly, lz, block.node(lane + 2)));
+
+            Vec3f n0, n1, n2;
+            if (isRibbon) {
+                n0 = project(lx, ly, lz, _nodeNormals[id - 2]);
+                n1 = project(lx, ly, lz, _nodeNormals[id - 1]);
+                n2 = project(lx, ly, lz, _nodeNormals[id - 0]);
+            }
 
-        if (pointOnSpline<isRibbon>(q0, q1, q2, ray.nearT(), ray.farT(), isect, n0, n1, n2)) {
-            ray.setFarT(isect.t);
-            isect.curveP0 = id - 2;
-            didIntersect = true;
+            if (pointOnSpline<isRibbon>(q0, q1, q2, ray.nearT(), ray.farT(), isect, n0, n1, n2)) {
+                ray.setFarT(isect.t);
+                isect.blockId = blockId;
+                isect.lane = lane;
+                didIntersect = true;
+            }
         }
     });
 
@@ -485,19 +557,23 @@ void Curves::intersectionInfo(const IntersectionTemporary &data, IntersectionInf
 {
     const CurveIntersection &isect = *data.as<CurveIntersection>();
 
-    uint32 p0 = isect.curveP0;
+    const CurveBlock &block = _blocks[isect.blockId];
+    Vec3f q0 = block.node(isect.lane + 0).xyz();
+    Vec3f q1 = block.node(isect.lane + 1).xyz();
+    Vec3f q2 = block.node(isect.lane + 2).xyz();
     float t = isect.uv.x();
 
-    Vec3f tangent = BSpline::quadraticDeriv(_nodeData[p0].xyz(), _nodeData[p0 + 1].xyz(), _nodeData[p0 + 2].xyz(), t);
+    Vec3f tangent = BSpline::quadraticDeriv(q0, q1, q2, t);
     tangent.normalize();
 
     if (_mode == MODE_RIBBON) {
+        uint32 p0 = block.firstSegment + isect.lane - 2;
         Vec3f normal = BSpline::quadratic(_nodeNormals[p0], _nodeNormals[p0 + 1], _nodeNormals[p0 + 2], t);
         info.Ng = info.Ns = (tangent*tangent.dot(normal) - normal).normalized();
     } else if (_mode == MODE_BCSDF_CYLINDER) {
         info.Ng = info.Ns = (-info.w - tangent*tangent.dot(-info.w)).normalized();
     } else if (_mode == MODE_HALF_CYLINDER || _mode == MODE_CYLINDER) {
-        Vec3f point = BSpline::quadratic(_nodeData[p0].xyz(), _nodeData[p0 + 1].xyz(), _nodeData[p0 + 2].xyz(), t);
+        Vec3f point = BSpline::quadratic(q0, q1, q2, t);
 
         Vec3f localP = info.p - point;
         localP -= tangent*(localP.dot(tangent));
@@ -519,9 +595,10 @@ bool Curves::tangentSpace(const IntersectionTemporary &data, const IntersectionI
 {
     const CurveIntersection &isect = *data.as<CurveIntersection>();
 
-    uint32 p0 = isect.curveP0;
+    const CurveBlock &block = _blocks[isect.blockId];
+    uint32 k = isect.lane;
     float t = isect.uv.x();
-    Vec3f tangent = BSpline::quadraticDeriv(_nodeData[p0].xyz(), _nodeData[p0 + 1].xyz(), _nodeData[p0 + 2].xyz(), t);
+    Vec3f tangent = BSpline::quadraticDeriv(block.node(k).xyz(), block.node(k + 1).xyz(), block.node(k + 2).xyz(), t);
 
     B = tangent.normalized();
     T = B.cross(info.Ng);
@@ -569,20 +646,33 @@ const TriangleMesh &Curves::asTriangleMesh()
     return *_proxy;
 }
 
-void Curves::prepareForRender()
+void Curves::transformNodes()
 {
-    Bvh::PrimVector prims;
-    prims.reserve(_nodeCount - 2*_curveCount);
+    // Nodes that are released after the build anyway are transformed in
+    // place, which avoids holding two copies of large hair files
+    if (canReleaseNodes())
+        _tfNodeData = std::move(_nodeData);
+    else
+        _tfNodeData = _nodeData;
 
     float widthScale = _transform.extractScaleVec().avg();
-
-    for (Vec4f &data : _nodeData) {
+    for (Vec4f &data : _tfNodeData) {
         Vec3f newP = _transform*data.xyz();
         data.x() = newP.x();
         data.y() = newP.y();
         data.z() = newP.z();
         data.w() *= widthScale;
     }
+}
+
+void Curves::prepareForRender()
+{
+    transformNodes();
+
+    // Segments are grouped into blocks of consecutive segments of the same
+    // curve, which are spatially coherent
+    std::vector<std::pair<uint32, uint32>> blockRanges;
+    blockRanges.reserve((_nodeCount - 2*_curveCount)/CurveBlock::Width + _curveCount);
 
     UniformSampler rand;
     for (uint32 i = 0; i < _curveCount; ++i) {
@@ -593,33 +683,87 @@ void Curves::prepareForRender()
         if (_subsample > 0.0f && rand.next1D() < _subsample)
             continue;
 
-        for (uint32 t = start + 2; t < _curveEnds[i]; ++t) {
-            const Vec4f &p0 = _nodeData[t - 2];
-            const Vec4f &p1 = _nodeData[t - 1];
-            const Vec4f &p2 = _nodeData[t - 0];
+        for (uint32 t = start + 2; t < _curveEnds[i]; t += CurveBlock::Width)
+            blockRanges.emplace_back(t, min(_curveEnds[i] - t, uint32(CurveBlock::Width)));
+    }
 
-            prims.emplace_back(
-                curveBox(p0, p1, p2),
-                (p0.xyz() + p1.xyz() + p2.xyz())*(1.0f/3.0f),
-                t
-            );
-        }
+    _blockCount = blockRanges.size();
+    _blocks = alignedAlloc<CurveBlock>(_blockCount, 16);
+
+    Bvh::PrimVector prims;
+    prims.reserve(_blockCount);
+    for (uint32 i = 0; i < _blockCount; ++i) {
+        _blocks[i].set(_tfNodeData.data(), blockRanges[i].first, blockRanges[i].second);
+
+        // Bounds are computed from the quantized nodes, which is what the
+        // intersection sees
+        Box3f box = blockBounds(_blocks[i]);
+        prims.emplace_back(box, box.center(), i);
     }
 
-    _bvh.reset(new Bvh::BinaryBvh(std::move(prims), 2));
+    Bvh::CacheKey key("curve_blocks");
+    key.add(prims).add(_bvhLayout.toString()).add(_splitBudget).add(uint32(CurveBlock::Width));
+    // Spatial splits clip against the control points, not just the boxes
+    if (_splitBudget > 0.0f)
+        key.add(_tfNodeData);
+
+    _bvh = Bvh::BvhCache::fetch<Bvh::SwitchableBvh>(key, _blockCount, [&]() {
+        Bvh::ClipFunction clip = [&](uint32 blockId, const Box3f &region) {
+            const CurveBlock &block = _blocks[blockId];
+            Box3f result;
+            for (uint32 k = 0; k < block.count; ++k) {
+                Box3f clipped = clipCurve(block.node(k), block.node(k + 1), block.node(k + 2), region);
+                if (Bvh::SpatialSplitter::isValid(clipped))
+                    result.grow(clipped);
+            }
+            return result;
+        };
+        Bvh::SwitchableBvh *bvh = new Bvh::SwitchableBvh(std::move(prims), 2, _bvhLayout, false, _splitBudget, clip);
+        DBG("Curve BVH: %s", bvh->buildStats().toString());
+        return bvh;
+    });
 
     //_needsRayTransform = true;
 
     computeBounds();
 
+    // Only the quantized blocks are needed from here on, so the full
+    // precision nodes are dropped for the duration of the render. They are
+    // reloaded in teardownAfterRender
+    if (canReleaseNodes())
+        releaseNodes();
+
     Primitive::prepareForRender();
 }
 
+void Curves::updateTransform()
+{
+    // The blocks are rebuilt from the untransformed nodes, so that repeated
+    // edits do not accumulate round-off. Refitting loses the tighter boxes
+    // of spatial splits, but keeps the tree valid
+    // The nodes may have been released in prepareForRender
+    if (_nodeData.empty())
+        loadCurves();
+    transformNodes();
+    buildBlocks();
+    computeBounds();
+    if (canReleaseNodes())
+        releaseNodes();
+
+    _bvh->refit([&](uint32 blockId) {
+        return blockBounds(_blocks[blockId]);
+    });
+}
+
 void Curves::teardownAfterRender()
 {
     _bvh.reset();
-    // TODO
-    loadCurves();
+    _blocks.reset();
+    _blockCount = 0;
+    std::vector<Vec4f>().swap(_tfNodeData);
+    // The untransformed nodes are only gone if they were released
+    if (_nodeData.empty())
+        loadCurves();
 
     Primitive::teardownAfterRender();
 }
@@ -1,13 +1,15 @@
 #ifndef CURVES_HPP_
 #define CURVES_HPP_
 
+#include "CurveBlock.hpp"
 #include "Primitive.hpp"
 
-#include "bvh/BinaryBvh.hpp"
+#include "bvh/SwitchableBvh.hpp"
 
 #include "io/Path.hpp"
 
 #include "StringableEnum.hpp"
+#include "Memory.hpp"
 
 #include <memory>
 #include <vector>
@@ -31,6 +33,8 @@ class Curves : public Primitive
 
     PathPtr _path;
     CurveMode _mode;
+    Bvh::SwitchableBvh::Layout _bvhLayout;
+    float _splitBudget;
     float _curveThickness;
     float _subsample;
     bool _overrideThickness;
@@ -41,6 +45,9 @@ class Curves : public Primitive
 
     std::vector<uint32> _curveEnds;
     std::vector<Vec4f> _nodeData;
+    // World space copy of _nodeData that the blocks are built from. Only
+    // kept for the duration of the render
+    std::vector<Vec4f> _tfNodeData;
     std::vector<Vec3f> _nodeColor;
     std::vector<Vec3f> _nodeNormals;
 
@@ -49,10 +56,20 @@ class Curves : public Primitive
 
     Box3f _bounds;
 
-    std::unique_ptr<Bvh::BinaryBvh> _bvh;
+    // Leaves of the BVH. The BVH is built over blocks rather than single
+    // segments (see CurveBlock)
+    aligned_unique_ptr<CurveBlock> _blocks;
+    uint32 _blockCount;
+
+    std::unique_ptr<Bvh::SwitchableBvh> _bvh;
 
     void loadCurves();
+    bool canReleaseNodes() const;
+    void releaseNodes();
+    void buildBlocks();
     void computeBounds();
+    Box3f blockBounds(const CurveBlock &block) const;
+    void transformNodes();
     void buildProxy();
 
     template<bool isRibbon>
@@ -94,6 +111,7 @@ public:
 
     virtual void prepareForRender() override;
     virtual void teardownAfterRender() override;
+    virtual void updateTransform() override;
 
     virtual int numBsdfs() const override;
     virtual std::shared_ptr<Bsdf> &bsdf(int index) override;
@@ -295,6 +295,16 @@ float Disk::approximateRadiance(uint32 /*threadIndex*/, const Vec3f &p) const
     return (TWO_PI - std::abs(Q))*_emission->average().max();
 }
 
+bool Disk::emissionCone(Vec3f &axis, float &theta, float &intensity) const
+{
+    if (!isEmissive())
+        return false;
+    axis = _n;
+    theta = 0.0f;
+    intensity = _emission->average().max()*_area;
+    return true;
+}
+
 Box3f Disk::bounds() const
 {
     Box3f result;
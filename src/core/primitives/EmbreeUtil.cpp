@@ -5,6 +5,7 @@ namespace Tungsten {
 namespace EmbreeUtil {
 
 static RTCDevice globalDevice = nullptr;
+static bool useDynamicScenes = false;
 
 void initDevice()
 {
@@ -16,6 +17,26 @@ RTCDevice getDevice()
     return globalDevice;
 }
 
+void setDynamicScenes(bool dynamic)
+{
+    useDynamicScenes = dynamic;
+}
+
+bool dynamicScenes()
+{
+    return useDynamicScenes;
+}
+
+RTCSceneFlags sceneFlags()
+{
+    return useDynamicScenes ? RTC_SCENE_DYNAMIC | RTC_SCENE_INCOHERENT : RTC_SCENE_STATIC | RTC_SCENE_INCOHERENT;
+}
+
+RTCGeometryFlags geometryFlags()
+{
+    return useDynamicScenes ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC;
+}
+
 }
 
 }
@@ -15,6 +15,15 @@ namespace EmbreeUtil {
 void initDevice();
 RTCDevice getDevice();
 
+// With dynamic scenes enabled, scenes and meshes are created such that they
+// can be updated in place after they were committed (see
+// TraceableScene::update). This trades some build quality for fast refits
+// and is meant for interactive use
+void setDynamicScenes(bool dynamic);
+bool dynamicScenes();
+RTCSceneFlags sceneFlags();
+RTCGeometryFlags geometryFlags();
+
 inline RTCBounds convert(const Box3f &b)
 {
     return RTCBounds{
@@ -49,6 +58,7 @@ inline RTCRay convert(const Ray &r)
     ray.tfar  = r.farT();
     ray.geomID = RTC_INVALID_GEOMETRY_ID;
     ray.primID = RTC_INVALID_GEOMETRY_ID;
+    ray.instID = RTC_INVALID_GEOMETRY_ID;
     return ray;
 }
 
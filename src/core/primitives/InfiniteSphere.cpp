@@ -116,7 +116,7 @@ bool InfiniteSphere::isSamplable() const
 
 void InfiniteSphere::makeSamplable(const TraceableScene &scene, uint32 /*threadIndex*/)
 {
-    _emission->makeSamplable(MAP_SPHERICAL);
+    _emission->makeSamplable(MAP_SPHERICAL, scene.integrator().invertsPaths());
     _sceneBounds = scene.bounds();
     _sceneBounds.grow(1e-2f);
 }
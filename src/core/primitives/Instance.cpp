@@ -1,5 +1,6 @@
 #include "Instance.hpp"
 #include "TriangleMesh.hpp"
+#include "EmbreeUtil.hpp"
 
 #include "sampling/PathSampleGenerator.hpp"
 #include "sampling/SampleWarp.hpp"
@@ -47,6 +48,16 @@ void Instance::buildProxy()
     _proxy = std::make_shared<TriangleMesh>(std::move(verts), std::move(tris), std::make_shared<NullBsdf>(), "Instances", false, false);
 }
 
+bool Instance::hasNativeMasters() const
+{
+    for (const auto &m : _master) {
+        const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(m.get());
+        if (!mesh || typeid(*mesh) != typeid(TriangleMesh) || !mesh->hasEmbreeGeometry())
+            return false;
+    }
+    return !_master.empty();
+}
+
 const Primitive &Instance::getMaster(const IntersectionTemporary &data) const
 {
     return *_master[_instanceId[data.flags]];
@@ -90,6 +101,7 @@ void Instance::fromJson(JsonPtr value, const Scene &scene)
     if (auto instanceB = value["instancesB"]) _instanceFileB = scene.fetchResource(instanceB);
 
     value.getField("ratio", _ratio);
+    _bvhLayout = value["bvh_layout"];
 }
 
 rapidjson::Value Instance::toJson(Allocator &allocator) const
@@ -102,7 +114,8 @@ rapidjson::Value Instance::toJson(Allocator &allocator) const
     JsonObject result{Primitive::toJson(allocator), allocator,
         "type", "instances",
         "masters", std::move(masters),
-        "ratio", _ratio
+        "ratio", _ratio,
+        "bvh_layout", _bvhLayout.toString()
     };
 
     if (_instanceFileB) {
@@ -258,11 +271,14 @@ bool saveInstances(const Path &path, uint32 instanceCount, const Vec3f *instance
 
 Instance::Instance()
 : _ratio(0),
-  _instanceCount(0)
+  _bvhLayout("binary"),
+  _instanceCount(0),
+  _nativeMasters(false),
+  _scene(nullptr)
 {
 }
 
-void Instance::loadResources()
+void Instance::loadInstanceData()
 {
     Box3f bounds;
     if (_instanceFileA)
@@ -281,19 +297,98 @@ void Instance::loadResources()
     }
 }
 
+void Instance::loadResources()
+{
+    for (auto &m : _master)
+        m->loadResources();
+
+    loadInstanceData();
+}
+
 void Instance::saveResources()
 {
     if (_instanceFileA && !_instanceFileB)
         saveInstances(*_instanceFileA, _instanceCount, _instancePos.get(), _instanceRot.get(), _instanceId.get(), false);
 }
 
+Mat4f Instance::instanceTransform(uint32 instance) const
+{
+    return Mat4f::translate(_tfInstancePos[instance])*_tfInstanceRot[instance].toMatrix();
+}
+
+unsigned Instance::addEmbreeInstances(RTCScene scene) const
+{
+    // Every master is built into one Embree scene that all of its placements
+    // share. Embree only supports a single level of instancing, so each
+    // placement still needs an instance geometry of its own, but that only
+    // holds the transform and a reference to the shared scene
+    std::vector<RTCScene> masterScenes;
+    masterScenes.reserve(_master.size());
+    for (const auto &m : _master)
+        masterScenes.push_back(static_cast<const TriangleMesh &>(*m).embreeScene());
+
+    unsigned firstId = RTC_INVALID_GEOMETRY_ID;
+    for (uint32 i = 0; i < _instanceCount; ++i) {
+        unsigned geomId = rtcNewInstance2(scene, masterScenes[_instanceId[i]]);
+        rtcSetTransform2(scene, geomId, RTC_MATRIX_ROW_MAJOR, instanceTransform(i).data());
+        if (i == 0)
+            firstId = geomId;
+    }
+    return firstId;
+}
+
+RTCScene Instance::embreeScene() const
+{
+    RTCScene scene = _scene.load(std::memory_order_acquire);
+    if (scene)
+        return scene;
+
+    std::unique_lock<std::mutex> lock(_sceneMutex);
+    scene = _scene.load(std::memory_order_relaxed);
+    if (!scene) {
+        scene = rtcDeviceNewScene(EmbreeUtil::getDevice(), EmbreeUtil::sceneFlags(), RTC_INTERSECT1);
+        addEmbreeInstances(scene);
+        rtcCommit(scene);
+        _scene.store(scene, std::memory_order_release);
+    }
+    return scene;
+}
+
+void Instance::updateEmbreeInstances(RTCScene scene, unsigned firstId) const
+{
+    for (uint32 i = 0; i < _instanceCount; ++i)
+        rtcSetTransform2(scene, firstId + i, RTC_MATRIX_ROW_MAJOR, instanceTransform(i).data());
+}
+
+void Instance::setIntersection(const Ray &ray, uint32 instance, uint32 primId, float u, float v,
+        IntersectionTemporary &data) const
+{
+    // Only the direction of the ray is needed to set up the mesh intersection
+    QuaternionF invRot = _tfInstanceRot[instance].conjugate();
+    const TriangleMesh &master = static_cast<const TriangleMesh &>(*_master[_instanceId[instance]]);
+    master.setIntersection(Ray(ray.pos(), invRot*ray.dir()), primId, u, v, data);
+
+    data.primitive = this;
+    data.flags = instance;
+}
+
 bool Instance::intersect(Ray &ray, IntersectionTemporary &data) const
 {
+    if (_nativeMasters) {
+        RTCRay eRay(EmbreeUtil::convert(ray));
+        rtcIntersect(embreeScene(), eRay);
+        if (eRay.geomID == RTC_INVALID_GEOMETRY_ID)
+            return false;
+        ray.setFarT(eRay.tfar);
+        setIntersection(ray, eRay.instID, eRay.primID, eRay.u, eRay.v, data);
+        return true;
+    }
+
     bool hit = false;
     uint32 prim;
     _bvh->trace(ray, [&](Ray &ray, uint32 id, float tMin, const Vec3pf &/*bounds*/) {
-        QuaternionF invRot = _instanceRot[id].conjugate();
-        Ray localRay = ray.scatter(invRot*(ray.pos() - _instancePos[id]), invRot*ray.dir(), tMin);
+        QuaternionF invRot = _tfInstanceRot[id].conjugate();
+        Ray localRay = ray.scatter(invRot*(ray.pos() - _tfInstancePos[id]), invRot*ray.dir(), tMin);
         bool hitI = _master[_instanceId[id]]->intersect(localRay, data);
         if (hitI) {
             hit = true;
@@ -312,11 +407,17 @@ bool Instance::intersect(Ray &ray, IntersectionTemporary &data) const
 
 bool Instance::occluded(const Ray &ray) const
 {
+    if (_nativeMasters) {
+        RTCRay eRay(EmbreeUtil::convert(ray));
+        rtcOccluded(embreeScene(), eRay);
+        return eRay.geomID != RTC_INVALID_GEOMETRY_ID;
+    }
+
     Ray tmpRay = ray;
     bool occluded = false;
     _bvh->trace(tmpRay, [&](Ray &ray, uint32 id, float tMin, const Vec3pf &/*bounds*/) {
-        QuaternionF invRot = _instanceRot[id].conjugate();
-        Ray localRay = ray.scatter(invRot*(ray.pos() - _instancePos[id]), invRot*ray.dir(), tMin);
+        QuaternionF invRot = _tfInstanceRot[id].conjugate();
+        Ray localRay = ray.scatter(invRot*(ray.pos() - _tfInstancePos[id]), invRot*ray.dir(), tMin);
         bool occludedI = _master[_instanceId[id]]->occluded(localRay);
         if (occludedI) {
             occluded = true;
@@ -336,10 +437,10 @@ void Instance::intersectionInfo(const IntersectionTemporary &data, IntersectionI
 {
     getMaster(data).intersectionInfo(data, info);
 
-    QuaternionF rot = _instanceRot[data.flags];
+    QuaternionF rot = _tfInstanceRot[data.flags];
     info.Ng = rot*info.Ng;
     info.Ns = rot*info.Ns;
-    info.p = _instancePos[data.flags] + rot*info.p;
+    info.p = _tfInstancePos[data.flags] + rot*info.p;
     info.primitive = this;
 }
 
@@ -389,25 +490,29 @@ const TriangleMesh &Instance::asTriangleMesh()
     return *_proxy;
 }
 
-void Instance::prepareForRender()
+void Instance::transformInstances()
 {
-    for (auto &m : _master)
-        m->prepareForRender();
-
-    Bvh::PrimVector prims;
-    prims.reserve(_instanceCount);
+    if (!_tfInstancePos) {
+        _tfInstancePos.reset(new Vec3f[_instanceCount]);
+        _tfInstanceRot.reset(new QuaternionF[_instanceCount]);
+    }
 
     auto rot = QuaternionF::fromMatrix(_transform.extractRotation());
     for (uint32 i = 0; i < _instanceCount; ++i) {
-        _instancePos[i] = _transform*_instancePos[i];
-        _instanceRot[i] = rot*_instanceRot[i];
+        _tfInstancePos[i] = _transform*_instancePos[i];
+        _tfInstanceRot[i] = rot*_instanceRot[i];
     }
+}
+
+Bvh::PrimVector Instance::computeInstanceBounds() const
+{
+    Bvh::PrimVector prims;
+    prims.reserve(_instanceCount);
 
     std::vector<Box3f> masterBounds;
     for (const auto &m : _master)
         masterBounds.emplace_back(m->bounds());
 
-    _bounds = Box3f();
     for (uint32 i = 0; i < _instanceCount; ++i) {
         Box3f bLocal = masterBounds[_instanceId[i]];
 
@@ -415,22 +520,82 @@ void Instance::prepareForRender()
         for (float x : {0, 1})
             for (float y : {0, 1})
                 for (float z : {0, 1})
-                    bGlobal.grow(_instancePos[i] + _instanceRot[i]*lerp(bLocal.min(), bLocal.max(), Vec3f(x, y, z)));
-
-        _bounds.grow(bGlobal);
+                    bGlobal.grow(_tfInstancePos[i] + _tfInstanceRot[i]*lerp(bLocal.min(), bLocal.max(), Vec3f(x, y, z)));
 
         prims.emplace_back(Bvh::Primitive(bGlobal, bGlobal.center(), i));
     }
 
-    _bvh.reset(new Bvh::BinaryBvh(std::move(prims), 2));
+    return prims;
+}
+
+void Instance::prepareForRender()
+{
+    for (auto &m : _master)
+        m->prepareForRender();
+
+    transformInstances();
+
+    Bvh::PrimVector prims = computeInstanceBounds();
+    _bounds = Box3f();
+    for (const Bvh::Primitive &prim : prims)
+        _bounds.grow(narrow(prim.box()));
+
+    _nativeMasters = hasNativeMasters();
+    if (!_nativeMasters) {
+        Bvh::CacheKey key("instances");
+        key.add(prims).add(_bvhLayout.toString());
+
+        _bvh = Bvh::BvhCache::fetch<Bvh::SwitchableBvh>(key, _instanceCount, [&]() {
+            Bvh::SwitchableBvh *bvh = new Bvh::SwitchableBvh(std::move(prims), 2, _bvhLayout);
+            DBG("Instance BVH: %s", bvh->buildStats().toString());
+            return bvh;
+        });
+    }
 
     Primitive::prepareForRender();
 }
 
+void Instance::updateTransform()
+{
+    if (_nativeMasters && !EmbreeUtil::dynamicScenes()) {
+        Primitive::updateTransform();
+        return;
+    }
+
+    // Placements are recomputed from the untransformed ones, so that repeated
+    // edits do not accumulate round-off
+    transformInstances();
+
+    Bvh::PrimVector prims = computeInstanceBounds();
+    _bounds = Box3f();
+    for (const Bvh::Primitive &prim : prims)
+        _bounds.grow(narrow(prim.box()));
+
+    if (_nativeMasters) {
+        // A fresh scene hands out geometry IDs starting from zero
+        RTCScene scene = _scene.load(std::memory_order_relaxed);
+        if (scene) {
+            updateEmbreeInstances(scene, 0);
+            rtcCommit(scene);
+        }
+    } else {
+        _bvh->refit([&](uint32 id) { return narrow(prims[id].box()); });
+    }
+}
+
 void Instance::teardownAfterRender()
 {
     _bvh.reset();
-    loadResources();
+    _nativeMasters = false;
+    RTCScene scene = _scene.load(std::memory_order_relaxed);
+    if (scene) {
+        rtcDeleteScene(scene);
+        _scene = nullptr;
+    }
+    for (auto &m : _master)
+        m->teardownAfterRender();
+    _tfInstancePos.reset();
+    _tfInstanceRot.reset();
 
     Primitive::teardownAfterRender();
 }
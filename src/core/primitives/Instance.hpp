@@ -5,7 +5,11 @@
 
 #include "math/Quaternion.hpp"
 
-#include "bvh/BinaryBvh.hpp"
+#include "bvh/SwitchableBvh.hpp"
+
+#include <embree2/rtcore.h>
+#include <atomic>
+#include <mutex>
 
 namespace Tungsten {
 
@@ -16,19 +20,37 @@ class Instance : public Primitive
     PathPtr _instanceFileA;
     PathPtr _instanceFileB;
     float _ratio;
+    Bvh::SwitchableBvh::Layout _bvhLayout;
 
     uint32 _instanceCount;
     std::unique_ptr<Vec3f[]> _instancePos;
     std::unique_ptr<QuaternionF[]> _instanceRot;
     std::unique_ptr<uint8[]> _instanceId;
 
+    // World space copies of the placements above, computed from them with
+    // the current transform. Only kept for the duration of the render
+    std::unique_ptr<Vec3f[]> _tfInstancePos;
+    std::unique_ptr<QuaternionF[]> _tfInstanceRot;
+
     Box3f _bounds;
 
     std::shared_ptr<TriangleMesh> _proxy;
 
-    std::unique_ptr<Bvh::BinaryBvh> _bvh;
+    std::unique_ptr<Bvh::SwitchableBvh> _bvh;
+    bool _nativeMasters;
+    // Scene of the Embree instances, for tracing them on their own. Native
+    // instances normally go straight into the scene BVH, so it is built on
+    // first use
+    mutable std::atomic<RTCScene> _scene;
+    mutable std::mutex _sceneMutex;
 
     void buildProxy();
+    void loadInstanceData();
+    bool hasNativeMasters() const;
+    void transformInstances();
+    Bvh::PrimVector computeInstanceBounds() const;
+    Mat4f instanceTransform(uint32 instance) const;
+    RTCScene embreeScene() const;
 
     const Primitive &getMaster(const IntersectionTemporary &data) const;
 
@@ -65,12 +87,30 @@ public:
 
     virtual void prepareForRender() override;
     virtual void teardownAfterRender() override;
+    virtual void updateTransform() override;
 
     virtual int numBsdfs() const override;
     virtual std::shared_ptr<Bsdf> &bsdf(int index) override;
     virtual void setBsdf(int index, std::shared_ptr<Bsdf> &bsdf) override;
 
     virtual Primitive *clone() override;
+
+    // If all masters are triangle meshes, instances are Embree instances of
+    // the mesh scenes instead of leaves of a BVH of our own. They can then
+    // also be added to another Embree scene, with consecutive geometry IDs
+    // starting at the returned ID
+    unsigned addEmbreeInstances(RTCScene scene) const;
+    // Moves instances previously added to scene by addEmbreeInstances to
+    // their current transforms. Only valid for dynamic scenes
+    void updateEmbreeInstances(RTCScene scene, unsigned firstId) const;
+    // Fills in the intersection temporary for a hit on an Embree instance
+    void setIntersection(const Ray &ray, uint32 instance, uint32 primId, float u, float v,
+            IntersectionTemporary &data) const;
+
+    bool hasEmbreeInstances() const
+    {
+        return _nativeMasters;
+    }
 };
 
 }
@@ -168,6 +168,14 @@ float Point::approximateRadiance(uint32 /*threadIndex*/, const Vec3f &p) const
     return INV_FOUR_PI*_power.max()/(_pos - p).lengthSq();
 }
 
+bool Point::emissionCone(Vec3f &axis, float &theta, float &intensity) const
+{
+    axis = Vec3f(0.0f, 1.0f, 0.0f);
+    theta = PI;
+    intensity = INV_FOUR_PI*_power.max();
+    return true;
+}
+
 Box3f Point::bounds() const
 {
     return Box3f(_pos);
@@ -122,6 +122,12 @@ void Primitive::teardownAfterRender()
         _emission.reset();
 }
 
+void Primitive::updateTransform()
+{
+    teardownAfterRender();
+    prepareForRender();
+}
+
 void Primitive::setupTangentFrame(const IntersectionTemporary &data,
         const IntersectionInfo &info, TangentFrame &dst) const
 {
@@ -86,6 +86,15 @@ public:
     virtual bool isInfinite() const = 0;
 
     virtual float approximateRadiance(uint32 threadIndex, const Vec3f &p) const = 0;
+    // Bounds the emission of the primitive for the light BVH (see LightBvh):
+    // All emitting normals lie within theta of axis, and intensity is the
+    // largest radiant intensity in any direction, so that intensity/d^2 is
+    // comparable to approximateRadiance. Lights that cannot provide this
+    // return false and are sampled separately
+    virtual bool emissionCone(Vec3f &/*axis*/, float &/*theta*/, float &/*intensity*/) const
+    {
+        return false;
+    }
 
     virtual Box3f bounds() const = 0;
 
@@ -93,6 +102,10 @@ public:
 
     virtual void prepareForRender();
     virtual void teardownAfterRender();
+    // Brings a prepared primitive up to date after its transform changed.
+    // By default the primitive is prepared again from scratch. Primitives
+    // with their own acceleration structures refit them instead
+    virtual void updateTransform();
 
     virtual int numBsdfs() const = 0;
     virtual std::shared_ptr<Bsdf> &bsdf(int index) = 0;
@@ -278,6 +278,16 @@ float Quad::approximateRadiance(uint32 /*threadIndex*/, const Vec3f &p) const
     return (TWO_PI - std::abs(Q))*_emission->average().max();
 }
 
+bool Quad::emissionCone(Vec3f &axis, float &theta, float &intensity) const
+{
+    if (!isEmissive())
+        return false;
+    axis = _frame.normal;
+    theta = 0.0f;
+    intensity = _emission->average().max()*_area;
+    return true;
+}
+
 Box3f Quad::bounds() const
 {
     Box3f result;
@@ -60,6 +60,7 @@ public:
     virtual bool isInfinite() const override;
 
     virtual float approximateRadiance(uint32 threadIndex, const Vec3f &p) const override;
+    virtual bool emissionCone(Vec3f &axis, float &theta, float &intensity) const override;
     virtual Box3f bounds() const override;
 
     virtual const TriangleMesh &asTriangleMesh() override;
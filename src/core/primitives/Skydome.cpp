@@ -7,17 +7,42 @@
 #include "bsdfs/NullBsdf.hpp"
 
 #include "math/Spectral.hpp"
+#include "math/BitManip.hpp"
 #include "math/Angle.hpp"
 
 #include "io/JsonObject.hpp"
+#include "io/FileUtils.hpp"
 #include "io/Scene.hpp"
 
+#include "thread/ThreadUtils.hpp"
+
+#include "Debug.hpp"
+
+#include <tinyformat/tinyformat.hpp>
 #include <skylight/ArHosekSkyModel.h>
 #include <iostream>
 #include <cstring>
 
 namespace Tungsten {
 
+static CONSTEXPR int SizeX = 512;
+static CONSTEXPR int SizeY = 256;
+static CONSTEXPR int NumSamples = 10;
+static CONSTEXPR float GroundAlbedo = 0.2f;
+
+// Bump this whenever the evaluation of the sky changes
+static CONSTEXPR uint32 SkyCacheVersion = 2;
+static CONSTEXPR uint32 SkyCacheMagic = 0x594B5354; // "TSKY"
+
+struct SkyCacheHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint64 key;
+};
+
+Path Skydome::_cacheDirectory;
+
 struct SkydomeIntersection
 {
     Vec3f p;
@@ -30,24 +55,26 @@ Skydome::Skydome()
   _gammaScale(1.0f),
   _turbidity(3.0f),
   _intensity(2.0f),
-  _doSample(true)
+  _doSample(true),
+  _sunAzimuth(0.0f)
 {
 }
 
 Vec2f Skydome::directionToUV(const Vec3f &wi) const
 {
-    return Vec2f(std::atan2(wi.z(), wi.x())*INV_TWO_PI + 0.5f, std::acos(-wi.y())*INV_PI);
+    float u = (std::atan2(wi.z(), wi.x()) - _sunAzimuth)*INV_TWO_PI + 0.5f;
+    return Vec2f(u - std::floor(u), std::acos(-wi.y())*INV_PI);
 }
 
 Vec2f Skydome::directionToUV(const Vec3f &wi, float &sinTheta) const
 {
     sinTheta = std::sqrt(max(1.0f - wi.y()*wi.y(), 0.0f));
-    return Vec2f(std::atan2(wi.z(), wi.x())*INV_TWO_PI + 0.5f, std::acos(-wi.y())*INV_PI);
+    return directionToUV(wi);
 }
 
 Vec3f Skydome::uvToDirection(Vec2f uv, float &sinTheta) const
 {
-    float phi   = (uv.x() - 0.5f)*TWO_PI;
+    float phi   = (uv.x() - 0.5f)*TWO_PI + _sunAzimuth;
     float theta = uv.y()*PI;
     sinTheta = std::sin(theta);
     return Vec3f(
@@ -134,7 +161,7 @@ bool Skydome::isSamplable() const
 
 void Skydome::makeSamplable(const TraceableScene &scene, uint32 /*threadIndex*/)
 {
-    _sky->makeSamplable(MAP_SPHERICAL);
+    _sky->makeSamplable(MAP_SPHERICAL, scene.integrator().invertsPaths());
     _sceneBounds = scene.bounds();
     _sceneBounds.grow(1e-2f);
 }
@@ -267,13 +294,9 @@ const TriangleMesh &Skydome::asTriangleMesh()
     return *_proxy;
 }
 
-static CONSTEXPR int SizeX = 512;
-static CONSTEXPR int SizeY = 256;
-static CONSTEXPR int NumSamples = 10;
-
 static void fillImage(ArHosekSkyModelState *state, float *lambdas, Vec3f *weights, Vec3f *img, Vec3f sun, float gammaScale)
 {
-    for (int y = 0; y < SizeY/2; ++y) {
+    ThreadUtils::parallelFor(0, SizeY/2, 4, [&](uint32 y) {
         float theta = (y + 0.5f)*PI/SizeY;
         for (int x = 0; x < SizeX; ++x) {
             float phi = (x + 0.5f)*TWO_PI/SizeX;
@@ -286,29 +309,96 @@ static void fillImage(ArHosekSkyModelState *state, float *lambdas, Vec3f *weight
 
             img[x + y*SizeX] += Spectral::xyzToRgb(xyz);
         }
+    });
+}
+
+// The tabulated sky only depends on the sun elevation and the model
+// parameters. The sun azimuth is applied at lookup, so that all times of day
+// with the same elevation share a cache entry
+uint64 Skydome::cacheKey(float sunElevation) const
+{
+    float params[] = {sunElevation, _intensity, _temperature, _turbidity, GroundAlbedo};
+    int32 settings[] = {SizeX, SizeY, NumSamples};
+    uint64 key = BitManip::hash(params, sizeof(params), BitManip::hash("skydome"));
+    return BitManip::hash(settings, sizeof(settings), key);
+}
+
+Path Skydome::cachePath(uint64 key)
+{
+    return _cacheDirectory/tfm::format("%016x.sky", key);
+}
+
+bool Skydome::loadCachedSky(uint64 key, Vec3f *img)
+{
+    Path path = cachePath(key);
+    if (!path.exists())
+        return false;
+    InputStreamHandle in = FileUtils::openInputStream(path);
+    if (!in)
+        return false;
+
+    SkyCacheHeader header;
+    FileUtils::streamRead(in, header);
+    if (!in->good() || header.magic != SkyCacheMagic || header.version != SkyCacheVersion || header.key != key)
+        return false;
+
+    FileUtils::streamRead(in, img, SizeX*SizeY);
+    if (!in->good()) {
+        DBG("Ignoring corrupt sky cache entry at %s", path);
+        return false;
     }
+    return true;
 }
 
-void Skydome::prepareForRender()
+void Skydome::saveCachedSky(uint64 key, const Vec3f *img)
 {
-    float lambdas[NumSamples];
-    Vec3f weights[NumSamples];
-    Spectral::spectralXyzWeights(NumSamples, lambdas, weights);
+    Path path = cachePath(key);
+    bool written = FileUtils::writeFileAtomically(path, [&](OutputStreamHandle &out) {
+        FileUtils::streamWrite(out, SkyCacheHeader{SkyCacheMagic, SkyCacheVersion, key});
+        FileUtils::streamWrite(out, img, SizeX*SizeY);
+    });
+    if (!written)
+        DBG("Unable to write sky cache entry at %s", path);
+}
 
-    Vec3f sun = _transform.transformVector(Vec3f(0.0f, 1.0f, 0.0f));
+void Skydome::setCacheDirectory(const Path &directory)
+{
+    _cacheDirectory = directory.empty() ? Path() : directory.absolute();
+    if (!_cacheDirectory.empty() && !FileUtils::createDirectory(_cacheDirectory))
+        DBG("Unable to create sky cache directory at %s", _cacheDirectory);
+}
 
+void Skydome::prepareForRender()
+{
+    Vec3f sun = sunDirection();
     float sunElevation = std::asin(clamp(sun.y(), -1.0f, 1.0f));
-
-    ArHosekSkyModelState *sunState = arhosekskymodelstate_alienworld_alloc_init(sunElevation, _intensity,
-            _temperature, _turbidity, 0.2f);
+    _sunAzimuth = std::atan2(sun.z(), sun.x());
+    // The same sun, rotated about the zenith to azimuth 0
+    Vec3f localSun(std::cos(sunElevation), std::sin(sunElevation), 0.0f);
 
     std::unique_ptr<Vec3f[]> img(new Vec3f[SizeX*SizeY]);
-    std::memset(img.get(), 0, SizeX*SizeY*sizeof(img[0]));
 
-    fillImage(sunState, lambdas, weights, img.get(), sun, 1.0f);
+    uint64 key = cacheKey(sunElevation);
+    bool useCache = !_cacheDirectory.empty();
+    if (!useCache || !loadCachedSky(key, img.get())) {
+        float lambdas[NumSamples];
+        Vec3f weights[NumSamples];
+        Spectral::spectralXyzWeights(NumSamples, lambdas, weights);
 
-    for (int y = SizeY/2; y < min(SizeY/2 + 2, SizeY); ++y)
-        std::memcpy(img.get() + y*SizeX, img.get() + (SizeY/2 - 1)*SizeX, SizeX*sizeof(img[0]));
+        ArHosekSkyModelState *sunState = arhosekskymodelstate_alienworld_alloc_init(sunElevation, _intensity,
+                _temperature, _turbidity, GroundAlbedo);
+
+        std::memset(img.get(), 0, SizeX*SizeY*sizeof(img[0]));
+
+        fillImage(sunState, lambdas, weights, img.get(), localSun, 1.0f);
+        arhosekskymodelstate_free(sunState);
+
+        for (int y = SizeY/2; y < min(SizeY/2 + 2, SizeY); ++y)
+            std::memcpy(img.get() + y*SizeX, img.get() + (SizeY/2 - 1)*SizeX, SizeX*sizeof(img[0]));
+
+        if (useCache)
+            saveCachedSky(key, img.get());
+    }
 
     _sky = std::make_shared<BitmapTexture>(img.release(), SizeX, SizeY, BitmapTexture::TexelType::RGB_HDR, true, false);
     _emission = _sky;
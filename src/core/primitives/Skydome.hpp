@@ -11,6 +11,8 @@ class Scene;
 
 class Skydome : public Primitive
 {
+    static Path _cacheDirectory;
+
     const Scene *_scene;
 
     std::shared_ptr<BitmapTexture> _sky;
@@ -20,6 +22,11 @@ class Skydome : public Primitive
     float _intensity;
     bool _doSample;
 
+    // The sky is tabulated with the sun at azimuth 0, which makes it
+    // independent of the sun azimuth. Lookups rotate about the zenith by
+    // this angle instead
+    float _sunAzimuth;
+
     std::shared_ptr<TriangleMesh> _proxy;
 
     Box3f _sceneBounds;
@@ -29,12 +36,22 @@ class Skydome : public Primitive
     Vec3f uvToDirection(Vec2f uv, float &sinTheta) const;
     void buildProxy();
 
+    uint64 cacheKey(float sunElevation) const;
+    static Path cachePath(uint64 key);
+    static bool loadCachedSky(uint64 key, Vec3f *img);
+    static void saveCachedSky(uint64 key, const Vec3f *img);
+
 protected:
     virtual float powerToRadianceFactor() const override;
 
 public:
     Skydome();
 
+    // Optional directory in which the evaluated sky radiance is stored, so
+    // that renders and frames with the same sky parameters skip evaluating
+    // the sky model. Disabled if empty
+    static void setCacheDirectory(const Path &directory);
+
     void setScene(const Scene *scene)
     {
         _scene = scene;
@@ -270,6 +270,16 @@ float Sphere::approximateRadiance(uint32 /*threadIndex*/, const Vec3f &p) const
     return solidAngle(p)*_emission->average().max();
 }
 
+bool Sphere::emissionCone(Vec3f &axis, float &theta, float &intensity) const
+{
+    if (!isEmissive())
+        return false;
+    axis = Vec3f(0.0f, 1.0f, 0.0f);
+    theta = PI;
+    intensity = _emission->average().max()*PI*_radius*_radius;
+    return true;
+}
+
 Box3f Sphere::bounds() const
 {
     return Box3f(_pos - _radius, _pos + _radius);
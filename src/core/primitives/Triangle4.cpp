@@ -0,0 +1,25 @@
+#include "Triangle4.hpp"
+
+#include "sse/SimdDispatch.hpp"
+
+namespace Tungsten {
+
+void intersectTriangle4SpanSse(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId)
+{
+    for (int i = 0; i < count; ++i)
+        intersectTriangle4(ray, t[i], resultU, resultV, resultId);
+}
+
+Triangle4SpanKernel triangle4SpanKernel()
+{
+#ifdef WIDE_SIMD_KERNELS
+    if (SimdDispatch::activeIsa() == SimdIsaAvx512)
+        return &intersectTriangle4SpanAvx512;
+    else if (SimdDispatch::activeIsa() == SimdIsaAvx2)
+        return &intersectTriangle4SpanAvx2;
+#endif
+    return &intersectTriangle4SpanSse;
+}
+
+}
@@ -98,6 +98,24 @@ inline void intersectTriangle4(Ray &ray, const Triangle4 &t,
     }
 }
 
+// Intersects the ray with count consecutive Triangle4s, with the same
+// results as calling intersectTriangle4 on each of them in turn. The
+// versions for wider instruction sets test two or four Triangle4s at once
+typedef void (*Triangle4SpanKernel)(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId);
+
+void intersectTriangle4SpanSse(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId);
+#ifdef WIDE_SIMD_KERNELS
+void intersectTriangle4SpanAvx2(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId);
+void intersectTriangle4SpanAvx512(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId);
+#endif
+
+// The widest version supported by SimdDispatch::activeIsa()
+Triangle4SpanKernel triangle4SpanKernel();
+
 }
 
 #endif /* TRIANGLE4_HPP_ */
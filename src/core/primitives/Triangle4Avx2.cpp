@@ -0,0 +1,70 @@
+// AVX2 version of intersectTriangle4Span (see Triangle4Span.inl). This
+// file is compiled with the baseline flags, and only the code between the
+// target pragmas below uses AVX2, so that shared headers are never built
+// for a wider instruction set. It must only be called into when
+// SimdDispatch reports support for it
+#ifdef WIDE_SIMD_KERNELS
+
+#include "Triangle4.hpp"
+
+#include "sse/SimdFloat.hpp"
+
+#include <immintrin.h>
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to=function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define SIMD_TARGET_AVX2
+
+#include "sse/SimdAvx2.hpp"
+
+namespace Tungsten {
+
+namespace Avx2 {
+
+typedef float8 V;
+
+// Floats offset..offset + 3 of t[0] and t[1]. If n is 1, the second half
+// repeats the first
+static inline V gather(const Triangle4 *t, int n, int offset)
+{
+    const float *f = reinterpret_cast<const float *>(t) + offset;
+    __m128 lo = _mm_load_ps(f);
+    __m128 hi = n > 1 ? _mm_load_ps(reinterpret_cast<const float *>(t + 1) + offset) : lo;
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+#include "Triangle4Span.inl"
+
+}
+
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#undef SIMD_TARGET_AVX2
+
+namespace Tungsten {
+
+void intersectTriangle4SpanAvx2(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId)
+{
+    float o[] = {ray.pos().x(), ray.pos().y(), ray.pos().z()};
+    float d[] = {ray.dir().x(), ray.dir().y(), ray.dir().z()};
+    float farT = ray.farT();
+    int hit = Avx2::intersectTriangle4Span(o, d, ray.nearT(), farT, t, count, resultU, resultV);
+    if (hit >= 0) {
+        ray.setFarT(farT);
+        resultId = t[hit/4].id[hit % 4];
+    }
+}
+
+}
+
+#endif
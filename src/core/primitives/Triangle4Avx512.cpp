@@ -0,0 +1,77 @@
+// AVX-512 version of intersectTriangle4Span (see Triangle4Span.inl). This
+// file is compiled with the baseline flags, and only the code between the
+// target pragmas below uses AVX-512, so that shared headers are never built
+// for a wider instruction set. It must only be called into when
+// SimdDispatch reports support for it
+#ifdef WIDE_SIMD_KERNELS
+
+#include "Triangle4.hpp"
+
+#include "sse/SimdFloat.hpp"
+
+#include <immintrin.h>
+
+// AVX-512 implies FMA. Contracting the products would change the rounding,
+// and the results have to match the SSE version exactly
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to=function)
+#pragma clang fp contract(off)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+#endif
+#define SIMD_TARGET_AVX512
+
+#include "sse/SimdAvx512.hpp"
+
+namespace Tungsten {
+
+namespace Avx512 {
+
+typedef float16 V;
+
+// Floats offset..offset + 3 of t[0] to t[3]. If n is less than 4, the
+// missing quarters repeat the last loaded one
+static inline V gather(const Triangle4 *t, int n, int offset)
+{
+    __m128 q[4];
+    for (int i = 0; i < 4; ++i)
+        q[i] = i < n ? _mm_load_ps(reinterpret_cast<const float *>(t + i) + offset) : q[i - 1];
+    __m512 result = _mm512_castps128_ps512(q[0]);
+    result = _mm512_insertf32x4(result, q[1], 1);
+    result = _mm512_insertf32x4(result, q[2], 2);
+    return _mm512_insertf32x4(result, q[3], 3);
+}
+
+#include "Triangle4Span.inl"
+
+}
+
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#undef SIMD_TARGET_AVX512
+
+namespace Tungsten {
+
+void intersectTriangle4SpanAvx512(Ray &ray, const Triangle4 *t, int count,
+        float &resultU, float &resultV, uint32 &resultId)
+{
+    float o[] = {ray.pos().x(), ray.pos().y(), ray.pos().z()};
+    float d[] = {ray.dir().x(), ray.dir().y(), ray.dir().z()};
+    float farT = ray.farT();
+    int hit = Avx512::intersectTriangle4Span(o, d, ray.nearT(), farT, t, count, resultU, resultV);
+    if (hit >= 0) {
+        ray.setFarT(farT);
+        resultId = t[hit/4].id[hit % 4];
+    }
+}
+
+}
+
+#endif
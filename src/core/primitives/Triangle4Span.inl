@@ -0,0 +1,76 @@
+// Intersection of a span of Triangle4s, testing V::n/4 of them at once.
+// Compiled once per wide instruction set. The including file provides the
+// lane type V (float8 or float16) and gather, which loads the same four
+// floats of several Triangle4s.
+// Everything defined here has internal linkage, so that the copies built
+// for different instruction sets never get mixed up by the linker.
+// The operations mirror intersectTriangle4, so that the results are the
+// same as testing the Triangle4s one by one
+
+static inline void cross(const V *a, const V *b, V *result)
+{
+    result[0] = a[1]*b[2] - a[2]*b[1];
+    result[1] = a[2]*b[0] - a[0]*b[2];
+    result[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static inline V dot(const V *a, const V *b)
+{
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+// Returns 4*i + k for lane k of Triangle4 i if it is the closest hit in
+// (nearT, farT), or -1 otherwise. farT is set to the distance of the hit
+static int intersectTriangle4Span(const float *o, const float *d, float nearT, float &farT,
+        const Triangle4 *t, int count, float &resultU, float &resultV)
+{
+    typedef SimdBool<V::n> pbool;
+    const int Group = V::n/4;
+
+    V rayO[] = {V(o[0]), V(o[1]), V(o[2])};
+    V rayD[] = {V(d[0]), V(d[1]), V(d[2])};
+
+    int hit = -1;
+    for (int i = 0; i < count; i += Group) {
+        int n = count - i < Group ? count - i : Group;
+
+        V p0[3], e1[3], e2[3];
+        for (int a = 0; a < 3; ++a) {
+            p0[a] = gather(t + i, n, a*4);
+            e1[a] = gather(t + i, n, 12 + a*4) - p0[a];
+            e2[a] = gather(t + i, n, 24 + a*4) - p0[a];
+        }
+
+        V P[3];
+        cross(rayD, e2, P);
+        V det = dot(e1, P);
+        pbool invalidMask = (det <= V(0.0f));
+        V invDet = V(1.0f)/det;
+
+        V T[] = {rayO[0] - p0[0], rayO[1] - p0[1], rayO[2] - p0[2]};
+
+        V u = dot(T, P)*invDet;
+        invalidMask = invalidMask || (u < V(0.0f)) || (u > V(1.0f));
+
+        V Q[3];
+        cross(T, e1, Q);
+        V v = dot(rayD, Q)*invDet;
+        invalidMask = invalidMask || (v < V(0.0f)) || (u + v > V(1.0f));
+
+        V maxT = dot(e2, Q)*invDet;
+        invalidMask = invalidMask || (maxT <= V(nearT)) || (maxT >= V(farT));
+        if (invalidMask.all())
+            continue;
+
+        uint32 invalid = invalidMask.mask();
+        for (int k = 0; k < 4*n; ++k) {
+            if (!(invalid & (1u << k)) && maxT[k] < farT) {
+                farT = maxT[k];
+                resultU = u[k];
+                resultV = v[k];
+                hit = 4*i + k;
+            }
+        }
+    }
+    return hit;
+}
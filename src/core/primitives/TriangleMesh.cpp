@@ -14,6 +14,8 @@
 #include "io/MeshIO.hpp"
 #include "io/Scene.hpp"
 
+#include "thread/ThreadUtils.hpp"
+
 #include <unordered_map>
 #include <iostream>
 
@@ -46,7 +48,8 @@ TriangleMesh::TriangleMesh(const TriangleMesh &o)
   _verts(o._verts),
   _tris(o._tris),
   _bsdfs(o._bsdfs),
-  _bounds(o._bounds)
+  _bounds(o._bounds),
+  _scene(nullptr)
 {
 }
 
@@ -74,7 +77,8 @@ TriangleMesh::TriangleMesh(std::vector<Vertex> verts, std::vector<TriangleI> tri
   _recomputeNormals(false),
   _verts(std::move(verts)),
   _tris(std::move(tris)),
-  _bsdfs(std::move(bsdfs))
+  _bsdfs(std::move(bsdfs)),
+  _scene(nullptr)
 {
 }
 
@@ -316,28 +320,37 @@ void TriangleMesh::makeCylinder(float radius, float height)
 
 bool TriangleMesh::intersect(Ray &ray, IntersectionTemporary &data) const
 {
+    if (!hasEmbreeGeometry())
+        return false;
+
     RTCRay eRay(EmbreeUtil::convert(ray));
-    rtcIntersect(_scene, eRay);
+    rtcIntersect(embreeScene(), eRay);
     if (eRay.geomID != RTC_INVALID_GEOMETRY_ID) {
         ray.setFarT(eRay.tfar);
-
-        data.primitive = this;
-        MeshIntersection *isect = data.as<MeshIntersection>();
-        isect->Ng = unnormalizedGeometricNormalAt(eRay.primID);
-        isect->u = eRay.u;
-        isect->v = eRay.v;
-        isect->primId = eRay.primID;
-        isect->backSide = isect->Ng.dot(ray.dir()) > 0.0f;
-
+        setIntersection(ray, eRay.primID, eRay.u, eRay.v, data);
         return true;
     }
     return false;
 }
 
+void TriangleMesh::setIntersection(const Ray &ray, uint32 primId, float u, float v, IntersectionTemporary &data) const
+{
+    data.primitive = this;
+    MeshIntersection *isect = data.as<MeshIntersection>();
+    isect->Ng = unnormalizedGeometricNormalAt(primId);
+    isect->u = u;
+    isect->v = v;
+    isect->primId = primId;
+    isect->backSide = isect->Ng.dot(ray.dir()) > 0.0f;
+}
+
 bool TriangleMesh::occluded(const Ray &ray) const
 {
+    if (!hasEmbreeGeometry())
+        return false;
+
     RTCRay eRay(EmbreeUtil::convert(ray));
-    rtcOccluded(_scene, eRay);
+    rtcOccluded(embreeScene(), eRay);
     return eRay.geomID != RTC_INVALID_GEOMETRY_ID;
 }
 
@@ -407,7 +420,7 @@ void TriangleMesh::makeSamplable(const TraceableScene &/*scene*/, uint32 /*threa
         areas[i] = MathUtil::triangleArea(p0, p1, p2);
         _totalArea += areas[i];
     }
-    _triSampler.reset(new Distribution1D(std::move(areas)));
+    _triSampler.reset(new AliasDistribution1D(std::move(areas)));
 }
 
 bool TriangleMesh::samplePosition(PathSampleGenerator &sampler, PositionSample &sample) const
@@ -516,54 +529,56 @@ float TriangleMesh::approximateRadiance(uint32 /*threadIndex*/, const Vec3f &/*p
     return -1.0f;
 }
 
+bool TriangleMesh::emissionCone(Vec3f &axis, float &theta, float &intensity) const
+{
+    if (!isEmissive())
+        return false;
+    // Bounding the normals of the mesh is not worth it; meshes are treated
+    // as if all of their area faced the shading point
+    axis = Vec3f(0.0f, 1.0f, 0.0f);
+    theta = PI;
+    intensity = _emission->average().max()*_totalArea;
+    return true;
+}
+
 Box3f TriangleMesh::bounds() const
 {
     return _bounds;
 }
 
-void TriangleMesh::prepareForRender()
+void TriangleMesh::transformVertices()
 {
-    computeBounds();
-
-    if (_verts.empty() || _tris.empty())
-        return;
-
-    _scene = rtcDeviceNewScene(EmbreeUtil::getDevice(), RTC_SCENE_STATIC | RTC_SCENE_INCOHERENT, RTC_INTERSECT1);
-    _geomId = rtcNewTriangleMesh(_scene, RTC_GEOMETRY_STATIC, _tris.size(), _verts.size(), 1);
-    Vec4f *vs = static_cast<Vec4f *>(rtcMapBuffer(_scene, _geomId, RTC_VERTEX_BUFFER));
-    Vec3u *ts = static_cast<Vec3u *>(rtcMapBuffer(_scene, _geomId, RTC_INDEX_BUFFER));
-
-    for (size_t i = 0; i < _tris.size(); ++i) {
-        const TriangleI &t = _tris[i];
-        _tris[i].material = clamp(_tris[i].material, 0, int(_bsdfs.size()) - 1);
-        ts[i] = Vec3u(t.v0, t.v1, t.v2);
-    }
-
-    _tfVerts.resize(_verts.size());
     Mat4f normalTform(_transform.toNormalMatrix());
-    for (size_t i = 0; i < _verts.size(); ++i) {
+    ThreadUtils::parallelFor(0, uint32(_verts.size()), 4096, [&](uint32 i) {
         _tfVerts[i] = Vertex(
             _transform*_verts[i].pos(),
             normalTform.transformVector(_verts[i].normal()),
             _verts[i].uv()
         );
-        const Vec3f &p = _tfVerts[i].pos();
-        vs[i] = Vec4f(p.x(), p.y(), p.z(), 0.0f);
-    }
-
-    _totalArea = 0.0f;
-    for (size_t i = 0; i < _tris.size(); ++i) {
-        Vec3f p0 = _tfVerts[_tris[i].v0].pos();
-        Vec3f p1 = _tfVerts[_tris[i].v1].pos();
-        Vec3f p2 = _tfVerts[_tris[i].v2].pos();
-        _totalArea += MathUtil::triangleArea(p0, p1, p2);
-    }
+    });
+
+    int maxMaterial = int(_bsdfs.size()) - 1;
+    _totalArea = float(ThreadUtils::parallelReduce(0, uint32(_tris.size()), 4096, 0.0, [&](double &area, uint32 i) {
+        TriangleI &t = _tris[i];
+        t.material = clamp(t.material, 0, maxMaterial);
+
+        Vec3f p0 = _tfVerts[t.v0].pos();
+        Vec3f p1 = _tfVerts[t.v1].pos();
+        Vec3f p2 = _tfVerts[t.v2].pos();
+        area += MathUtil::triangleArea(p0, p1, p2);
+    }, [](double a, double b) { return a + b; }));
     _invArea = 1.0f/_totalArea;
+}
 
-    rtcUnmapBuffer(_scene, _geomId, RTC_VERTEX_BUFFER);
-    rtcUnmapBuffer(_scene, _geomId, RTC_INDEX_BUFFER);
+void TriangleMesh::prepareForRender()
+{
+    computeBounds();
 
-    rtcCommit(_scene);
+    if (_verts.empty() || _tris.empty())
+        return;
+
+    _tfVerts.resize(_verts.size());
+    transformVertices();
 
     //if (_backfaceCulling)
     // TODO
@@ -571,14 +586,65 @@ void TriangleMesh::prepareForRender()
     Primitive::prepareForRender();
 }
 
+void TriangleMesh::updateTransform()
+{
+    if (!hasEmbreeGeometry() || !EmbreeUtil::dynamicScenes()) {
+        Primitive::updateTransform();
+        return;
+    }
+
+    // The vertices are overwritten in place, since the Embree scenes that
+    // this mesh was added to read them straight from the buffer
+    computeBounds();
+    transformVertices();
+    _triSampler.reset();
+
+    RTCScene scene = _scene.load(std::memory_order_relaxed);
+    if (scene) {
+        rtcUpdate(scene, _geomId);
+        rtcCommit(scene);
+    }
+}
+
+RTCScene TriangleMesh::embreeScene() const
+{
+    RTCScene scene = _scene.load(std::memory_order_acquire);
+    if (scene)
+        return scene;
+
+    std::unique_lock<std::mutex> lock(_sceneMutex);
+    scene = _scene.load(std::memory_order_relaxed);
+    if (!scene) {
+        // Packets need RTC_INTERSECT4 when they reach this scene through an instance
+        scene = rtcDeviceNewScene(EmbreeUtil::getDevice(), EmbreeUtil::sceneFlags(),
+                RTC_INTERSECT1 | RTC_INTERSECT4);
+        _geomId = addEmbreeGeometry(scene);
+        rtcCommit(scene);
+        _scene.store(scene, std::memory_order_release);
+    }
+    return scene;
+}
+
+unsigned TriangleMesh::addEmbreeGeometry(RTCScene scene) const
+{
+    // Embree reads positions and indices straight out of the transformed
+    // vertices and the triangles, so no copies of the mesh are made
+    unsigned geomId = rtcNewTriangleMesh(scene, EmbreeUtil::geometryFlags(), _tris.size(), _tfVerts.size(), 1);
+    rtcSetBuffer(scene, geomId, RTC_VERTEX_BUFFER, &_tfVerts[0], 0, sizeof(Vertex));
+    rtcSetBuffer(scene, geomId, RTC_INDEX_BUFFER, &_tris[0], 0, sizeof(TriangleI));
+    return geomId;
+}
+
 void TriangleMesh::teardownAfterRender()
 {
-    if (_scene)  {
-        rtcDeleteGeometry(_scene, _geomId);
-        rtcDeleteScene(_scene);
+    RTCScene scene = _scene.load(std::memory_order_relaxed);
+    if (scene) {
+        rtcDeleteGeometry(scene, _geomId);
+        rtcDeleteScene(scene);
         _scene = nullptr;
     }
     _tfVerts.clear();
+    _triSampler.reset();
 
     Primitive::teardownAfterRender();
 }
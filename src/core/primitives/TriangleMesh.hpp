@@ -5,12 +5,14 @@
 #include "Triangle.hpp"
 #include "Vertex.hpp"
 
-#include "sampling/Distribution1D.hpp"
+#include "sampling/AliasDistribution1D.hpp"
 
 #include "io/Path.hpp"
 #include <memory>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <mutex>
 
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_scene.h>
@@ -33,19 +35,24 @@ class TriangleMesh : public Primitive
 
     std::vector<std::shared_ptr<Bsdf>> _bsdfs;
 
-    std::unique_ptr<Distribution1D> _triSampler;
+    std::unique_ptr<AliasDistribution1D> _triSampler;
     float _totalArea;
     float _invArea;
 
     Box3f _bounds;
 
-    RTCScene _scene;
-    unsigned _geomId;
+    // Scene holding only this mesh, for tracing it on its own. Meshes that
+    // go straight into the scene BVH rarely need it, so it is built on first use
+    mutable std::atomic<RTCScene> _scene;
+    mutable std::mutex _sceneMutex;
+    mutable unsigned _geomId;
 
     Vec3f unnormalizedGeometricNormalAt(int triangle) const;
     Vec3f normalAt(int triangle, float u, float v) const;
     Vec2f uvAt(int triangle, float u, float v) const;
 
+    void transformVertices();
+
 protected:
     virtual float powerToRadianceFactor() const override;
 
@@ -106,10 +113,12 @@ public:
     virtual bool isInfinite() const override;
 
     virtual float approximateRadiance(uint32 threadIndex, const Vec3f &p) const override;
+    virtual bool emissionCone(Vec3f &axis, float &theta, float &intensity) const override;
     virtual Box3f bounds() const override;
 
     virtual void prepareForRender() override;
     virtual void teardownAfterRender() override;
+    virtual void updateTransform() override;
 
     virtual int numBsdfs() const override;
     virtual std::shared_ptr<Bsdf> &bsdf(int index) override;
@@ -117,6 +126,20 @@ public:
 
     virtual Primitive *clone() override;
 
+    // Adds the triangles of this mesh to an Embree scene and returns the
+    // geometry ID. Only valid between prepareForRender and teardownAfterRender
+    unsigned addEmbreeGeometry(RTCScene scene) const;
+    // Fills in the intersection temporary for a hit reported by Embree
+    void setIntersection(const Ray &ray, uint32 primId, float u, float v, IntersectionTemporary &data) const;
+
+    bool hasEmbreeGeometry() const
+    {
+        return !_tfVerts.empty();
+    }
+
+    // Only valid if hasEmbreeGeometry() is true
+    RTCScene embreeScene() const;
+
     const std::vector<TriangleI>& tris() const
     {
         return _tris;
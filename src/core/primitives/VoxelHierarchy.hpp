@@ -4,8 +4,10 @@
 #include "math/Vec.hpp"
 #include "math/Ray.hpp"
 
+#include <cstring>
 #include <memory>
 #include <limits>
+#include <vector>
 #include <array>
 
 namespace Tungsten {
@@ -30,7 +32,7 @@ class VoxelHierarchy
     };
 
     Vec3f _offset;
-    std::array<std::unique_ptr<Cubelet[]>, NumLevels> _grids;
+    std::array<std::vector<Cubelet>, NumLevels> _grids;
 
     void buildHierarchy(int level, const ElementType *data, ElementType *parent)
     {
@@ -64,7 +66,7 @@ class VoxelHierarchy
                     if (brickContainsVoxels(x, y, z))
                         nonZeroCount++;
 
-        _grids[level].reset(new Cubelet[nonZeroCount]);
+        _grids[level].resize(nonZeroCount);
 
         std::memset(parent, 0, sizeof(ElementType)*parentSize*parentSize*parentSize);
 
@@ -153,6 +155,29 @@ class VoxelHierarchy
     }
 
 public:
+    // Creates an empty hierarchy, to be filled in with insert
+    VoxelHierarchy(Vec3f offset)
+    : _offset(offset)
+    {
+        _grids[NumLevels - 1].resize(1);
+    }
+
+    // Restores a hierarchy from the output of serialize
+    VoxelHierarchy(const std::vector<uint8> &src)
+    {
+        const uint8 *p = src.data();
+        std::memcpy(&_offset, p, sizeof(Vec3f));
+        p += sizeof(Vec3f);
+        for (std::vector<Cubelet> &grid : _grids) {
+            uint32 count;
+            std::memcpy(&count, p, sizeof(uint32));
+            p += sizeof(uint32);
+            grid.resize(count);
+            std::memcpy(grid.data(), p, count*sizeof(Cubelet));
+            p += count*sizeof(Cubelet);
+        }
+    }
+
     VoxelHierarchy(Vec3f offset, const ElementType *data)
     : _offset(offset)
     {
@@ -162,7 +187,7 @@ public:
 
         ElementType *bufferA = temporaryA.get(), *bufferB = temporaryB.get();
 
-        _grids[NumLevels - 1].reset(new Cubelet[1]);
+        _grids[NumLevels - 1].resize(1);
 
         for (int i = 0; i < NumLevels - 1; ++i) {
             const ElementType *src = (i == 0 ? data : bufferA);
@@ -228,6 +253,66 @@ public:
         return &_grids[0][idx].at(x % BrickSize, y % BrickSize, z % BrickSize);
     }
 
+    // Returns the voxel at (x, y, z), allocating the bricks above it if
+    // needed. Only non-zero voxels should be inserted, so that the hierarchy
+    // stays as sparse as one built from a dense grid
+    ElementType &insert(int x, int y, int z)
+    {
+        int idx = 0;
+        for (int i = NumLevels - 1; i > 0; --i) {
+            int px = x/(1 << (SizePower*i)) % BrickSize;
+            int py = y/(1 << (SizePower*i)) % BrickSize;
+            int pz = z/(1 << (SizePower*i)) % BrickSize;
+
+            ElementType &child = _grids[i][idx].at(px, py, pz);
+            if (!child) {
+                _grids[i - 1].emplace_back();
+                child = ElementType(_grids[i - 1].size());
+            }
+            idx = child - 1;
+        }
+
+        return _grids[0][idx].at(x % BrickSize, y % BrickSize, z % BrickSize);
+    }
+
+    void serialize(std::vector<uint8> &dst) const
+    {
+        dst.resize(serializedSize());
+        uint8 *p = dst.data();
+        std::memcpy(p, &_offset, sizeof(Vec3f));
+        p += sizeof(Vec3f);
+        for (const std::vector<Cubelet> &grid : _grids) {
+            uint32 count = uint32(grid.size());
+            std::memcpy(p, &count, sizeof(uint32));
+            p += sizeof(uint32);
+            std::memcpy(p, grid.data(), count*sizeof(Cubelet));
+            p += count*sizeof(Cubelet);
+        }
+    }
+
+    size_t serializedSize() const
+    {
+        size_t result = sizeof(Vec3f);
+        for (const std::vector<Cubelet> &grid : _grids)
+            result += sizeof(uint32) + grid.size()*sizeof(Cubelet);
+        return result;
+    }
+
+    size_t memoryUsage() const
+    {
+        size_t result = sizeof(*this);
+        for (const std::vector<Cubelet> &grid : _grids)
+            result += grid.capacity()*sizeof(Cubelet);
+        return result;
+    }
+
+    // Releases the slack left over from insert
+    void shrinkToFit()
+    {
+        for (std::vector<Cubelet> &grid : _grids)
+            grid.shrink_to_fit();
+    }
+
     template<typename Visitor>
     void iterateNonZeroVoxels(Visitor visitor)
     {
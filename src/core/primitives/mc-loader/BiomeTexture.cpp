@@ -77,9 +77,9 @@ void BiomeTexture::derivatives(const Vec2f &uv, Vec2f &derivs) const
     return _substrate->derivatives(uv, derivs);
 }
 
-void BiomeTexture::makeSamplable(TextureMapJacobian jacobian)
+void BiomeTexture::makeSamplable(TextureMapJacobian jacobian, bool invertible)
 {
-    _substrate->makeSamplable(jacobian);
+    _substrate->makeSamplable(jacobian, invertible);
 }
 
 Vec2f BiomeTexture::sample(TextureMapJacobian jacobian, const Vec2f &uv) const
@@ -51,7 +51,7 @@ public:
             _nodes.resize(builder.numNodes());
 
             uint32 tail = 1;
-            recursiveBuild(builder.root().get(), 0, tail, emission);
+            recursiveBuild(builder.root(), 0, tail, emission);
         }
     }
 
@@ -5,12 +5,18 @@
 #include "MemBuf.hpp"
 #include "NBT.hpp"
 
+#include "primitives/VoxelHierarchy.hpp"
+
+#include "thread/ThreadUtils.hpp"
+
+#include "io/MemoryMappedFile.hpp"
 #include "io/FileIterables.hpp"
 #include "io/Path.hpp"
 
 #include <tinyformat/tinyformat.hpp>
 #include <miniz/miniz.h>
 #include <functional>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <cstdio>
@@ -21,22 +27,32 @@ namespace MinecraftLoader {
 template<typename ElementType>
 class MapLoader
 {
-    static const size_t CompressedChunkSize = 1024*1024;
+public:
+    typedef VoxelHierarchy<2, 4, ElementType> Grid;
+
+private:
     static const size_t DecompressedChunkSize = 5*1024*1024;
 
-    Path _path;
+    // A region file covers 512x256x512 blocks, which are split into 2x2 grids
+    struct Region
+    {
+        Path path;
+        int x, z;
+        int height;
+        std::unique_ptr<Grid> grids[4];
+        std::unique_ptr<uint8[]> biomes;
+    };
 
-    std::unique_ptr<uint8[]> _locationTable, _timestampTable;
-    std::unique_ptr<uint8[]> _compressedChunk, _decompressedChunk;
-    std::unique_ptr<ElementType[]> _regionGrid;
-    std::unique_ptr<uint8[]> _biomes;
-    int _regionHeight;
+    Path _path;
 
-    void loadChunk(std::istream &in, int chunkX, int chunkZ)
+    static void loadChunk(std::istream &in, int chunkX, int chunkZ, Region &region)
     {
         NbtTag root(in);
 
         int gridOffset = (chunkX/16) + 2*(chunkZ/16);
+        Grid &grid = *region.grids[gridOffset];
+        int baseX = 16*(chunkX % 16);
+        int baseZ = 16*(chunkZ % 16);
 
         NbtTag &sections = root["Level"]["Sections"];
         for (int i = 0; i < sections.size(); ++i) {
@@ -44,8 +60,8 @@ class MapLoader
             NbtTag &add    = sections.subtag(i)["Add"];
             NbtTag &data   = sections.subtag(i)["Data"];
             int chunkY = sections.subtag(i)["Y"].asInt();
-
-            int base = gridOffset*256*256*256 + 16*((chunkX % 16) + 256*chunkY + 256*256*(chunkZ % 16));
+            if (chunkY < 0 || chunkY >= 16)
+                continue;
 
             for (int z = 0; z < 16; ++z) {
                 for (int y = 0; y < 16; ++y) {
@@ -57,10 +73,12 @@ class MapLoader
                         if (add   ) blockId |= ((static_cast<uint8>(add [idx/2]) >> ((idx & 1)*4)) & 0xF) << 12;
                         if (data  ) blockId |= ((static_cast<uint8>(data[idx/2]) >> ((idx & 1)*4)) & 0xF);
 
-                        _regionGrid[base + x + 256*y + 256*256*z] = blockId;
-
-                        if (blockId)
-                            _regionHeight = max(_regionHeight, chunkY*16 + y + 1);
+                        // Air is never inserted, so that empty parts of the
+                        // section allocate nothing
+                        if (blockId) {
+                            grid.insert(baseX + x, chunkY*16 + y, baseZ + z) = blockId;
+                            region.height = max(region.height, chunkY*16 + y + 1);
+                        }
                     }
                 }
             }
@@ -68,90 +86,137 @@ class MapLoader
 
         NbtTag &biomes = root["Level"]["Biomes"];
         if (biomes) {
-            int base = gridOffset*256*256 + 16*((chunkX % 16) + 256*(chunkZ % 16));
+            int base = gridOffset*256*256 + baseX + 256*baseZ;
 
             for (int z = 0; z < 16; ++z)
                 for (int x = 0; x < 16; ++x)
-                    _biomes[base + x + z*256] = static_cast<uint8>(biomes[x + z*16]);
+                    region.biomes[base + x + z*256] = static_cast<uint8>(biomes[x + z*16]);
         }
     }
 
-    void loadRegion(std::istream &in)
+    // Inflates the chunks straight out of the mapped file. decompressed is
+    // scratch space of DecompressedChunkSize bytes
+    static void loadRegion(Region &region, uint8 *decompressed)
     {
-        FileUtils::streamRead(in, _locationTable.get(), 4096);
-        FileUtils::streamRead(in, _timestampTable.get(), 4096);
-
-        std::memset(_regionGrid.get(), 0, 512*256*512*sizeof(ElementType));
-        std::memset(_biomes.get(), 0xFF, 512*512*sizeof(uint8));
-        _regionHeight = 0;
+        for (int i = 0; i < 4; ++i)
+            region.grids[i].reset(new Grid(Vec3f(
+                (region.x*2 + (i & 1))*256.0f, 0.0f, (region.z*2 + (i >> 1))*256.0f)));
+        region.biomes.reset(new uint8[512*512]);
+        std::memset(region.biomes.get(), 0xFF, 512*512*sizeof(uint8));
+        region.height = 0;
+
+        MemoryMappedFile file(region.path);
+        if (!file.valid() || file.size() < 8192) {
+            DBG("Failed to map region file at '%s'", region.path);
+            return;
+        }
+        const uint8 *locationTable = file.data();
 
         for (int i = 0; i < 1024; ++i) {
             int chunkX = i % 32;
             int chunkZ = i / 32;
 
-            uint32 offset = 4*1024*(
-                (uint32(_locationTable[i*4 + 0]) << 16) +
-                (uint32(_locationTable[i*4 + 1]) <<  8) +
-                 uint32(_locationTable[i*4 + 2]));
-            uint32 length = uint32(_locationTable[i*4 + 3])*4*1024;
+            size_t offset = 4*1024*(
+                (size_t(locationTable[i*4 + 0]) << 16) +
+                (size_t(locationTable[i*4 + 1]) <<  8) +
+                 size_t(locationTable[i*4 + 2]));
+            size_t length = size_t(locationTable[i*4 + 3])*4*1024;
 
             if (offset == 0 || length == 0)
                 continue;
+            if (offset + 5 > file.size()) {
+                tfm::printf("Ignoring chunk %i, %i past the end of the region file\n", chunkX, chunkZ);
+                std::cout.flush();
+                continue;
+            }
 
-            in.seekg(offset);
-            FileUtils::streamRead(in, _compressedChunk.get(), length);
-
-            uint32 chunkLength =
-                (uint32(_compressedChunk[0]) << 24) +
-                (uint32(_compressedChunk[1]) << 16) +
-                (uint32(_compressedChunk[2]) <<  8) +
-                 uint32(_compressedChunk[3]);
-            if (_compressedChunk[4] != 2) {
+            const uint8 *compressedChunk = file.data() + offset;
+            size_t chunkLength =
+                (size_t(compressedChunk[0]) << 24) +
+                (size_t(compressedChunk[1]) << 16) +
+                (size_t(compressedChunk[2]) <<  8) +
+                 size_t(compressedChunk[3]);
+            chunkLength = min(chunkLength, file.size() - offset - 5);
+            if (compressedChunk[4] != 2) {
                 // Only accept Zlib compression
-                tfm::printf("Ignoring chunk %i, %i with unsupported compression mode %i\n", chunkX, chunkZ, _compressedChunk[4]);
+                tfm::printf("Ignoring chunk %i, %i with unsupported compression mode %i\n", chunkX, chunkZ, compressedChunk[4]);
                 std::cout.flush();
                 continue;
             }
 
             uLongf destLength = DecompressedChunkSize;
-            if (uncompress(_decompressedChunk.get(), &destLength, _compressedChunk.get() + 5, chunkLength) != Z_OK) {
+            if (uncompress(decompressed, &destLength, compressedChunk + 5, uLong(chunkLength)) != Z_OK) {
                 tfm::printf("Decompression failed for chunk %i, %i\n", chunkX, chunkZ);
                 std::cout.flush();
                 continue;
             }
 
-            MemBuf buffer(reinterpret_cast<char *>(_decompressedChunk.get()), destLength);
+            MemBuf buffer(reinterpret_cast<char *>(decompressed), destLength);
             std::istream bufferStream(&buffer);
 
-            loadChunk(bufferStream, i % 32, i/32);
+            loadChunk(bufferStream, chunkX, chunkZ, region);
+        }
+
+        for (int i = 0; i < 4; ++i)
+            region.grids[i]->shrinkToFit();
+    }
+
+    static void loadBatch(std::vector<Region> &regions, size_t begin, size_t end,
+            const std::function<void(int, int, int, std::unique_ptr<Grid>, uint8 *)> &regionHandler)
+    {
+        uint32 numTasks = ThreadUtils::parallelTaskCount(0, uint32(end - begin), 1);
+        std::vector<std::unique_ptr<uint8[]>> scratch(numTasks);
+        auto body = [&](uint32 taskId, uint32 chunkStart, uint32 chunkEnd) {
+            if (!scratch[taskId])
+                scratch[taskId].reset(new uint8[DecompressedChunkSize]);
+
+            for (uint32 i = chunkStart; i < chunkEnd; ++i) {
+                try {
+                    loadRegion(regions[i], scratch[taskId].get());
+                } catch (const std::runtime_error &e) {
+                    // Exceptions must not escape the worker threads. A broken
+                    // region only loses its own chunks
+                    DBG("Failed to load region file at '%s': %s", regions[i].path, e.what());
+                }
+            }
+        };
+        ThreadUtils::parallelChunks(uint32(begin), uint32(end), 1, numTasks, body);
+
+        for (size_t j = begin; j < end; ++j) {
+            Region &r = regions[j];
+            for (int i = 0; i < 4; ++i)
+                regionHandler(r.x*2 + (i & 1), r.z*2 + (i >> 1), r.height, std::move(r.grids[i]),
+                        r.biomes.get() + 256*256*i);
+            r.biomes.reset();
         }
     }
 
 public:
     MapLoader(const Path &path)
-    : _path(path),
-      _regionHeight(0)
+    : _path(path)
     {
-        _locationTable.reset(new uint8[4096]);
-        _timestampTable.reset(new uint8[4096]);
-        _compressedChunk.reset(new uint8[CompressedChunkSize]);
-        _decompressedChunk.reset(new uint8[DecompressedChunkSize]);
-        _regionGrid.reset(new ElementType[512*256*512]);
-        _biomes.reset(new uint8[512*512]);
     }
 
-    void loadRegions(const std::function<void(int, int, int, ElementType *, uint8 *)> &regionHandler) {
+    // Regions are loaded in parallel on the thread pool, but handed to the
+    // regionHandler serially and in a fixed order.
+    // If a rowHandler is given, region files are loaded one row (of equal z)
+    // at a time in order of increasing z, and the rowHandler is called after
+    // the grids of each row were handed over. The loader then never holds
+    // more than one row of regions
+    void loadRegions(const std::function<void(int, int, int, std::unique_ptr<Grid>, uint8 *)> &regionHandler,
+            const std::function<void()> &rowHandler = nullptr) {
         if (!_path.exists() || !_path.isDirectory()) {
             DBG("Failed to open minecraft map folder at '%s'", _path);
             return;
         }
-        Path region(_path/"region");
-        if (!region.exists() || !region.isDirectory()) {
+        Path regionPath(_path/"region");
+        if (!regionPath.exists() || !regionPath.isDirectory()) {
             DBG("Failed to open region folder for minecraft map at '%s'", _path);
             return;
         }
 
-        for (const Path &p : region.files("mca")) {
+        std::vector<Region> regions;
+        for (const Path &p : regionPath.files("mca")) {
             std::string base = p.baseName().asString();
             if (base.length() < 2 || tolower(base.front()) != 'r' || base[1] != '.')
                 continue;
@@ -159,15 +224,30 @@ public:
             if (std::sscanf(base.c_str() + 2, "%i.%i", &x, &z) != 2)
                 continue;
 
-            InputStreamHandle in = FileUtils::openInputStream(p);
-            if (!in)
-                continue;
-            loadRegion(*in);
+            regions.emplace_back();
+            regions.back().path = p;
+            regions.back().x = x;
+            regions.back().z = z;
+        }
+        if (regions.empty())
+            return;
+
+        if (!rowHandler) {
+            loadBatch(regions, 0, regions.size(), regionHandler);
+            return;
+        }
 
-            regionHandler(x*2 + 0, z*2 + 0, _regionHeight, _regionGrid.get(),                 _biomes.get());
-            regionHandler(x*2 + 1, z*2 + 0, _regionHeight, _regionGrid.get() + 256*256*256,   _biomes.get() + 256*256);
-            regionHandler(x*2 + 0, z*2 + 1, _regionHeight, _regionGrid.get() + 256*256*256*2, _biomes.get() + 256*256*2);
-            regionHandler(x*2 + 1, z*2 + 1, _regionHeight, _regionGrid.get() + 256*256*256*3, _biomes.get() + 256*256*3);
+        std::sort(regions.begin(), regions.end(), [](const Region &a, const Region &b) {
+            return a.z < b.z || (a.z == b.z && a.x < b.x);
+        });
+        for (size_t begin = 0; begin < regions.size(); ) {
+            size_t end = begin + 1;
+            while (end < regions.size() && regions[end].z == regions[begin].z)
+                end++;
+
+            loadBatch(regions, begin, end, regionHandler);
+            rowHandler();
+            begin = end;
         }
     }
 };
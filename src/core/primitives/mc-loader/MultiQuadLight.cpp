@@ -189,7 +189,9 @@ bool MultiQuadLight::isSamplable() const
 
 void MultiQuadLight::makeSamplable(const TraceableScene &/*scene*/, uint32 threadIndex)
 {
-    _samplers.resize(threadIndex + 1);
+    // Threads may be prepared in any order
+    if (_samplers.size() <= threadIndex)
+        _samplers.resize(threadIndex + 1);
     _samplers[threadIndex].reset(new ThreadlocalSampleInfo);
     _samplers[threadIndex]->sampleWeights.resize(_geometry.triangleCount());
     _samplers[threadIndex]->insideIds.resize(_geometry.triangleCount());
@@ -41,6 +41,7 @@ private:
     std::vector<TriangleInfo> _triInfo;
     std::vector<std::pair<int, int>> _simdSpan, _modelSpan;
     int _triangleOffset;
+    Triangle4SpanKernel _intersectSpan;
 
     void clipPointToRect(Vec3f &p, Vec2f &uv, const Box2f &bounds, const TexturedQuad &quad) const
     {
@@ -61,7 +62,11 @@ private:
     }
 
 public:
-    QuadGeometry() = default;
+    QuadGeometry()
+    : _triangleOffset(0),
+      _intersectSpan(triangle4SpanKernel())
+    {
+    }
 
     void beginModel()
     {
@@ -158,8 +163,8 @@ public:
         int start = _simdSpan[idx].first;
         int end   = _simdSpan[idx].second;
 
-        for (int i = start; i < end; ++i)
-            intersectTriangle4(ray, _geometry[i], isect.u, isect.v, isect.id);
+        if (start < end)
+            _intersectSpan(ray, &_geometry[start], end - start, isect.u, isect.v, isect.id);
     }
 
     Box3f bounds(int idx) const
@@ -0,0 +1,247 @@
+#ifndef REGIONCACHE_HPP_
+#define REGIONCACHE_HPP_
+
+#include "thread/ThreadUtils.hpp"
+
+#include "Logging.hpp"
+#include "IntTypes.hpp"
+
+#include <tinyformat/tinyformat.hpp>
+#include <miniz/miniz.h>
+#include <limits>
+#include <atomic>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <deque>
+#include <mutex>
+
+namespace Tungsten {
+namespace MinecraftLoader {
+
+// Out-of-core storage for the region grids of a map. All grids are kept
+// compressed, and a grid is only built when the first ray reaches its leaf in
+// the region BVH. Once the built grids exceed the memory budget, the least
+// recently used ones are evicted again.
+// Every thread pins the grids it used since the last eviction, so that
+// repeated visits of a region never touch shared state. Evicted grids stay
+// alive until all threads that pinned them notice the eviction, so the budget
+// is a soft limit
+template<typename Grid>
+class RegionCache
+{
+    struct Slot
+    {
+        std::vector<uint8> compressed;
+        size_t rawSize;
+
+        std::mutex buildLock;
+        std::shared_ptr<Grid> grid;
+        size_t residentSize;
+        std::atomic<uint64> lastUse;
+    };
+
+    struct ThreadPins
+    {
+        uint64 epoch;
+        std::vector<std::shared_ptr<Grid>> grids;
+        std::vector<uint32> pinned;
+    };
+
+    // Slots are only added while loading, before any grid is acquired
+    std::deque<Slot> _slots;
+    uint32 _slotCount;
+    size_t _budget;
+    size_t _compressedSize;
+    // Unique over the lifetime of the program, so that the thread local pins
+    // of a destroyed cache are never mistaken for those of a new one
+    uint64 _cacheId;
+
+    std::mutex _pinLock;
+    std::unordered_map<std::thread::id, std::unique_ptr<ThreadPins>> _threadPins;
+    // Advanced by every eviction. Threads drop their pins once they see a
+    // new value
+    std::atomic<uint64> _epoch;
+
+    std::mutex _evictLock;
+    // Advanced on every fault. Slots remember the value at their last miss,
+    // which orders them well enough for eviction
+    std::atomic<uint64> _clock;
+    std::atomic<size_t> _residentSize;
+    std::atomic<size_t> _peakResidentSize;
+    std::atomic<uint32> _residentCount;
+    std::atomic<uint32> _faults;
+    std::atomic<uint32> _evictions;
+
+    static uint64 nextCacheId()
+    {
+        static std::atomic<uint64> counter(0);
+        return ++counter;
+    }
+
+    ThreadPins &threadPins()
+    {
+        struct LocalPins
+        {
+            uint64 cacheId;
+            ThreadPins *pins;
+        };
+        static thread_local LocalPins local = {0, nullptr};
+
+        if (local.cacheId != _cacheId) {
+            std::unique_lock<std::mutex> lock(_pinLock);
+            std::unique_ptr<ThreadPins> &pins = _threadPins[std::this_thread::get_id()];
+            if (!pins)
+                pins.reset(new ThreadPins{_epoch, std::vector<std::shared_ptr<Grid>>(), std::vector<uint32>()});
+            local.cacheId = _cacheId;
+            local.pins = pins.get();
+        }
+        return *local.pins;
+    }
+
+    std::shared_ptr<Grid> fetch(uint32 id)
+    {
+        Slot &slot = _slots[id];
+        slot.lastUse.store(_clock.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        std::shared_ptr<Grid> grid = std::atomic_load(&slot.grid);
+        if (grid)
+            return grid;
+
+        std::unique_lock<std::mutex> lock(slot.buildLock);
+        grid = std::atomic_load(&slot.grid);
+        if (grid)
+            return grid;
+
+        std::vector<uint8> raw(slot.rawSize);
+        mz_ulong rawSize = mz_ulong(slot.rawSize);
+        mz_uncompress(raw.data(), &rawSize, slot.compressed.data(), mz_ulong(slot.compressed.size()));
+        grid = std::make_shared<Grid>(raw);
+
+        // Account for the grid before publishing it, so that a concurrent
+        // eviction can never subtract it first
+        slot.residentSize = grid->memoryUsage();
+        slot.lastUse = ++_clock;
+        size_t resident = (_residentSize += slot.residentSize);
+        size_t peak = _peakResidentSize;
+        while (resident > peak && !_peakResidentSize.compare_exchange_weak(peak, resident));
+        _residentCount++;
+        _faults++;
+        std::atomic_store(&slot.grid, grid);
+        lock.unlock();
+
+        if (resident > _budget)
+            evict(id);
+
+        return grid;
+    }
+
+    void evict(uint32 keep)
+    {
+        std::unique_lock<std::mutex> lock(_evictLock);
+
+        while (_residentSize > _budget) {
+            uint32 victim = _slotCount;
+            uint64 oldest = std::numeric_limits<uint64>::max();
+            for (uint32 i = 0; i < _slotCount; ++i) {
+                if (i != keep && _slots[i].lastUse < oldest && std::atomic_load(&_slots[i].grid)) {
+                    oldest = _slots[i].lastUse;
+                    victim = i;
+                }
+            }
+            if (victim == _slotCount)
+                break;
+
+            Slot &slot = _slots[victim];
+            if (std::atomic_exchange(&slot.grid, std::shared_ptr<Grid>())) {
+                _residentSize -= slot.residentSize;
+                _residentCount--;
+                _evictions++;
+            }
+        }
+        _epoch++;
+    }
+
+public:
+    RegionCache(size_t budget)
+    : _slotCount(0),
+      _budget(budget),
+      _compressedSize(0),
+      _cacheId(nextCacheId()),
+      _epoch(0),
+      _clock(0),
+      _residentSize(0),
+      _peakResidentSize(0),
+      _residentCount(0),
+      _faults(0),
+      _evictions(0)
+    {
+    }
+
+    // Compresses the grids into new slots, which are numbered in the order
+    // the grids are added. Must not be called once grids are acquired
+    void add(std::vector<std::unique_ptr<Grid>> grids)
+    {
+        uint32 first = _slotCount;
+        for (size_t i = 0; i < grids.size(); ++i)
+            _slots.emplace_back();
+        _slotCount = uint32(_slots.size());
+
+        ThreadUtils::parallelFor(0, uint32(grids.size()), 1, [&](uint32 i) {
+            std::vector<uint8> raw;
+            grids[i]->serialize(raw);
+            grids[i].reset();
+
+            Slot &slot = _slots[first + i];
+            mz_ulong compressedSize = mz_compressBound(mz_ulong(raw.size()));
+            slot.compressed.resize(compressedSize);
+            mz_compress2(slot.compressed.data(), &compressedSize, raw.data(), mz_ulong(raw.size()), MZ_BEST_SPEED);
+            slot.compressed.resize(compressedSize);
+            slot.compressed.shrink_to_fit();
+            slot.rawSize = raw.size();
+            slot.residentSize = 0;
+            slot.lastUse = 0;
+        });
+
+        for (uint32 i = first; i < _slotCount; ++i)
+            _compressedSize += _slots[i].compressed.size();
+    }
+
+    // The grid stays valid until the calling thread acquires the next grid
+    Grid *acquire(uint32 id)
+    {
+        ThreadPins &pins = threadPins();
+
+        uint64 epoch = _epoch.load(std::memory_order_relaxed);
+        if (pins.epoch != epoch) {
+            for (uint32 i : pins.pinned)
+                pins.grids[i].reset();
+            pins.pinned.clear();
+            pins.epoch = epoch;
+        }
+        if (pins.grids.size() < _slotCount)
+            pins.grids.resize(_slotCount);
+
+        if (Grid *grid = pins.grids[id].get())
+            return grid;
+
+        pins.grids[id] = fetch(id);
+        pins.pinned.push_back(id);
+        return pins.grids[id].get();
+    }
+
+    void printStats() const
+    {
+        auto mb = [](size_t bytes) { return bytes/(1024.0*1024.0); };
+        printTimestampedLog(tfm::format("Minecraft regions: %d/%d resident (%.1f MB, peak %.1f MB, "
+                "budget %.1f MB, %.1f MB compressed), %d faults, %d evictions",
+                uint32(_residentCount), _slotCount, mb(_residentSize), mb(_peakResidentSize),
+                mb(_budget), mb(_compressedSize), uint32(_faults), uint32(_evictions)));
+    }
+};
+
+}
+}
+
+#endif /* REGIONCACHE_HPP_ */
@@ -139,7 +139,7 @@ public:
             _primToNode.resize(emission.size());
 
             uint32 tail = 1;
-            recursiveBuild(builder.root().get(), 0, tail, emission);
+            recursiveBuild(builder.root(), 0, tail, emission);
 
             for (Node &node : _nodes)
                 node.radiusSq *= node.radiusSq;
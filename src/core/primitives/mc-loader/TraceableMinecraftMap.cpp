@@ -24,6 +24,8 @@
 
 #include <tinyformat/tinyformat.hpp>
 #include <unordered_set>
+#include <functional>
+#include <deque>
 
 namespace Tungsten {
 namespace MinecraftLoader {
@@ -35,7 +37,8 @@ struct MapIntersection
 };
 
 TraceableMinecraftMap::TraceableMinecraftMap()
-: _missingBsdf(std::make_shared<LambertBsdf>())
+: _regionMemoryBudget(0.0f),
+  _missingBsdf(std::make_shared<LambertBsdf>())
 {
     _missingBsdf->setAlbedo(std::make_shared<ConstantTexture>(0.2f));
 
@@ -49,6 +52,7 @@ TraceableMinecraftMap::TraceableMinecraftMap(const TraceableMinecraftMap &o)
 {
     _mapPath = o._mapPath;
     _packPaths = o._packPaths;
+    _regionMemoryBudget = o._regionMemoryBudget;
 
     _missingBsdf = o._missingBsdf;
     _bsdfCache = o._bsdfCache;
@@ -396,9 +400,13 @@ int TraceableMinecraftMap::resolveLiquidBlock(ResourcePackLoader &pack, int x, i
         if (heights[i] >= 8)
             scale[i] = 1;
 
-    uint32 key = 0;
+    // The scales change the geometry as well, so they have to be part of the
+    // key. Otherwise the model would depend on which block was resolved first
+    uint64 key = 0;
     for (int i = 0; i < 4; ++i)
-        key = (key << 4) | uint32(heights[i]);
+        key = (key << 4) | uint64(heights[i]);
+    for (int i = 0; i < 4; ++i)
+        key = (key << 2) | uint64(min(scale[i], 4) - 1);
     for (int i = 0; i < 6; ++i)
         key = (key << 1) | (hasFace[i] ? 1 : 0);
     key = (key << 1) | (isLava ? 1 : 0);
@@ -487,19 +495,13 @@ int TraceableMinecraftMap::resolveLiquidBlock(ResourcePackLoader &pack, int x, i
     return _geometry.size() - 1;
 }
 
-void TraceableMinecraftMap::resolveBlocks(ResourcePackLoader &pack)
+void TraceableMinecraftMap::resolveSpecialBlocks(ResourcePackLoader &pack, const std::vector<Vec2i> &regions,
+        std::vector<DeferredBlock> &deferredBlocks)
 {
-    struct DeferredBlock
-    {
-        ElementType &dst;
-        ElementType value;
-    };
-    std::vector<DeferredBlock> deferredBlocks;
-
-    for (auto &region : _regions) {
-        region.second->iterateNonZeroVoxels([&](ElementType &voxel, int x, int y, int z) {
-            int globalX = region.first.x()*256 + x;
-            int globalZ = region.first.y()*256 + z;
+    for (const Vec2i &region : regions) {
+        _regions[region]->iterateNonZeroVoxels([&](ElementType &voxel, int x, int y, int z) {
+            int globalX = region.x()*256 + x;
+            int globalZ = region.y()*256 + z;
             if (pack.isSpecialBlock(voxel)) {
                 const ModelRef *ref = pack.mapSpecialBlock(*this, globalX, y, globalZ,
                         x + 256*y + 256*256*z, voxel);
@@ -516,9 +518,13 @@ void TraceableMinecraftMap::resolveBlocks(ResourcePackLoader &pack)
             }
         });
     }
+}
 
-    for (auto &region : _regions) {
-        region.second->iterateNonZeroVoxels([&](ElementType &voxel, int x, int y, int z) {
+void TraceableMinecraftMap::resolveRegularBlocks(ResourcePackLoader &pack, const std::vector<Vec2i> &regions,
+        std::vector<DeferredBlock> &deferredBlocks)
+{
+    for (const Vec2i &region : regions) {
+        _regions[region]->iterateNonZeroVoxels([&](ElementType &voxel, int x, int y, int z) {
             if (!pack.isSpecialBlock(voxel) && !pack.isLiquid(voxel)) {
                 const ModelRef *ref = pack.mapBlock(voxel, x + 256*y + 256*256*z);
                 auto iter = _modelToPrimitive.find(ref);
@@ -531,17 +537,90 @@ void TraceableMinecraftMap::resolveBlocks(ResourcePackLoader &pack)
     }
     for (DeferredBlock &block : deferredBlocks)
         block.dst = block.value;
+}
 
-    QuadGeometry emitters;
-
-    for (auto &region : _regions) {
-        region.second->iterateNonZeroVoxels([&](ElementType &voxel, int x, int y, int z) {
-            int globalX = region.first.x()*256 + x;
-            int globalZ = region.first.y()*256 + z;
+void TraceableMinecraftMap::collectEmitters(const std::vector<Vec2i> &regions, QuadGeometry &emitters)
+{
+    for (const Vec2i &region : regions) {
+        _regions[region]->iterateNonZeroVoxels([&](ElementType &voxel, int x, int y, int z) {
+            int globalX = region.x()*256 + x;
+            int globalZ = region.y()*256 + z;
             if (voxel && _emitterTemplates.nonEmpty(voxel - 1))
                 emitters.addQuads(_emitterTemplates, voxel - 1, Mat4f::translate(Vec3f(Vec3i(globalX, y, globalZ))));
         });
     }
+}
+
+void TraceableMinecraftMap::resolveBlocks(ResourcePackLoader &pack)
+{
+    std::vector<Vec2i> regions;
+    for (auto &region : _regions)
+        regions.push_back(region.first);
+
+    std::vector<DeferredBlock> deferredBlocks;
+    resolveSpecialBlocks(pack, regions, deferredBlocks);
+    resolveRegularBlocks(pack, regions, deferredBlocks);
+
+    QuadGeometry emitters;
+    collectEmitters(regions, emitters);
+
+    _lights = std::make_shared<MultiQuadLight>(std::move(emitters), _materials);
+}
+
+void TraceableMinecraftMap::streamBlocksToCache(ResourcePackLoader &pack, MapLoader<ElementType> &loader,
+        const std::function<void(int, int, int, std::unique_ptr<HierarchicalGrid>, uint8 *)> &regionHandler)
+{
+    // Blocks may only be resolved once the rows of region files next to them
+    // are loaded, and their regular blocks may only be resolved once the special
+    // blocks of the next row are, which still need the unresolved ids. Rows
+    // are therefore finished two rows behind the loader, and at most three
+    // rows of grids are held uncompressed at any time
+    struct PendingRow
+    {
+        std::vector<Vec2i> regions;
+        uint32 firstGrid;
+        std::vector<DeferredBlock> deferredBlocks;
+    };
+    std::deque<PendingRow> rows;
+    PendingRow current{std::vector<Vec2i>(), 0, std::vector<DeferredBlock>()};
+    QuadGeometry emitters;
+
+    auto finishRow = [&](PendingRow &row) {
+        resolveRegularBlocks(pack, row.regions, row.deferredBlocks);
+        collectEmitters(row.regions, emitters);
+
+        std::vector<std::unique_ptr<HierarchicalGrid>> grids;
+        for (size_t i = 0; i < row.regions.size(); ++i) {
+            _regions.erase(row.regions[i]);
+            grids.emplace_back(std::move(_grids[row.firstGrid + i]));
+        }
+        _regionCache->add(std::move(grids));
+    };
+
+    loader.loadRegions([&](int x, int z, int height, std::unique_ptr<HierarchicalGrid> grid, uint8 *biomes) {
+        current.regions.push_back(Vec2i(x, z));
+        regionHandler(x, z, height, std::move(grid), biomes);
+    }, [&]() {
+        rows.emplace_back(std::move(current));
+        current = PendingRow{std::vector<Vec2i>(), uint32(_grids.size()), std::vector<DeferredBlock>()};
+
+        if (rows.size() >= 2) {
+            PendingRow &previous = rows[rows.size() - 2];
+            resolveSpecialBlocks(pack, previous.regions, previous.deferredBlocks);
+        }
+        if (rows.size() >= 3) {
+            finishRow(rows.front());
+            rows.pop_front();
+        }
+    });
+
+    if (!rows.empty())
+        resolveSpecialBlocks(pack, rows.back().regions, rows.back().deferredBlocks);
+    for (PendingRow &row : rows)
+        finishRow(row);
+
+    _grids.clear();
+    _regions.clear();
 
     _lights = std::make_shared<MultiQuadLight>(std::move(emitters), _materials);
 }
@@ -560,6 +639,8 @@ void TraceableMinecraftMap::fromJson(JsonPtr value, const Scene &scene)
         else
             _packPaths.emplace_back(scene.fetchResource(packs));
     }
+
+    value.getField("region_memory_budget", _regionMemoryBudget);
 }
 
 rapidjson::Value TraceableMinecraftMap::toJson(Allocator &allocator) const
@@ -577,6 +658,8 @@ rapidjson::Value TraceableMinecraftMap::toJson(Allocator &allocator) const
             a.PushBack(JsonUtils::toJson(*p, allocator), allocator);
         result.add("resource_packs", std::move(a));
     }
+    if (_regionMemoryBudget > 0.0f)
+        result.add("region_memory_budget", _regionMemoryBudget);
 
     return result;
 }
@@ -598,7 +681,7 @@ void TraceableMinecraftMap::loadResources()
             buildModels(pack);
 
             MapLoader<ElementType> loader(*_mapPath);
-            loader.loadRegions([&](int x, int z, int height, ElementType *data, uint8 *biomes) {
+            auto regionHandler = [&](int x, int z, int height, std::unique_ptr<HierarchicalGrid> grid, uint8 *biomes) {
                 Box3f bounds(Vec3f(x*256.0f, 0.0f, z*256.0f), Vec3f((x + 1)*256.0f, float(height), (z + 1)*256.0f));
                 Vec3f centroid((x + 0.5f)*256.0f, height*0.5f, (z + 0.5f)*256.0f);
 
@@ -608,20 +691,34 @@ void TraceableMinecraftMap::loadResources()
 
                 buildBiomeColors(pack, x, z, biomes);
 
-                _grids.emplace_back(new HierarchicalGrid(bounds.min(), data));
+                _grids.emplace_back(std::move(grid));
                 _regions[Vec2i(x, z)] = _grids.back().get();
-            });
-
-            resolveBlocks(pack);
+            };
+
+            if (_regionMemoryBudget > 0.0f) {
+                _regionCache.reset(new RegionCache<HierarchicalGrid>(size_t(_regionMemoryBudget*1024.0f*1024.0f)));
+                streamBlocksToCache(pack, loader, regionHandler);
+            } else {
+                loader.loadRegions(regionHandler);
+                resolveBlocks(pack);
+            }
         } catch (const std::runtime_error &e) {
             DBG("Failed to load Minecraft map: %s", e.what());
 
             _bounds = Box3f();
             prims.clear();
+            _regionCache.reset();
         }
     }
 
-    _chunkBvh.reset(new Bvh::BinaryBvh(std::move(prims), 1));
+    Bvh::CacheKey key("minecraft_regions");
+    key.add(prims);
+
+    _chunkBvh = Bvh::BvhCache::fetch<Bvh::BinaryBvh>(key, uint32(prims.size()), [&]() {
+        Bvh::BinaryBvh *bvh = new Bvh::BinaryBvh(std::move(prims), 1);
+        DBG("Minecraft region BVH: %s", bvh->buildStats().toString());
+        return bvh;
+    });
 }
 
 bool TraceableMinecraftMap::intersect(Ray &ray, IntersectionTemporary &data) const
@@ -633,7 +730,7 @@ bool TraceableMinecraftMap::intersect(Ray &ray, IntersectionTemporary &data) con
     Vec3f dT = std::abs(1.0f/ray.dir());
 
     _chunkBvh->trace(ray, [&](Ray &ray, uint32 id, float tMin, const Vec3pf &/*bounds*/) {
-        _grids[id]->trace(ray, dT, tMin, [&](uint32 idx, const Vec3f &offset, float /*t*/) {
+        auto intersectQuads = [&](uint32 idx, const Vec3f &offset, float /*t*/) {
             Vec3f oldPos = ray.pos();
             ray.setPos(oldPos - offset);
 
@@ -641,7 +738,12 @@ bool TraceableMinecraftMap::intersect(Ray &ray, IntersectionTemporary &data) con
 
             ray.setPos(oldPos);
             return ray.farT() < farT;
-        });
+        };
+
+        if (_regionCache)
+            _regionCache->acquire(id)->trace(ray, dT, tMin, intersectQuads);
+        else
+            _grids[id]->trace(ray, dT, tMin, intersectQuads);
     });
 
     if (ray.farT() < farT) {
@@ -746,6 +848,9 @@ void TraceableMinecraftMap::prepareForRender()
 
 void TraceableMinecraftMap::teardownAfterRender()
 {
+    if (_regionCache)
+        _regionCache->printStats();
+
     /*_grids.clear();
     _chunkBvh.reset();
 
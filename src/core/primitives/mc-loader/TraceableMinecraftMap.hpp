@@ -4,6 +4,7 @@
 #include "MultiQuadLight.hpp"
 #include "QuadMaterial.hpp"
 #include "QuadGeometry.hpp"
+#include "RegionCache.hpp"
 
 #include "primitives/VoxelHierarchy.hpp"
 #include "primitives/Primitive.hpp"
@@ -15,6 +16,7 @@
 #include "bvh/BinaryBvh.hpp"
 
 #include <unordered_map>
+#include <functional>
 #include <vector>
 #include <memory>
 #include <string>
@@ -26,6 +28,7 @@ class Scene;
 namespace MinecraftLoader {
 
 class ResourcePackLoader;
+template<typename ElementType> class MapLoader;
 struct TexturedQuad;
 class ModelRef;
 
@@ -44,12 +47,14 @@ class TraceableMinecraftMap : public Primitive
 
     PathPtr _mapPath;
     std::vector<PathPtr> _packPaths;
+    // In MB. If set, region grids are only built on demand (see RegionCache)
+    float _regionMemoryBudget;
 
     std::shared_ptr<Bsdf> _missingBsdf;
     std::vector<QuadMaterial> _materials;
     std::unordered_map<std::string, int> _bsdfCache;
     std::unordered_map<const ModelRef *, int> _modelToPrimitive;
-    std::unordered_map<uint32, int> _liquidMap;
+    std::unordered_map<uint64, int> _liquidMap;
 
     QuadGeometry _geometry;
     QuadGeometry _emitterTemplates;
@@ -58,6 +63,8 @@ class TraceableMinecraftMap : public Primitive
     std::unique_ptr<TriangleMesh> _proxy;
     std::vector<std::unique_ptr<HierarchicalGrid>> _grids;
     std::unordered_map<Vec2i, HierarchicalGrid *> _regions;
+    // Replaces _grids once loading is done, if a memory budget is set
+    std::unique_ptr<RegionCache<HierarchicalGrid>> _regionCache;
 
     std::vector<std::unique_ptr<BiomeTileTexture>> _biomes;
     std::unordered_map<Vec2i, const BiomeTileTexture *> _biomeMap;
@@ -83,7 +90,25 @@ class TraceableMinecraftMap : public Primitive
 
     int resolveLiquidBlock(ResourcePackLoader &pack, int x, int y, int z);
 
+    // Special and liquid blocks depend on the unresolved ids of their
+    // neighbours, so their resolved ids are only written by
+    // resolveRegularBlocks, once all of their neighbours were looked at
+    struct DeferredBlock
+    {
+        ElementType &dst;
+        ElementType value;
+    };
+
+    void resolveSpecialBlocks(ResourcePackLoader &pack, const std::vector<Vec2i> &regions,
+            std::vector<DeferredBlock> &deferredBlocks);
+    void resolveRegularBlocks(ResourcePackLoader &pack, const std::vector<Vec2i> &regions,
+            std::vector<DeferredBlock> &deferredBlocks);
+    void collectEmitters(const std::vector<Vec2i> &regions, QuadGeometry &emitters);
     void resolveBlocks(ResourcePackLoader &pack);
+    // Used instead of resolveBlocks if a memory budget is set. Resolves the
+    // regions while they are loaded and moves them into the region cache
+    void streamBlocksToCache(ResourcePackLoader &pack, MapLoader<ElementType> &loader,
+            const std::function<void(int, int, int, std::unique_ptr<HierarchicalGrid>, uint8 *)> &regionHandler);
 
 public:
     TraceableMinecraftMap();
@@ -0,0 +1,166 @@
+#include "LightBvh.hpp"
+
+#include "primitives/Primitive.hpp"
+
+#include "bvh/BvhBuilder.hpp"
+
+#include "math/MathUtil.hpp"
+#include "math/Angle.hpp"
+
+#include <utility>
+
+namespace Tungsten {
+
+static CONSTEXPR uint32 LeafFlag = 0x80000000u;
+
+LightBvh::LightBvh(const std::vector<const Primitive *> &lights)
+{
+    std::vector<Node> leaves;
+    Bvh::PrimVector prims;
+    for (const Primitive *light : lights) {
+        Node leaf;
+        if (light->isInfinite() || !light->emissionCone(leaf.axis, leaf.theta, leaf.intensity))
+            continue;
+        leaf.bounds = light->bounds();
+        leaf.children = uint32(_lights.size()) | LeafFlag;
+
+        prims.emplace_back(leaf.bounds, leaf.bounds.center(), uint32(_lights.size()));
+        leaves.push_back(leaf);
+        _lights.push_back(light);
+    }
+
+    if (prims.empty()) {
+        _nodes.emplace_back();
+        _nodes[0].theta = PI;
+        _nodes[0].intensity = 0.0f;
+        _nodes[0].children = LeafFlag;
+        return;
+    }
+
+    Bvh::BvhBuilder builder(2);
+    builder.build(std::move(prims));
+
+    _nodes.resize(builder.numNodes());
+    uint32 tail = 1;
+    recursiveBuild(builder.root(), 0, tail, leaves);
+}
+
+void LightBvh::recursiveBuild(const Bvh::NaiveBvhNode *node, uint32 head, uint32 &tail,
+        const std::vector<Node> &leaves)
+{
+    Node &dst = _nodes[head];
+    if (node->isLeaf()) {
+        dst = leaves[node->id()];
+        _lightSet.insert(_lights[node->id()]);
+    } else {
+        uint32 children = tail;
+        tail += 2;
+        recursiveBuild(node->child(0), children + 0, tail, leaves);
+        recursiveBuild(node->child(1), children + 1, tail, leaves);
+
+        const Node &l = _nodes[children + 0];
+        const Node &r = _nodes[children + 1];
+        dst.bounds = l.bounds;
+        dst.bounds.grow(r.bounds);
+        dst.axis = l.axis;
+        dst.theta = l.theta;
+        coneUnion(dst.axis, dst.theta, r.axis, r.theta);
+        dst.intensity = l.intensity + r.intensity;
+        dst.children = children;
+    }
+}
+
+// Smallest cone containing both cones (axis, theta) and (axisB, thetaB)
+void LightBvh::coneUnion(Vec3f &axis, float &theta, Vec3f axisB, float thetaB)
+{
+    if (thetaB > theta) {
+        std::swap(axis, axisB);
+        std::swap(theta, thetaB);
+    }
+
+    float cosThetaD = clamp(axis.dot(axisB), -1.0f, 1.0f);
+    float thetaD = std::acos(cosThetaD);
+    if (min(thetaD + thetaB, PI) <= theta)
+        return;
+
+    float thetaO = (theta + thetaD + thetaB)*0.5f;
+    Vec3f ortho = axisB - axis*cosThetaD;
+    if (thetaO >= PI) {
+        theta = PI;
+    } else if (ortho.lengthSq() < 1e-12f) {
+        theta = min(thetaD + thetaB, PI);
+    } else {
+        float thetaR = thetaO - theta;
+        axis = (axis*std::cos(thetaR) + ortho.normalized()*std::sin(thetaR)).normalized();
+        theta = thetaO;
+    }
+}
+
+// Bounds the irradiance at p from the lights in the node by their summed
+// intensity, attenuated by the smallest angle any of them can emit towards p
+float LightBvh::nodeImportance(const Node &node, const Vec3f &p) const
+{
+    Vec3f d = p - node.bounds.center();
+    float distSq = d.lengthSq();
+    float radiusSq = node.bounds.diagonal().lengthSq()*0.25f;
+
+    // Inside the bounding sphere, no emission direction can be ruled out
+    if (distSq <= radiusSq || node.theta >= PI)
+        return node.intensity/max(max(distSq, radiusSq), 1e-6f);
+
+    float dist = std::sqrt(distSq);
+    float thetaL = std::acos(clamp(node.axis.dot(d)/dist, -1.0f, 1.0f));
+    float thetaU = std::asin(std::sqrt(radiusSq/distSq));
+    float thetaP = max(thetaL - node.theta - thetaU, 0.0f);
+    if (thetaP >= PI_HALF)
+        return 0.0f;
+
+    return node.intensity*std::cos(thetaP)/distSq;
+}
+
+// Single lights know their own emission better than the cone bound does
+float LightBvh::childImportance(uint32 threadIndex, uint32 child, const Vec3f &p) const
+{
+    const Node &node = _nodes[child];
+    if (node.children & LeafFlag) {
+        float radiance = _lights[node.children & ~LeafFlag]->approximateRadiance(threadIndex, p);
+        if (radiance >= 0.0f)
+            return radiance;
+    }
+    return nodeImportance(node, p);
+}
+
+const Primitive *LightBvh::sample(uint32 threadIndex, const Vec3f &p, float u, float &pdf) const
+{
+    pdf = 1.0f;
+    if (_lights.empty())
+        return nullptr;
+
+    uint32 node = 0;
+    while (!(_nodes[node].children & LeafFlag)) {
+        uint32 children = _nodes[node].children;
+        float importanceL = childImportance(threadIndex, children + 0, p);
+        float importanceR = childImportance(threadIndex, children + 1, p);
+        float total = importanceL + importanceR;
+        if (!(total > 0.0f))
+            return nullptr;
+
+        float probL = importanceL/total;
+        float probR = importanceR/total;
+        // The sample is rescaled to [0, 1) after each decision, so that a
+        // single dimension suffices for the whole descent
+        if (importanceR == 0.0f || (importanceL > 0.0f && u < probL)) {
+            u = min(u/probL, 1.0f - 1e-7f);
+            pdf *= probL;
+            node = children + 0;
+        } else {
+            u = clamp((u - probL)/probR, 0.0f, 1.0f - 1e-7f);
+            pdf *= probR;
+            node = children + 1;
+        }
+    }
+
+    return _lights[_nodes[node].children & ~LeafFlag];
+}
+
+}
@@ -0,0 +1,97 @@
+#ifndef LIGHTBVH_HPP_
+#define LIGHTBVH_HPP_
+
+#include "math/Vec.hpp"
+#include "math/Box.hpp"
+
+#include "IntTypes.hpp"
+
+#include <unordered_set>
+#include <vector>
+
+namespace Tungsten {
+
+namespace Bvh {
+class NaiveBvhNode;
+}
+
+class Primitive;
+
+// Hierarchy over the finite lights of a scene for many-light sampling. Every
+// node stores the bounds, an orientation cone and the summed intensity of
+// the lights below it, from which an importance relative to a shading point
+// is estimated (see Conty and Kulla, "Importance Sampling of Many Lights with
+// Adaptive Tree Splitting"). Sampling descends from the root and picks a
+// child proportional to its importance at each level, so it costs O(log n)
+// instead of evaluating all lights.
+// This generalizes the emitter hierarchies of the Minecraft map
+// (mc-loader/EmissiveBvh.hpp) to arbitrary primitives that provide an
+// emission cone (see Primitive::emissionCone)
+class LightBvh
+{
+    struct Node
+    {
+        Box3f bounds;
+        // All emitting normals lie within theta of axis
+        Vec3f axis;
+        float theta;
+        float intensity;
+        // Index of the left child, or the light index with the top bit set
+        uint32 children;
+    };
+
+    std::vector<const Primitive *> _lights;
+    std::vector<Node> _nodes;
+    std::unordered_set<const Primitive *> _lightSet;
+
+    void recursiveBuild(const Bvh::NaiveBvhNode *node, uint32 head, uint32 &tail,
+            const std::vector<Node> &leaves);
+
+    static void coneUnion(Vec3f &axis, float &theta, Vec3f axisB, float thetaB);
+
+    float nodeImportance(const Node &node, const Vec3f &p) const;
+    float childImportance(uint32 threadIndex, uint32 child, const Vec3f &p) const;
+
+public:
+    // Scenes with fewer lights than this are better off evaluating the
+    // exact approximateRadiance of every light
+    static CONSTEXPR uint32 MinLights = 16;
+
+    // Only lights for which emissionCone returns true are added. All others
+    // have to be sampled separately
+    LightBvh(const std::vector<const Primitive *> &lights);
+
+    // Importance of the whole hierarchy at p, in the units of
+    // Primitive::approximateRadiance
+    float importance(const Vec3f &p) const
+    {
+        return nodeImportance(_nodes[0], p);
+    }
+
+    // Picks a light with probability proportional to its importance at p.
+    // u is consumed on the way down. Returns nullptr if no light can
+    // contribute to p.
+    // There is no matching pdf query: the MIS weights of
+    // TraceBase::sampleDirect only compare strategies for the chosen light,
+    // so the selection probability only enters as the returned pdf
+    const Primitive *sample(uint32 threadIndex, const Vec3f &p, float u, float &pdf) const;
+
+    bool contains(const Primitive *light) const
+    {
+        return _lightSet.count(light) != 0;
+    }
+
+    const std::vector<const Primitive *> &lights() const
+    {
+        return _lights;
+    }
+
+    bool empty() const
+    {
+        return _lights.empty();
+    }
+};
+
+}
+
+#endif /* LIGHTBVH_HPP_ */
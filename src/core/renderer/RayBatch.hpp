@@ -0,0 +1,153 @@
+#ifndef RAYBATCH_HPP_
+#define RAYBATCH_HPP_
+
+#include "primitives/IntersectionTemporary.hpp"
+#include "primitives/IntersectionInfo.hpp"
+
+#include "sse/SimdFloat.hpp"
+
+#include "math/Ray.hpp"
+
+#include "AlignedAllocator.hpp"
+#include "IntTypes.hpp"
+
+#include <vector>
+
+namespace Tungsten {
+
+// A batch of rays that are traced together through TraceableScene. Rays are
+// stored as a structure of arrays in packets of PacketSize lanes, which map
+// directly onto Embree's ray packets. Coherent rays (e.g. camera rays of a
+// tile) should be pushed next to each other, so that they share a packet.
+// After tracing, each ray has its own intersection results and hit flag
+class RayBatch
+{
+public:
+    static CONSTEXPR uint32 PacketSize = 4;
+
+    struct Packet
+    {
+        float4 posX, posY, posZ;
+        float4 dirX, dirY, dirZ;
+        float4 nearT, farT, time;
+    };
+
+private:
+    template<typename T> using aligned_vector = std::vector<T, AlignedAllocator<T, 16>>;
+
+    aligned_vector<Packet> _packets;
+    std::vector<uint8> _primaryRay;
+    std::vector<uint8> _hit;
+    std::vector<IntersectionTemporary> _data;
+    std::vector<IntersectionInfo> _info;
+    uint32 _size;
+
+public:
+    RayBatch()
+    : _size(0)
+    {
+    }
+
+    void clear()
+    {
+        _size = 0;
+    }
+
+    uint32 push(const Ray &ray)
+    {
+        uint32 idx = _size++;
+        if (_size > _primaryRay.size()) {
+            if (idx % PacketSize == 0)
+                _packets.emplace_back();
+            _primaryRay.emplace_back();
+            _hit.emplace_back();
+            _data.emplace_back();
+            _info.emplace_back();
+        }
+        setRay(idx, ray);
+        return idx;
+    }
+
+    void setRay(uint32 i, const Ray &ray)
+    {
+        Packet &p = _packets[i/PacketSize];
+        uint32 lane = i % PacketSize;
+        p.posX [lane] = ray.pos().x();
+        p.posY [lane] = ray.pos().y();
+        p.posZ [lane] = ray.pos().z();
+        p.dirX [lane] = ray.dir().x();
+        p.dirY [lane] = ray.dir().y();
+        p.dirZ [lane] = ray.dir().z();
+        p.nearT[lane] = ray.nearT();
+        p.farT [lane] = ray.farT();
+        p.time [lane] = ray.time();
+        _primaryRay[i] = ray.isPrimaryRay();
+    }
+
+    Ray ray(uint32 i) const
+    {
+        const Packet &p = _packets[i/PacketSize];
+        uint32 lane = i % PacketSize;
+        Ray result(
+            Vec3f(p.posX[lane], p.posY[lane], p.posZ[lane]),
+            Vec3f(p.dirX[lane], p.dirY[lane], p.dirZ[lane]),
+            p.nearT[lane],
+            p.farT[lane],
+            p.time[lane]
+        );
+        result.setPrimaryRay(_primaryRay[i] != 0);
+        return result;
+    }
+
+    void setFarT(uint32 i, float farT)
+    {
+        _packets[i/PacketSize].farT[i % PacketSize] = farT;
+    }
+
+    // Results of the last trace. For intersection queries, hit() is set if
+    // the ray hit a finite primitive and data()/info() are filled in. For
+    // occlusion queries, hit() is set if the ray is occluded
+    void setHit(uint32 i, bool hit)
+    {
+        _hit[i] = hit;
+    }
+
+    bool hit(uint32 i) const
+    {
+        return _hit[i] != 0;
+    }
+
+    IntersectionTemporary &data(uint32 i)
+    {
+        return _data[i];
+    }
+
+    IntersectionInfo &info(uint32 i)
+    {
+        return _info[i];
+    }
+
+    const Packet &packet(uint32 i) const
+    {
+        return _packets[i];
+    }
+
+    uint32 packetCount() const
+    {
+        return (_size + PacketSize - 1)/PacketSize;
+    }
+
+    uint32 size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+};
+
+}
+
+#endif /* RAYBATCH_HPP_ */
@@ -0,0 +1,139 @@
+#include "RenderStatistics.hpp"
+
+#include "math/MathUtil.hpp"
+
+#include "io/JsonObject.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace Tungsten {
+
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<RenderStatistics::ThreadCounters>> registry;
+static uint64 intervalStart = 0;
+
+static thread_local RenderStatistics::ThreadCounters *localCounters = nullptr;
+
+static uint64 nanosecondsNow()
+{
+    return uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+RenderStatistics::ThreadCounters::ThreadCounters()
+: category(TimeNone),
+  categoryStart(0)
+{
+    for (int i = 0; i < CounterCount; ++i) {
+        counters[i] = 0;
+        counterBaseline[i] = 0;
+    }
+    for (int i = 0; i < TimeCategoryCount; ++i) {
+        nanoseconds[i] = 0;
+        timeBaseline[i] = 0;
+    }
+}
+
+int RenderStatistics::ThreadCounters::switchCategory(int newCategory)
+{
+    uint64 now = nanosecondsNow();
+    if (category != TimeNone) {
+        std::atomic<uint64> &time = nanoseconds[category];
+        time.store(time.load(std::memory_order_relaxed) + (now - categoryStart), std::memory_order_relaxed);
+    }
+
+    int previous = category;
+    category = newCategory;
+    categoryStart = now;
+    return previous;
+}
+
+RenderStatistics::Report::Report()
+: elapsed(0.0)
+{
+    for (int i = 0; i < CounterCount; ++i)
+        counters[i] = 0;
+    for (int i = 0; i < TimeCategoryCount; ++i)
+        seconds[i] = 0.0;
+}
+
+rapidjson::Value RenderStatistics::Report::toJson(rapidjson::Document::AllocatorType &allocator) const
+{
+    double invElapsed = elapsed > 0.0 ? 1.0/elapsed : 0.0;
+    uint64 shadowRays = counters[OcclusionRays] + counters[ShadowSegments];
+    uint64 pathRays = counters[ClosestHitRays] - min(counters[ShadowSegments], counters[ClosestHitRays]);
+    uint64 secondaryRays = pathRays - min(counters[PrimaryRays], pathRays);
+    double pathLength = counters[Samples] ? double(pathRays)/counters[Samples] : 0.0;
+
+    rapidjson::Value threadValue(rapidjson::kArrayType);
+    for (double samplesPerSecond : threadSamplesPerSecond)
+        threadValue.PushBack(JsonUtils::toJson(samplesPerSecond, allocator), allocator);
+
+    return JsonObject{allocator,
+        "elapsed", elapsed,
+        "primary_rays", counters[PrimaryRays],
+        "secondary_rays", secondaryRays,
+        "shadow_rays", shadowRays,
+        "samples", counters[Samples],
+        "primary_rays_per_second", counters[PrimaryRays]*invElapsed,
+        "secondary_rays_per_second", secondaryRays*invElapsed,
+        "shadow_rays_per_second", shadowRays*invElapsed,
+        "samples_per_second", counters[Samples]*invElapsed,
+        "average_path_length", pathLength,
+        "intersection_time", seconds[TimeIntersection],
+        "shading_time", seconds[TimeShading],
+        "light_sampling_time", seconds[TimeLightSampling],
+        "thread_samples_per_second", std::move(threadValue)
+    };
+}
+
+RenderStatistics::ThreadCounters &RenderStatistics::local()
+{
+    if (!localCounters) {
+        std::unique_lock<std::mutex> lock(registryMutex);
+        registry.emplace_back(new ThreadCounters());
+        localCounters = registry.back().get();
+    }
+    return *localCounters;
+}
+
+void RenderStatistics::reset()
+{
+    std::unique_lock<std::mutex> lock(registryMutex);
+
+    for (const auto &thread : registry) {
+        for (int i = 0; i < CounterCount; ++i)
+            thread->counterBaseline[i] = thread->counters[i].load(std::memory_order_relaxed);
+        for (int i = 0; i < TimeCategoryCount; ++i)
+            thread->timeBaseline[i] = thread->nanoseconds[i].load(std::memory_order_relaxed);
+    }
+    intervalStart = nanosecondsNow();
+}
+
+RenderStatistics::Report RenderStatistics::report()
+{
+    std::unique_lock<std::mutex> lock(registryMutex);
+
+    Report result;
+    result.elapsed = (nanosecondsNow() - intervalStart)*1e-9;
+
+    for (const auto &thread : registry) {
+        uint64 counts[CounterCount];
+        for (int i = 0; i < CounterCount; ++i) {
+            counts[i] = thread->counters[i].load(std::memory_order_relaxed) - thread->counterBaseline[i];
+            result.counters[i] += counts[i];
+        }
+        for (int i = 0; i < TimeCategoryCount; ++i)
+            result.seconds[i] += (thread->nanoseconds[i].load(std::memory_order_relaxed) - thread->timeBaseline[i])*1e-9;
+
+        // Threads that never traced a sample (e.g. the main thread) are left out
+        if (counts[Samples] > 0 && result.elapsed > 0.0)
+            result.threadSamplesPerSecond.push_back(counts[Samples]/result.elapsed);
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,119 @@
+#ifndef RENDERSTATISTICS_HPP_
+#define RENDERSTATISTICS_HPP_
+
+#include "IntTypes.hpp"
+
+#include <rapidjson/document.h>
+#include <atomic>
+#include <vector>
+
+namespace Tungsten {
+
+// Per-thread throughput counters for the renderer. Every thread increments
+// its own cache line padded block of counters without any locking, and the
+// blocks are only summed up when a report is requested.
+// Collection is compiled in with ENABLE_RENDER_STATISTICS. Otherwise the
+// RENDER_STAT_* macros below expand to nothing and there is no overhead.
+class RenderStatistics
+{
+public:
+    // TraceableScene counts every closest hit and occlusion query it
+    // answers. Integrators additionally count which of the closest hit
+    // queries were camera rays or segments of transmittance-aware shadow
+    // rays, so that the remainder can be reported as secondary rays
+    enum Counter
+    {
+        PrimaryRays,
+        ClosestHitRays,
+        OcclusionRays,
+        ShadowSegments,
+        Samples,
+        CounterCount
+    };
+
+    // Time is attributed exclusively, i.e. time spent intersecting shadow
+    // rays during light sampling only counts towards intersection time
+    enum TimeCategory
+    {
+        TimeNone = -1,
+        TimeIntersection,
+        TimeShading,
+        TimeLightSampling,
+        TimeCategoryCount
+    };
+
+    struct ThreadCounters
+    {
+        char _pad0[64];
+        std::atomic<uint64> counters[CounterCount];
+        std::atomic<uint64> nanoseconds[TimeCategoryCount];
+        // Only touched by the owning thread
+        int category;
+        uint64 categoryStart;
+        // Only touched while holding the registry lock
+        uint64 counterBaseline[CounterCount];
+        uint64 timeBaseline[TimeCategoryCount];
+        char _pad1[64];
+
+        ThreadCounters();
+
+        // Only the owning thread writes to its counters, so a plain
+        // load/store is enough and avoids a locked instruction
+        void add(Counter counter, uint64 amount)
+        {
+            counters[counter].store(counters[counter].load(std::memory_order_relaxed) + amount,
+                    std::memory_order_relaxed);
+        }
+
+        int switchCategory(int newCategory);
+    };
+
+    class ScopedTimer
+    {
+        ThreadCounters &_counters;
+        int _previous;
+
+    public:
+        ScopedTimer(TimeCategory category)
+        : _counters(local()),
+          _previous(_counters.switchCategory(category))
+        {
+        }
+
+        ~ScopedTimer()
+        {
+            _counters.switchCategory(_previous);
+        }
+    };
+
+    struct Report
+    {
+        double elapsed;
+        uint64 counters[CounterCount];
+        double seconds[TimeCategoryCount];
+        std::vector<double> threadSamplesPerSecond;
+
+        Report();
+
+        rapidjson::Value toJson(rapidjson::Document::AllocatorType &allocator) const;
+    };
+
+    static ThreadCounters &local();
+
+    // Starts a new measurement interval. Counts from before the call are
+    // excluded from subsequent reports
+    static void reset();
+    static Report report();
+};
+
+#ifdef ENABLE_RENDER_STATISTICS
+# define RENDER_STAT_ADD(COUNTER, AMOUNT) RenderStatistics::local().add(RenderStatistics::COUNTER, AMOUNT)
+# define RENDER_STAT_TIMER(CATEGORY) RenderStatistics::ScopedTimer renderStatTimer(RenderStatistics::CATEGORY)
+#else
+# define RENDER_STAT_ADD(COUNTER, AMOUNT) do {} while(false)
+# define RENDER_STAT_TIMER(CATEGORY)
+#endif
+
+}
+
+#endif /* RENDERSTATISTICS_HPP_ */
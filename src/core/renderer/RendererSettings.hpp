@@ -28,6 +28,7 @@ class RendererSettings : public JsonSerializable
     uint32 _sppStep;
     std::string _checkpointInterval;
     std::string _timeout;
+    std::string _deadline;
     std::vector<OutputBufferSettings> _outputs;
 
 public:
@@ -42,7 +43,8 @@ public:
       _spp(32),
       _sppStep(16),
       _checkpointInterval("0"),
-      _timeout("0")
+      _timeout("0"),
+      _deadline("0")
     {
     }
 
@@ -66,6 +68,7 @@ public:
         value.getField("spp_step", _sppStep);
         value.getField("checkpoint_interval", _checkpointInterval);
         value.getField("timeout", _timeout);
+        value.getField("deadline", _deadline);
 
         if (auto outputs = value["output_buffers"]) {
             for (unsigned i = 0; i < outputs.size(); ++i) {
@@ -86,7 +89,8 @@ public:
             "spp", _spp,
             "spp_step", _sppStep,
             "checkpoint_interval", _checkpointInterval,
-            "timeout", _timeout
+            "timeout", _timeout,
+            "deadline", _deadline
         };
         if (!_outputFile.empty())
             result.add("output_file", _outputFile);
@@ -199,6 +203,11 @@ public:
         return _timeout;
     }
 
+    std::string deadline() const
+    {
+        return _deadline;
+    }
+
     const std::vector<OutputBufferSettings> &renderOutputs() const
     {
         return _outputs;
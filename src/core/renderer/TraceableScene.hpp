@@ -4,6 +4,8 @@
 #include "integrators/Integrator.hpp"
 
 #include "primitives/InfiniteSphere.hpp"
+#include "primitives/TriangleMesh.hpp"
+#include "primitives/Instance.hpp"
 #include "primitives/EmbreeUtil.hpp"
 #include "primitives/Primitive.hpp"
 
@@ -13,7 +15,12 @@
 
 #include "media/Medium.hpp"
 
+#include "RenderStatistics.hpp"
 #include "RendererSettings.hpp"
+#include "LightBvh.hpp"
+#include "RayBatch.hpp"
+#include <algorithm>
+#include <typeinfo>
 #include <vector>
 #include <memory>
 
@@ -25,6 +32,12 @@ namespace Tungsten {
 class TraceableScene
 {
 public:
+    struct InstanceRange
+    {
+        unsigned firstGeomId;
+        const Instance *instance;
+    };
+
     struct IntersectionRay : RTCRay
     {
         IntersectionTemporary &data;
@@ -35,6 +48,42 @@ public:
         : RTCRay(eRay), data(data_), ray(ray_), userGeomId(userGeomId_) {}
     };
 
+    // Packet counterpart of IntersectionRay. Lane i of the packet
+    // corresponds to ray offset + i of the batch
+    static_assert(RayBatch::PacketSize == 4, "Ray batch packets must match RTCRay4");
+    struct IntersectionPacket : RTCRay4
+    {
+        RayBatch &batch;
+        uint32 offset;
+        unsigned userGeomId;
+
+        IntersectionPacket(RayBatch &batch_, uint32 offset_, unsigned userGeomId_)
+        : batch(batch_), offset(offset_), userGeomId(userGeomId_)
+        {
+            const RayBatch::Packet &p = batch.packet(offset/RayBatch::PacketSize);
+            _mm_store_ps(orgx, p.posX.raw());
+            _mm_store_ps(orgy, p.posY.raw());
+            _mm_store_ps(orgz, p.posZ.raw());
+            _mm_store_ps(dirx, p.dirX.raw());
+            _mm_store_ps(diry, p.dirY.raw());
+            _mm_store_ps(dirz, p.dirZ.raw());
+            _mm_store_ps(tnear, p.nearT.raw());
+            _mm_store_ps(tfar, p.farT.raw());
+            _mm_store_ps(time, p.time.raw());
+            for (int i = 0; i < 4; ++i) {
+                mask[i] = ~0u;
+                geomID[i] = primID[i] = instID[i] = RTC_INVALID_GEOMETRY_ID;
+            }
+        }
+
+        Ray ray(int lane) const
+        {
+            Ray result = batch.ray(offset + lane);
+            result.setFarT(tfar[lane]);
+            return result;
+        }
+    };
+
 private:
     const float DefaultEpsilon = 5e-4f;
 
@@ -45,14 +94,92 @@ private:
     std::vector<std::shared_ptr<Medium>> &_media;
     std::vector<std::shared_ptr<Primitive>> _lights;
     std::vector<std::shared_ptr<Primitive>> _infiniteLights;
+    std::unique_ptr<LightBvh> _lightBvh;
+    std::vector<const Primitive *> _looseLights;
     std::vector<const Primitive *> _finites;
+    std::vector<const Primitive *> _userPrimitives;
+    std::vector<const TriangleMesh *> _meshes;
+    std::vector<InstanceRange> _instances;
     RendererSettings _settings;
+    uint32 _seed;
 
     RTCScene _scene = nullptr;
-    unsigned _userGeomId;
+    unsigned _userGeomId = RTC_INVALID_GEOMETRY_ID;
 
     Box3f _sceneBounds;
 
+    bool finishIntersection(const Ray &ray, IntersectionTemporary &data, IntersectionInfo &info) const
+    {
+        if (data.primitive) {
+            info.p = ray.pos() + ray.dir()*ray.farT();
+            info.w = ray.dir();
+            info.epsilon = DefaultEpsilon;
+            data.primitive->intersectionInfo(data, info);
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    // Triangle meshes and instances are native geometry of the scene BVH.
+    // Embree only reports the triangle and barycentrics for them, so the
+    // intersection temporary is filled in after traversal
+    void finishNativeHit(unsigned instId, unsigned geomId, unsigned primId, float u, float v, const Ray &ray,
+            IntersectionTemporary &data) const
+    {
+        if (instId != RTC_INVALID_GEOMETRY_ID) {
+            auto iter = std::upper_bound(_instances.begin(), _instances.end(), instId,
+                    [](unsigned id, const InstanceRange &r) { return id < r.firstGeomId; }) - 1;
+            iter->instance->setIntersection(ray, instId - iter->firstGeomId, primId, u, v, data);
+        } else if (geomId != RTC_INVALID_GEOMETRY_ID && geomId != _userGeomId) {
+            _meshes[geomId]->setIntersection(ray, primId, u, v, data);
+        }
+    }
+
+    void collectLights()
+    {
+        _lights.clear();
+        _infiniteLights.clear();
+
+        int lightCount = 0;
+        for (std::shared_ptr<Primitive> &m : _primitives) {
+            if (m->isEmissive()) {
+                lightCount++;
+                if (m->isSamplable())
+                    _lights.push_back(m);
+                if (m->isInfinite())
+                    _infiniteLights.push_back(m);
+            }
+        }
+        if (lightCount == 0) {
+            std::shared_ptr<InfiniteSphere> defaultLight = std::make_shared<InfiniteSphere>();
+            defaultLight->setEmission(std::make_shared<ConstantTexture>(1.0f));
+            _lights.push_back(defaultLight);
+            _infiniteLights.push_back(defaultLight);
+        }
+
+        // Scenes with many lights sample most of them through the light BVH.
+        // The remaining (loose) lights are still evaluated one by one
+        _lightBvh.reset();
+        _looseLights.clear();
+        for (const std::shared_ptr<Primitive> &m : _lights)
+            _looseLights.push_back(m.get());
+        if (_lights.size() >= LightBvh::MinLights) {
+            std::unique_ptr<LightBvh> bvh(new LightBvh(_looseLights));
+            if (bvh->lights().size() >= LightBvh::MinLights) {
+                _looseLights.erase(std::remove_if(_looseLights.begin(), _looseLights.end(),
+                        [&](const Primitive *p) { return bvh->contains(p); }), _looseLights.end());
+                _lightBvh = std::move(bvh);
+            }
+        }
+    }
+
+    static void packetValidMask(const RayBatch &batch, uint32 offset, int *valid)
+    {
+        for (uint32 i = 0; i < RayBatch::PacketSize; ++i)
+            valid[i] = offset + i < batch.size() ? -1 : 0;
+    }
+
 public:
     TraceableScene(Camera &cam, Integrator &integrator,
             std::vector<std::shared_ptr<Primitive>> &primitives,
@@ -65,7 +192,8 @@ public:
       _primitives(primitives),
       _bsdfs(bsdfs),
       _media(media),
-      _settings(settings)
+      _settings(settings),
+      _seed(seed)
     {
         _cam.prepareForRender();
         _cam.requestOutputBuffers(_settings.renderOutputs());
@@ -76,30 +204,13 @@ public:
         for (std::shared_ptr<Bsdf> &b : _bsdfs)
             b->prepareForRender();
 
-        int finiteCount = 0, lightCount = 0;
         for (std::shared_ptr<Primitive> &m : _primitives) {
             m->prepareForRender();
             for (int i = 0; i < m->numBsdfs(); ++i)
                 if (m->bsdf(i)->unnamed())
                     m->bsdf(i)->prepareForRender();
-
-            if (!m->isDirac() && !m->isInfinite())
-                finiteCount++;
-
-            if (m->isEmissive()) {
-                lightCount++;
-                if (m->isSamplable())
-                    _lights.push_back(m);
-                if (m->isInfinite())
-                    _infiniteLights.push_back(m);
-            }
-        }
-        if (lightCount == 0) {
-            std::shared_ptr<InfiniteSphere> defaultLight = std::make_shared<InfiniteSphere>();
-            defaultLight->setEmission(std::make_shared<ConstantTexture>(1.0f));
-            _lights.push_back(defaultLight);
-            _infiniteLights.push_back(defaultLight);
         }
+        collectLights();
 
         for (std::shared_ptr<Primitive> &m : _primitives) {
             if (m->isInfinite() || m->isDirac())
@@ -110,28 +221,82 @@ public:
         }
 
         if (_settings.useSceneBvh()) {
-            _scene = rtcDeviceNewScene(EmbreeUtil::getDevice(), RTC_SCENE_STATIC | RTC_SCENE_INCOHERENT, RTC_INTERSECT1);
-            _userGeomId = rtcNewUserGeometry(_scene, _finites.size());
+            _scene = rtcDeviceNewScene(EmbreeUtil::getDevice(), EmbreeUtil::sceneFlags(),
+                    RTC_INTERSECT1 | RTC_INTERSECT4);
+
+            // Triangle meshes and instances of them go straight into the
+            // scene BVH, which saves traversing a second BVH per primitive.
+            // Everything else is intersected through a single user geometry
+            std::vector<const Instance *> instances;
+            for (const Primitive *prim : _finites) {
+                const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(prim);
+                const Instance *instance = dynamic_cast<const Instance *>(prim);
+                if (mesh && typeid(*mesh) == typeid(TriangleMesh)) {
+                    if (mesh->hasEmbreeGeometry()) {
+                        unsigned geomId = mesh->addEmbreeGeometry(_scene);
+                        if (geomId >= _meshes.size())
+                            _meshes.resize(geomId + 1, nullptr);
+                        _meshes[geomId] = mesh;
+                    }
+                } else if (instance && instance->hasEmbreeInstances()) {
+                    instances.push_back(instance);
+                } else {
+                    _userPrimitives.push_back(prim);
+                }
+            }
+            // Instances are added last, so that their (possibly millions of)
+            // geometry IDs do not inflate the mesh lookup table
+            for (const Instance *instance : instances)
+                _instances.push_back(InstanceRange{instance->addEmbreeInstances(_scene), instance});
+        }
+
+        if (_settings.useSceneBvh() && !_userPrimitives.empty()) {
+            _userGeomId = rtcNewUserGeometry(_scene, _userPrimitives.size());
             rtcSetUserData(_scene, _userGeomId, this);
 
             rtcSetBoundsFunction(_scene, _userGeomId, [](void *ptr, size_t i, RTCBounds &bounds) {
-                bounds = EmbreeUtil::convert(static_cast<TraceableScene *>(ptr)->finites()[i]->bounds());
+                bounds = EmbreeUtil::convert(static_cast<TraceableScene *>(ptr)->_userPrimitives[i]->bounds());
             });
             rtcSetIntersectFunction(_scene, _userGeomId, [](void *ptr, RTCRay &embreeRay, size_t i) {
                 IntersectionRay &ray = *static_cast<IntersectionRay *>(&embreeRay);
-                if (static_cast<TraceableScene *>(ptr)->finites()[i]->intersect(ray.ray, ray.data)) {
+                // A closer native triangle may have been found in the meantime
+                ray.ray.setFarT(embreeRay.tfar);
+                if (static_cast<TraceableScene *>(ptr)->_userPrimitives[i]->intersect(ray.ray, ray.data)) {
                     embreeRay.tfar = ray.ray.farT();
                     embreeRay.geomID = ray.userGeomId;
                     embreeRay.primID = i;
+                    embreeRay.instID = RTC_INVALID_GEOMETRY_ID;
                 }
             });
             rtcSetOccludedFunction(_scene, _userGeomId, [](void *ptr, RTCRay &embreeRay, size_t i) {
-                if (static_cast<TraceableScene *>(ptr)->finites()[i]->occluded(Ray(EmbreeUtil::convert(embreeRay))))
+                if (static_cast<TraceableScene *>(ptr)->_userPrimitives[i]->occluded(Ray(EmbreeUtil::convert(embreeRay))))
                     embreeRay.geomID = 0;
             });
-
-            rtcCommit(_scene);
+            rtcSetIntersectFunction4(_scene, _userGeomId, [](const void *valid, void *ptr, RTCRay4 &embreeRay, size_t i) {
+                IntersectionPacket &packet = *static_cast<IntersectionPacket *>(&embreeRay);
+                const Primitive *prim = static_cast<TraceableScene *>(ptr)->_userPrimitives[i];
+                for (int lane = 0; lane < 4; ++lane) {
+                    if (!static_cast<const int *>(valid)[lane])
+                        continue;
+                    Ray ray = packet.ray(lane);
+                    if (prim->intersect(ray, packet.batch.data(packet.offset + lane))) {
+                        embreeRay.tfar[lane] = ray.farT();
+                        embreeRay.geomID[lane] = packet.userGeomId;
+                        embreeRay.primID[lane] = i;
+                        embreeRay.instID[lane] = RTC_INVALID_GEOMETRY_ID;
+                    }
+                }
+            });
+            rtcSetOccludedFunction4(_scene, _userGeomId, [](const void *valid, void *ptr, RTCRay4 &embreeRay, size_t i) {
+                IntersectionPacket &packet = *static_cast<IntersectionPacket *>(&embreeRay);
+                const Primitive *prim = static_cast<TraceableScene *>(ptr)->_userPrimitives[i];
+                for (int lane = 0; lane < 4; ++lane)
+                    if (static_cast<const int *>(valid)[lane] && prim->occluded(packet.ray(lane)))
+                        embreeRay.geomID[lane] = 0;
+            });
         }
+        if (_settings.useSceneBvh())
+            rtcCommit(_scene);
 
         _integrator.prepareForRender(*this, seed);
     }
@@ -147,16 +312,81 @@ public:
         for (std::shared_ptr<Bsdf> &b : _bsdfs)
             b->teardownAfterRender();
 
+        // The scene BVH references mesh buffers and scenes owned by the
+        // primitives, so it has to go first
+        if (_scene)
+            rtcDeleteScene(_scene);
+        _scene = nullptr;
+
         for (std::shared_ptr<Primitive> &m : _primitives) {
             m->teardownAfterRender();
             for (int i = 0; i < m->numBsdfs(); ++i)
                 if (m->bsdf(i)->unnamed())
                     m->bsdf(i)->teardownAfterRender();
         }
+    }
 
-        if (_scene)
-            rtcDeleteScene(_scene);
-        _scene = nullptr;
+    // Brings the scene up to date after the transforms of some primitives or
+    // any materials changed, without rebuilding it from scratch. Transformed
+    // primitives refit their own acceleration structures, and only their
+    // geometry is updated in the scene BVH. Rendering starts over afterwards
+    // and must not be in progress. This requires dynamic scenes (see
+    // EmbreeUtil::setDynamicScenes); if the scene BVH is static, nothing is
+    // changed and false is returned, and the scene has to be recreated instead
+    bool update(const std::vector<Primitive *> &transformed)
+    {
+        if (_scene && !EmbreeUtil::dynamicScenes())
+            return false;
+
+        _integrator.teardownAfterRender();
+        _cam.teardownAfterRender();
+
+        for (std::shared_ptr<Bsdf> &b : _bsdfs) {
+            b->teardownAfterRender();
+            b->prepareForRender();
+        }
+        for (std::shared_ptr<Primitive> &m : _primitives) {
+            for (int i = 0; i < m->numBsdfs(); ++i) {
+                if (m->bsdf(i)->unnamed()) {
+                    m->bsdf(i)->teardownAfterRender();
+                    m->bsdf(i)->prepareForRender();
+                }
+            }
+        }
+
+        for (Primitive *prim : transformed)
+            prim->updateTransform();
+
+        if (_scene) {
+            bool userChanged = false;
+            for (Primitive *prim : transformed) {
+                auto mesh = std::find(_meshes.begin(), _meshes.end(), prim);
+                auto instance = std::find_if(_instances.begin(), _instances.end(),
+                        [&](const InstanceRange &r) { return r.instance == prim; });
+                if (mesh != _meshes.end())
+                    rtcUpdate(_scene, unsigned(mesh - _meshes.begin()));
+                else if (instance != _instances.end())
+                    instance->instance->updateEmbreeInstances(_scene, instance->firstGeomId);
+                else
+                    userChanged = true;
+            }
+            // User geometry bounds are queried again for all user primitives,
+            // which is cheap compared to the primitives' own BVHs
+            if (userChanged && _userGeomId != RTC_INVALID_GEOMETRY_ID)
+                rtcUpdate(_scene, _userGeomId);
+            rtcCommit(_scene);
+        }
+
+        _sceneBounds = Box3f();
+        for (const Primitive *prim : _finites)
+            _sceneBounds.grow(prim->bounds());
+        collectLights();
+
+        _cam.prepareForRender();
+        _cam.requestOutputBuffers(_settings.renderOutputs());
+        _integrator.prepareForRender(*this, _seed);
+
+        return true;
     }
 
     float hitDistance(Ray &ray) const
@@ -164,31 +394,69 @@ public:
         IntersectionTemporary data;
         IntersectionRay eRay(EmbreeUtil::convert(ray), data, ray, _userGeomId);
         rtcIntersect(_scene, eRay);
-        return eRay.ray.farT();
+        ray.setFarT(eRay.tfar);
+        return ray.farT();
     }
 
     bool intersect(Ray &ray, IntersectionTemporary &data, IntersectionInfo &info) const
     {
+        RENDER_STAT_TIMER(TimeIntersection);
+        RENDER_STAT_ADD(ClosestHitRays, 1);
+
         info.primitive = nullptr;
         data.primitive = nullptr;
 
         if (_settings.useSceneBvh()) {
             IntersectionRay eRay(EmbreeUtil::convert(ray), data, ray, _userGeomId);
             rtcIntersect(_scene, eRay);
+            ray.setFarT(eRay.tfar);
+            finishNativeHit(eRay.instID, eRay.geomID, eRay.primID, eRay.u, eRay.v, ray, data);
         } else {
             for (const Primitive *prim : _finites)
                 prim->intersect(ray, data);
         }
 
-        if (data.primitive) {
-            info.p = ray.pos() + ray.dir()*ray.farT();
-            info.w = ray.dir();
-            info.epsilon = DefaultEpsilon;
-            data.primitive->intersectionInfo(data, info);
-            return true;
+        return finishIntersection(ray, data, info);
+    }
+
+    // Intersects all rays of the batch with the scene, one packet at a time.
+    // Equivalent to calling intersect on every ray, but much cheaper for
+    // coherent rays. The far distance of each ray is set to its hit distance
+    void intersect(RayBatch &batch) const
+    {
+        RENDER_STAT_TIMER(TimeIntersection);
+        RENDER_STAT_ADD(ClosestHitRays, batch.size());
+
+        for (uint32 i = 0; i < batch.size(); ++i) {
+            batch.info(i).primitive = nullptr;
+            batch.data(i).primitive = nullptr;
+        }
+
+        if (_settings.useSceneBvh()) {
+            for (uint32 offset = 0; offset < batch.size(); offset += RayBatch::PacketSize) {
+                alignas(16) int valid[4];
+                packetValidMask(batch, offset, valid);
+
+                IntersectionPacket packet(batch, offset, _userGeomId);
+                rtcIntersect4(valid, _scene, packet);
+
+                for (uint32 lane = 0; lane < RayBatch::PacketSize && offset + lane < batch.size(); ++lane) {
+                    batch.setFarT(offset + lane, packet.tfar[lane]);
+                    finishNativeHit(packet.instID[lane], packet.geomID[lane], packet.primID[lane], packet.u[lane], packet.v[lane],
+                            packet.ray(lane), batch.data(offset + lane));
+                }
+            }
         } else {
-            return false;
+            for (uint32 i = 0; i < batch.size(); ++i) {
+                Ray ray = batch.ray(i);
+                for (const Primitive *prim : _finites)
+                    prim->intersect(ray, batch.data(i));
+                batch.setFarT(i, ray.farT());
+            }
         }
+
+        for (uint32 i = 0; i < batch.size(); ++i)
+            batch.setHit(i, finishIntersection(batch.ray(i), batch.data(i), batch.info(i)));
     }
 
     bool intersectInfinites(Ray &ray, IntersectionTemporary &data, IntersectionInfo &info) const
@@ -210,6 +478,9 @@ public:
 
     bool occluded(const Ray &ray) const
     {
+        RENDER_STAT_TIMER(TimeIntersection);
+        RENDER_STAT_ADD(OcclusionRays, 1);
+
         if (_settings.useSceneBvh()) {
             auto eRay = EmbreeUtil::convert(ray);
             rtcOccluded(_scene, eRay);
@@ -222,6 +493,39 @@ public:
         }
     }
 
+    // Tests all rays of the batch for occlusion. hit() of each ray is set if
+    // the ray is occluded
+    void occluded(RayBatch &batch) const
+    {
+        RENDER_STAT_TIMER(TimeIntersection);
+        RENDER_STAT_ADD(OcclusionRays, batch.size());
+
+        if (_settings.useSceneBvh()) {
+            for (uint32 offset = 0; offset < batch.size(); offset += RayBatch::PacketSize) {
+                alignas(16) int valid[4];
+                packetValidMask(batch, offset, valid);
+
+                IntersectionPacket packet(batch, offset, _userGeomId);
+                rtcOccluded4(valid, _scene, packet);
+
+                for (uint32 lane = 0; lane < RayBatch::PacketSize && offset + lane < batch.size(); ++lane)
+                    batch.setHit(offset + lane, packet.geomID[lane] != RTC_INVALID_GEOMETRY_ID);
+            }
+        } else {
+            for (uint32 i = 0; i < batch.size(); ++i) {
+                Ray ray = batch.ray(i);
+                bool occluded = false;
+                for (const Primitive *prim : _finites) {
+                    if (prim->occluded(ray)) {
+                        occluded = true;
+                        break;
+                    }
+                }
+                batch.setHit(i, occluded);
+            }
+        }
+    }
+
     const Box3f &bounds() const
     {
         return _sceneBounds;
@@ -252,6 +556,19 @@ public:
         return _lights;
     }
 
+    // Null if the scene has too few lights to benefit from a hierarchy
+    const LightBvh *lightBvh() const
+    {
+        return _lightBvh.get();
+    }
+
+    // Lights not covered by the light BVH. This is all lights if there is
+    // no light BVH
+    const std::vector<const Primitive *> &looseLights() const
+    {
+        return _looseLights;
+    }
+
     const std::vector<const Primitive *> &finites() const
     {
         return _finites;
@@ -0,0 +1,115 @@
+#ifndef ALIASDISTRIBUTION1D_HPP_
+#define ALIASDISTRIBUTION1D_HPP_
+
+#include "math/MathUtil.hpp"
+
+#include "IntTypes.hpp"
+
+#include <vector>
+
+namespace Tungsten {
+
+// Drop-in replacement for Distribution1D that samples in constant time with
+// Vose's alias method, instead of binary searching the CDF. Every entry
+// keeps itself with probability q and otherwise passes on to its alias.
+// Unlike the CDF, the mapping from u to entries is not monotonic, so there
+// is no cdf/unwarp. Use sites that need to invert their samples have to stick
+// to Distribution1D
+class AliasDistribution1D
+{
+public:
+    struct Entry
+    {
+        float q;
+        uint32 alias;
+    };
+
+    // Builds the table of n normalized pdf values into dst. small and large
+    // are scratch space that can be reused between calls
+    static void buildTable(const float *pdf, uint32 n, Entry *dst,
+            std::vector<uint32> &small, std::vector<uint32> &large)
+    {
+        small.clear();
+        large.clear();
+        for (uint32 i = 0; i < n; ++i) {
+            dst[i].q = pdf[i]*n;
+            dst[i].alias = i;
+            (dst[i].q < 1.0f ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32 l = small.back();
+            uint32 g = large.back();
+            small.pop_back();
+
+            dst[l].alias = g;
+            dst[g].q = (dst[g].q + dst[l].q) - 1.0f;
+            if (dst[g].q < 1.0f) {
+                large.pop_back();
+                small.push_back(g);
+            }
+        }
+        // Whatever is left over is only off by round-off
+        for (uint32 i : large)
+            dst[i].q = 1.0f;
+        for (uint32 i : small)
+            dst[i].q = 1.0f;
+    }
+
+    // Checks a table read from disk before it is used. warp follows the
+    // aliases without bounds checks
+    static bool isValidTable(const Entry *table, uint32 n)
+    {
+        for (uint32 i = 0; i < n; ++i)
+            if (table[i].alias >= n)
+                return false;
+        return true;
+    }
+
+    static void warp(const Entry *table, uint32 n, float &u, int &idx)
+    {
+        float x = u*n;
+        uint32 i = min(uint32(x), n - 1);
+        float f = x - i;
+        const Entry &e = table[i];
+        if (f < e.q) {
+            idx = int(i);
+            u = clamp(f/e.q, 0.0f, 1.0f);
+        } else {
+            idx = int(e.alias);
+            u = clamp((f - e.q)/(1.0f - e.q), 0.0f, 1.0f);
+        }
+    }
+
+private:
+    std::vector<float> _pdf;
+    std::vector<Entry> _table;
+
+public:
+    AliasDistribution1D(std::vector<float> weights)
+    : _pdf(std::move(weights)),
+      _table(_pdf.size())
+    {
+        float totalWeight = 0.0f;
+        for (float p : _pdf)
+            totalWeight += p;
+        for (float &p : _pdf)
+            p /= totalWeight;
+
+        std::vector<uint32> small, large;
+        buildTable(_pdf.data(), uint32(_pdf.size()), _table.data(), small, large);
+    }
+
+    void warp(float &u, int &idx) const
+    {
+        warp(_table.data(), uint32(_table.size()), u, idx);
+    }
+
+    float pdf(int idx) const
+    {
+        return _pdf[idx];
+    }
+};
+
+}
+
+#endif /* ALIASDISTRIBUTION1D_HPP_ */
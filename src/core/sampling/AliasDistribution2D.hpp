@@ -0,0 +1,122 @@
+#ifndef ALIASDISTRIBUTION2D_HPP_
+#define ALIASDISTRIBUTION2D_HPP_
+
+#include "AliasDistribution1D.hpp"
+
+#include "math/MathUtil.hpp"
+
+#include "thread/ThreadUtils.hpp"
+
+#include "io/FileUtils.hpp"
+
+#include <vector>
+
+namespace Tungsten {
+
+// Constant time counterpart of Distribution2D, built from alias tables for
+// the rows and the marginal distribution. The pdfs are normalized exactly
+// like those of Distribution2D, but samples cannot be inverted (see
+// AliasDistribution1D)
+class AliasDistribution2D
+{
+    typedef AliasDistribution1D::Entry Entry;
+
+    int _w, _h;
+    std::vector<float> _marginalPdf;
+    std::vector<Entry> _marginalTable;
+    std::vector<float> _pdf;
+    std::vector<Entry> _table;
+
+public:
+    AliasDistribution2D()
+    : _w(0), _h(0)
+    {
+    }
+
+    AliasDistribution2D(std::vector<float> weights, int w, int h)
+    : _w(w), _h(h),
+      _marginalPdf(h, 0.0f),
+      _marginalTable(h),
+      _pdf(std::move(weights)),
+      _table(_pdf.size())
+    {
+        uint32 rowsPerChunk = max(16384/max(w, 1), 1);
+        uint32 numTasks = ThreadUtils::parallelTaskCount(0, uint32(h), rowsPerChunk);
+        auto body = [&](uint32 /*taskId*/, uint32 start, uint32 end) {
+            std::vector<uint32> small, large;
+            for (uint32 y = start; y < end; ++y) {
+                float *pdf = &_pdf[y*w];
+
+                float rowWeight = 0.0f;
+                for (int x = 0; x < w; ++x)
+                    rowWeight += pdf[x];
+                _marginalPdf[y] = rowWeight;
+
+                if (rowWeight < 1e-4f) {
+                    for (int x = 0; x < w; ++x)
+                        pdf[x] = 1.0f/w;
+                } else {
+                    for (int x = 0; x < w; ++x)
+                        pdf[x] /= rowWeight;
+                }
+                AliasDistribution1D::buildTable(pdf, uint32(w), &_table[y*w], small, large);
+            }
+        };
+        // Each task reuses its scratch lists for all of its rows
+        ThreadUtils::parallelChunks(0, uint32(h), rowsPerChunk, numTasks, body);
+
+        float totalWeight = 0.0f;
+        for (float p : _marginalPdf)
+            totalWeight += p;
+        for (float &p : _marginalPdf)
+            p /= totalWeight;
+
+        std::vector<uint32> small, large;
+        AliasDistribution1D::buildTable(_marginalPdf.data(), uint32(h), _marginalTable.data(), small, large);
+    }
+
+    void warp(Vec2f &uv, int &row, int &column) const
+    {
+        AliasDistribution1D::warp(_marginalTable.data(), uint32(_h), uv.y(), row);
+        AliasDistribution1D::warp(&_table[row*_w], uint32(_w), uv.x(), column);
+    }
+
+    float pdf(int row, int column) const
+    {
+        row    = clamp(row,    0, _h - 1);
+        column = clamp(column, 0, _w - 1);
+        return _pdf[row*_w + column]*_marginalPdf[row];
+    }
+
+    bool load(InputStreamHandle &in, int w, int h)
+    {
+        _w = w;
+        _h = h;
+        _marginalPdf.resize(h);
+        _marginalTable.resize(h);
+        _pdf.resize(size_t(w)*h);
+        _table.resize(size_t(w)*h);
+        FileUtils::streamRead(in, _marginalPdf);
+        FileUtils::streamRead(in, _marginalTable);
+        FileUtils::streamRead(in, _pdf);
+        FileUtils::streamRead(in, _table);
+        if (!in->good() || !AliasDistribution1D::isValidTable(_marginalTable.data(), uint32(h)))
+            return false;
+        for (int y = 0; y < h; ++y)
+            if (!AliasDistribution1D::isValidTable(&_table[size_t(y)*w], uint32(w)))
+                return false;
+        return true;
+    }
+
+    void save(OutputStreamHandle &out) const
+    {
+        FileUtils::streamWrite(out, _marginalPdf);
+        FileUtils::streamWrite(out, _marginalTable);
+        FileUtils::streamWrite(out, _pdf);
+        FileUtils::streamWrite(out, _table);
+    }
+};
+
+}
+
+#endif /* ALIASDISTRIBUTION2D_HPP_ */
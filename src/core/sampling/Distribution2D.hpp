@@ -3,6 +3,10 @@
 
 #include "math/MathUtil.hpp"
 
+#include "thread/ThreadUtils.hpp"
+
+#include "io/FileUtils.hpp"
+
 #include <algorithm>
 #include <vector>
 
@@ -15,6 +19,11 @@ class Distribution2D
     std::vector<float> _pdf;
     std::vector<float> _cdf;
 public:
+    Distribution2D()
+    : _w(0), _h(0)
+    {
+    }
+
     Distribution2D(std::vector<float> weights, int w, int h)
     : _w(w), _h(h), _pdf(std::move(weights))
     {
@@ -22,23 +31,19 @@ public:
         _marginalPdf.resize(h, 0.0f);
         _marginalCdf.resize(h + 1);
 
-        _marginalCdf[0] = 0.0f;
-        for (int y = 0; y < h; ++y) {
+        // Rows are independent of each other, so build and normalize their
+        // CDFs in parallel
+        uint32 rowsPerChunk = max(16384/max(w, 1), 1);
+        ThreadUtils::parallelFor(0, uint32(h), rowsPerChunk, [&](uint32 y) {
             int idxP = y*w;
             int idxC = y*(w + 1);
+            int idxTail = idxC + w;
 
             _cdf[idxC] = 0.0f;
-            for (int x = 0; x < w; ++x, ++idxP, ++idxC) {
-                _marginalPdf[y] += _pdf[idxP];
-                _cdf[idxC + 1] = _cdf[idxC] + _pdf[idxP];
+            for (int x = 0; x < w; ++x) {
+                _marginalPdf[y] += _pdf[idxP + x];
+                _cdf[idxC + x + 1] = _cdf[idxC + x] + _pdf[idxP + x];
             }
-            _marginalCdf[y + 1] = _marginalCdf[y] + _marginalPdf[y];
-        }
-
-        for (int y = 0; y < h; ++y) {
-            int idxP = y*w;
-            int idxC = y*(w + 1);
-            int idxTail = idxC + w;
 
             float rowWeight = _cdf[idxTail];
             if (rowWeight < 1e-4f) {
@@ -53,7 +58,11 @@ public:
                 }
             }
             _cdf[idxTail] = 1.0f;
-        }
+        });
+
+        _marginalCdf[0] = 0.0f;
+        for (int y = 0; y < h; ++y)
+            _marginalCdf[y + 1] = _marginalCdf[y] + _marginalPdf[y];
 
         float totalWeight = _marginalCdf.back();
         for (float &p : _marginalPdf)
@@ -94,6 +103,29 @@ public:
             uv.y()*_marginalPdf[row] + _marginalCdf[row]
         );
     }
+
+    bool load(InputStreamHandle &in, int w, int h)
+    {
+        _w = w;
+        _h = h;
+        _marginalPdf.resize(h);
+        _marginalCdf.resize(h + 1);
+        _pdf.resize(size_t(w)*h);
+        _cdf.resize(size_t(w + 1)*h);
+        FileUtils::streamRead(in, _marginalPdf);
+        FileUtils::streamRead(in, _marginalCdf);
+        FileUtils::streamRead(in, _pdf);
+        FileUtils::streamRead(in, _cdf);
+        return in->good();
+    }
+
+    void save(OutputStreamHandle &out) const
+    {
+        FileUtils::streamWrite(out, _marginalPdf);
+        FileUtils::streamWrite(out, _marginalCdf);
+        FileUtils::streamWrite(out, _pdf);
+        FileUtils::streamWrite(out, _cdf);
+    }
 };
 
 }
@@ -0,0 +1,188 @@
+#ifndef HIERARCHICALDISTRIBUTION2D_HPP_
+#define HIERARCHICALDISTRIBUTION2D_HPP_
+
+#include "math/MathUtil.hpp"
+
+#include "thread/ThreadUtils.hpp"
+
+#include "io/FileUtils.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace Tungsten {
+
+// Samples a 2D distribution by descending a mip pyramid of summed weights,
+// as in Clarberg et al., "Wavelet Importance Sampling". At each level, a
+// column and then a row of the four child texels is picked and the sample
+// rescaled, so no full resolution CDF is needed. The pyramid takes a third
+// of the memory of the weights on top of them, builds in a single pass and,
+// unlike the alias tables, can be inverted.
+// Levels halve the resolution rounding up, and children outside the level
+// below are treated as having no weight
+class HierarchicalDistribution2D
+{
+    struct Level
+    {
+        int w, h;
+        size_t offset;
+    };
+
+    int _w, _h;
+    std::vector<Level> _levels;
+    // All levels back to back, finest first
+    std::vector<float> _weights;
+    float _invTotal;
+
+    void initLevels()
+    {
+        _levels.clear();
+        size_t offset = 0;
+        int w = _w, h = _h;
+        while (true) {
+            _levels.push_back(Level{w, h, offset});
+            offset += size_t(w)*h;
+            if (w == 1 && h == 1)
+                break;
+            w = (w + 1)/2;
+            h = (h + 1)/2;
+        }
+    }
+
+    float weight(const Level &level, int x, int y) const
+    {
+        if (x >= level.w || y >= level.h)
+            return 0.0f;
+        return _weights[level.offset + size_t(y)*level.w + x];
+    }
+
+    // Sums up the texels of each level from the level below
+    void buildLevels()
+    {
+        for (size_t i = 1; i < _levels.size(); ++i) {
+            const Level &src = _levels[i - 1];
+            const Level &dst = _levels[i];
+            uint32 rowsPerChunk = max(16384/max(dst.w, 1), 1);
+            ThreadUtils::parallelFor(0, uint32(dst.h), rowsPerChunk, [&](uint32 y) {
+                for (int x = 0; x < dst.w; ++x)
+                    _weights[dst.offset + size_t(y)*dst.w + x] =
+                        weight(src, x*2 + 0, y*2 + 0) + weight(src, x*2 + 1, y*2 + 0) +
+                        weight(src, x*2 + 0, y*2 + 1) + weight(src, x*2 + 1, y*2 + 1);
+            });
+        }
+    }
+
+    // Picks the second of two children with probability w1/(w0 + w1) and
+    // rescales u to [0, 1]
+    static bool pick(float &u, float w0, float w1)
+    {
+        float p0 = w0/(w0 + w1);
+        if (w1 == 0.0f || (w0 > 0.0f && u < p0)) {
+            u = clamp(u/p0, 0.0f, 1.0f);
+            return false;
+        } else {
+            u = clamp((u - p0)/(1.0f - p0), 0.0f, 1.0f);
+            return true;
+        }
+    }
+
+    // Inverse of pick
+    static float unpick(float u, float w0, float w1, bool second)
+    {
+        float p0 = w0 + w1 > 0.0f ? w0/(w0 + w1) : 0.5f;
+        return second ? p0 + u*(1.0f - p0) : u*p0;
+    }
+
+public:
+    HierarchicalDistribution2D()
+    : _w(0), _h(0), _invTotal(0.0f)
+    {
+    }
+
+    HierarchicalDistribution2D(std::vector<float> weights, int w, int h)
+    : _w(w), _h(h), _weights(std::move(weights))
+    {
+        initLevels();
+        _weights.resize(_levels.back().offset + 1);
+        buildLevels();
+
+        if (!(_weights.back() > 0.0f)) {
+            std::fill(_weights.begin(), _weights.begin() + size_t(_w)*_h, 1.0f);
+            buildLevels();
+        }
+        _invTotal = 1.0f/_weights.back();
+    }
+
+    void warp(Vec2f &uv, int &row, int &column) const
+    {
+        int x = 0, y = 0;
+        for (int i = int(_levels.size()) - 2; i >= 0; --i) {
+            const Level &level = _levels[i];
+            x *= 2;
+            y *= 2;
+            float w00 = weight(level, x, y + 0), w10 = weight(level, x + 1, y + 0);
+            float w01 = weight(level, x, y + 1), w11 = weight(level, x + 1, y + 1);
+            if (pick(uv.x(), w00 + w01, w10 + w11)) {
+                x++;
+                y += pick(uv.y(), w10, w11);
+            } else {
+                y += pick(uv.y(), w00, w01);
+            }
+        }
+        row = y;
+        column = x;
+    }
+
+    Vec2f unwarp(Vec2f uv, int row, int column) const
+    {
+        int x = clamp(column, 0, _w - 1);
+        int y = clamp(row,    0, _h - 1);
+        for (size_t i = 0; i + 1 < _levels.size(); ++i) {
+            const Level &level = _levels[i];
+            int x0 = x & ~1, y0 = y & ~1;
+            float w00 = weight(level, x0, y0 + 0), w10 = weight(level, x0 + 1, y0 + 0);
+            float w01 = weight(level, x0, y0 + 1), w11 = weight(level, x0 + 1, y0 + 1);
+
+            uv.y() = x & 1 ? unpick(uv.y(), w10, w11, y & 1) : unpick(uv.y(), w00, w01, y & 1);
+            uv.x() = unpick(uv.x(), w00 + w01, w10 + w11, x & 1);
+
+            x /= 2;
+            y /= 2;
+        }
+        return uv;
+    }
+
+    float pdf(int row, int column) const
+    {
+        row    = clamp(row,    0, _h - 1);
+        column = clamp(column, 0, _w - 1);
+        return _weights[size_t(row)*_w + column]*_invTotal;
+    }
+
+    bool load(InputStreamHandle &in, int w, int h)
+    {
+        _w = w;
+        _h = h;
+        initLevels();
+        _weights.resize(_levels.back().offset + 1);
+        FileUtils::streamRead(in, _weights);
+        if (!in->good())
+            return false;
+        // There are no indices to check, but negative or non-finite weights
+        // would make warp pick children that cannot be sampled
+        for (float weight : _weights)
+            if (!(weight >= 0.0f && weight < 1e30f))
+                return false;
+        _invTotal = 1.0f/_weights.back();
+        return _weights.back() > 0.0f;
+    }
+
+    void save(OutputStreamHandle &out) const
+    {
+        FileUtils::streamWrite(out, _weights);
+    }
+};
+
+}
+
+#endif /* HIERARCHICALDISTRIBUTION2D_HPP_ */
@@ -16,6 +16,7 @@ class SobolPathSampler : public PathSampleGenerator
     uint32 _scramble;
     uint32 _index;
     uint32 _dimension;
+    bool _seedPerPath;
 
     inline uint32 permutedIndex() const
     {
@@ -23,12 +24,15 @@ class SobolPathSampler : public PathSampleGenerator
     }
 
 public:
-    SobolPathSampler(uint32 seed)
+    // With seedPerPath set, the supplemental sampler is reseeded for every
+    // path from its pixel and sample index
+    SobolPathSampler(uint32 seed, bool seedPerPath = false)
     : _supplementalSampler(seed),
       _seed(seed),
       _scramble(0),
       _index(0),
-      _dimension(0)
+      _dimension(0),
+      _seedPerPath(seedPerPath)
     {
     }
 
@@ -49,6 +53,8 @@ public:
         _scramble = _seed ^ MathUtil::hash32(pixelId);
         _index = sample;
         _dimension = 0;
+        if (_seedPerPath)
+            _supplementalSampler = UniformSampler::forPath(_seed, pixelId, sample);
     }
     virtual void advancePath() override final
     {
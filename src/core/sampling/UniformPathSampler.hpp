@@ -9,19 +9,29 @@ namespace Tungsten {
 class UniformPathSampler : public PathSampleGenerator
 {
     UniformSampler _sampler;
+    uint32 _seed;
+    bool _seedPerPath;
 
 public:
-    UniformPathSampler(uint32 seed)
-    : _sampler(seed)
+    // With seedPerPath set, every path is seeded from its pixel and sample
+    // index, so that results do not depend on which sampler traced a path
+    UniformPathSampler(uint32 seed, bool seedPerPath = false)
+    : _sampler(seed),
+      _seed(seed),
+      _seedPerPath(seedPerPath)
     {
     }
     UniformPathSampler(const UniformSampler &sampler)
-    : _sampler(sampler)
+    : _sampler(sampler),
+      _seed(0),
+      _seedPerPath(false)
     {
     }
 
-    virtual void startPath(uint32 /*pixelId*/, uint32 /*sample*/) override
+    virtual void startPath(uint32 pixelId, uint32 sample) override
     {
+        if (_seedPerPath)
+            _sampler = UniformSampler::forPath(_seed, pixelId, sample);
     }
     virtual void advancePath() override
     {
@@ -2,6 +2,7 @@
 #define UNIFORMSAMPLER_HPP_
 
 #include "math/BitManip.hpp"
+#include "math/MathUtil.hpp"
 #include "math/Vec.hpp"
 
 #include "io/FileUtils.hpp"
@@ -25,6 +26,17 @@ public:
     {
     }
 
+    // Independent stream for one path, determined by its pixel and sample
+    // index alone
+    static UniformSampler forPath(uint32 seed, uint32 pixelId, uint32 sample)
+    {
+        uint32 pixelHash = MathUtil::hash32(pixelId ^ MathUtil::hash32(seed));
+        uint32 sampleHash = MathUtil::hash32(sample ^ MathUtil::hash32(pixelHash));
+        UniformSampler result((uint64(pixelHash) << 32) | sampleHash, pixelHash);
+        result.nextI();
+        return result;
+    }
+
     void saveState(OutputStreamHandle &out)
     {
         FileUtils::streamWrite(out, _state);
@@ -0,0 +1,149 @@
+#ifndef SIMDAVX2_HPP_
+#define SIMDAVX2_HPP_
+
+// 8-wide SimdBool and SimdFloat. The baseline build does not enable AVX2,
+// so these are only available to kernels that enable it for their own code
+// with target pragmas (e.g. Triangle4Avx2.cpp). Such a file includes SimdFloat.hpp
+// before pushing the pragmas, and this header after pushing them and
+// defining SIMD_TARGET_AVX2, so that only the wide types are built for AVX2
+#if !defined(__AVX2__) && !defined(SIMD_TARGET_AVX2)
+#error "The AVX2 SIMD types need AVX2 to be enabled, e.g. by target pragmas"
+#endif
+#ifndef SIMDFLOAT_HPP_
+#error "SimdFloat.hpp has to be included before AVX2 is enabled"
+#endif
+
+namespace Tungsten {
+
+template<>
+class SimdBool<8>
+{
+    union {
+        __m256 _b;
+        uint32 _i[8];
+    };
+
+    friend SimdFloat<8>;
+public:
+    static CONSTEXPR uint32 n = 8;
+    static CONSTEXPR size_t Alignment = 8*sizeof(float);
+
+    SimdBool() = default;
+    SimdBool(const SimdBool &o) = default;
+    SimdBool(const __m256 &a)
+    : _b(a)
+    {
+    }
+    SimdBool(bool a)
+    : _b(_mm256_set1_ps(a ? BitManip::uintBitsToFloat(0xFFFFFFFF) : 0))
+    {
+    }
+
+    bool any() const { return _mm256_movemask_ps(_b) != 0; }
+    bool all() const { return _mm256_movemask_ps(_b) == 0xFF; }
+    uint32 mask() const { return _mm256_movemask_ps(_b); }
+
+    SimdBool operator!() const { return _mm256_xor_ps(_mm256_set1_ps(BitManip::uintBitsToFloat(0xFFFFFFFF)), _b); }
+    SimdBool operator||(const SimdBool &o) const { return _mm256_or_ps(_b, o._b); }
+    SimdBool operator&&(const SimdBool &o) const { return _mm256_and_ps(_b, o._b); }
+
+    bool operator[](uint32 idx) { return _i[idx]; };
+};
+
+typedef SimdBool<8> bool8;
+
+template<>
+class SimdFloat<8>
+{
+    union {
+        __m256 _a;
+        float _f[8];
+        uint32 _i[8];
+    };
+
+    friend SimdFloat<8> min(const Tungsten::SimdFloat<8> &, const Tungsten::SimdFloat<8> &);
+    friend SimdFloat<8> max(const Tungsten::SimdFloat<8> &, const Tungsten::SimdFloat<8> &);
+    friend SimdFloat<8> sqrt(const Tungsten::SimdFloat<8> &);
+
+public:
+    static CONSTEXPR uint32 n = 8;
+    static CONSTEXPR size_t Alignment = 8*sizeof(float);
+
+    SimdFloat() = default;
+    SimdFloat(const SimdFloat &o) = default;
+    SimdFloat(const float *a)
+    : _a(_mm256_load_ps(a))
+    {
+    }
+    SimdFloat(float a)
+    : _a(_mm256_set1_ps(a))
+    {
+    }
+    SimdFloat(float r0, float r1, float r2, float r3, float r4, float r5, float r6, float r7)
+    : _a(_mm256_set_ps(r7, r6, r5, r4, r3, r2, r1, r0))
+    {
+    }
+    SimdFloat(const __m256 &a)
+    : _a(a)
+    {
+    }
+
+    SimdFloat operator-() const { return _mm256_sub_ps(_mm256_setzero_ps(), _a); }
+    SimdFloat operator+(const SimdFloat &o) const { return _mm256_add_ps(_a, o._a); }
+    SimdFloat operator-(const SimdFloat &o) const { return _mm256_sub_ps(_a, o._a); }
+    SimdFloat operator*(const SimdFloat &o) const { return _mm256_mul_ps(_a, o._a); }
+    SimdFloat operator/(const SimdFloat &o) const { return _mm256_div_ps(_a, o._a); }
+    SimdFloat operator^(const SimdFloat &o) const { return _mm256_xor_ps(_a, o._a); }
+
+    SimdFloat operator&(const SimdBool<8> &o) const { return _mm256_and_ps(_a, o._b); }
+    SimdFloat blend(const SimdFloat &o, const SimdBool<8> &mask) const { return _mm256_blendv_ps(_a, o._a, mask._b); }
+
+    SimdFloat &operator+=(const SimdFloat &o) { _a = _mm256_add_ps(_a, o._a); return *this; }
+    SimdFloat &operator-=(const SimdFloat &o) { _a = _mm256_sub_ps(_a, o._a); return *this; }
+    SimdFloat &operator*=(const SimdFloat &o) { _a = _mm256_mul_ps(_a, o._a); return *this; }
+    SimdFloat &operator/=(const SimdFloat &o) { _a = _mm256_div_ps(_a, o._a); return *this; }
+    SimdFloat &operator^=(const SimdFloat &o) { _a = _mm256_xor_ps(_a, o._a); return *this; }
+
+    SimdBool<8> operator==(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_EQ_OQ)); }
+    SimdBool<8> operator!=(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_NEQ_OQ)); }
+    SimdBool<8> operator<=(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_LE_OQ)); }
+    SimdBool<8> operator>=(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_GE_OQ)); }
+    SimdBool<8> operator< (const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_LT_OQ)); }
+    SimdBool<8> operator> (const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_GT_OQ)); }
+
+    float *data() { return _f; }
+    const float *data() const { return _f; };
+    void store(float *a) const { _mm256_store_ps(a, _a); }
+
+    const __m256 &raw() const { return _a; }
+
+    float sum() const {
+        alignas(32) float as[8];
+        _mm256_store_ps(as, _a);
+        return as[0] + as[1] + as[2] + as[3] + as[4] + as[5] + as[6] + as[7];
+    }
+
+    float &operator[](unsigned i) { return _f[i]; }
+    float operator[](unsigned i) const { return _f[i]; }
+};
+
+typedef SimdFloat<8> float8;
+
+inline SimdFloat<8> min(const SimdFloat<8> &a, const SimdFloat<8> &b)
+{
+    return SimdFloat<8>(_mm256_min_ps(a._a, b._a));
+}
+
+inline SimdFloat<8> max(const SimdFloat<8> &a, const SimdFloat<8> &b)
+{
+    return SimdFloat<8>(_mm256_max_ps(a._a, b._a));
+}
+
+inline Tungsten::SimdFloat<8> sqrt(const Tungsten::SimdFloat<8> &a)
+{
+    return Tungsten::SimdFloat<8>(_mm256_sqrt_ps(a._a));
+}
+
+}
+
+#endif /* SIMDAVX2_HPP_ */
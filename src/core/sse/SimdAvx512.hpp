@@ -0,0 +1,145 @@
+#ifndef SIMDAVX512_HPP_
+#define SIMDAVX512_HPP_
+
+// 16-wide SimdBool and SimdFloat. The baseline build does not enable
+// AVX-512, so these are only available to kernels that enable it for their
+// own code with target pragmas (e.g. Triangle4Avx512.cpp). Such a file
+// includes SimdFloat.hpp before pushing the pragmas, and this header after
+// pushing them and defining SIMD_TARGET_AVX512, so that only the wide types
+// are built for AVX-512
+#if !defined(__AVX512F__) && !defined(SIMD_TARGET_AVX512)
+#error "The AVX-512 SIMD types need AVX-512 to be enabled, e.g. by target pragmas"
+#endif
+#ifndef SIMDFLOAT_HPP_
+#error "SimdFloat.hpp has to be included before AVX-512 is enabled"
+#endif
+
+namespace Tungsten {
+
+template<>
+class SimdBool<16>
+{
+    __mmask16 _b;
+
+    friend SimdFloat<16>;
+public:
+    static CONSTEXPR uint32 n = 16;
+    static CONSTEXPR size_t Alignment = sizeof(__mmask16);
+
+    SimdBool() = default;
+    SimdBool(const SimdBool &o) = default;
+    SimdBool(__mmask16 a)
+    : _b(a)
+    {
+    }
+    SimdBool(bool a)
+    : _b(a ? 0xFFFF : 0)
+    {
+    }
+
+    bool any() const { return _b != 0; }
+    bool all() const { return _b == 0xFFFF; }
+    uint32 mask() const { return _b; }
+
+    SimdBool operator!() const { return __mmask16(~_b); }
+    SimdBool operator||(const SimdBool &o) const { return __mmask16(_b | o._b); }
+    SimdBool operator&&(const SimdBool &o) const { return __mmask16(_b & o._b); }
+
+    bool operator[](uint32 idx) { return (_b >> idx) & 1; };
+};
+
+typedef SimdBool<16> bool16;
+
+template<>
+class SimdFloat<16>
+{
+    union {
+        __m512 _a;
+        float _f[16];
+        uint32 _i[16];
+    };
+
+    friend SimdFloat<16> min(const Tungsten::SimdFloat<16> &, const Tungsten::SimdFloat<16> &);
+    friend SimdFloat<16> max(const Tungsten::SimdFloat<16> &, const Tungsten::SimdFloat<16> &);
+    friend SimdFloat<16> sqrt(const Tungsten::SimdFloat<16> &);
+
+    // AVX-512F only has bitwise operations on integer registers
+    static __m512 xorPs(const __m512 &a, const __m512 &b)
+    {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+    }
+
+public:
+    static CONSTEXPR uint32 n = 16;
+    static CONSTEXPR size_t Alignment = 16*sizeof(float);
+
+    SimdFloat() = default;
+    SimdFloat(const SimdFloat &o) = default;
+    SimdFloat(const float *a)
+    : _a(_mm512_load_ps(a))
+    {
+    }
+    SimdFloat(float a)
+    : _a(_mm512_set1_ps(a))
+    {
+    }
+    SimdFloat(const __m512 &a)
+    : _a(a)
+    {
+    }
+
+    SimdFloat operator-() const { return _mm512_sub_ps(_mm512_setzero_ps(), _a); }
+    SimdFloat operator+(const SimdFloat &o) const { return _mm512_add_ps(_a, o._a); }
+    SimdFloat operator-(const SimdFloat &o) const { return _mm512_sub_ps(_a, o._a); }
+    SimdFloat operator*(const SimdFloat &o) const { return _mm512_mul_ps(_a, o._a); }
+    SimdFloat operator/(const SimdFloat &o) const { return _mm512_div_ps(_a, o._a); }
+    SimdFloat operator^(const SimdFloat &o) const { return xorPs(_a, o._a); }
+
+    SimdFloat operator&(const SimdBool<16> &o) const { return _mm512_maskz_mov_ps(o._b, _a); }
+    SimdFloat blend(const SimdFloat &o, const SimdBool<16> &mask) const { return _mm512_mask_blend_ps(mask._b, _a, o._a); }
+
+    SimdFloat &operator+=(const SimdFloat &o) { _a = _mm512_add_ps(_a, o._a); return *this; }
+    SimdFloat &operator-=(const SimdFloat &o) { _a = _mm512_sub_ps(_a, o._a); return *this; }
+    SimdFloat &operator*=(const SimdFloat &o) { _a = _mm512_mul_ps(_a, o._a); return *this; }
+    SimdFloat &operator/=(const SimdFloat &o) { _a = _mm512_div_ps(_a, o._a); return *this; }
+    SimdFloat &operator^=(const SimdFloat &o) { _a = xorPs(_a, o._a); return *this; }
+
+    SimdBool<16> operator==(const SimdFloat &o) const { return SimdBool<16>(_mm512_cmp_ps_mask(_a, o._a, _CMP_EQ_OQ)); }
+    SimdBool<16> operator!=(const SimdFloat &o) const { return SimdBool<16>(_mm512_cmp_ps_mask(_a, o._a, _CMP_NEQ_OQ)); }
+    SimdBool<16> operator<=(const SimdFloat &o) const { return SimdBool<16>(_mm512_cmp_ps_mask(_a, o._a, _CMP_LE_OQ)); }
+    SimdBool<16> operator>=(const SimdFloat &o) const { return SimdBool<16>(_mm512_cmp_ps_mask(_a, o._a, _CMP_GE_OQ)); }
+    SimdBool<16> operator< (const SimdFloat &o) const { return SimdBool<16>(_mm512_cmp_ps_mask(_a, o._a, _CMP_LT_OQ)); }
+    SimdBool<16> operator> (const SimdFloat &o) const { return SimdBool<16>(_mm512_cmp_ps_mask(_a, o._a, _CMP_GT_OQ)); }
+
+    float *data() { return _f; }
+    const float *data() const { return _f; };
+    void store(float *a) const { _mm512_store_ps(a, _a); }
+
+    const __m512 &raw() const { return _a; }
+
+    float sum() const { return _mm512_reduce_add_ps(_a); }
+
+    float &operator[](unsigned i) { return _f[i]; }
+    float operator[](unsigned i) const { return _f[i]; }
+};
+
+typedef SimdFloat<16> float16;
+
+inline SimdFloat<16> min(const SimdFloat<16> &a, const SimdFloat<16> &b)
+{
+    return SimdFloat<16>(_mm512_min_ps(a._a, b._a));
+}
+
+inline SimdFloat<16> max(const SimdFloat<16> &a, const SimdFloat<16> &b)
+{
+    return SimdFloat<16>(_mm512_max_ps(a._a, b._a));
+}
+
+inline Tungsten::SimdFloat<16> sqrt(const Tungsten::SimdFloat<16> &a)
+{
+    return Tungsten::SimdFloat<16>(_mm512_sqrt_ps(a._a));
+}
+
+}
+
+#endif /* SIMDAVX512_HPP_ */
@@ -24,6 +24,7 @@ public:
 
     bool any() const;
     bool all() const;
+    uint32 mask() const;
 
     SimdBool operator!() const;
     SimdBool operator||(const SimdBool &o) const;
@@ -49,6 +50,7 @@ public:
 
     bool any() const { return _b; }
     bool all() const { return _b; }
+    uint32 mask() const { return _b ? 1 : 0; }
 
     SimdBool operator!() const { return !_b; }
     SimdBool operator||(const SimdBool &o) const { return _b || o._b; }
@@ -84,6 +86,8 @@ public:
 
     bool any() const { return _mm_movemask_ps(_b) != 0; }
     bool all() const { return _mm_movemask_ps(_b) == 0xF; }
+    // One bit per lane, lane 0 in the lowest bit
+    uint32 mask() const { return _mm_movemask_ps(_b); }
 
     SimdBool operator!() const { return _mm_xor_ps(_mm_set1_ps(BitManip::uintBitsToFloat(0xFFFFFFFF)), _b); }
     SimdBool operator||(const SimdBool &o) const { return _mm_or_ps(_b, o._b); }
@@ -96,45 +100,6 @@ typedef SimdBool<4> bool4;
 
 #endif
 
-#ifdef __AVX__
-template<>
-class SimdBool<8>
-{
-    union {
-        __m256 _b;
-        uint32 _i[8];
-    };
-
-    friend SimdFloat<8>;
-public:
-    static CONSTEXPR uint32 n = 8;
-    static CONSTEXPR size_t Alignment = 8*sizeof(float);
-
-    SimdBool() = default;
-    SimdBool(const SimdBool &o) = default;
-    SimdBool(const __m256 &a)
-    : _b(a)
-    {
-    }
-    SimdBool(bool a)
-    : _b(_mm256_set1_ps(a ? BitManip::uintBitsToFloat(0xFFFFFFFF) : 0))
-    {
-    }
-
-    bool any() const { return _mm256_movemask_ps(_b) != 0; }
-    bool all() const { return _mm256_movemask_ps(_b) == 0xFF; }
-
-    SimdBool operator!() const { return _mm256_xor_ps(_mm256_set1_ps(BitManip::uintBitsToFloat(0xFFFFFFFF)), _b); }
-    SimdBool operator||(const SimdBool &o) const { return _mm256_or_ps(_b, o._b); }
-    SimdBool operator&&(const SimdBool &o) const { return _mm256_and_ps(_b, o._b); }
-
-    bool operator[](uint32 idx) { return _i[idx]; };
-};
-
-typedef SimdBool<8> bool8;
-
-#endif
-
 }
 
 #endif /* SIMDBOOL_HPP_ */
@@ -0,0 +1,120 @@
+#include "SimdDispatch.hpp"
+
+#include "IntTypes.hpp"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace Tungsten {
+
+namespace SimdDispatch {
+
+static SimdIsa maxIsa = SimdIsaAvx512;
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+static void cpuid(uint32 leaf, uint32 subleaf, uint32 regs[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, int(leaf), int(subleaf));
+    for (int i = 0; i < 4; ++i)
+        regs[i] = uint32(info[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches. Must only be called
+// if CPUID reports OSXSAVE
+static uint64 xcr0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32 eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64(edx) << 32) | eax;
+#endif
+}
+
+static SimdIsa detectIsa()
+{
+    uint32 regs[4];
+    cpuid(0, 0, regs);
+    uint32 maxLeaf = regs[0];
+    if (maxLeaf < 7)
+        return SimdIsaSse;
+
+    cpuid(1, 0, regs);
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx     = (regs[2] & (1u << 28)) != 0;
+    bool fma     = (regs[2] & (1u << 12)) != 0;
+    if (!osxsave || !avx || !fma)
+        return SimdIsaSse;
+
+    // SSE and AVX state (bits 1 and 2), plus opmask and the upper halves
+    // of zmm0-15 and zmm16-31 (bits 5-7) for AVX-512
+    uint64 xcr = xcr0();
+    if ((xcr & 0x06) != 0x06)
+        return SimdIsaSse;
+
+    cpuid(7, 0, regs);
+    bool avx2    = (regs[1] & (1u <<  5)) != 0;
+    bool avx512f = (regs[1] & (1u << 16)) != 0;
+    if (!avx2)
+        return SimdIsaSse;
+    if (avx512f && (xcr & 0xE6) == 0xE6)
+        return SimdIsaAvx512;
+    return SimdIsaAvx2;
+}
+#else
+static SimdIsa detectIsa()
+{
+    return SimdIsaSse;
+}
+#endif
+
+SimdIsa hostIsa()
+{
+    static SimdIsa isa = detectIsa();
+    return isa;
+}
+
+SimdIsa activeIsa()
+{
+    SimdIsa isa = hostIsa();
+    return isa < maxIsa ? isa : maxIsa;
+}
+
+void setMaxIsa(SimdIsa isa)
+{
+    maxIsa = isa;
+}
+
+const char *isaName(SimdIsa isa)
+{
+    switch (isa) {
+    case SimdIsaAvx2:   return "avx2";
+    case SimdIsaAvx512: return "avx512";
+    default:            return "sse";
+    }
+}
+
+bool parseIsa(const std::string &name, SimdIsa &isa)
+{
+    for (SimdIsa i : {SimdIsaSse, SimdIsaAvx2, SimdIsaAvx512}) {
+        if (name == isaName(i)) {
+            isa = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+}
@@ -0,0 +1,37 @@
+#ifndef SIMDDISPATCH_HPP_
+#define SIMDDISPATCH_HPP_
+
+#include <string>
+
+namespace Tungsten {
+
+// Instruction sets that hot kernels may be compiled for. Kernels for the
+// wider instruction sets live in their own namespaces in separate
+// translation units, which enable the instruction set with target pragmas
+// (e.g. NlMeansAvx2.cpp), and are only called if the host supports them
+enum SimdIsa
+{
+    SimdIsaSse,
+    SimdIsaAvx2,
+    SimdIsaAvx512,
+};
+
+namespace SimdDispatch {
+
+// Widest instruction set supported by both the processor and the OS,
+// as reported by CPUID
+SimdIsa hostIsa();
+
+// The instruction set kernels should be selected for, i.e. hostIsa()
+// capped by setMaxIsa. Useful to get reproducible results across machines
+SimdIsa activeIsa();
+void setMaxIsa(SimdIsa isa);
+
+const char *isaName(SimdIsa isa);
+bool parseIsa(const std::string &name, SimdIsa &isa);
+
+}
+
+}
+
+#endif /* SIMDDISPATCH_HPP_ */
@@ -46,6 +46,7 @@ public:
 
     float *data();
     const float *data() const;
+    void store(float *a) const;
 
     float sum() const;
 
@@ -99,6 +100,7 @@ public:
 
     float *data() { return &_a; }
     const float *data() const { return &_a; };
+    void store(float *a) const { *a = _a; }
 
     float sum() const { return _a; }
 
@@ -174,6 +176,7 @@ public:
 
     float *data() { return _f; }
     const float *data() const { return _f; };
+    void store(float *a) const { _mm_store_ps(a, _a); }
 
     const __m128 &raw() const { return _a; }
 
@@ -196,78 +199,6 @@ typedef SimdFloat<4> float4;
 
 #endif
 
-#ifdef __AVX__
-template<>
-class SimdFloat<8>
-{
-    union {
-        __m256 _a;
-        float _f[8];
-        uint32 _i[8];
-    };
-
-    SimdFloat(const __m256 &a)
-    : _a(a)
-    {
-    }
-
-    friend SimdFloat<8> min(const Tungsten::SimdFloat<8> &, const Tungsten::SimdFloat<8> &);
-    friend SimdFloat<8> max(const Tungsten::SimdFloat<8> &, const Tungsten::SimdFloat<8> &);
-    friend SimdFloat<8> sqrt(const Tungsten::SimdFloat<8> &);
-
-public:
-    static CONSTEXPR uint32 n = 8;
-    static CONSTEXPR size_t Alignment = 8*sizeof(float);
-
-    SimdFloat() = default;
-    SimdFloat(const SimdFloat &o) = default;
-    SimdFloat(const float *a)
-    : _a(_mm256_load_ps(a))
-    {
-    }
-    SimdFloat(float a)
-    : _a(_mm256_set1_ps(a))
-    {
-    }
-
-    SimdFloat operator-() const { return _mm256_sub_ps(_mm256_setzero_ps(), _a); }
-    SimdFloat operator+(const SimdFloat &o) const { return _mm256_add_ps(_a, o._a); }
-    SimdFloat operator-(const SimdFloat &o) const { return _mm256_sub_ps(_a, o._a); }
-    SimdFloat operator*(const SimdFloat &o) const { return _mm256_mul_ps(_a, o._a); }
-    SimdFloat operator/(const SimdFloat &o) const { return _mm256_div_ps(_a, o._a); }
-
-    SimdFloat operator&(const SimdBool<8> &o) const { return _mm256_and_ps(_a, o._b); }
-    SimdFloat blend(const SimdFloat &o, const SimdBool<8> &mask) const { return _mm256_blendv_ps(_a, o._a, mask._b); }
-
-    SimdFloat &operator+=(const SimdFloat &o) { _a = _mm256_add_ps(_a, o._a); return *this; }
-    SimdFloat &operator-=(const SimdFloat &o) { _a = _mm256_sub_ps(_a, o._a); return *this; }
-    SimdFloat &operator*=(const SimdFloat &o) { _a = _mm256_mul_ps(_a, o._a); return *this; }
-    SimdFloat &operator/=(const SimdFloat &o) { _a = _mm256_div_ps(_a, o._a); return *this; }
-
-    SimdBool<8> operator==(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_EQ_OQ)); }
-    SimdBool<8> operator!=(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_NEQ_OQ)); }
-    SimdBool<8> operator<=(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_LE_OQ)); }
-    SimdBool<8> operator>=(const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_GE_OQ)); }
-    SimdBool<8> operator< (const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_LT_OQ)); }
-    SimdBool<8> operator> (const SimdFloat &o) const { return SimdBool<8>(_mm256_cmp_ps(_a, o._a, _CMP_GT_OQ)); }
-
-    float *data() { return _f; }
-    const float *data() const { return _f; };
-
-    float sum() const {
-        alignas(32) float as[8];
-        _mm256_store_ps(as, _a);
-        return as[0] + as[1] + as[2] + as[3] + as[4] + as[5] + as[6] + as[7];
-    }
-
-    float &operator[](unsigned i) { return _f[i]; }
-    float operator[](unsigned i) const { return _f[i]; }
-};
-
-typedef SimdFloat<4> float8;
-
-#endif
-
 inline SimdFloat<1> min(const SimdFloat<1> &a, const SimdFloat<1> &b)
 {
     return a._a < b._a ? a : b;
@@ -290,18 +221,6 @@ inline SimdFloat<4> max(const SimdFloat<4> &a, const SimdFloat<4> &b)
 }
 #endif
 
-#ifdef __AVX__
-inline SimdFloat<8> min(const SimdFloat<8> &a, const SimdFloat<8> &b)
-{
-    return SimdFloat<8>(_mm256_min_ps(a._a, b._a));
-}
-
-inline SimdFloat<8> max(const SimdFloat<8> &a, const SimdFloat<8> &b)
-{
-    return SimdFloat<8>(_mm256_max_ps(a._a, b._a));
-}
-#endif
-
 inline Tungsten::SimdFloat<1> sqrt(const Tungsten::SimdFloat<1> &a)
 {
     return Tungsten::SimdFloat<1>(std::sqrt(a._a));
@@ -314,13 +233,6 @@ inline Tungsten::SimdFloat<4> sqrt(const Tungsten::SimdFloat<4> &a)
 }
 #endif
 
-#ifdef __AVX__
-inline Tungsten::SimdFloat<8> sqrt(const Tungsten::SimdFloat<8> &a)
-{
-    return Tungsten::SimdFloat<8>(_mm256_sqrt_ps(a._a));
-}
-#endif
-
 
 }
 
@@ -2,16 +2,41 @@
 
 #include "primitives/IntersectionInfo.hpp"
 
+#include "sampling/HierarchicalDistribution2D.hpp"
+#include "sampling/AliasDistribution2D.hpp"
 #include "sampling/Distribution2D.hpp"
 
 #include "math/MathUtil.hpp"
+#include "math/BitManip.hpp"
 #include "math/Angle.hpp"
 
 #include "io/JsonObject.hpp"
+#include "io/FileUtils.hpp"
 #include "io/Scene.hpp"
 
+#include "thread/ThreadUtils.hpp"
+
+#include "Debug.hpp"
+
+#include <tinyformat/tinyformat.hpp>
+
 namespace Tungsten {
 
+// Bump this whenever the serialized layout of any of the sampling tables changes
+static CONSTEXPR uint32 SamplingCacheVersion = 1;
+static CONSTEXPR uint32 SamplingCacheMagic = 0x53444D54; // "TMDS"
+// Smaller textures build their tables faster than they could be loaded
+static CONSTEXPR int SamplingCacheMinTexels = 1024*1024;
+
+struct SamplingCacheHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint64 key;
+};
+
+bool BitmapTexture::_cacheSamplingTables = false;
+
 struct Rgba
 {
     uint8 c[4];
@@ -40,6 +65,7 @@ BitmapTexture::BitmapTexture(PathPtr path, TexelConversion conversion,
   _gammaCorrect(gammaCorrect),
   _linear(linear),
   _clamp(clamp),
+  _hierarchicalSampling(false),
   _valid(false),
   _min(0.0f), _max(0.0f), _avg(0.0f),
   _texels(nullptr),
@@ -52,6 +78,7 @@ BitmapTexture::BitmapTexture(PathPtr path, TexelConversion conversion,
 BitmapTexture::BitmapTexture(void *texels, int w, int h, TexelType texelType, bool linear, bool clamp)
 : _linear(linear),
   _clamp(clamp),
+  _hierarchicalSampling(false),
   _valid(true),
   _scale(1.0f)
 {
@@ -60,19 +87,20 @@ BitmapTexture::BitmapTexture(void *texels, int w, int h, TexelType texelType, bo
 
 BitmapTexture::BitmapTexture(const BitmapTexture &o)
 {
-    _path            = o._path;
-    _texelConversion = o._texelConversion;
-    _gammaCorrect    = o._gammaCorrect;
-    _linear          = o._linear;
-    _clamp           = o._clamp;
-    _valid           = o._valid;
-    _min             = o._min;
-    _max             = o._max;
-    _avg             = o._avg;
-    _w               = o._w;
-    _h               = o._h;
-    _texelType       = o._texelType;
-    _scale           = o._scale;
+    _path                 = o._path;
+    _texelConversion      = o._texelConversion;
+    _gammaCorrect         = o._gammaCorrect;
+    _linear               = o._linear;
+    _clamp                = o._clamp;
+    _hierarchicalSampling = o._hierarchicalSampling;
+    _valid                = o._valid;
+    _min                  = o._min;
+    _max                  = o._max;
+    _avg                  = o._avg;
+    _w                    = o._w;
+    _h                    = o._h;
+    _texelType            = o._texelType;
+    _scale                = o._scale;
 
     if (o._texels) {
         size_t size = 0;
@@ -161,6 +189,18 @@ inline float BitmapTexture::weight(int x, int y) const
         return getScalar(x, y);
 }
 
+size_t BitmapTexture::texelBytes() const
+{
+    size_t texels = size_t(_w)*_h;
+    switch (_texelType) {
+    case TexelType::SCALAR_LDR: return texels*sizeof(uint8);
+    case TexelType::SCALAR_HDR: return texels*sizeof(float);
+    case TexelType::RGB_LDR:    return texels*sizeof(Rgba);
+    case TexelType::RGB_HDR:    return texels*sizeof(Vec3f);
+    }
+    return 0;
+}
+
 BitmapTexture::TexelType BitmapTexture::getTexelType(bool isRgb, bool isHdr)
 {
     if (isRgb && isHdr)
@@ -216,18 +256,20 @@ void BitmapTexture::fromJson(JsonPtr value, const Scene &scene)
     value.getField("interpolate", _linear);
     value.getField("clamp", _clamp);
     value.getField("scale", _scale);
+    value.getField("hierarchical_sampling", _hierarchicalSampling);
 }
 
 rapidjson::Value BitmapTexture::toJson(Allocator &allocator) const
 {
-    bool writeFullStruct = !_gammaCorrect || !_linear || _clamp || _scale != 1.0f;
+    bool writeFullStruct = !_gammaCorrect || !_linear || _clamp || _scale != 1.0f || _hierarchicalSampling;
     if (writeFullStruct) {
         JsonObject result{Texture::toJson(allocator), allocator,
             "type", "bitmap",
             "gamma_correct", _gammaCorrect,
             "interpolate", _linear,
             "clamp", _clamp,
-            "scale", _scale
+            "scale", _scale,
+            "hierarchical_sampling", _hierarchicalSampling
         };
         if (_path)
             result.add("file", *_path);
@@ -397,61 +439,196 @@ void BitmapTexture::derivatives(const Vec2f &uv, Vec2f &derivs) const
     derivs.y() = lerp(dv11, dv12, dv21, dv22, u, v)*_scale;
 }
 
-void BitmapTexture::makeSamplable(TextureMapJacobian jacobian)
+std::vector<float> BitmapTexture::samplingWeights(TextureMapJacobian jacobian) const
 {
-    if (_distribution[jacobian])
-        return;
-
-    std::vector<float> weights(_w*_h);
-    for (int y = 0, idx = 0; y < _h; ++y) {
+    // Texels are dilated by one in each direction, so that the weights cover
+    // the footprint of bilinear interpolation. Rows and blocks of columns are
+    // independent, so both passes run in parallel
+    std::vector<float> weights(size_t(_w)*_h);
+    uint32 rowsPerChunk = max(16384/max(_w, 1), 1);
+    ThreadUtils::parallelFor(0, uint32(_h), rowsPerChunk, [&](uint32 y) {
         float rowWeight = 1.0f;
         if (jacobian == MAP_SPHERICAL)
             rowWeight *= std::sin((y*PI)/_h);
-        for (int x = 0; x < _w; ++x, ++idx)
-            weights[idx] = weight(x, y)*rowWeight;
-    }
-    for (int y = 0; y < _h; ++y) {
+        float *row = &weights[size_t(y)*_w];
+        for (int x = 0; x < _w; ++x)
+            row[x] = weight(x, y)*rowWeight;
+
         for (int x = 0; x < _w - 1; ++x)
-            weights[x + y*_w] = max(weights[x + y*_w], weights[x + 1 + y*_w]);
+            row[x] = max(row[x], row[x + 1]);
         if (!_clamp)
-            weights[y*_w] = weights[_w - 1 + y*_w] = max(weights[_w - 1 + y*_w], weights[y*_w]);
+            row[0] = row[_w - 1] = max(row[_w - 1], row[0]);
         for (int x = _w - 1; x > 0; --x)
-            weights[x + y*_w] = max(weights[x + y*_w], weights[x - 1 + y*_w]);
-    }
-    for (int x = 0; x < _w; ++x) {
+            row[x] = max(row[x], row[x - 1]);
+    });
+
+    CONSTEXPR int ColumnsPerBlock = 64;
+    uint32 numBlocks = (_w + ColumnsPerBlock - 1)/ColumnsPerBlock;
+    ThreadUtils::parallelFor(0, numBlocks, 1, [&](uint32 block) {
+        int x0 = block*ColumnsPerBlock;
+        int x1 = min(x0 + ColumnsPerBlock, _w);
+        auto at = [&](int x, int y) -> float & { return weights[size_t(y)*_w + x]; };
+
         for (int y = 0; y < _h - 1; ++y)
-            weights[x + y*_w] = max(weights[x + y*_w], weights[x + (y + 1)*_w]);
+            for (int x = x0; x < x1; ++x)
+                at(x, y) = max(at(x, y), at(x, y + 1));
         if (!_clamp)
-            weights[x] = weights[x + (_h - 1)*_w] = max(weights[x], weights[x + (_h - 1)*_w]);
+            for (int x = x0; x < x1; ++x)
+                at(x, 0) = at(x, _h - 1) = max(at(x, 0), at(x, _h - 1));
         for (int y = _h - 1; y > 0; --y)
-            weights[x + y*_w] = max(weights[x + y*_w], weights[x + (y - 1)*_w]);
+            for (int x = x0; x < x1; ++x)
+                at(x, y) = max(at(x, y), at(x, y - 1));
+    });
+
+    return weights;
+}
+
+Path BitmapTexture::samplingCachePath(TextureMapJacobian jacobian, SamplingTable table) const
+{
+    const char *tableName = table == SAMPLE_CDF   ? ".cdf"
+                          : table == SAMPLE_ALIAS ? ".alias"
+                          :                         ".hierarchical";
+    return *_path + (jacobian == MAP_SPHERICAL ? ".spherical" : ".uniform") + tableName + ".samples";
+}
+
+uint64 BitmapTexture::samplingCacheKey(TextureMapJacobian jacobian, SamplingTable table) const
+{
+    uint32 settings[] = {uint32(_w), uint32(_h), uint32(_texelType), uint32(_clamp),
+            uint32(jacobian), uint32(table)};
+    uint64 key = BitManip::hash(_texels, texelBytes());
+    return BitManip::hash(settings, sizeof(settings), key);
+}
+
+bool BitmapTexture::loadSamplingCache(TextureMapJacobian jacobian, SamplingTable table)
+{
+    Path path = samplingCachePath(jacobian, table);
+    if (!path.exists())
+        return false;
+    InputStreamHandle in = FileUtils::openInputStream(path);
+    if (!in)
+        return false;
+
+    SamplingCacheHeader header;
+    FileUtils::streamRead(in, header);
+    if (!in->good() || header.magic != SamplingCacheMagic || header.version != SamplingCacheVersion
+            || header.key != samplingCacheKey(jacobian, table))
+        return false;
+
+    bool success = false;
+    switch (table) {
+    case SAMPLE_CDF:
+        _distribution[jacobian].reset(new Distribution2D());
+        success = _distribution[jacobian]->load(in, _w, _h);
+        break;
+    case SAMPLE_ALIAS:
+        _aliasDistribution[jacobian].reset(new AliasDistribution2D());
+        success = _aliasDistribution[jacobian]->load(in, _w, _h);
+        break;
+    case SAMPLE_HIERARCHICAL:
+        _hierarchicalDistribution[jacobian].reset(new HierarchicalDistribution2D());
+        success = _hierarchicalDistribution[jacobian]->load(in, _w, _h);
+        break;
     }
 
-    _distribution[jacobian].reset(new Distribution2D(std::move(weights), _w, _h));
+    if (!success) {
+        DBG("Ignoring corrupt sampling cache at '%s'", path);
+        _distribution[jacobian].reset();
+        _aliasDistribution[jacobian].reset();
+        _hierarchicalDistribution[jacobian].reset();
+    }
+    return success;
+}
+
+void BitmapTexture::saveSamplingCache(TextureMapJacobian jacobian, SamplingTable table) const
+{
+    Path path = samplingCachePath(jacobian, table);
+    bool written = FileUtils::writeFileAtomically(path, [&](OutputStreamHandle &out) {
+        FileUtils::streamWrite(out, SamplingCacheHeader{SamplingCacheMagic, SamplingCacheVersion,
+                samplingCacheKey(jacobian, table)});
+        switch (table) {
+        case SAMPLE_CDF:          _distribution[jacobian]->save(out); break;
+        case SAMPLE_ALIAS:        _aliasDistribution[jacobian]->save(out); break;
+        case SAMPLE_HIERARCHICAL: _hierarchicalDistribution[jacobian]->save(out); break;
+        }
+    });
+    if (!written)
+        DBG("Unable to write sampling cache at %s", path);
+}
+
+void BitmapTexture::makeSamplable(TextureMapJacobian jacobian, bool invertible)
+{
+    if (_distribution[jacobian] || _hierarchicalDistribution[jacobian])
+        return;
+    if (_aliasDistribution[jacobian] && !invertible)
+        return;
+    _aliasDistribution[jacobian].reset();
+
+    SamplingTable table = _hierarchicalSampling ? SAMPLE_HIERARCHICAL
+                        : invertible            ? SAMPLE_CDF
+                        :                         SAMPLE_ALIAS;
+
+    bool useCache = _cacheSamplingTables && _valid && _path && !_path->empty()
+            && _w*_h >= SamplingCacheMinTexels;
+    if (useCache && loadSamplingCache(jacobian, table))
+        return;
+
+    std::vector<float> weights = samplingWeights(jacobian);
+    switch (table) {
+    case SAMPLE_CDF:
+        _distribution[jacobian].reset(new Distribution2D(std::move(weights), _w, _h));
+        break;
+    case SAMPLE_ALIAS:
+        _aliasDistribution[jacobian].reset(new AliasDistribution2D(std::move(weights), _w, _h));
+        break;
+    case SAMPLE_HIERARCHICAL:
+        _hierarchicalDistribution[jacobian].reset(new HierarchicalDistribution2D(std::move(weights), _w, _h));
+        break;
+    }
+
+    if (useCache)
+        saveSamplingCache(jacobian, table);
 }
 
 Vec2f BitmapTexture::sample(TextureMapJacobian jacobian, const Vec2f &uv) const
 {
     Vec2f newUv(uv);
     int row, column;
-    _distribution[jacobian]->warp(newUv, row, column);
+    if (_aliasDistribution[jacobian])
+        _aliasDistribution[jacobian]->warp(newUv, row, column);
+    else if (_hierarchicalDistribution[jacobian])
+        _hierarchicalDistribution[jacobian]->warp(newUv, row, column);
+    else
+        _distribution[jacobian]->warp(newUv, row, column);
     return Vec2f((newUv.x() + column)/_w, 1.0f - (newUv.y() + row)/_h);
 }
 
 Vec2f BitmapTexture::invert(TextureMapJacobian jacobian, const Vec2f &uv) const
 {
+    if (!_distribution[jacobian] && !_hierarchicalDistribution[jacobian])
+        FAIL("BitmapTexture::invert requires the texture to be made samplable as invertible");
+
     Vec2f newUv = Vec2f(uv.x()*_w, (1.0f - uv.y())*_h);
     int row = int(newUv.y());
     int column = int(newUv.x());
     newUv.x() -= column;
     newUv.y() -= row;
 
-    return _distribution[jacobian]->unwarp(newUv, row, column);
+    if (_hierarchicalDistribution[jacobian])
+        return _hierarchicalDistribution[jacobian]->unwarp(newUv, row, column);
+    else
+        return _distribution[jacobian]->unwarp(newUv, row, column);
 }
 
 float BitmapTexture::pdf(TextureMapJacobian jacobian, const Vec2f &uv) const
 {
-    return _distribution[jacobian]->pdf(int((1.0f - uv.y())*_h), int(uv.x()*_w))*_w*_h;
+    int row = int((1.0f - uv.y())*_h);
+    int column = int(uv.x()*_w);
+    if (_aliasDistribution[jacobian])
+        return _aliasDistribution[jacobian]->pdf(row, column)*_w*_h;
+    else if (_hierarchicalDistribution[jacobian])
+        return _hierarchicalDistribution[jacobian]->pdf(row, column)*_w*_h;
+    else
+        return _distribution[jacobian]->pdf(row, column)*_w*_h;
 }
 
 void BitmapTexture::scaleValues(float factor)
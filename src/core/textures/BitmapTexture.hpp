@@ -6,8 +6,12 @@
 #include "io/ImageIO.hpp"
 #include "io/Path.hpp"
 
+#include <vector>
+
 namespace Tungsten {
 
+class HierarchicalDistribution2D;
+class AliasDistribution2D;
 class Distribution2D;
 
 class BitmapTexture : public Texture
@@ -23,10 +27,20 @@ public:
 private:
     typedef JsonSerializable::Allocator Allocator;
 
+    enum SamplingTable : uint32
+    {
+        SAMPLE_CDF          = 0,
+        SAMPLE_ALIAS        = 1,
+        SAMPLE_HIERARCHICAL = 2,
+    };
+
+    static bool _cacheSamplingTables;
+
     PathPtr _path;
     TexelConversion _texelConversion;
     bool _gammaCorrect;
     bool _linear, _clamp;
+    bool _hierarchicalSampling;
     bool _valid;
 
     Vec3f _min, _max, _avg;
@@ -36,7 +50,12 @@ private:
     TexelType _texelType;
     float _scale;
 
+    // Exactly one of these is built per samplable jacobian. The alias
+    // tables are faster, but only the CDF can be inverted. The hierarchical
+    // distribution replaces both if requested
     std::unique_ptr<Distribution2D> _distribution[MAP_JACOBIAN_COUNT];
+    std::unique_ptr<AliasDistribution2D> _aliasDistribution[MAP_JACOBIAN_COUNT];
+    std::unique_ptr<HierarchicalDistribution2D> _hierarchicalDistribution[MAP_JACOBIAN_COUNT];
 
     inline bool isRgb() const;
     inline bool isHdr() const;
@@ -51,6 +70,15 @@ private:
     inline Vec3f getRgb(int x, int y) const;
     inline float weight(int x, int y) const;
 
+    size_t texelBytes() const;
+
+    std::vector<float> samplingWeights(TextureMapJacobian jacobian) const;
+
+    Path samplingCachePath(TextureMapJacobian jacobian, SamplingTable table) const;
+    uint64 samplingCacheKey(TextureMapJacobian jacobian, SamplingTable table) const;
+    bool loadSamplingCache(TextureMapJacobian jacobian, SamplingTable table);
+    void saveSamplingCache(TextureMapJacobian jacobian, SamplingTable table) const;
+
 protected:
     TexelType getTexelType(bool isRgb, bool isHdr);
 
@@ -81,7 +109,7 @@ public:
     virtual Vec3f operator[](const IntersectionInfo &info) const override;
     virtual void derivatives(const Vec2f &uv, Vec2f &derivs) const override;
 
-    virtual void makeSamplable(TextureMapJacobian jacobian) override;
+    virtual void makeSamplable(TextureMapJacobian jacobian, bool invertible) override;
     virtual Vec2f sample(TextureMapJacobian jacobian, const Vec2f &uv) const override;
     virtual Vec2f invert(TextureMapJacobian jacobian, const Vec2f &uv) const override;
     virtual float pdf(TextureMapJacobian jacobian, const Vec2f &uv) const override;
@@ -90,6 +118,13 @@ public:
 
     virtual Texture *clone() const override;
 
+    // Sampling tables of large textures loaded from files are persisted in
+    // files next to them and reused by later renders. Disabled by default
+    static void setSamplingCacheEnabled(bool enabled)
+    {
+        _cacheSamplingTables = enabled;
+    }
+
     const PathPtr &path() const
     {
         return _path;
@@ -125,6 +160,11 @@ public:
         return _linear;
     }
 
+    bool hierarchicalSampling() const
+    {
+        return _hierarchicalSampling;
+    }
+
     void setClamp(bool clamp)
     {
         _clamp = clamp;
@@ -140,6 +180,11 @@ public:
         _linear = linear;
     }
 
+    void setHierarchicalSampling(bool hierarchicalSampling)
+    {
+        _hierarchicalSampling = hierarchicalSampling;
+    }
+
     TexelConversion texelConversion() const
     {
         return _texelConversion;
@@ -158,6 +203,7 @@ public:
             _gammaCorrect != o._gammaCorrect ? _gammaCorrect < o._gammaCorrect :
             _linear != o._linear ? _linear < o._linear :
             _clamp != o._clamp ? _clamp < o._clamp :
+            _hierarchicalSampling != o._hierarchicalSampling ? _hierarchicalSampling < o._hierarchicalSampling :
             false;
 
     }
@@ -169,7 +215,8 @@ public:
             _texelConversion == o._texelConversion &&
             _gammaCorrect == o._gammaCorrect &&
             _linear == o._linear &&
-            _clamp == o._clamp;
+            _clamp == o._clamp &&
+            _hierarchicalSampling == o._hierarchicalSampling;
     }
 };
 
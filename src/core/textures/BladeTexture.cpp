@@ -96,7 +96,7 @@ void BladeTexture::derivatives(const Vec2f &/*uv*/, Vec2f &derivs) const
     derivs = Vec2f(0.0f);
 }
 
-void BladeTexture::makeSamplable(TextureMapJacobian /*jacobian*/)
+void BladeTexture::makeSamplable(TextureMapJacobian /*jacobian*/, bool /*invertible*/)
 {
 }
 
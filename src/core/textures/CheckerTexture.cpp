@@ -78,7 +78,7 @@ void CheckerTexture::derivatives(const Vec2f &/*uv*/, Vec2f &derivs) const
     derivs = Vec2f(0.0f);
 }
 
-void CheckerTexture::makeSamplable(TextureMapJacobian /*jacobian*/)
+void CheckerTexture::makeSamplable(TextureMapJacobian /*jacobian*/, bool /*invertible*/)
 {
 }
 
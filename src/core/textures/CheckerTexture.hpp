@@ -29,7 +29,7 @@ public:
     virtual Vec3f operator[](const IntersectionInfo &info) const override;
     virtual void derivatives(const Vec2f &uv, Vec2f &derivs) const override;
 
-    virtual void makeSamplable(TextureMapJacobian jacobian) override;
+    virtual void makeSamplable(TextureMapJacobian jacobian, bool invertible) override;
     virtual Vec2f sample(TextureMapJacobian jacobian, const Vec2f &uv) const override;
     virtual float pdf(TextureMapJacobian jacobian, const Vec2f &uv) const override;
 
@@ -62,7 +62,7 @@ void ConstantTexture::derivatives(const Vec2f &/*uv*/, Vec2f &derivs) const
     derivs = Vec2f(0.0f);
 }
 
-void ConstantTexture::makeSamplable(TextureMapJacobian /*jacobian*/)
+void ConstantTexture::makeSamplable(TextureMapJacobian /*jacobian*/, bool /*invertible*/)
 {
 }
 
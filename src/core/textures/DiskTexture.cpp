@@ -63,7 +63,7 @@ void DiskTexture::derivatives(const Vec2f &/*uv*/, Vec2f &derivs) const
     derivs = Vec2f(0.0f);
 }
 
-void DiskTexture::makeSamplable(TextureMapJacobian /*jacobian*/)
+void DiskTexture::makeSamplable(TextureMapJacobian /*jacobian*/, bool /*invertible*/)
 {
 }
 
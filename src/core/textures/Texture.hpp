@@ -33,7 +33,10 @@ public:
     virtual Vec3f operator[](const IntersectionInfo &info) const = 0;
     virtual void derivatives(const Vec2f &uv, Vec2f &derivs) const = 0;
 
-    virtual void makeSamplable(TextureMapJacobian jacobian) = 0;
+    // Prepares sample and pdf for the jacobian. Sampling tables may trade
+    // invertibility for speed, so invert is only available if invertible
+    // was requested
+    virtual void makeSamplable(TextureMapJacobian jacobian, bool invertible) = 0;
     virtual Vec2f sample(TextureMapJacobian jacobian, const Vec2f &uv) const = 0;
     virtual Vec2f invert(TextureMapJacobian jacobian, const Vec2f &uv) const;
     virtual float pdf(TextureMapJacobian jacobian, const Vec2f &uv) const = 0;
@@ -0,0 +1,94 @@
+#include "NumaTopology.hpp"
+#include "ThreadUtils.hpp"
+
+#if _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <fstream>
+#include <string>
+#endif
+
+namespace Tungsten {
+
+#if defined(__linux__)
+// Parses cpu lists of the form "0-3,8,10-11"
+static std::vector<uint32> parseCpuList(const std::string &list)
+{
+    std::vector<uint32> result;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        try {
+            uint32 first = std::stoul(range.substr(0, dash));
+            uint32 last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+            for (uint32 i = first; i <= last; ++i)
+                result.push_back(i);
+        } catch (const std::exception &) {
+        }
+        pos = end + 1;
+    }
+    return result;
+}
+#endif
+
+NumaTopology::NumaTopology()
+{
+#if _WIN32
+    ULONG highestNode;
+    if (GetNumaHighestNodeNumber(&highestNode)) {
+        for (ULONG node = 0; node <= highestNode; ++node) {
+            ULONGLONG mask;
+            if (!GetNumaNodeProcessorMask(UCHAR(node), &mask) || mask == 0)
+                continue;
+            std::vector<uint32> cpus;
+            for (uint32 i = 0; i < 64; ++i)
+                if (mask & (1ull << i))
+                    cpus.push_back(i);
+            _nodeCpus.emplace_back(std::move(cpus));
+        }
+    }
+#elif defined(__linux__)
+    for (uint32 node = 0; ; ++node) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!in.good())
+            break;
+        std::string list;
+        std::getline(in, list);
+        std::vector<uint32> cpus = parseCpuList(list);
+        if (!cpus.empty())
+            _nodeCpus.emplace_back(std::move(cpus));
+    }
+#endif
+
+    if (_nodeCpus.empty()) {
+        std::vector<uint32> cpus;
+        for (uint32 i = 0; i < ThreadUtils::idealThreadCount(); ++i)
+            cpus.push_back(i);
+        _nodeCpus.emplace_back(std::move(cpus));
+    }
+}
+
+bool NumaTopology::pinCurrentThread(uint32 cpu)
+{
+#if _WIN32
+    if (cpu >= 64)
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+}
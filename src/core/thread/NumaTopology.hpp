@@ -0,0 +1,35 @@
+#ifndef NUMATOPOLOGY_HPP_
+#define NUMATOPOLOGY_HPP_
+
+#include "IntTypes.hpp"
+
+#include <vector>
+
+namespace Tungsten {
+
+// Describes which logical processors belong to which NUMA node.
+// On platforms where the topology cannot be queried, all processors
+// are reported as belonging to a single node
+class NumaTopology
+{
+    std::vector<std::vector<uint32>> _nodeCpus;
+
+public:
+    NumaTopology();
+
+    static bool pinCurrentThread(uint32 cpu);
+
+    uint32 nodeCount() const
+    {
+        return _nodeCpus.size();
+    }
+
+    const std::vector<uint32> &nodeCpus(uint32 node) const
+    {
+        return _nodeCpus[node];
+    }
+};
+
+}
+
+#endif /* NUMATOPOLOGY_HPP_ */
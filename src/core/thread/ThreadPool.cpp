@@ -1,13 +1,28 @@
+#include "NumaTopology.hpp"
 #include "ThreadPool.hpp"
 
-#include <chrono>
-
 namespace Tungsten {
 
-ThreadPool::ThreadPool(uint32 threadCount)
+// Set by every worker before it runs any job, so that threads never look up
+// their id in state shared with the thread that starts them
+static thread_local const ThreadPool *localPool = nullptr;
+static thread_local uint32 localThreadId = 0;
+
+ThreadPool::ThreadPool(uint32 threadCount, bool pinThreads)
 : _threadCount(threadCount),
-  _terminateFlag(false)
+  _pinThreads(pinThreads),
+  _nodeCount(1),
+  _terminateFlag(false),
+  _injectedCount(0),
+  _queuedJobs(0),
+  _sleepers(0)
 {
+    for (uint32 i = 0; i < _threadCount; ++i) {
+        _queues.emplace_back(new WorkStealingDeque<Job>());
+        _affineQueues.emplace_back(new AffineQueue());
+    }
+
+    assignProcessors();
     startThreads();
 }
 
@@ -16,82 +31,253 @@ ThreadPool::~ThreadPool()
     stop();
 }
 
-std::shared_ptr<TaskGroup> ThreadPool::acquireTask(uint32 &subTaskId)
+void ThreadPool::assignProcessors()
 {
-    if (_terminateFlag)
-        return nullptr;
-    std::shared_ptr<TaskGroup> task = _tasks.front();
-    if (task->isAborting()) {
-        _tasks.pop_front();
-        return nullptr;
+    _threadNodes.resize(_threadCount, 0);
+    if (_pinThreads) {
+        NumaTopology topology;
+
+        std::vector<uint32> cpus, cpuNodes;
+        for (uint32 node = 0; node < topology.nodeCount(); ++node) {
+            for (uint32 cpu : topology.nodeCpus(node)) {
+                cpus.push_back(cpu);
+                cpuNodes.push_back(node);
+            }
+        }
+
+        // Spread the workers evenly over all processors. Processors are
+        // ordered by node, so thread ids end up contiguous per node
+        for (uint32 i = 0; i < _threadCount; ++i) {
+            uint32 idx = _threadCount <= cpus.size() ? uint32((uint64(i)*cpus.size())/_threadCount) : i % cpus.size();
+            _threadCpus.push_back(cpus[idx]);
+            _threadNodes[i] = cpuNodes[idx];
+        }
+
+        // Renumber nodes so that only nodes with workers are counted
+        std::vector<int> nodeIndex(topology.nodeCount(), -1);
+        _nodeCount = 0;
+        for (uint32 &node : _threadNodes) {
+            if (nodeIndex[node] == -1)
+                nodeIndex[node] = _nodeCount++;
+            node = nodeIndex[node];
+        }
+        if (_nodeCount == 0)
+            _nodeCount = 1;
     }
-    subTaskId = task->startSubTask();
-    if (subTaskId == task->numSubTasks() - 1)
-        _tasks.pop_front();
-    return std::move(task);
+
+    _victims.resize(_threadCount);
+    for (uint32 i = 0; i < _threadCount; ++i) {
+        for (uint32 j = 1; j < _threadCount; ++j)
+            if (_threadNodes[(i + j) % _threadCount] == _threadNodes[i])
+                _victims[i].push_back((i + j) % _threadCount);
+        for (uint32 j = 1; j < _threadCount; ++j)
+            if (_threadNodes[(i + j) % _threadCount] != _threadNodes[i])
+                _victims[i].push_back((i + j) % _threadCount);
+    }
+}
+
+uint32 ThreadPool::numericThreadId() const
+{
+    // Threads not in the pool get a previously unassigned id
+    if (localPool == this)
+        return localThreadId;
+    return _threadCount;
+}
+
+void ThreadPool::pushJob(uint32 threadId, Job *job, bool wakeAll)
+{
+    if (threadId < _threadCount) {
+        _queues[threadId]->push(job);
+    } else {
+        std::unique_lock<std::mutex> lock(_injectMutex);
+        _injectedJobs.push_back(job);
+        _injectedCount++;
+    }
+    _queuedJobs++;
+
+    wakeThreads(wakeAll);
+}
+
+ThreadPool::Job *ThreadPool::findJob(uint32 threadId)
+{
+    if (threadId < _threadCount && _affineQueues[threadId]->count > 0) {
+        AffineQueue &queue = *_affineQueues[threadId];
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        if (!queue.jobs.empty()) {
+            Job *job = queue.jobs.front();
+            queue.jobs.pop_front();
+            queue.count--;
+            return job;
+        }
+    }
+
+    Job *job = nullptr;
+    if (threadId < _threadCount)
+        job = _queues[threadId]->pop();
+
+    if (!job && _injectedCount > 0) {
+        std::unique_lock<std::mutex> lock(_injectMutex);
+        if (!_injectedJobs.empty()) {
+            job = _injectedJobs.front();
+            _injectedJobs.pop_front();
+            _injectedCount--;
+        }
+    }
+
+    // Victim lists start with our neighbour, so that thieves spread out.
+    // Threads outside of the pool just go through all workers
+    if (threadId < _threadCount) {
+        for (size_t i = 0; i < _victims[threadId].size() && !job; ++i)
+            job = _queues[_victims[threadId][i]]->steal();
+    } else {
+        for (uint32 i = 0; i < _threadCount && !job; ++i)
+            job = _queues[i]->steal();
+    }
+
+    if (job)
+        _queuedJobs--;
+    return job;
+}
+
+void ThreadPool::runJob(uint32 threadId, Job *job)
+{
+    if (job->group->isAborting()) {
+        delete job;
+        wakeThreads(true);
+        return;
+    }
+
+    std::shared_ptr<TaskGroup> task;
+    uint32 subTaskId = job->group->startSubTask();
+    if (job->affine) {
+        subTaskId = threadId;
+        task = std::move(job->group);
+        delete job;
+    } else if (subTaskId + 1 < job->group->numSubTasks()) {
+        task = job->group;
+        pushJob(threadId, job, false);
+    } else {
+        task = std::move(job->group);
+        delete job;
+    }
+
+    task->run(threadId, subTaskId);
+
+    // Threads blocked in yield may be waiting on this group
+    if (task->isDone())
+        wakeThreads(true);
+}
+
+void ThreadPool::wakeThreads(bool all)
+{
+    if (_sleepers == 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(_sleepMutex);
+    if (all)
+        _sleepCond.notify_all();
+    else
+        _sleepCond.notify_one();
+}
+
+bool ThreadPool::hasWork(uint32 threadId) const
+{
+    return _queuedJobs > 0 || (threadId < _threadCount && _affineQueues[threadId]->count > 0);
+}
+
+// Deques may only be popped by their owner, so they are drained from the
+// top instead. Steals can fail spuriously under contention, hence the loop
+void ThreadPool::clearJobs()
+{
+    for (auto &queue : _queues)
+        while (!queue->empty())
+            if (Job *job = queue->steal())
+                delete job;
+    for (auto &queue : _affineQueues) {
+        std::unique_lock<std::mutex> lock(queue->mutex);
+        for (Job *job : queue->jobs)
+            delete job;
+        queue->jobs.clear();
+        queue->count = 0;
+    }
+
+    std::unique_lock<std::mutex> lock(_injectMutex);
+    for (Job *job : _injectedJobs)
+        delete job;
+    _injectedJobs.clear();
+    _injectedCount = 0;
+    _queuedJobs = 0;
 }
 
 void ThreadPool::runWorker(uint32 threadId)
 {
+    localPool = this;
+    localThreadId = threadId;
+
+    if (_pinThreads)
+        NumaTopology::pinCurrentThread(_threadCpus[threadId]);
+
     while (!_terminateFlag) {
-        uint32 subTaskId;
-        std::shared_ptr<TaskGroup> task;
-        {
-            std::unique_lock<std::mutex> lock(_taskMutex);
-            _taskCond.wait(lock, [this]{return _terminateFlag || !_tasks.empty();});
-            task = acquireTask(subTaskId);
+        if (Job *job = findJob(threadId)) {
+            runJob(threadId, job);
+            continue;
         }
-        if (task)
-            task->run(threadId, subTaskId);
+
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        _sleepers++;
+        _sleepCond.wait(lock, [&]{return _terminateFlag || hasWork(threadId);});
+        _sleepers--;
     }
 }
 
 void ThreadPool::startThreads()
 {
     _terminateFlag = false;
-    for (uint32 i = 0; i < _threadCount; ++i) {
+    for (uint32 i = 0; i < _threadCount; ++i)
         _workers.emplace_back(new std::thread(&ThreadPool::runWorker, this, i));
-        _idToNumericId.insert(std::make_pair(_workers.back()->get_id(), i));
-    }
 }
 
 void ThreadPool::yield(TaskGroup &wait)
 {
-    std::chrono::milliseconds waitSpan(10);
-    uint32 id = _threadCount; // Threads not in the pool get a previously unassigned id
-
-    auto iter = _idToNumericId.find(std::this_thread::get_id());
-    if (iter != _idToNumericId.end())
-        id = iter->second;
+    uint32 id = numericThreadId();
 
     while (!wait.isDone() && !_terminateFlag) {
-        uint32 subTaskId;
-        std::shared_ptr<TaskGroup> task;
-        {
-            std::unique_lock<std::mutex> lock(_taskMutex);
-            if (!_taskCond.wait_for(lock, waitSpan, [this]{return _terminateFlag || !_tasks.empty();}))
-                continue;
-            task = acquireTask(subTaskId);
+        if (Job *job = findJob(id)) {
+            runJob(id, job);
+            continue;
         }
-        if (task)
-            task->run(id, subTaskId);
+
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        _sleepers++;
+        _sleepCond.wait(lock, [&]{return _terminateFlag || hasWork(id) || wait.isDone();});
+        _sleepers--;
     }
 }
 
+void ThreadPool::signalTermination()
+{
+    _terminateFlag = true;
+    std::unique_lock<std::mutex> lock(_sleepMutex);
+    _sleepCond.notify_all();
+}
+
 void ThreadPool::reset()
 {
-    stop();
-    _tasks.clear();
+    // The new workers take over the deques of the old ones, so the old
+    // workers are joined rather than detached, which would leave a second
+    // owner pushing to the same deque
+    signalTermination();
+    for (auto &worker : _workers)
+        worker->join();
+    _workers.clear();
+
+    clearJobs();
     startThreads();
 }
 
 void ThreadPool::stop()
 {
-    _terminateFlag = true;
-    {
-        std::unique_lock<std::mutex> lock(_taskMutex);
-        _taskCond.notify_all();
-    }
+    signalTermination();
     while (!_workers.empty()) {
         _workers.back()->detach();
         _workers.pop_back();
@@ -103,16 +289,25 @@ std::shared_ptr<TaskGroup> ThreadPool::enqueue(TaskFunc func, int numSubtasks, F
     std::shared_ptr<TaskGroup> task(std::make_shared<TaskGroup>(std::move(func),
             std::move(finisher), numSubtasks));
 
-    {
-        std::unique_lock<std::mutex> lock(_taskMutex);
-        _tasks.emplace_back(task);
-        if (numSubtasks == 1)
-            _taskCond.notify_one();
-        else
-            _taskCond.notify_all();
-    }
+    pushJob(numericThreadId(), new Job(task), numSubtasks > 1);
 
     return std::move(task);
 }
 
+std::shared_ptr<TaskGroup> ThreadPool::enqueuePerThread(TaskFunc func, Finisher finisher)
+{
+    std::shared_ptr<TaskGroup> task(std::make_shared<TaskGroup>(std::move(func),
+            std::move(finisher), _threadCount));
+
+    for (uint32 i = 0; i < _threadCount; ++i) {
+        AffineQueue &queue = *_affineQueues[i];
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(new Job(task, true));
+        queue.count++;
+    }
+    wakeThreads(true);
+
+    return task;
+}
+
 }
@@ -1,12 +1,12 @@
 #ifndef THREADPOOL_HPP_
 #define THREADPOOL_HPP_
 
+#include "WorkStealingDeque.hpp"
 #include "TaskGroup.hpp"
 
 #include "IntTypes.hpp"
 
 #include <condition_variable>
-#include <unordered_map>
 #include <functional>
 #include <atomic>
 #include <memory>
@@ -22,22 +22,72 @@ class ThreadPool
     typedef std::function<void(uint32, uint32, uint32)> TaskFunc;
     typedef std::function<void()> Finisher;
 
+    // A job hands out the sub-tasks of one task group. There is exactly one
+    // job per group in flight; whoever claims a sub-task pushes the job back
+    // onto its own deque, so that idle threads can steal the remainder
+    struct Job
+    {
+        std::shared_ptr<TaskGroup> group;
+        // Affine jobs run exactly one sub-task, on one particular worker
+        bool affine;
+
+        Job(std::shared_ptr<TaskGroup> group_, bool affine_ = false)
+        : group(std::move(group_)),
+          affine(affine_)
+        {
+        }
+    };
+
+    struct AffineQueue
+    {
+        std::deque<Job *> jobs;
+        std::atomic<uint32> count;
+        std::mutex mutex;
+
+        AffineQueue() : count(0) {}
+    };
+
     uint32 _threadCount;
+    bool _pinThreads;
     std::vector<std::unique_ptr<std::thread>> _workers;
+    std::vector<std::unique_ptr<WorkStealingDeque<Job>>> _queues;
+    std::vector<std::unique_ptr<AffineQueue>> _affineQueues;
+
+    // Processor, NUMA node and steal order of each worker. Victims on the
+    // same node are tried before crossing over to other nodes
+    std::vector<uint32> _threadCpus;
+    std::vector<uint32> _threadNodes;
+    std::vector<std::vector<uint32>> _victims;
+    uint32 _nodeCount;
     std::atomic<bool> _terminateFlag;
 
-    std::deque<std::shared_ptr<TaskGroup>> _tasks;
-    std::mutex _taskMutex;
-    std::condition_variable _taskCond;
+    // Threads outside of the pool don't own a deque and submit through here
+    std::deque<Job *> _injectedJobs;
+    std::atomic<uint32> _injectedCount;
+    std::mutex _injectMutex;
+
+    std::atomic<int32> _queuedJobs;
+    std::atomic<int32> _sleepers;
+    std::mutex _sleepMutex;
+    std::condition_variable _sleepCond;
+
+    uint32 numericThreadId() const;
+
+    void pushJob(uint32 threadId, Job *job, bool wakeAll);
+    Job *findJob(uint32 threadId);
+    void runJob(uint32 threadId, Job *job);
+    void wakeThreads(bool all);
+    void clearJobs();
+    void signalTermination();
+    bool hasWork(uint32 threadId) const;
 
-    std::unordered_map<std::thread::id, uint32> _idToNumericId;
+    void assignProcessors();
 
-    std::shared_ptr<TaskGroup> acquireTask(uint32 &subTaskId);
     void runWorker(uint32 threadId);
     void startThreads();
 
 public:
-    ThreadPool(uint32 threadCount);
+    ThreadPool(uint32 threadCount, bool pinThreads = false);
     ~ThreadPool();
 
     void yield(TaskGroup &wait);
@@ -47,11 +97,26 @@ public:
 
     std::shared_ptr<TaskGroup> enqueue(TaskFunc func, int numSubtasks = 1,
             Finisher finisher = Finisher());
+    // Runs func exactly once on every worker thread, with the sub-task id
+    // equal to the thread id. Useful for first-touch allocation of
+    // per-thread state on the memory node of that thread
+    std::shared_ptr<TaskGroup> enqueuePerThread(TaskFunc func, Finisher finisher = Finisher());
 
     uint32 threadCount() const
     {
         return _threadCount;
     }
+
+    uint32 nodeCount() const
+    {
+        return _nodeCount;
+    }
+
+    // Threads outside of the pool are reported as belonging to node 0
+    uint32 threadNode(uint32 threadId) const
+    {
+        return threadId < _threadCount ? _threadNodes[threadId] : 0;
+    }
 };
 
 }
@@ -1,6 +1,4 @@
-#include "ThreadPool.hpp"
-
-#include "math/MathUtil.hpp"
+#include "ThreadUtils.hpp"
 
 #include <thread>
 #if _WIN32
@@ -37,25 +35,9 @@ uint32 idealThreadCount()
     return 4;
 }
 
-void startThreads(int numThreads)
-{
-    pool = new ThreadPool(numThreads);
-}
-
-void parallelFor(uint32 start, uint32 end, uint32 partitions, std::function<void(uint32)> func)
+void startThreads(int numThreads, bool pinThreads)
 {
-    auto taskRun = [&func, start, end](uint32 idx, uint32 num, uint32 /*threadId*/)
-    {
-        uint32 span = (end - start + num - 1)/num;
-        uint32 iStart = start + span*idx;
-        uint32 iEnd = min(iStart + span, end);
-        for (uint32 i = iStart; i < iEnd; ++i)
-            func(i);
-    };
-    if (partitions == 1)
-        taskRun(0, 1, 0);
-    else
-        pool->yield(*pool->enqueue(taskRun, partitions));
+    pool = new ThreadPool(numThreads, pinThreads);
 }
 
 }
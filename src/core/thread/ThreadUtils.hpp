@@ -1,22 +1,102 @@
 #ifndef THREADUTILS_HPP_
 #define THREADUTILS_HPP_
 
+#include "ThreadPool.hpp"
+
 #include "IntTypes.hpp"
 
-#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 namespace Tungsten {
 
-class ThreadPool;
-
 namespace ThreadUtils {
 
 extern ThreadPool *pool;
 
 uint32 idealThreadCount();
-void startThreads(int numThreads);
+// If pinThreads is set, workers are pinned to processors and grouped by NUMA node
+void startThreads(int numThreads, bool pinThreads = false);
+
+// Splits [start, end) into chunks of grainSize indices and runs
+// body(taskId, chunkStart, chunkEnd) for each of them. Chunks are handed out
+// dynamically, so loops with very uneven per-item cost still balance well.
+// taskId is in [0, numTasks) and identifies the task running the chunk
+template<typename Body>
+void parallelChunks(uint32 start, uint32 end, uint32 grainSize, uint32 numTasks, Body &body)
+{
+    uint32 numChunks = (end - start - 1)/grainSize + 1;
+    if (numTasks == 1) {
+        for (uint32 chunk = 0; chunk < numChunks; ++chunk) {
+            uint32 chunkStart = start + chunk*grainSize;
+            body(0, chunkStart, chunkStart + std::min(grainSize, end - chunkStart));
+        }
+        return;
+    }
+
+    std::atomic<uint32> nextChunk(0);
+    pool->yield(*pool->enqueue([&](uint32 taskId, uint32, uint32) {
+        uint32 chunk;
+        while ((chunk = nextChunk++) < numChunks) {
+            uint32 chunkStart = start + chunk*grainSize;
+            body(taskId, chunkStart, chunkStart + std::min(grainSize, end - chunkStart));
+        }
+    }, numTasks));
+}
+
+inline uint32 parallelTaskCount(uint32 start, uint32 end, uint32 grainSize)
+{
+    // Tools that never start the thread pool just run the loop serially
+    if (!pool)
+        return 1;
+    uint32 numChunks = (end - start - 1)/grainSize + 1;
+    return std::min(numChunks, pool->threadCount() + 1);
+}
 
-void parallelFor(uint32 start, uint32 end, uint32 partitions, std::function<void(uint32)> func);
+// Calls func(i) for every i in [start, end)
+template<typename Func>
+void parallelFor(uint32 start, uint32 end, uint32 grainSize, Func func)
+{
+    if (end <= start)
+        return;
+    grainSize = std::max(grainSize, 1u);
+
+    auto body = [&](uint32 /*taskId*/, uint32 chunkStart, uint32 chunkEnd) {
+        for (uint32 i = chunkStart; i < chunkEnd; ++i)
+            func(i);
+    };
+    parallelChunks(start, end, grainSize, parallelTaskCount(start, end, grainSize), body);
+}
+
+// Calls func(acc, i) for every i in [start, end), where acc is an accumulator
+// private to the running chunk that starts out as identity. The accumulators
+// are combined with reduce(a, b) in chunk order once all tasks are done, so the
+// result does not depend on which task happened to run which chunk
+template<typename T, typename Func, typename Reduce>
+T parallelReduce(uint32 start, uint32 end, uint32 grainSize, T identity, Func func, Reduce reduce)
+{
+    if (end <= start)
+        return identity;
+    grainSize = std::max(grainSize, 1u);
+
+    uint32 numChunks = (end - start - 1)/grainSize + 1;
+    std::vector<T> partials(numChunks, identity);
+
+    auto body = [&](uint32 /*taskId*/, uint32 chunkStart, uint32 chunkEnd) {
+        // Accumulate into a local to avoid false sharing between tasks
+        T acc = identity;
+        for (uint32 i = chunkStart; i < chunkEnd; ++i)
+            func(acc, i);
+        partials[(chunkStart - start)/grainSize] = std::move(acc);
+    };
+    parallelChunks(start, end, grainSize, parallelTaskCount(start, end, grainSize), body);
+
+    T result = std::move(identity);
+    for (T &partial : partials)
+        result = reduce(result, partial);
+    return result;
+}
 
 }
 
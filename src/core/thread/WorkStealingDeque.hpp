@@ -0,0 +1,149 @@
+#ifndef WORKSTEALINGDEQUE_HPP_
+#define WORKSTEALINGDEQUE_HPP_
+
+#include "IntTypes.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace Tungsten {
+
+// Chase-Lev work-stealing deque, following the formulation of
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013)
+// Only the owning thread may call push and pop. Any thread may call steal.
+// Elements are stored as raw pointers; ownership of an element passes to
+// whichever call successfully returns it.
+template<typename T>
+class WorkStealingDeque
+{
+    class RingBuffer
+    {
+        int64 _mask;
+        std::unique_ptr<std::atomic<T *>[]> _data;
+
+    public:
+        RingBuffer(int64 capacity)
+        : _mask(capacity - 1),
+          _data(new std::atomic<T *>[size_t(capacity)])
+        {
+        }
+
+        int64 capacity() const
+        {
+            return _mask + 1;
+        }
+
+        T *load(int64 i) const
+        {
+            return _data[i & _mask].load(std::memory_order_relaxed);
+        }
+
+        void store(int64 i, T *value)
+        {
+            _data[i & _mask].store(value, std::memory_order_relaxed);
+        }
+
+        RingBuffer *grow(int64 top, int64 bottom) const
+        {
+            RingBuffer *result = new RingBuffer(capacity()*2);
+            for (int64 i = top; i < bottom; ++i)
+                result->store(i, load(i));
+            return result;
+        }
+    };
+
+    // Top and bottom are touched by different threads; keep them on
+    // separate cache lines to avoid false sharing between owner and thieves
+    std::atomic<int64> _top;
+    char _pad0[64 - sizeof(std::atomic<int64>)];
+    std::atomic<int64> _bottom;
+    char _pad1[64 - sizeof(std::atomic<int64>)];
+    std::atomic<RingBuffer *> _buffer;
+
+    // Thieves may still be reading from a buffer after it was replaced, so
+    // retired buffers are only freed when the deque is destroyed. Since the
+    // capacity doubles each time, this wastes at most as much memory as the
+    // live buffer
+    std::vector<std::unique_ptr<RingBuffer>> _retired;
+
+public:
+    WorkStealingDeque(int64 initialCapacity = 64)
+    : _top(0),
+      _bottom(0),
+      _buffer(new RingBuffer(initialCapacity))
+    {
+    }
+
+    ~WorkStealingDeque()
+    {
+        delete _buffer.load(std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    void push(T *value)
+    {
+        int64 b = _bottom.load(std::memory_order_relaxed);
+        int64 t = _top.load(std::memory_order_acquire);
+        RingBuffer *buffer = _buffer.load(std::memory_order_relaxed);
+        if (b - t > buffer->capacity() - 1) {
+            _retired.emplace_back(buffer);
+            buffer = buffer->grow(t, b);
+            _buffer.store(buffer, std::memory_order_release);
+        }
+        buffer->store(b, value);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    T *pop()
+    {
+        int64 b = _bottom.load(std::memory_order_relaxed) - 1;
+        RingBuffer *buffer = _buffer.load(std::memory_order_relaxed);
+        _bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64 t = _top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            _bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T *result = buffer->load(b);
+        if (t == b) {
+            // Last element; race against thieves for it
+            if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                result = nullptr;
+            _bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    T *steal()
+    {
+        int64 t = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64 b = _bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+
+        RingBuffer *buffer = _buffer.load(std::memory_order_consume);
+        T *result = buffer->load(t);
+        if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return result;
+    }
+
+    bool empty() const
+    {
+        int64 b = _bottom.load(std::memory_order_relaxed);
+        int64 t = _top.load(std::memory_order_relaxed);
+        return t >= b;
+    }
+};
+
+}
+
+#endif /* WORKSTEALINGDEQUE_HPP_ */
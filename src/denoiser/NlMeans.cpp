@@ -0,0 +1,107 @@
+#include "NlMeans.hpp"
+#include "NlMeansKernels.hpp"
+
+#include "sse/SimdDispatch.hpp"
+
+#include "Memory.hpp"
+
+#include <cstring>
+
+namespace Tungsten {
+
+namespace Sse {
+
+typedef float4 V;
+
+static inline V vexp(V f) { return fmath::exp_ps(f.raw()); }
+
+#include "PackedNlMeans.inl"
+
+}
+
+void packedNlMeansSse(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch)
+{
+    Sse::packedNlMeansTile(images, tile, F, R, k, varianceScale, scratch);
+}
+
+void SimdNlMeans::denoise(int F, int R, float k, float varianceScale)
+{
+    if (_params.empty())
+        return;
+    int w = _params[0].image.w();
+    int h = _params[0].image.h();
+
+    SimdIsa isa = SimdIsaSse;
+    size_t lanes = 4;
+    PackedNlMeansKernel kernel = &packedNlMeansSse;
+#ifdef WIDE_SIMD_KERNELS
+    if (SimdDispatch::activeIsa() == SimdIsaAvx512) {
+        isa = SimdIsaAvx512;
+        lanes = 16;
+        kernel = &packedNlMeansAvx512;
+    } else if (SimdDispatch::activeIsa() == SimdIsaAvx2) {
+        isa = SimdIsaAvx2;
+        lanes = 8;
+        kernel = &packedNlMeansAvx2;
+    }
+#endif
+
+    size_t bufferSize = size_t(w)*h*lanes;
+    auto image         = alignedZeroAlloc<float>(bufferSize, PackedNlMeansAlignment);
+    auto guide         = alignedZeroAlloc<float>(bufferSize, PackedNlMeansAlignment);
+    auto variance      = alignedZeroAlloc<float>(bufferSize, PackedNlMeansAlignment);
+    auto result        = alignedAlloc    <float>(bufferSize, PackedNlMeansAlignment);
+    auto resultWeights = alignedAlloc    <float>(bufferSize, PackedNlMeansAlignment);
+    PackedNlMeansImages images{image.get(), guide.get(), variance.get(), result.get(), resultWeights.get(), w, h};
+
+    // We parallelize by dicing the input image up into 32x32 tiles
+    std::vector<Vec2i> tiles;
+    for (int tileY : range(0, h, PackedNlMeansTileSize))
+        for (int tileX : range(0, w, PackedNlMeansTileSize))
+            tiles.emplace_back(tileX, tileY);
+
+    size_t scratchSize = packedNlMeansScratchSize(F, lanes);
+    std::vector<aligned_unique_ptr<float>> scratch(ThreadUtils::idealThreadCount());
+
+    int numBlocks = (_params.size() + lanes - 1)/lanes;
+    for (size_t i = 0; i < _params.size(); i += lanes) {
+        size_t lim = min(i + lanes, _params.size());
+
+        for (size_t b = i; b < lim; ++b) {
+            size_t idx = b % lanes;
+            for (int j = 0; j < w*h; ++j) {
+                image   [j*lanes + idx] = _params[b].image   [j];
+                guide   [j*lanes + idx] = _params[b].guide   [j];
+                variance[j*lanes + idx] = _params[b].variance[j];
+            }
+        }
+        std::memset(result.get(), 0, bufferSize*sizeof(float));
+        std::memset(resultWeights.get(), 0, bufferSize*sizeof(float));
+
+        printTimestampedLog(tfm::format("Denoising feature set %d/%d (%d-wide %s)", i/lanes + 1, numBlocks,
+                lanes, SimdDispatch::isaName(isa)));
+
+        ThreadUtils::pool->enqueue([&](uint32 j, uint32, uint32 threadId) {
+            printProgressBar(j, tiles.size());
+
+            if (!scratch[threadId])
+                scratch[threadId] = alignedAlloc<float>(scratchSize, PackedNlMeansAlignment);
+
+            Vec2i tile = tiles[j];
+            Box2i tileRect(tile, min(tile + PackedNlMeansTileSize, Vec2i(w, h)));
+            kernel(images, tileRect, F, R, k, varianceScale, scratch[threadId].get());
+        }, tiles.size())->wait();
+        printProgressBar(tiles.size(), tiles.size());
+
+        for (size_t b = i; b < lim; ++b) {
+            _params[b].dst = PixmapF(w, h);
+            for (int j = 0; j < w*h; ++j)
+                _params[b].dst[j] = result[j*lanes + b % lanes]/resultWeights[j*lanes + b % lanes];
+        }
+    }
+
+    _params.clear();
+}
+
+}
@@ -156,10 +156,11 @@ Pixmap<Texel> nlMeans(const Pixmap<Texel> &image, const Pixmap<Texel> &guide, co
     return std::move(result);
 }
 
-// This class gathers up 1-channel images and denoises them 4 of them
-// simultaneously by packing 4 images into one SIMD float. This is
-// useful when denoising feature buffers and yields a ~2x speedup compared
-// to filtering each 1-channel image separately.
+// This class gathers up 1-channel images and denoises several of them
+// simultaneously by packing them into one SIMD float. This is useful when
+// denoising feature buffers and yields a ~2x speedup compared to filtering
+// each 1-channel image separately with 4-wide SSE. On hosts with AVX2 or
+// AVX-512, 8 or 16 images are packed at a time (see SimdDispatch)
 class SimdNlMeans
 {
     struct NlMeansParams
@@ -176,40 +177,7 @@ public:
         _params.emplace_back(NlMeansParams{dst, image, guide, variance});
     }
 
-    void denoise(int F, int R, float k, float varianceScale = 1.0f)
-    {
-        if (_params.empty())
-            return;
-        int w = _params[0].image.w();
-        int h = _params[0].image.h();
-
-        Pixmap4pf image(w, h), guide(w, h), variance(w, h);
-
-        int numBlocks = (_params.size() + 3)/4;
-        for (size_t i = 0; i < _params.size(); i += 4) {
-            int lim = min(i + 4, _params.size());
-
-            for (int k = i; k < lim; ++k) {
-                int idx = k % 4;
-                for (int j = 0; j < w*h; ++j) {
-                    image   [j][idx] = _params[k].image   [j];
-                    guide   [j][idx] = _params[k].guide   [j];
-                    variance[j][idx] = _params[k].variance[j];
-                }
-            }
-
-            printTimestampedLog(tfm::format("Denoising feature set %d/%d", i/4 + 1, numBlocks));
-            image = nlMeans(image, guide, variance, F, R, k, varianceScale, true);
-
-            for (int k = i; k < lim; ++k) {
-                _params[k].dst = PixmapF(w, h);
-                for (int j = 0; j < w*h; ++j)
-                    _params[k].dst[j] = image[j][k % 4];
-            }
-        }
-
-        _params.clear();
-    }
+    void denoise(int F, int R, float k, float varianceScale = 1.0f);
 };
 
 }
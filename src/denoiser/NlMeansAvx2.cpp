@@ -0,0 +1,69 @@
+// AVX2 version of the packed NL-means kernel (see PackedNlMeans.inl). This
+// file is compiled with the baseline flags, and only the code between the
+// target pragmas below uses AVX2, so that shared headers are never built
+// for a wider instruction set. It must only be called into when
+// SimdDispatch reports support for it
+#ifdef WIDE_SIMD_KERNELS
+
+#include "NlMeansKernels.hpp"
+
+#include "sse/SimdFloat.hpp"
+
+#include <immintrin.h>
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to=function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+#define SIMD_TARGET_AVX2
+
+#include "sse/SimdAvx2.hpp"
+
+namespace Tungsten {
+
+namespace Avx2 {
+
+typedef float8 V;
+
+// fmath has no 8-wide variant, so we use Cephes' polynomial instead
+static inline V vexp(V f)
+{
+    __m256 x = _mm256_max_ps(_mm256_min_ps(f.raw(), _mm256_set1_ps(88.3762626647949f)), _mm256_set1_ps(-87.3365447504019f));
+    __m256 fx = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(exponent));
+}
+
+#include "PackedNlMeans.inl"
+
+}
+
+void packedNlMeansAvx2(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch)
+{
+    Avx2::packedNlMeansTile(images, tile, F, R, k, varianceScale, scratch);
+}
+
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#undef SIMD_TARGET_AVX2
+
+#endif
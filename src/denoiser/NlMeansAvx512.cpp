@@ -0,0 +1,68 @@
+// AVX-512 version of the packed NL-means kernel (see PackedNlMeans.inl).
+// This file is compiled with the baseline flags, and only the code between
+// the target pragmas below uses AVX-512, so that shared headers are never
+// built for a wider instruction set. It must only be called into when
+// SimdDispatch reports support for it
+#ifdef WIDE_SIMD_KERNELS
+
+#include "NlMeansKernels.hpp"
+
+#include "sse/SimdFloat.hpp"
+
+#include <immintrin.h>
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f,fma"))), apply_to=function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f,fma")
+#endif
+#define SIMD_TARGET_AVX512
+
+#include "sse/SimdAvx512.hpp"
+
+namespace Tungsten {
+
+namespace Avx512 {
+
+typedef float16 V;
+
+// fmath has no 16-wide variant, so we use Cephes' polynomial instead
+static inline V vexp(V f)
+{
+    __m512 x = _mm512_max_ps(_mm512_min_ps(f.raw(), _mm512_set1_ps(88.3762626647949f)), _mm512_set1_ps(-87.3365447504019f));
+    __m512 fx = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), x);
+
+    __m512 y = _mm512_set1_ps(1.9875691500e-4f);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894e-2f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459e-1f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201e-1f));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+    return _mm512_scalef_ps(y, fx);
+}
+
+#include "PackedNlMeans.inl"
+
+}
+
+void packedNlMeansAvx512(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch)
+{
+    Avx512::packedNlMeansTile(images, tile, F, R, k, varianceScale, scratch);
+}
+
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#undef SIMD_TARGET_AVX512
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef NLMEANSKERNELS_HPP_
+#define NLMEANSKERNELS_HPP_
+
+#include "math/Box.hpp"
+
+#include <cstddef>
+
+namespace Tungsten {
+
+// Packed NL-means filters several 1-channel images at once. The images are
+// stored as w*h texels of N floats each, where N is the lane count of the
+// kernel (4, 8 or 16). All buffers must be aligned to PackedNlMeansAlignment
+struct PackedNlMeansImages
+{
+    const float *image, *guide, *variance;
+    // Accumulated weighted sum and sum of weights of each pixel. Both have
+    // to be zero initialized by the caller
+    float *result, *resultWeights;
+    int w, h;
+};
+
+static const int PackedNlMeansTileSize = 32;
+static const int PackedNlMeansAlignment = 64;
+
+// Floats of scratch memory needed per thread by the kernels
+static inline size_t packedNlMeansScratchSize(int F, int lanes)
+{
+    size_t padSize = PackedNlMeansTileSize + 2*F;
+    return (PackedNlMeansTileSize*PackedNlMeansTileSize + 2*padSize*padSize)*lanes;
+}
+
+// Filters one tile of at most PackedNlMeansTileSize^2 pixels. The kernels
+// for the wider instruction sets are compiled with target pragmas and live
+// in their own namespaces, so they may only be called when SimdDispatch
+// reports support for them
+typedef void (*PackedNlMeansKernel)(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch);
+
+void packedNlMeansSse(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch);
+#ifdef WIDE_SIMD_KERNELS
+void packedNlMeansAvx2(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch);
+void packedNlMeansAvx512(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch);
+#endif
+
+}
+
+#endif /* NLMEANSKERNELS_HPP_ */
@@ -0,0 +1,178 @@
+// Packed NL-means kernel, compiled once per instruction set. The including
+// file provides the lane type V (float4, float8 or float16) and vexp. It
+// includes this file inside a namespace specific to its instruction set, and
+// everything defined here has internal linkage, so that the copies built
+// for different instruction sets never get mixed up by the linker.
+// This mirrors boxFilter and nlMeansWeights of BoxFilter.hpp and NlMeans.hpp
+
+static const int Lanes = V::n;
+
+static inline V texel(const float *buf, int w, int x, int y)
+{
+    return V(buf + size_t(x + y*w)*Lanes);
+}
+
+static inline void setTexel(float *buf, int w, int x, int y, V value)
+{
+    value.store(buf + size_t(x + y*w)*Lanes);
+}
+
+static void packedBoxFilterSlow(const float *src, float *result, int w, int R, int x0, int y0, int x1, int y1)
+{
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            V sum(0.0f);
+            int pixelCount = 0;
+            for (int dy = -R; dy <= R; ++dy) {
+                for (int dx = -R; dx <= R; ++dx) {
+                    int xp = x + dx;
+                    int yp = y + dy;
+                    if (xp >= x0 && xp < x1 && yp >= y0 && yp < y1) {
+                        sum += texel(src, w, xp, yp);
+                        pixelCount++;
+                    }
+                }
+            }
+
+            setTexel(result, w, x, y, sum/V(float(pixelCount)));
+        }
+    }
+}
+
+static void packedBoxFilter(const float *src, float *tmp, float *result, int w, int R, int x0, int y0, int x1, int y1)
+{
+    if (x1 - x0 < 2*R || y1 - y0 < 2*R) {
+        packedBoxFilterSlow(src, result, w, R, x0, y0, x1, y1);
+        return;
+    }
+
+    V factor(1.0f/(2*R + 1));
+
+    for (int y = y0; y < y1; ++y) {
+        V sumL(0.0f);
+        V sumR(0.0f);
+        for (int x = 0; x < 2*R; ++x) {
+            sumL += texel(src, w, x0 + x, y);
+            sumR += texel(src, w, x1 - 1 - x, y);
+            if (x >= R) {
+                setTexel(tmp, w, x0 + x - R      , y, sumL/V(float(x + 1)));
+                setTexel(tmp, w, x1 - 1 - (x - R), y, sumR/V(float(x + 1)));
+            }
+        }
+        for (int x = x0 + R; x < x1 - R; ++x) {
+            sumL += texel(src, w, x + R, y);
+            setTexel(tmp, w, x, y, sumL*factor);
+            sumL = sumL - texel(src, w, x - R, y);
+        }
+    }
+
+    for (int x = x0; x < x1; ++x) {
+        V sumL(0.0f);
+        V sumR(0.0f);
+        for (int y = 0; y < 2*R; ++y) {
+            sumL += texel(tmp, w, x, y0 + y);
+            sumR += texel(tmp, w, x, y1 - 1 - y);
+            if (y >= R) {
+                setTexel(result, w, x, y0 + y - R      , sumL/V(float(y + 1)));
+                setTexel(result, w, x, y1 - 1 - (y - R), sumR/V(float(y + 1)));
+            }
+        }
+        for (int y = y0 + R; y < y1 - R; ++y) {
+            sumL += texel(tmp, w, x, y + R);
+            setTexel(result, w, x, y, sumL*factor);
+            sumL = sumL - texel(tmp, w, x, y - R);
+        }
+    }
+}
+
+static void packedNlMeansWeights(float *weights, float *distances, float *tmp, const PackedNlMeansImages &images,
+        Box2i srcRect, int F, float k, int dx, int dy, float varianceScale)
+{
+    const float Epsilon = 1e-7f;
+    const float MinCenterWeight = 1e-4f;
+    const float DistanceClamp = 10000.0f;
+
+    const int TileSize = PackedNlMeansTileSize;
+    int padSize = TileSize + 2*F;
+    int w = images.w;
+
+    Box2i imageRect(Vec2i(0), Vec2i(images.w, images.h));
+    Vec2i delta = Vec2i(dx, dy);
+
+    Box2i clippedSrc(srcRect.min() + delta, srcRect.max() + delta);
+    clippedSrc.intersect(imageRect);
+    clippedSrc = Box2i(clippedSrc.min() - delta, clippedSrc.max() - delta);
+
+    Box2i paddedClippedSrc = srcRect;
+    paddedClippedSrc.grow(F);
+    paddedClippedSrc.intersect(imageRect);
+    paddedClippedSrc = Box2i(paddedClippedSrc.min() + delta, paddedClippedSrc.max() + delta);
+    paddedClippedSrc.intersect(imageRect);
+    paddedClippedSrc = Box2i(paddedClippedSrc.min() - delta, paddedClippedSrc.max() - delta);
+
+    // Nothing of srcRect lies inside the image after shifting
+    if (paddedClippedSrc.empty())
+        return;
+
+    V scale(varianceScale);
+    V kV(k);
+    for (int y : paddedClippedSrc.range(1)) {
+        for (int x : paddedClippedSrc.range(0)) {
+            // From Rousselle et al.'s paper
+            V varP = texel(images.variance, w, x, y)*scale;
+            V varQ = texel(images.variance, w, x + dx, y + dy)*scale;
+            V diff = texel(images.guide, w, x, y) - texel(images.guide, w, x + dx, y + dy);
+            V squaredDiff = diff*diff - (varP + min(varP, varQ));
+            V dist = squaredDiff/((varP + varQ)*kV*kV + V(Epsilon));
+            Vec2i p = Vec2i(x, y) - paddedClippedSrc.min();
+            setTexel(distances, padSize, p.x(), p.y(), min(dist, V(DistanceClamp)));
+        }
+    }
+
+    Vec2i paddedSize = paddedClippedSrc.diagonal();
+    packedBoxFilter(distances, tmp, distances, padSize, F, 0, 0, paddedSize.x(), paddedSize.y());
+
+    for (int y : clippedSrc.range(1)) {
+        for (int x : clippedSrc.range(0)) {
+            Vec2i p = Vec2i(x, y) - paddedClippedSrc.min();
+            Vec2i q = Vec2i(x, y) - srcRect.min();
+            V distance = texel(distances, padSize, p.x(), p.y());
+            V weight = vexp(V(0.0f) - max(distance, V(0.0f)));
+            if (dx == 0 && dy == 0)
+                weight = max(weight, V(MinCenterWeight));
+            setTexel(weights, TileSize, q.x(), q.y(), weight);
+        }
+    }
+}
+
+static void packedNlMeansTile(const PackedNlMeansImages &images, Box2i tile,
+        int F, int R, float k, float varianceScale, float *scratch)
+{
+    const int TileSize = PackedNlMeansTileSize;
+    int padSize = TileSize + 2*F;
+    int w = images.w;
+    int h = images.h;
+
+    float *weights = scratch;
+    float *tmpBufA = weights + size_t(TileSize*TileSize)*Lanes;
+    float *tmpBufB = tmpBufA + size_t(padSize*padSize)*Lanes;
+
+    for (int dy = -R; dy <= R; ++dy) {
+        for (int dx = -R; dx <= R; ++dx) {
+            Box2i shiftedRect(Vec2i(-dx, -dy), Vec2i(w - dx, h - dy));
+            shiftedRect.intersect(tile);
+
+            packedNlMeansWeights(weights, tmpBufA, tmpBufB, images, shiftedRect, F, k, dx, dy, varianceScale);
+
+            for (int y : shiftedRect.range(1)) {
+                for (int x : shiftedRect.range(0)) {
+                    Vec2i q = Vec2i(x, y) - shiftedRect.min();
+                    V weight = texel(weights, TileSize, q.x(), q.y());
+                    V image = texel(images.image, w, x + dx, y + dy);
+                    setTexel(images.result,        w, x, y, texel(images.result,        w, x, y) + weight*image);
+                    setTexel(images.resultWeights, w, x, y, texel(images.resultWeights, w, x, y) + weight);
+                }
+            }
+        }
+    }
+}
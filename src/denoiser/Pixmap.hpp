@@ -15,12 +15,15 @@ class Pixmap
     int _w, _h;
     aligned_unique_ptr<Texel> _pixels;
 
+    // Wide SIMD texels need more than the 16 byte default
+    static CONSTEXPR int Alignment = alignof(Texel) > 16 ? alignof(Texel) : 16;
+
 public:
     Pixmap() = default;
 
     Pixmap(int w, int h, const Texel *src = nullptr)
     : _w(w), _h(h),
-      _pixels(src ? alignedAlloc<Texel>(w*h, 16) : alignedZeroAlloc<Texel>(w*h, 16))
+      _pixels(src ? alignedAlloc<Texel>(w*h, Alignment) : alignedZeroAlloc<Texel>(w*h, Alignment))
     {
         if (src)
             std::memcpy(_pixels.get(), src, w*h*sizeof(Texel));
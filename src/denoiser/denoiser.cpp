@@ -7,6 +7,8 @@
 #include "io/ImageIO.hpp"
 #include "io/Scene.hpp"
 
+#include "sse/SimdDispatch.hpp"
+
 #include "Regression.hpp"
 #include "NlMeans.hpp"
 #include "Pixmap.hpp"
@@ -23,6 +25,7 @@ using namespace Tungsten;
 
 static const int OPT_VERSION  = 0;
 static const int OPT_HELP     = 1;
+static const int OPT_MAX_ISA  = 2;
 
 template<typename Texel>
 struct RenderBuffer
@@ -107,7 +110,8 @@ Pixmap3f nforDenoiser(RenderBuffer3f image, std::vector<RenderBufferF> features)
     // Second filter pass (section 5.4)
     printTimestampedLog("Beginning second filter pass");
     printTimestampedLog("Denoising final features...");
-    std::vector<PixmapF> finalFeatures;
+    std::vector<PixmapF> finalFeatures(filteredFeaturesA.size());
+    std::vector<PixmapF> combinedFeatures, combinedFeatureVars;
     for (size_t i = 0; i < filteredFeaturesA.size(); ++i) {
         PixmapF combinedFeature(w, h);
         PixmapF combinedFeatureVar(w, h);
@@ -119,8 +123,14 @@ Pixmap3f nforDenoiser(RenderBuffer3f image, std::vector<RenderBufferF> features)
         filteredFeaturesA[i].reset();
         filteredFeaturesB[i].reset();
 
-        finalFeatures.emplace_back(nlMeans(combinedFeature, combinedFeature, combinedFeatureVar, 3, 2, 0.5f));
+        combinedFeatures.emplace_back(std::move(combinedFeature));
+        combinedFeatureVars.emplace_back(std::move(combinedFeatureVar));
     }
+    for (size_t i = 0; i < combinedFeatures.size(); ++i)
+        featureFilter.addBuffer(finalFeatures[i], combinedFeatures[i], combinedFeatures[i], combinedFeatureVars[i]);
+    featureFilter.denoise(3, 2, 0.5f);
+    combinedFeatures.clear();
+    combinedFeatureVars.clear();
 
     Pixmap3f combinedResult(w, h);
     Pixmap3f combinedResultVar(w, h);
@@ -190,6 +200,7 @@ int main(int argc, const char *argv[])
     CliParser parser("denoiser", "[options] scene outputfile");
     parser.addOption('h', "help", "Prints this help text", false, OPT_HELP);
     parser.addOption('v', "version", "Prints version information", false, OPT_VERSION);
+    parser.addOption('\0', "max-isa", "Limits the instruction set filter kernels are selected for (sse, avx2 or avx512). By default, the widest one supported by the host is used", true, OPT_MAX_ISA);
 
     parser.parse(argc, argv);
     if (parser.isPresent(OPT_VERSION)) {
@@ -201,6 +212,13 @@ int main(int argc, const char *argv[])
         return 0;
     }
 
+    if (parser.isPresent(OPT_MAX_ISA)) {
+        SimdIsa isa;
+        if (!SimdDispatch::parseIsa(parser.param(OPT_MAX_ISA), isa))
+            parser.fail("Unknown instruction set '%s'\n", parser.param(OPT_MAX_ISA));
+        SimdDispatch::setMaxIsa(isa);
+    }
+
     Path sceneFile(parser.operands()[0]);
     Path targetFile(parser.operands()[1]);
 
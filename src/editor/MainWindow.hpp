@@ -66,6 +66,11 @@ public:
     {
         return _previewWindow;
     }
+
+    RenderWindow *renderWindow()
+    {
+        return _renderWindow;
+    }
 };
 
 }
@@ -356,6 +356,8 @@ void PreviewWindow::transformFinished(Mat4f delta)
         e->setTransform(delta*e->transform());
     updateFixedTransform();
     update();
+
+    emit selectionTransformed();
 }
 
 void PreviewWindow::recomputeCentroids()
@@ -152,6 +152,7 @@ public slots:
 signals:
     void selectionChanged();
     void primitiveListChanged();
+    void selectionTransformed();
 
 public:
     PreviewWindow(QWidget *proxyParent, MainWindow *parent);
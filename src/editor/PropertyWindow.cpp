@@ -1,6 +1,7 @@
 #include "PropertyWindow.hpp"
 #include "VerticalScrollArea.hpp"
 #include "PreviewWindow.hpp"
+#include "RenderWindow.hpp"
 #include "MainWindow.hpp"
 
 #include "properties/PrimitiveProperties.hpp"
@@ -98,11 +99,13 @@ void PropertyWindow::rebuildTabs()
     PrimitiveProperties *primProps = new PrimitiveProperties(_propertyTabs, _scene, _selection);
     connect(primProps, SIGNAL(primitiveNameChange(Primitive *)), this, SLOT(changePrimitiveName(Primitive *)));
     connect(primProps, SIGNAL(triggerRedraw()), _parent.previewWindow(), SLOT(update()));
+    connect(primProps, SIGNAL(triggerRedraw()), _parent.renderWindow(), SLOT(materialsChanged()));
     _propertyTabs->addTab(primProps, "Primitive");
 
     VerticalScrollArea *scrollArea = new VerticalScrollArea(_propertyTabs);
     BsdfProperties *bsdfProps = new BsdfProperties(scrollArea, _scene, _selection);
     connect(bsdfProps, SIGNAL(triggerRedraw()), _parent.previewWindow(), SLOT(update()));
+    connect(bsdfProps, SIGNAL(triggerRedraw()), _parent.renderWindow(), SLOT(materialsChanged()));
 
     scrollArea->setWidget(bsdfProps);
     _propertyTabs->addTab(scrollArea, "Material");
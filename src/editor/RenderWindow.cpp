@@ -103,6 +103,34 @@ void RenderWindow::sceneChanged()
     }
 }
 
+// Applies edits to a running render. The flattened scene only exists while
+// rendering, and is otherwise created from scratch by the next render anyway
+void RenderWindow::updateFlattenedScene(const std::vector<Primitive *> &transformed)
+{
+    if (!_flattenedScene)
+        return;
+
+    _flattenedScene->integrator().abortRender();
+    if (!_flattenedScene->update(transformed))
+        _flattenedScene.reset(_scene->makeTraceable());
+
+    _image->fill(Qt::black);
+    repaint();
+
+    startRender();
+}
+
+void RenderWindow::selectionTransformed()
+{
+    const std::unordered_set<Primitive *> &selection = _parent.selection();
+    updateFlattenedScene(std::vector<Primitive *>(selection.begin(), selection.end()));
+}
+
+void RenderWindow::materialsChanged()
+{
+    updateFlattenedScene(std::vector<Primitive *>());
+}
+
 QRgb RenderWindow::tonemap(const Vec3f &c) const
 {
     Vec3i pixel(clamp(c*_pow2Exposure*255.0f, Vec3f(0.0f), Vec3f(255.0f)));
@@ -39,6 +39,7 @@ class RenderWindow : public QWidget
     QRgb tonemap(const Vec3f &c) const;
 
     void updateStatus();
+    void updateFlattenedScene(const std::vector<Primitive *> &transformed);
 
 private slots:
     void startRender();
@@ -60,6 +61,8 @@ protected:
 
 public slots:
     void sceneChanged();
+    void selectionTransformed();
+    void materialsChanged();
 
 signals:
     void rendererFinished();
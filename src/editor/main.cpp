@@ -25,6 +25,8 @@ int main(int argc, char *argv[])
     ThreadUtils::startThreads(threadCount);
 
     EmbreeUtil::initDevice();
+    // Allows edits to be applied to a running render without a full rebuild
+    EmbreeUtil::setDynamicScenes(true);
 
 #ifdef OPENVDB_AVAILABLE
         openvdb::initialize();
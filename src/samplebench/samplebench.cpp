@@ -0,0 +1,135 @@
+#include "Version.hpp"
+#include "Timer.hpp"
+
+#include "sampling/AliasDistribution2D.hpp"
+#include "sampling/AliasDistribution1D.hpp"
+#include "sampling/Distribution2D.hpp"
+#include "sampling/Distribution1D.hpp"
+#include "sampling/UniformSampler.hpp"
+
+#include "io/CliParser.hpp"
+
+#include <tinyformat/tinyformat.hpp>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+
+using namespace Tungsten;
+
+static const int OPT_VERSION = 1;
+static const int OPT_HELP    = 2;
+static const int OPT_SAMPLES = 3;
+
+// Emitter areas and environment map texels are heavily skewed, so the
+// weights are drawn from a heavy tailed distribution rather than uniformly
+static std::vector<float> skewedWeights(uint32 n, UniformSampler &sampler)
+{
+    std::vector<float> weights(n);
+    for (float &w : weights)
+        w = std::pow(sampler.next1D(), 8.0f);
+    return weights;
+}
+
+// Returns nanoseconds per sample. The largest deviation of the sampled
+// histogram from the pdf is stored in maxError, relative to the largest pdf
+template<typename Distribution>
+double benchmark1D(const Distribution &distribution, uint32 n, uint32 samples, double &maxError)
+{
+    std::vector<uint32> histogram(n, 0);
+    UniformSampler sampler(0xDEADBEEF);
+
+    Timer timer;
+    for (uint32 i = 0; i < samples; ++i) {
+        float u = sampler.next1D();
+        int idx;
+        distribution.warp(u, idx);
+        histogram[idx]++;
+    }
+    timer.stop();
+
+    double maxPdf = 0.0;
+    maxError = 0.0;
+    for (uint32 i = 0; i < n; ++i) {
+        maxPdf = std::max(maxPdf, double(distribution.pdf(i)));
+        maxError = std::max(maxError, std::abs(histogram[i]/double(samples) - distribution.pdf(i)));
+    }
+    maxError /= maxPdf;
+
+    return timer.elapsed()*1e9/samples;
+}
+
+template<typename Distribution>
+double benchmark2D(const Distribution &distribution, uint32 samples, uint32 &checksum)
+{
+    UniformSampler sampler(0xDEADBEEF);
+
+    checksum = 0;
+    Timer timer;
+    for (uint32 i = 0; i < samples; ++i) {
+        Vec2f uv(sampler.next1D(), sampler.next1D());
+        int row, column;
+        distribution.warp(uv, row, column);
+        checksum += uint32(row*31 + column);
+    }
+    timer.stop();
+
+    return timer.elapsed()*1e9/samples;
+}
+
+int main(int argc, const char *argv[])
+{
+    CliParser parser("samplebench", "[options]");
+    parser.addOption('h', "help", "Prints this help text", false, OPT_HELP);
+    parser.addOption('v', "version", "Prints version information", false, OPT_VERSION);
+    parser.addOption('s', "samples", "Number of samples drawn from each distribution "
+            "(default: 10000000)", true, OPT_SAMPLES);
+
+    parser.parse(argc, argv);
+
+    if (parser.isPresent(OPT_HELP)) {
+        parser.printHelpText();
+        return 0;
+    }
+    if (parser.isPresent(OPT_VERSION)) {
+        std::cout << "samplebench, version " << VERSION_STRING << std::endl;
+        return 0;
+    }
+
+    uint32 samples = 10000000;
+    if (parser.isPresent(OPT_SAMPLES)) {
+        samples = uint32(std::strtoul(parser.param(OPT_SAMPLES).c_str(), nullptr, 10));
+        if (samples == 0)
+            parser.fail("Invalid sample count '%s'", parser.param(OPT_SAMPLES));
+    }
+
+    UniformSampler sampler(0xBA5EBA11);
+
+    std::cout << "1D distributions (ns/sample, max. histogram error relative to max. pdf)" << std::endl;
+    for (uint32 n : {16u, 256u, 4096u, 65536u, 1048576u}) {
+        std::vector<float> weights = skewedWeights(n, sampler);
+        Distribution1D cdf(weights);
+        AliasDistribution1D alias(weights);
+
+        double cdfError, aliasError;
+        double cdfTime = benchmark1D(cdf, n, samples, cdfError);
+        double aliasTime = benchmark1D(alias, n, samples, aliasError);
+        std::cout << tfm::format("  n=%7d  cdf %6.2f ns (%.4f)  alias %6.2f ns (%.4f)  speedup %.2fx",
+                n, cdfTime, cdfError, aliasTime, aliasError, cdfTime/aliasTime) << std::endl;
+    }
+
+    std::cout << "2D distributions (ns/sample)" << std::endl;
+    for (int size : {64, 512, 2048}) {
+        std::vector<float> weights = skewedWeights(uint32(size*size/2), sampler);
+        Distribution2D cdf(weights, size, size/2);
+        AliasDistribution2D alias(weights, size, size/2);
+
+        // The checksums only keep the loops from being optimized away
+        uint32 cdfChecksum, aliasChecksum;
+        double cdfTime = benchmark2D(cdf, samples, cdfChecksum);
+        double aliasTime = benchmark2D(alias, samples, aliasChecksum);
+        std::cout << tfm::format("  %4dx%-4d  cdf %6.2f ns  alias %6.2f ns  speedup %.2fx  (%08x %08x)",
+                size, size/2, cdfTime, aliasTime, cdfTime/aliasTime, cdfChecksum, aliasChecksum) << std::endl;
+    }
+
+    return 0;
+}
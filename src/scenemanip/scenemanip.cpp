@@ -1,3 +1,11 @@
+#include "primitives/EmbreeUtil.hpp"
+
+#include "renderer/TraceableScene.hpp"
+
+#include "thread/ThreadUtils.hpp"
+
+#include "bvh/BvhCache.hpp"
+
 #include "Version.hpp"
 
 #include "io/JsonLoadException.hpp"
@@ -25,6 +33,9 @@ static const int OPT_COMPRESSION_LEVEL = 6;
 static const int OPT_RELOCATE          = 7;
 static const int OPT_COPY_RELOCATE     = 8;
 static const int OPT_PATHS_ONLY        = 9;
+static const int OPT_BVH_CACHE         = 10;
+static const int OPT_PREBUILD_CACHE    = 11;
+static const int OPT_CLEAR_CACHE       = 12;
 
 static void listResources(Scene *scene, CliParser &/*parser*/)
 {
@@ -143,6 +154,20 @@ static void relocateResources(Scene *scene, CliParser &parser)
     Scene::save(scene->path(), *scene);
 }
 
+static void prebuildBvhCache(Scene *scene, CliParser &parser)
+{
+    if (!Bvh::BvhCache::enabled())
+        parser.fail("No BVH cache directory specified");
+
+    EmbreeUtil::initDevice();
+    ThreadUtils::startThreads(std::max(ThreadUtils::idealThreadCount() - 1, 1u));
+
+    scene->loadResources();
+    // Building the traceable scene prepares all primitives for rendering,
+    // which builds their BVHs and adds them to the cache
+    std::unique_ptr<TraceableScene> flattenedScene(scene->makeTraceable());
+}
+
 int main(int argc, const char *argv[])
 {
     CliParser parser("scenemanip");
@@ -155,6 +180,9 @@ int main(int argc, const char *argv[])
     parser.addOption('\0', "relocate", "Moves all resources referenced by the scene file into the specified output directory", false, OPT_RELOCATE);
     parser.addOption('\0', "copy", "Copy resources instead of moving them when running --relocate", false, OPT_COPY_RELOCATE);
     parser.addOption('\0', "paths-only", "Only modify resource paths in the scene file when running --relocate, don't copy or move any files", false, OPT_PATHS_ONLY);
+    parser.addOption('\0', "bvh-cache", "Specifies the BVH cache directory for --prebuild-bvh-cache and --clear-bvh-cache", true, OPT_BVH_CACHE);
+    parser.addOption('\0', "prebuild-bvh-cache", "Builds the BVHs of the scene and stores them in the BVH cache", false, OPT_PREBUILD_CACHE);
+    parser.addOption('\0', "clear-bvh-cache", "Deletes all entries in the BVH cache. Does not require an input file", false, OPT_CLEAR_CACHE);
 
     parser.parse(argc, argv);
 
@@ -166,6 +194,17 @@ int main(int argc, const char *argv[])
         parser.printHelpText();
         return 0;
     }
+
+    if (parser.isPresent(OPT_BVH_CACHE))
+        Bvh::BvhCache::setDirectory(Path(parser.param(OPT_BVH_CACHE)));
+    if (parser.isPresent(OPT_CLEAR_CACHE)) {
+        if (!Bvh::BvhCache::enabled())
+            parser.fail("No BVH cache directory specified");
+        int count = Bvh::BvhCache::clear();
+        std::cout << "Deleted " << count << " BVH cache entries" << std::endl;
+        if (parser.operands().empty())
+            return 0;
+    }
     if (parser.operands().empty())
         parser.fail("No input files");
     if (parser.operands().size() > 1)
@@ -184,6 +223,10 @@ int main(int argc, const char *argv[])
         zipResources(scene, parser);
     else if (parser.isPresent(OPT_RELOCATE))
         relocateResources(scene, parser);
+    else if (parser.isPresent(OPT_PREBUILD_CACHE))
+        prebuildBvhCache(scene, parser);
+    else if (parser.isPresent(OPT_CLEAR_CACHE))
+        return 0;
     else
         parser.fail("Don't know what to do! No action specified");
 
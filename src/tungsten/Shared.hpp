@@ -2,11 +2,19 @@
 #define SHARED_HPP_
 
 #include "primitives/EmbreeUtil.hpp"
+#include "primitives/Skydome.hpp"
 
+#include "renderer/RenderStatistics.hpp"
 #include "renderer/TraceableScene.hpp"
 
 #include "thread/ThreadUtils.hpp"
 
+#include "sse/SimdDispatch.hpp"
+
+#include "textures/BitmapTexture.hpp"
+
+#include "bvh/BvhCache.hpp"
+
 #include "io/JsonLoadException.hpp"
 #include "io/DirectoryChange.hpp"
 #include "io/StringUtils.hpp"
@@ -42,6 +50,15 @@ static const int OPT_SEED              = 7;
 static const int OPT_TIMEOUT           = 8;
 static const int OPT_OUTPUT_FILE       = 9;
 static const int OPT_HDR_OUTPUT_FILE   = 10;
+static const int OPT_NUMA              = 12;
+static const int OPT_DEADLINE          = 13;
+static const int OPT_BVH_CACHE         = 14;
+static const int OPT_SAMPLING_CACHE    = 15;
+static const int OPT_SKY_CACHE         = 16;
+static const int OPT_MAX_ISA           = 17;
+
+// Fraction of the deadline set aside for writing the outputs
+static const double DeadlineOutputReserve = 0.05;
 
 enum RenderState
 {
@@ -70,6 +87,10 @@ struct RendererStatus
     Path currentScene;
     std::deque<Path> queuedScenes;
 
+#ifdef ENABLE_RENDER_STATISTICS
+    RenderStatistics::Report statistics;
+#endif
+
     rapidjson::Value toJson(rapidjson::Document::AllocatorType &allocator) const
     {
         JsonObject result{allocator,
@@ -90,6 +111,9 @@ struct RendererStatus
 
         result.add("completed_scenes", std::move(completedValue),
                    "queued_scenes", std::move(queuedValue));
+#ifdef ENABLE_RENDER_STATISTICS
+        result.add("statistics", statistics.toJson(allocator));
+#endif
 
         return result;
     }
@@ -102,6 +126,7 @@ class StandaloneRenderer
 
     double _checkpointInterval;
     double _timeout;
+    double _deadline;
     int _threadCount;
     Path _inputDirectory;
     Path _outputDirectory;
@@ -113,6 +138,9 @@ class StandaloneRenderer
     std::mutex _logMutex;
     std::mutex _sceneMutex;
     RendererStatus _status;
+#ifdef ENABLE_RENDER_STATISTICS
+    bool _collectingStatistics;
+#endif
 
     void writeLogLine(const std::string &s)
     {
@@ -120,16 +148,38 @@ class StandaloneRenderer
         _logStream << s << std::endl;
     }
 
+    // Sizes the next pass from the throughput measured in the previous one.
+    // While there is plenty of time left, only half of it is planned at once,
+    // so that later passes can correct for changes in throughput (e.g. once
+    // adaptive sampling kicks in). Returns 0 if no further pass fits
+    uint32 deadlineSppStep(uint32 passSpp, double passTime, double timeLeft, uint32 sppStep) const
+    {
+        if (timeLeft <= 0.0)
+            return 0;
+        double sppPerSecond = passSpp/max(passTime, 1e-6);
+        double budget = sppPerSecond*timeLeft;
+        if (budget >= double(_scene->rendererSettings().spp()))
+            return _scene->rendererSettings().spp();
+        uint32 step = uint32(budget);
+        if (step > 2*sppStep)
+            step /= 2;
+        return step;
+    }
+
 public:
     StandaloneRenderer(CliParser &parser, std::ostream &logStream)
     : _parser(parser),
       _logStream(logStream),
       _checkpointInterval(0.0),
       _timeout(0.0),
+      _deadline(0.0),
       _threadCount(max(ThreadUtils::idealThreadCount() - 1, 1u))
     {
         _status.state = STATE_LOADING;
         _status.currentSpp = _status.nextSpp = _status.totalSpp = 0;
+#ifdef ENABLE_RENDER_STATISTICS
+        _collectingStatistics = false;
+#endif
 
         parser.addOption('h', "help", "Prints this help text", false, OPT_HELP);
         parser.addOption('v', "version", "Prints version information", false, OPT_VERSION);
@@ -140,9 +190,15 @@ public:
         parser.addOption('d', "output-directory", "Specifies the output directory. Overrides the setting in the scene file", true, OPT_OUTPUT_DIRECTORY);
         parser.addOption('\0', "spp", "Sets the number of samples per pixel to render at. Overrides the setting in the scene file", true, OPT_SPP);
         parser.addOption('\0', "timeout", "Specifies the maximum render time. A value of 0 (default) means unlimited. Overrides the setting in the scene file", true, OPT_TIMEOUT);
+        parser.addOption('\0', "deadline", "Specifies a render time budget. Passes are sized from the measured throughput so that the outputs are written by the deadline. A value of 0 (default) disables the deadline. Overrides the setting in the scene file", true, OPT_DEADLINE);
         parser.addOption('s', "seed", "Specifies the random seed to use", true, OPT_SEED);
         parser.addOption('o', "output-file", "Specifies the output file name. Overrides the setting in the scene file", true, OPT_OUTPUT_FILE);
         parser.addOption('e', "hdr-output-file", "Specifies the hdr output file name. Overrides the setting in the scene file", true, OPT_HDR_OUTPUT_FILE);
+        parser.addOption('\0', "numa", "Pins render threads to processors and keeps per-thread data and image tiles local to each NUMA node", false, OPT_NUMA);
+        parser.addOption('\0', "bvh-cache", "Specifies a directory in which built BVHs are cached across runs", true, OPT_BVH_CACHE);
+        parser.addOption('\0', "sampling-cache", "Caches the importance sampling tables of large textures (e.g. environment maps) in files next to them", false, OPT_SAMPLING_CACHE);
+        parser.addOption('\0', "sky-cache", "Specifies a directory in which evaluated skydomes are cached across renders and frames", true, OPT_SKY_CACHE);
+        parser.addOption('\0', "max-isa", "Limits the instruction set intersection kernels are selected for (sse, avx2 or avx512). By default, the widest one supported by the host is used", true, OPT_MAX_ISA);
     }
 
     void setup()
@@ -161,6 +217,21 @@ public:
             _checkpointInterval = StringUtils::parseDuration(_parser.param(OPT_CHECKPOINTS));
         if (_parser.isPresent(OPT_TIMEOUT))
             _timeout = StringUtils::parseDuration(_parser.param(OPT_TIMEOUT));
+        if (_parser.isPresent(OPT_DEADLINE))
+            _deadline = StringUtils::parseDuration(_parser.param(OPT_DEADLINE));
+
+        if (_parser.isPresent(OPT_BVH_CACHE))
+            Bvh::BvhCache::setDirectory(Path(_parser.param(OPT_BVH_CACHE)));
+        if (_parser.isPresent(OPT_SAMPLING_CACHE))
+            BitmapTexture::setSamplingCacheEnabled(true);
+        if (_parser.isPresent(OPT_SKY_CACHE))
+            Skydome::setCacheDirectory(Path(_parser.param(OPT_SKY_CACHE)));
+        if (_parser.isPresent(OPT_MAX_ISA)) {
+            SimdIsa isa;
+            if (!SimdDispatch::parseIsa(_parser.param(OPT_MAX_ISA), isa))
+                _parser.fail("Unknown instruction set '%s'\n", _parser.param(OPT_MAX_ISA));
+            SimdDispatch::setMaxIsa(isa);
+        }
 
         EmbreeUtil::initDevice();
 
@@ -168,7 +239,7 @@ public:
         openvdb::initialize();
 #endif
 
-        ThreadUtils::startThreads(_threadCount);
+        ThreadUtils::startThreads(_threadCount, _parser.isPresent(OPT_NUMA));
 
         if (_parser.isPresent(OPT_INPUT_DIRECTORY)) {
             _inputDirectory = Path(_parser.param(OPT_INPUT_DIRECTORY));
@@ -264,6 +335,8 @@ public:
                 _checkpointInterval = StringUtils::parseDuration(_scene->rendererSettings().checkpointInterval());
             if (!_parser.isPresent(OPT_TIMEOUT))
                 _timeout = StringUtils::parseDuration(_scene->rendererSettings().timeout());
+            if (!_parser.isPresent(OPT_DEADLINE))
+                _deadline = StringUtils::parseDuration(_scene->rendererSettings().deadline());
 
             if (resumeRender && !_parser.isPresent(OPT_RESTART)) {
                 writeLogLine("Trying to resume render from saved state... ");
@@ -278,6 +351,20 @@ public:
             }
 
             writeLogLine("Starting render...");
+#ifdef ENABLE_RENDER_STATISTICS
+            {
+                std::unique_lock<std::mutex> lock(_statusMutex);
+                RenderStatistics::reset();
+                _collectingStatistics = true;
+            }
+#endif
+            // With a deadline, a single spp pass measures the throughput and
+            // all further passes are sized from it
+            double renderBudget = _deadline*(1.0 - DeadlineOutputReserve);
+            uint32 sppStep = _scene->rendererSettings().sppStep();
+            if (_deadline > 0.0)
+                integrator.setNextSppStep(1);
+
             Timer timer, checkpointTimer;
             double totalElapsed = 0.0;
             while (!integrator.done()) {
@@ -288,8 +375,11 @@ public:
                     _status.nextSpp = integrator.nextSpp();
                 }
 
+                uint32 passStartSpp = integrator.currentSpp();
+                Timer passTimer;
                 integrator.startRender([](){});
                 integrator.waitForCompletion();
+                passTimer.stop();
                 writeLogLine(tfm::format("Completed %d/%d spp", integrator.currentSpp(), maxSpp));
                 timer.stop();
                 if (_timeout > 0.0 && timer.elapsed() > _timeout)
@@ -308,11 +398,30 @@ public:
                     writeLogLine(tfm::format("Saving checkpoint took %s",
                             StringUtils::durationToString(ioTimer.elapsed())));
                 }
+                uint32 passSpp = integrator.currentSpp() - passStartSpp;
+                if (_deadline > 0.0 && passSpp > 0 && !integrator.done()) {
+                    timer.stop();
+                    uint32 step = deadlineSppStep(passSpp, passTimer.elapsed(),
+                            renderBudget - timer.elapsed(), sppStep);
+                    integrator.setNextSppStep(step);
+                    if (step == 0)
+                        writeLogLine(tfm::format("Stopping at %d spp to meet the deadline", integrator.currentSpp()));
+                }
             }
             timer.stop();
 
             writeLogLine(tfm::format("Finished render. Render time %s",
                     StringUtils::durationToString(timer.elapsed())));
+#ifdef ENABLE_RENDER_STATISTICS
+            {
+                std::unique_lock<std::mutex> lock(_statusMutex);
+                _status.statistics = RenderStatistics::report();
+                _collectingStatistics = false;
+                const RenderStatistics::Report &r = _status.statistics;
+                writeLogLine(tfm::format("STATS samples %d closest %d occl %d isect %.2fs shade %.2fs light %.2fs",
+                        r.counters[4], r.counters[1], r.counters[2], r.seconds[0], r.seconds[1], r.seconds[2]));
+            }
+#endif
 
             integrator.saveOutputs();
             if (_scene->rendererSettings().enableResumeRender())
@@ -340,6 +449,10 @@ public:
     {
         std::unique_lock<std::mutex> lock(_statusMutex);
         RendererStatus copy(_status);
+#ifdef ENABLE_RENDER_STATISTICS
+        if (_collectingStatistics)
+            copy.statistics = RenderStatistics::report();
+#endif
         return std::move(copy);
     }
 